@@ -11,6 +11,13 @@ export GI_TYPELIB_PATH="${PREFIX}/lib/girepository-1.0:${PREFIX}/lib/${arch}/gir
 
 SRC_DIR=$(pwd)
 BUILD_DIR=${SRC_DIR}/obj-$(arch)
+
+# the kernels, linked into the plug-in, found uninstalled by pkg-config
+KERNELS_DIR=${SRC_DIR}/../immanuel-kernels
+KERNELS_BUILD_DIR=${KERNELS_DIR}/obj-$(arch)
+mkdir -p $KERNELS_BUILD_DIR && (cd $KERNELS_BUILD_DIR && meson -Dprefix=$PREFIX --buildtype=release $KERNELS_DIR; ninja)
+export PKG_CONFIG_PATH=${KERNELS_BUILD_DIR}/meson-uninstalled:$PKG_CONFIG_PATH
+
 mkdir -p $BUILD_DIR && cd $BUILD_DIR && meson -Dprefix=$PREFIX --buildtype=release $SRC_DIR && ninja
 
 cp $BUILD_DIR/color-mapper.so $HOME/.local/share/gegl-0.4/plug-ins
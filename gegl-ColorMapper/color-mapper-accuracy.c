@@ -0,0 +1,898 @@
+/* This file is part of the color-mapper GEGL operation
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* accuracy of the color-mapper row kernels against a double precision
+  * reference of the same math
+  *
+  * The reference follows color-mapper-kernel.c operation by operation,
+  * including the FLT_MIN and COLOR_MAPPER_Y_MIN guards of the ratios and
+  * the 0.00001 guards of saturation_clip, but computes everything in
+  * double from the float pixels and the float luminance planes all
+  * variants share (the gradients are differences of neighbouring Y, a Y
+  * in double would mostly measure the rounding of Y).  Each kernel variant (specialized scalar, generic
+  * scalar and every SIMD instruction set built in and supported by the
+  * CPU) renders a synthetic image for every technology, perceptual,
+  * fast_math, neutral and tinted white, two slider sets and with the
+  * gradients or a tone curve, and the rgb output is compared per channel:
+  *
+  *   max_abs, mean_abs   absolute error against the reference
+  *   max_ulp             distance in float steps to the rounded reference
+  *   ulp histogram       pixels per ulp range
+  *
+  * A pixel is within tolerance when its error is at most --max-abs or at
+  * most --max-ulp ulp.  The float math itself misses that on some pixels
+  * (an aux of Y near 0 under a brighter input makes luminance_ratio huge),
+  * so the specialized scalar kernels are the baseline: a configuration
+  * passes when the variant is within tolerance wherever the baseline is
+  * (or errs at most twice as much as the baseline there), and its mean
+  * error over those pixels, each capped at --max-abs (ratios near FLT_MAX
+  * are within 1024 ulp but far from 1e-4), is at most --max-mean above
+  * the one of the baseline.  The exit status is 1 when any configuration
+  * does not, so a new fast path can be gated on it.  The defaults, 1e-4
+  * or 1024 ulp and a mean of 1e-6, are what the AVX2 and AVX-512 kernels
+  * (FMA contracted, summed in a different order) meet on every seed
+  * tried, with and without fast_math.
+  *
+  *   color-mapper-accuracy [--width N] [--height N] [--seed N]
+  *                         [--variant NAME] [--technology N]
+  *                         [--max-abs E] [--max-ulp N] [--max-mean E]
+  *                         [--failures-only]
+  *
+  * NaN or infinite output where the reference is finite is bad output
+  * whether or not the baseline gives it too; such configurations fail,
+  * marked NON-FINITE, and are also counted on their own at the end.
+  *
+  * The kernels are plain C, so this builds without GEGL; see meson.build.
+  */
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "color-mapper-kernel.h"
+
+#define POW2(x) ((x)*(x))
+
+/* Y weights of linear sRGB, as babl has them */
+static const double luminance[3] = { 0.2126729, 0.7151522, 0.0721750 };
+
+/* neutral and a warm white representation */
+static const float whites[2][3] =
+{
+  { 1.0f,   1.0f,   1.0f   },
+  { 1.085f, 0.972f, 0.861f },
+};
+
+/* slider sets: the defaults and one that pushes much into saturation_clip */
+typedef struct
+{
+  const char *name;
+  float       scale;
+  float       saturation_min;
+  float       saturation_weighting_factor;
+  float       globalSaturation;
+} SliderSet;
+
+static const SliderSet slider_sets[] =
+{
+  { "default", 0.5f, 0.0f, 0.0f, 1.0f },
+  { "strong",  1.0f, 0.1f, 0.5f, 2.5f },
+};
+
+static const char *technology_names[COLOR_MAPPER_N_TECHNOLOGIES] =
+{
+  "default",
+  "default-rgb-unlimited",
+  "gradient-ratio",
+  "chroma-adoption-base",
+  "chroma-adoption-factor",
+  "chromaticity",
+  "saturation",
+  "ygrad-aux",
+};
+
+static const char *channel_names[3] = { "R", "G", "B" };
+
+/* an S curve for the tone curve configurations */
+static const char *tone_curve_text = "0,0 0.25,0.15 0.5,0.5 0.75,0.85 1,1";
+
+/* upper ends of the ulp histogram bins, the last bin takes the rest
+ * including non finite mismatches
+ */
+#define N_BINS 8
+static const int64_t bin_limits[N_BINS - 1] = { 0, 1, 2, 4, 16, 256, 65536 };
+static const char   *bin_names[N_BINS]      = { "0", "1", "2", "3-4", "5-16", "17-256", "257-64k", ">64k" };
+
+typedef struct
+{
+  const char                   *name;
+  const ColorMapperSimdKernels *simd;  /* NULL for the scalar variants */
+  int                           generic;
+} Variant;
+
+typedef struct
+{
+  double  max_abs;
+  double  sum_abs;
+  int64_t max_ulp;
+  long    n_pixels;
+  long    n_non_finite;   /* only one of output and reference is finite */
+  long    n_nan_output;   /* output NaN or infinite, the rounded reference
+                           * is finite */
+  long    n_failed;       /* out of tolerance */
+  long    n_regressed;    /* out of tolerance, the baseline is not and
+                           * errs less than half as much */
+  long    bins[N_BINS];
+  double  sum_abs_met;    /* errors capped at max_abs, on the pixels the
+                           * baseline meets the tolerance on */
+  long    n_met;
+} ChannelStats;
+
+typedef struct
+{
+  double  max_abs;
+  int64_t max_ulp;
+  double  max_mean;
+} Tolerance;
+
+/* test images with one pixel of clamped border on every side */
+typedef struct
+{
+  int     width;
+  int     height;
+  int     stride;    /* width + 2 */
+  float  *in;        /* RGBA */
+  float  *aux;
+  float  *Yin;       /* luminance by color_mapper_luminance () */
+  float  *Yaux;
+} TestImage;
+
+
+/* synthetic content */
+
+static uint32_t rng_state;
+
+static float
+random_float (float min,
+              float max)
+{
+  /* xorshift32 */
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+
+  return min + (max - min) * (rng_state >> 8) * (1.0f / 16777216.0f);
+}
+
+/* pixels the guards of the math exist for */
+static const float edge_cases[][3] =
+{
+  { 0.0f,     0.0f,     0.0f     },  /* black, Y = 0 */
+  { 1e-39f,   1e-39f,   1e-39f   },  /* denormal gray */
+  { 1e-38f,   0.0f,     2e-38f   },  /* Y around FLT_MIN */
+  { 1e-6f,    2e-6f,    0.0f     },  /* near black color */
+  { 0.18f,    0.18f,    0.18f    },  /* gray, no chroma */
+  { 1.0f,     1.0f,     1.0f     },  /* white */
+  { 1.0f,     0.0f,     0.0f     },  /* primaries */
+  { 0.0f,     1.0f,     0.0f     },
+  { 0.0f,     0.0f,     1.0f     },
+  { 1.0f,     1.0f,     0.0f     },
+  { 1.2f,     -0.05f,   0.3f     },  /* out of gamut */
+  { -0.1f,    0.4f,     0.5f     },
+  { 8.0f,     6.0f,     2.0f     },  /* HDR */
+  { 1.085f,   0.972f,   0.861f   },  /* the tinted white */
+  { 0.5f,     0.49999f, 0.5f     },  /* almost gray */
+};
+
+#define N_EDGE_CASES ((int) (sizeof (edge_cases) / sizeof (edge_cases[0])))
+
+static void
+fill_pixel (float *pixel,
+            int    band,
+            int    x,
+            int    y,
+            int    width,
+            int    height,
+            int    is_aux)
+{
+  const float u = (float) x / width;
+  const float v = (float) y / height;
+  int         c;
+
+  switch (band)
+    {
+    case 0: /* smooth ramps, aux more colorful than input */
+      pixel[0] = is_aux ? u : 0.5f * u + 0.25f;
+      pixel[1] = is_aux ? v : 0.5f * v + 0.25f;
+      pixel[2] = 0.5f + 0.5f * sinf (8.0f * (u + v) + is_aux);
+      break;
+
+    case 1: /* noise */
+      for (c = 0; c < 3; c++)
+        pixel[c] = random_float (0.0f, 1.0f);
+      break;
+
+    case 2: /* HDR noise with dark areas */
+      for (c = 0; c < 3; c++)
+        pixel[c] = powf (random_float (0.0f, 1.0f), 4.0f) * 16.0f;
+      break;
+
+    default: /* edge cases in 2x2 blocks, so some gradients are zero */
+      {
+        uint32_t block = ((x / 2) * 73856093u) ^ ((y / 2) * 19349663u);
+        uint32_t hash  = block ^ (is_aux * 83492791u);
+        int      i;
+
+        /* input equal to aux in some blocks */
+        if ((block & 7) == 0)
+          hash = block;
+        i = (hash >> 4) % N_EDGE_CASES;
+
+        for (c = 0; c < 3; c++)
+          pixel[c] = edge_cases[i][c];
+      }
+      break;
+    }
+
+  pixel[3] = is_aux ? 1.0f : random_float (0.0f, 1.0f);
+}
+
+static void
+test_image_init (TestImage *image,
+                 int        width,
+                 int        height)
+{
+  const int n = (width + 2) * (height + 2);
+  int       x, y;
+
+  image->width    = width;
+  image->height   = height;
+  image->stride   = width + 2;
+  image->in       = malloc (n * 4 * sizeof (float));
+  image->aux      = malloc (n * 4 * sizeof (float));
+  image->Yin      = malloc (n * sizeof (float));
+  image->Yaux     = malloc (n * sizeof (float));
+
+  /* four horizontal bands: ramps, noise, HDR, edge cases */
+  for (y = 0; y < height; y++)
+    for (x = 0; x < width; x++)
+      {
+        const int band = y * 4 / height;
+        const int idx  = ((y + 1) * image->stride + x + 1) * 4;
+
+        fill_pixel (image->in  + idx, band, x, y, width, height, 0);
+        fill_pixel (image->aux + idx, band, x, y, width, height, 1);
+      }
+
+  /* clamp the border */
+  for (y = 0; y < height + 2; y++)
+    for (x = 0; x < width + 2; x++)
+      {
+        const int sx = x < 1 ? 1 : x > width  ? width  : x;
+        const int sy = y < 1 ? 1 : y > height ? height : y;
+
+        if (sx == x && sy == y)
+          continue;
+
+        memcpy (image->in  + (y * image->stride + x) * 4,
+                image->in  + (sy * image->stride + sx) * 4, 4 * sizeof (float));
+        memcpy (image->aux + (y * image->stride + x) * 4,
+                image->aux + (sy * image->stride + sx) * 4, 4 * sizeof (float));
+      }
+
+  color_mapper_luminance (image->in,  image->Yin,  n, luminance);
+  color_mapper_luminance (image->aux, image->Yaux, n, luminance);
+}
+
+static void
+test_image_free (TestImage *image)
+{
+  free (image->in);
+  free (image->aux);
+  free (image->Yin);
+  free (image->Yaux);
+}
+
+
+/* double precision reference of all three stages for pixel x, y */
+
+static void
+reference_pixel (const ColorMapperParams *params,
+                 const TestImage         *image,
+                 int                      x,
+                 int                      y,
+                 double                   out[3])
+{
+  const int     s      = image->stride;
+  const int     p      = (y + 1) * s + x + 1;
+  const float  *Yi     = image->Yin;
+  const float  *Ya     = image->Yaux;
+  const float  *aux    = image->aux + p * 4;
+  const double  Yin    = Yi[p];
+  const double  Yaux   = Ya[p];
+  const int     tech   = params->technology;
+  double        n2t[3];
+  double        dx, dy, GradientYin, GradientYaux;
+  double        chroma_aux[3], Chroma_HSY_aux, Saturation_HSY_aux;
+  double        luminance_ratio, GradientRatio;
+  double        GradientYin_Yaux, GradientYaux_Yin, base;
+  int           invert;
+  double        caf, caf_global, sat_dz, Saturation_HSY_aux_dz;
+  double        tinted_gray[3], blended[3], factor;
+  double        clip_negative, clip_positive, saturation_clip;
+  int           c;
+
+  for (c = 0; c < 3; c++)
+    n2t[c] = params->neutral2tinted[c];
+
+  /* aux stage */
+  dx = (double) Ya[p - 1] - Ya[p + 1];
+  dy = (double) Ya[p - s] - Ya[p + s];
+  GradientYaux = 0.5 * sqrt (POW2 (dx) + POW2 (dy));
+
+  for (c = 0; c < 3; c++)
+    chroma_aux[c] = aux[c] - Yaux * n2t[c];
+
+  Chroma_HSY_aux = sqrt (POW2 (chroma_aux[0]) + POW2 (chroma_aux[1]) + POW2 (chroma_aux[2]) -
+                         (chroma_aux[0] * chroma_aux[1] + chroma_aux[0] * chroma_aux[2] + chroma_aux[1] * chroma_aux[2]));
+  Saturation_HSY_aux = (Yaux > FLT_MIN) ? Chroma_HSY_aux / sqrt (POW2 (Yaux) + POW2 (Chroma_HSY_aux)) : 0.0;
+
+  /* feature stage */
+  luminance_ratio = Yin / fmax ((double) COLOR_MAPPER_Y_MIN, Yaux);
+
+  if (params->tone_curve)
+    {
+      /* the table is the curve, only the lookup is in double */
+      const ColorMapperToneCurve *curve = params->tone_curve;
+      double                      t, ratio;
+      int                         i;
+
+      t = (log2 (fmax (Yaux, FLT_MIN)) - COLOR_MAPPER_TONE_CURVE_LOG2_MIN) * COLOR_MAPPER_TONE_CURVE_PER_STOP;
+      t = fmin (fmax (t, 0.0), COLOR_MAPPER_TONE_CURVE_SIZE - 1);
+      i = (int) t < COLOR_MAPPER_TONE_CURVE_SIZE - 2 ? (int) t : COLOR_MAPPER_TONE_CURVE_SIZE - 2;
+      t = t - i;
+
+      ratio         = curve->ratio[i] + ((double) curve->ratio[i + 1] - curve->ratio[i]) * t;
+      base          = curve->base[i]  + ((double) curve->base[i + 1]  - curve->base[i])  * t;
+      GradientRatio = ratio * luminance_ratio;
+      invert        = ratio > 1.0;
+    }
+  else
+    {
+      dx = (double) Yi[p - 1] - Yi[p + 1];
+      dy = (double) Yi[p - s] - Yi[p + s];
+      GradientYin = 0.5 * sqrt (POW2 (dx) + POW2 (dy));
+
+      GradientRatio = GradientYin / fmax (FLT_MIN, GradientYaux);
+
+      GradientYaux_Yin = GradientYaux * Yin;
+      GradientYin_Yaux = GradientYin * Yaux;
+
+      if (GradientYin_Yaux > GradientYaux_Yin)
+        base = GradientYaux_Yin / GradientYin_Yaux;
+      else if (GradientYaux_Yin > GradientYin_Yaux)
+        base = GradientYin_Yaux / GradientYaux_Yin;
+      else
+        base = 1.0;
+
+      if (params->perceptual)
+        base = pow (base, 1.0 / 2.2);
+      base -= 1.0;
+      invert = GradientYin_Yaux > GradientYaux_Yin;
+    }
+
+  /* combine stage */
+  switch (tech)
+    {
+    case COLOR_MAPPER_GRADIENT_RATIO:
+      out[0] = out[1] = out[2] = GradientRatio;
+      return;
+    case COLOR_MAPPER_CHROMATICITY:
+      out[0] = out[1] = out[2] = Chroma_HSY_aux;
+      return;
+    case COLOR_MAPPER_SATURATION:
+      out[0] = out[1] = out[2] = Saturation_HSY_aux;
+      return;
+    case COLOR_MAPPER_YGRAD_AUX:
+      out[0] = out[1] = out[2] = GradientYaux * params->gradient_scale;
+      return;
+    case COLOR_MAPPER_CHROMA_ADOPTION_FACTOR_BASE:
+      out[0] = out[1] = out[2] = base;
+      return;
+    }
+
+  caf = 1.0 + params->scale * base;
+  if (caf > FLT_MIN)
+    caf = invert ? 1.0 / caf : caf;
+  else
+    caf = 1.0;
+
+  if (tech == COLOR_MAPPER_CHROMA_ADOPTION_FACTOR)
+    {
+      out[0] = out[1] = out[2] = caf;
+      return;
+    }
+
+  Saturation_HSY_aux_dz = fmax (Saturation_HSY_aux - params->saturation_min, 0.0);
+  sat_dz = (Saturation_HSY_aux > FLT_MIN) ? Saturation_HSY_aux_dz / Saturation_HSY_aux : 0.0;
+
+  caf_global = caf * params->globalSaturation;
+  caf_global = 1.0 + (caf_global - 1.0) *
+               (params->saturation_weighting_factor * (Saturation_HSY_aux - 1.0) + 1.0) * sat_dz;
+
+  factor = luminance_ratio * caf_global;
+  for (c = 0; c < 3; c++)
+    {
+      tinted_gray[c] = Yin * n2t[c];
+      blended[c]     = tinted_gray[c] + chroma_aux[c] * factor;
+    }
+
+  if (tech == COLOR_MAPPER_DEFAULT_RGB_UNLIMITED)
+    {
+      for (c = 0; c < 3; c++)
+        out[c] = blended[c];
+      return;
+    }
+
+  /* saturation_clip, with the guards of the float code */
+  clip_negative = INFINITY;
+  clip_positive = -INFINITY;
+  for (c = 0; c < 3; c++)
+    {
+      clip_negative = fmin (clip_negative,
+                            tinted_gray[c] / (tinted_gray[c] - fmin (blended[c], (double) -0.00001f)));
+      clip_positive = fmax (clip_positive,
+                            fmax (blended[c] - fmax (1.0, tinted_gray[c]), 0.0) /
+                            (blended[c] - tinted_gray[c] + (double) 0.00001f));
+    }
+  saturation_clip = fmin (1.0 - clip_positive, clip_negative);
+
+  for (c = 0; c < 3; c++)
+    out[c] = (blended[c] - tinted_gray[c]) * saturation_clip + tinted_gray[c];
+}
+
+
+/* kernel output for one row, through the variant's stage functions */
+
+static void
+pick_kernels (const Variant           *variant,
+              const ColorMapperParams *params,
+              ColorMapperAuxFunc      *aux_func,
+              ColorMapperFeatureFunc  *features_func,
+              ColorMapperCombineFunc  *combine_func)
+{
+  const int neutral    = color_mapper_white_is_neutral (params);
+  const int perceptual = params->perceptual ? 1 : 0;
+  const int fast       = params->fast_math ? 1 : 0;
+
+  /* color_mapper_kernel_init () is never called here, so the get
+   * functions return the specialized scalar variants; the SIMD fallbacks
+   * mirror the dispatch in color-mapper-kernel.c
+   */
+  if (variant->generic)
+    {
+      *aux_func      = color_mapper_aux_scalar;
+      *features_func = color_mapper_features_scalar;
+      *combine_func  = color_mapper_combine_scalar;
+      return;
+    }
+
+  *aux_func      = color_mapper_kernel_get_aux (params);
+  *features_func = color_mapper_kernel_get_features (params);
+  *combine_func  = color_mapper_kernel_get_combine (params);
+
+  if (variant->simd)
+    {
+      *aux_func = variant->simd->aux[fast][neutral];
+
+      if (params->tone_curve)
+        *features_func = variant->simd->tone_curve_features[fast];
+      else
+        *features_func = variant->simd->features[fast][perceptual];
+
+      if (params->technology == COLOR_MAPPER_DEFAULT ||
+          params->technology == COLOR_MAPPER_DEFAULT_RGB_UNLIMITED)
+        *combine_func = variant->simd->combine[fast][params->technology][neutral];
+    }
+}
+
+/* distance in float steps, INT64_MAX when only one of them is finite */
+static int64_t
+ulp_distance (float a,
+              float b)
+{
+  int32_t ia, ib;
+
+  if (isnan (a) || isnan (b))
+    return (isnan (a) && isnan (b)) ? 0 : INT64_MAX;
+  if (isinf (a) || isinf (b))
+    return (a == b) ? 0 : INT64_MAX;
+
+  memcpy (&ia, &a, sizeof (ia));
+  memcpy (&ib, &b, sizeof (ib));
+
+  /* map the sign magnitude bits onto a monotonic integer line */
+  if (ia < 0)
+    ia = INT32_MIN - ia;
+  if (ib < 0)
+    ib = INT32_MIN - ib;
+
+  return llabs ((int64_t) ia - (int64_t) ib);
+}
+
+/* error of value, TRUE when it is within tolerance */
+static int
+accumulate (ChannelStats    *stats,
+            float            value,
+            double           reference,
+            const Tolerance *tolerance,
+            double          *error_out)
+{
+  const float   rounded = reference;
+  const int64_t ulp     = ulp_distance (value, rounded);
+  double        error;
+  int           bin;
+
+  /* references beyond the float range count as met by their rounding */
+  if (ulp == 0)
+    error = isfinite (rounded) ? fabs (rounded - reference) : 0.0;
+  else if (ulp == INT64_MAX)
+    error = INFINITY;
+  else
+    error = fabs (value - reference);
+
+  for (bin = 0; bin < N_BINS - 1; bin++)
+    if (ulp <= bin_limits[bin])
+      break;
+
+  stats->bins[bin]++;
+  stats->n_pixels++;
+
+  if (isfinite (error))
+    stats->sum_abs += error;
+  else
+    stats->n_non_finite++;
+
+  if (! isfinite (value) && isfinite (rounded))
+    stats->n_nan_output++;
+
+  *error_out = error;
+
+  if (error > stats->max_abs)
+    stats->max_abs = error;
+  if (ulp > stats->max_ulp)
+    stats->max_ulp = ulp;
+
+  if (error <= tolerance->max_abs || ulp <= tolerance->max_ulp)
+    return 1;
+
+  stats->n_failed++;
+  return 0;
+}
+
+static double
+mean_abs (const ChannelStats *stats)
+{
+  return stats->sum_abs / stats->n_pixels;
+}
+
+static double
+mean_abs_met (const ChannelStats *stats)
+{
+  return stats->n_met ? stats->sum_abs_met / stats->n_met : 0.0;
+}
+
+/* one row through the variant, planes hold the aux and feature planes */
+static void
+render_row (const Variant           *variant,
+            const ColorMapperParams *params,
+            const TestImage         *image,
+            int                      y,
+            float                   *planes,
+            float                   *out)
+{
+  const int              width = image->width;
+  ColorMapperAuxFunc     aux_func;
+  ColorMapperFeatureFunc features_func;
+  ColorMapperCombineFunc combine_func;
+  ColorMapperSource      in_source, aux_source;
+  ColorMapperAuxRow      aux_row;
+  ColorMapperFeatureRow  feature_row;
+  int                    k;
+
+  pick_kernels (variant, params, &aux_func, &features_func, &combine_func);
+
+  color_mapper_aux_row_init (&aux_row, planes, width, width, 0, 0);
+  color_mapper_feature_row_init (&feature_row, planes + COLOR_MAPPER_AUX_PLANES * width,
+                                 width, width, 0, 0);
+
+  for (k = 0; k < 3; k++)
+    {
+      in_source.Y[k]  = image->Yin  + (y + k) * image->stride;
+      aux_source.Y[k] = image->Yaux + (y + k) * image->stride;
+    }
+  in_source.rgba  = image->in  + ((y + 1) * image->stride + 1) * 4;
+  aux_source.rgba = image->aux + ((y + 1) * image->stride + 1) * 4;
+  in_source.contrast  = NULL;
+  aux_source.contrast = NULL;
+
+  aux_func (params, &aux_source, &aux_row, width);
+  features_func (params, &in_source, &aux_row, &feature_row, width);
+  combine_func (params, &feature_row, &aux_row, out, width);
+}
+
+/* the specialized scalar kernels are the baseline: a configuration fails
+ * when the variant misses the tolerance on a pixel the baseline meets it
+ * on, or when its mean error there exceeds the one of the baseline by
+ * more than max_mean; pixels the baseline itself misses are counted, not
+ * failed.  NaN or infinite output where the reference is finite is bad
+ * output even when the baseline gives the same, it fails as NON-FINITE;
+ * *non_finite tells whether there was any.
+ */
+static int
+run_configuration (const Variant           *variant,
+                   const ColorMapperParams *params,
+                   const char              *sliders,
+                   const TestImage         *image,
+                   const Tolerance         *tolerance,
+                   int                      failures_only,
+                   int                     *non_finite)
+{
+  static const Variant   baseline = { "scalar", NULL, 0 };
+  const int              width    = image->width;
+  const int              n_planes = COLOR_MAPPER_AUX_PLANES + COLOR_MAPPER_FEATURE_PLANES;
+  float                 *planes   = malloc (n_planes * width * sizeof (float));
+  float                 *out      = malloc (width * 4 * sizeof (float));
+  float                 *base_out = malloc (width * 4 * sizeof (float));
+  ChannelStats           stats[3], base_stats[3];
+  int                    ok = 1;
+  int                    x, y, c;
+
+  memset (stats, 0, sizeof (stats));
+  memset (base_stats, 0, sizeof (base_stats));
+
+  for (y = 0; y < image->height; y++)
+    {
+      render_row (variant, params, image, y, planes, out);
+      render_row (&baseline, params, image, y, planes, base_out);
+
+      for (x = 0; x < width; x++)
+        {
+          double reference[3];
+
+          reference_pixel (params, image, x, y, reference);
+
+          for (c = 0; c < 3; c++)
+            {
+              double    error, base_error;
+              const int within      = accumulate (&stats[c], out[x * 4 + c],
+                                                  reference[c], tolerance, &error);
+              const int base_within = accumulate (&base_stats[c], base_out[x * 4 + c],
+                                                  reference[c], tolerance, &base_error);
+
+              /* a baseline right at the limit is no reason to fail */
+              if (! within && base_within && error > 2.0 * base_error)
+                stats[c].n_regressed++;
+
+              if (base_within)
+                {
+                  stats[c].sum_abs_met      += fmin (error, tolerance->max_abs);
+                  stats[c].n_met++;
+                  base_stats[c].sum_abs_met += fmin (base_error, tolerance->max_abs);
+                  base_stats[c].n_met++;
+                }
+            }
+        }
+    }
+
+  *non_finite = 0;
+  for (c = 0; c < 3; c++)
+    {
+      if (stats[c].n_regressed ||
+          mean_abs_met (&stats[c]) > mean_abs_met (&base_stats[c]) + tolerance->max_mean)
+        ok = 0;
+      if (stats[c].n_nan_output)
+        *non_finite = 1;
+    }
+
+  if (! ok || *non_finite || ! failures_only)
+    {
+      printf ("%-8s %-22s %-9s %-10s %-5s %-7s %-7s %s\n",
+              variant->name, technology_names[params->technology],
+              params->tone_curve ? "curve" : "gradients",
+              params->perceptual ? "perceptual" : "linear",
+              params->fast_math ? "fast" : "exact",
+              color_mapper_white_is_neutral (params) ? "neutral" : "tinted",
+              sliders, *non_finite ? "NON-FINITE" : ! ok ? "FAILED" : "ok");
+
+      for (c = 0; c < 3; c++)
+        {
+          const ChannelStats *s = &stats[c];
+          int                 bin;
+
+          printf ("  %s max_abs %-10.4g mean_abs %-10.4g max_ulp %-10lld "
+                  "non_finite %-5ld nan_output %-5ld out_of_tolerance %-5ld regressed %-5ld ulp",
+                  channel_names[c], s->max_abs, mean_abs (s),
+                  s->max_ulp == INT64_MAX ? -1LL : (long long) s->max_ulp,
+                  s->n_non_finite, s->n_nan_output, s->n_failed, s->n_regressed);
+          for (bin = 0; bin < N_BINS; bin++)
+            printf (" %s:%ld", bin_names[bin], s->bins[bin]);
+          printf ("\n");
+        }
+    }
+
+  free (planes);
+  free (out);
+  free (base_out);
+
+  return ok;
+}
+
+static void
+usage (const char *program)
+{
+  fprintf (stderr,
+           "usage: %s [--width N] [--height N] [--seed N] [--variant NAME]\n"
+           "       [--technology N] [--max-abs E] [--max-ulp N] [--max-mean E]\n"
+           "       [--failures-only]\n", program);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  Variant     variants[5];
+  int         n_variants     = 0;
+  Tolerance   tolerance      = { 1e-4, 1024, 1e-6 };
+  const char *variant_filter = NULL;
+  int         technology     = -1;
+  int         width          = 256;
+  int         height         = 256;
+  int         failures_only  = 0;
+  int         n_configs      = 0;
+  int         n_failed       = 0;
+  int         n_non_finite   = 0;
+  TestImage   image;
+  ColorMapperToneCurve *curves[2][2];   /* [perceptual][fast] */
+  float       curve_x[8], curve_y[8];
+  int         n_points;
+  int         i, v, t, perceptual, fast, white, s, curve;
+
+  rng_state = 3;
+
+  for (i = 1; i < argc; i++)
+    {
+      if (! strcmp (argv[i], "--width") && i + 1 < argc)
+        width = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "--height") && i + 1 < argc)
+        height = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "--seed") && i + 1 < argc)
+        rng_state = 2 * strtoul (argv[++i], NULL, 10) + 1;
+      else if (! strcmp (argv[i], "--variant") && i + 1 < argc)
+        variant_filter = argv[++i];
+      else if (! strcmp (argv[i], "--technology") && i + 1 < argc)
+        technology = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "--max-abs") && i + 1 < argc)
+        tolerance.max_abs = atof (argv[++i]);
+      else if (! strcmp (argv[i], "--max-ulp") && i + 1 < argc)
+        tolerance.max_ulp = atoll (argv[++i]);
+      else if (! strcmp (argv[i], "--max-mean") && i + 1 < argc)
+        tolerance.max_mean = atof (argv[++i]);
+      else if (! strcmp (argv[i], "--failures-only"))
+        failures_only = 1;
+      else
+        {
+          usage (argv[0]);
+          return 2;
+        }
+    }
+
+  if (width < 1 || height < 4 ||
+      technology < -1 || technology >= COLOR_MAPPER_N_TECHNOLOGIES)
+    {
+      usage (argv[0]);
+      return 2;
+    }
+
+  variants[n_variants++] = (Variant) { "scalar",  NULL, 0 };
+  variants[n_variants++] = (Variant) { "generic", NULL, 1 };
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init ();
+#endif
+#ifdef HAVE_COLOR_MAPPER_AVX2
+  if (__builtin_cpu_supports ("avx2"))
+    variants[n_variants++] = (Variant) { "avx2", &color_mapper_simd_avx2, 0 };
+#endif
+#ifdef HAVE_COLOR_MAPPER_AVX512
+  if (__builtin_cpu_supports ("avx512f"))
+    variants[n_variants++] = (Variant) { "avx512", &color_mapper_simd_avx512, 0 };
+#endif
+#ifdef HAVE_COLOR_MAPPER_NEON
+  variants[n_variants++] = (Variant) { "neon", &color_mapper_simd_neon, 0 };
+#endif
+
+  test_image_init (&image, width, height);
+
+  n_points = color_mapper_tone_curve_parse (tone_curve_text, curve_x, curve_y, 8);
+  for (perceptual = 0; perceptual < 2; perceptual++)
+    for (fast = 0; fast < 2; fast++)
+      {
+        curves[perceptual][fast] = malloc (sizeof (ColorMapperToneCurve));
+        color_mapper_tone_curve_init (curves[perceptual][fast], curve_x, curve_y, n_points,
+                                      perceptual, fast);
+      }
+
+  printf ("tolerance: max_abs %g or max_ulp %lld per pixel, max_mean %g\n",
+          tolerance.max_abs, (long long) tolerance.max_ulp, tolerance.max_mean);
+
+  for (v = 0; v < n_variants; v++)
+    {
+      if (variant_filter && strcmp (variant_filter, variants[v].name))
+        continue;
+
+      for (t = 0; t < COLOR_MAPPER_N_TECHNOLOGIES; t++)
+        for (perceptual = 0; perceptual < 2; perceptual++)
+          for (fast = 0; fast < 2; fast++)
+            for (white = 0; white < 2; white++)
+              for (s = 0; s < (int) (sizeof (slider_sets) / sizeof (slider_sets[0])); s++)
+                for (curve = 0; curve < 2; curve++)
+                {
+                  ColorMapperParams params;
+                  int               non_finite;
+
+                  if (technology >= 0 && t != technology)
+                    continue;
+
+                  params.technology                  = t;
+                  params.perceptual                  = perceptual;
+                  params.fast_math                   = fast;
+                  params.scale                       = slider_sets[s].scale;
+                  params.saturation_min              = slider_sets[s].saturation_min;
+                  params.saturation_weighting_factor = slider_sets[s].saturation_weighting_factor;
+                  params.globalSaturation            = slider_sets[s].globalSaturation;
+                  params.neutral2tinted[0]           = whites[white][0];
+                  params.neutral2tinted[1]           = whites[white][1];
+                  params.neutral2tinted[2]           = whites[white][2];
+                  params.gradient_scale              = 0.5f;
+                  params.contrast_source             = 0;
+                  params.tone_curve                  = curve ? curves[perceptual][fast] : NULL;
+
+                  n_configs++;
+                  if (! run_configuration (&variants[v], &params, slider_sets[s].name,
+                                           &image, &tolerance, failures_only,
+                                           &non_finite) || non_finite)
+                    n_failed++;
+                  n_non_finite += non_finite;
+                }
+    }
+
+  test_image_free (&image);
+  for (perceptual = 0; perceptual < 2; perceptual++)
+    for (fast = 0; fast < 2; fast++)
+      free (curves[perceptual][fast]);
+
+  printf ("%d of %d configurations within tolerance\n", n_configs - n_failed, n_configs);
+  printf ("%d of %d configurations with NaN or infinite output on finite references\n",
+          n_non_finite, n_configs);
+
+  return n_failed ? 1 : 0;
+}
@@ -0,0 +1,65 @@
+#!/bin/sh
+# Smoke run of color-mapper-batch over three generated input / aux pairs,
+# run by meson test; needs the color-mapper plug-in next to the program.
+#
+# Checks that every pair is written, that a failing save is reported even
+# when an output from an earlier run is in its place, and that a line
+# whose output would overwrite its input is refused before anything runs.
+#
+#   color-mapper-batch-smoke.sh BATCH
+
+set -u
+
+batch=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+fail ()
+{
+  echo "FAILED: $*"
+  exit 1
+}
+
+# 32x24 binary PPM, a ramp per channel; seed tells input and aux apart
+ppm ()
+{
+  LC_ALL=C awk -v seed="$2" 'BEGIN {
+    printf "P6\n32 24\n255\n"
+    for (y = 0; y < 24; y++)
+      for (x = 0; x < 32; x++)
+        printf "%c%c%c", 20 + 3 * x, 20 + 4 * y, 20 + (x * seed + y) % 100
+  }' > "$1"
+}
+
+mkdir "$dir/out"
+for i in 1 2 3
+do
+  ppm "$dir/in$i.ppm" "$i"
+  ppm "$dir/aux$i.ppm" "$((i + 3))"
+done
+
+# three pairs, two to --output-dir, one with its own output and property
+printf '%s\t%s\n' "$dir/in1.ppm" "$dir/aux1.ppm" > "$dir/pairs.txt"
+printf '%s\t%s\n' "$dir/in2.ppm" "$dir/aux2.ppm" >> "$dir/pairs.txt"
+printf '%s\t%s\t%s\t%s\n' "$dir/in3.ppm" "$dir/aux3.ppm" "$dir/out/third.ppm" "scale=0.6" >> "$dir/pairs.txt"
+
+"$batch" --output-dir "$dir/out" "$dir/pairs.txt" || fail "batch of three pairs"
+for out in in1.ppm in2.ppm third.ppm
+do
+  test -s "$dir/out/$out" || fail "no $out"
+done
+ls -a "$dir/out" | grep -q '^\.color-mapper-batch' && fail "temporary file left"
+
+# gegl:save knows no such format; the stale file must not count as output
+echo stale > "$dir/out/stale.no-such-format"
+printf '%s\t%s\t%s\n' "$dir/in1.ppm" "$dir/aux1.ppm" "$dir/out/stale.no-such-format" > "$dir/bad.txt"
+"$batch" "$dir/bad.txt" > "$dir/bad.log" && fail "failed save not reported"
+grep -q "cannot write" "$dir/bad.log" || fail "failed save not reported: $(cat "$dir/bad.log")"
+
+# --output-dir the directory of the inputs
+cp "$dir/in1.ppm" "$dir/in1.orig"
+printf '%s\t%s\n' "$dir/in1.ppm" "$dir/aux1.ppm" > "$dir/same.txt"
+"$batch" --output-dir "$dir" "$dir/same.txt" 2> /dev/null && fail "input overwritten"
+cmp -s "$dir/in1.ppm" "$dir/in1.orig" || fail "input changed"
+
+echo "ok"
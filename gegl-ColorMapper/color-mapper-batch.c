@@ -0,0 +1,691 @@
+/* This file is part of the color-mapper GEGL operation
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* immanuel:color-mapper over many input / aux pairs in one process
+  *
+  * Every pair goes through three stages, each with its own threads:
+  *
+  *   decode   gegl:load of input and aux into buffers
+  *   map      immanuel:color-mapper, itself split over the GEGL threads
+  *   encode   gegl:save of the result
+  *
+  * so one pair is decoded while another one is mapped and a third one is
+  * written.  At most --in-flight pairs are between decode and the end of
+  * encode at any time, which bounds the memory to that many input, aux and
+  * output buffers.  Plug-ins and babl are loaded once for the whole batch.
+  *
+  * The manifest has one pair per line, fields separated by tabs (or by
+  * spaces when the line has no tab):
+  *
+  *   INPUT AUX [OUTPUT] [PROPERTY=VALUE]...
+  *
+  * Empty lines and lines starting with # are skipped.  Without OUTPUT the
+  * result goes to --output-dir under the name of INPUT; a line whose
+  * output would be its INPUT or AUX is refused.  Properties of a line
+  * override the ones given with --set for all lines; values are
+  * numbers, true / false, enum nicks ("default", "saturation", ...) or
+  * colors ("white", "#ffeedd", "rgb(1.0, 0.97, 0.9)").
+  *
+  * gegl:save writes to a hidden file next to OUTPUT, which is renamed to
+  * OUTPUT once it is complete, so a failed save never leaves a partial
+  * file there and is not hidden by one from an earlier run.
+  *
+  * Every pair prints one line when it is written, the batch a summary:
+  * files, failures, megapixels, wall time and throughput.
+  *
+  *   color-mapper-batch [--plugins DIR]... [--set PROPERTY=VALUE]...
+  *                      [--output-dir DIR] [--decoders N] [--mappers N]
+  *                      [--encoders N] [--in-flight N] [--threads N]
+  *                      MANIFEST
+  *
+  * The plug-in is looked for next to the program as well.  A MANIFEST of
+  * "-" is read from stdin.
+  */
+
+#include <errno.h>
+#include <gegl.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OP_NAME "immanuel:color-mapper"
+
+typedef struct _Batch Batch;
+
+/* one input / aux pair */
+typedef struct
+{
+  Batch       *batch;
+  gint         number;       /* line of the manifest */
+  gchar       *input_path;
+  gchar       *aux_path;
+  gchar       *output_path;
+  gchar      **properties;   /* NAME=VALUE of the manifest line */
+
+  GeglBuffer  *input;
+  GeglBuffer  *aux;
+  GeglBuffer  *output;
+
+  gint64       start;
+  gdouble      decode_s;
+  gdouble      map_s;
+  gdouble      encode_s;
+  gchar       *error;
+} BatchJob;
+
+struct _Batch
+{
+  GPtrArray   *properties;   /* NAME=VALUE from --set */
+  GThreadPool *decoders;
+  GThreadPool *mappers;
+  GThreadPool *encoders;
+
+  GMutex       mutex;
+  GCond        cond;
+  gint         in_flight;
+  gint         max_in_flight;
+  gint         n_jobs;
+  gint         n_done;
+  gint         n_failed;
+  gdouble      megapixels;
+  gdouble      map_s;
+};
+
+static gdouble
+seconds_since (gint64 start)
+{
+  return (g_get_monotonic_time () - start) / 1000000.0;
+}
+
+/* value is parsed by the type of the property */
+static gboolean
+set_property (GeglNode     *node,
+              const gchar  *assignment,
+              gchar       **error)
+{
+  gchar      **parts = g_strsplit (assignment, "=", 2);
+  GParamSpec  *pspec = NULL;
+  GValue       value = G_VALUE_INIT;
+  gboolean     ok    = TRUE;
+
+  if (parts[0] && parts[1])
+    pspec = gegl_operation_find_property (OP_NAME, parts[0]);
+
+  if (! pspec)
+    {
+      *error = g_strdup_printf ("%s is no property of %s", assignment, OP_NAME);
+      g_strfreev (parts);
+      return FALSE;
+    }
+
+  g_value_init (&value, pspec->value_type);
+
+  if (G_IS_PARAM_SPEC_DOUBLE (pspec))
+    {
+      g_value_set_double (&value, g_ascii_strtod (parts[1], NULL));
+    }
+  else if (G_IS_PARAM_SPEC_INT (pspec))
+    {
+      g_value_set_int (&value, atoi (parts[1]));
+    }
+  else if (G_IS_PARAM_SPEC_BOOLEAN (pspec))
+    {
+      g_value_set_boolean (&value, ! g_ascii_strcasecmp (parts[1], "true") ||
+                                   ! g_ascii_strcasecmp (parts[1], "yes") ||
+                                   ! strcmp (parts[1], "1"));
+    }
+  else if (G_IS_PARAM_SPEC_ENUM (pspec))
+    {
+      GEnumClass *enum_class = G_PARAM_SPEC_ENUM (pspec)->enum_class;
+      GEnumValue *enum_value = g_enum_get_value_by_nick (enum_class, parts[1]);
+
+      if (! enum_value)
+        enum_value = g_enum_get_value_by_name (enum_class, parts[1]);
+      if (! enum_value && g_ascii_isdigit (parts[1][0]))
+        enum_value = g_enum_get_value (enum_class, atoi (parts[1]));
+
+      if (enum_value)
+        g_value_set_enum (&value, enum_value->value);
+      else
+        ok = FALSE;
+    }
+  else if (pspec->value_type == GEGL_TYPE_COLOR)
+    {
+      g_value_take_object (&value, gegl_color_new (parts[1]));
+    }
+  else if (G_IS_PARAM_SPEC_STRING (pspec))
+    {
+      g_value_set_string (&value, parts[1]);
+    }
+  else
+    {
+      ok = FALSE;
+    }
+
+  if (ok)
+    gegl_node_set_property (node, parts[0], &value);
+  else
+    *error = g_strdup_printf ("cannot set %s", assignment);
+
+  g_value_unset (&value);
+  g_strfreev (parts);
+
+  return ok;
+}
+
+static gboolean
+set_properties (GeglNode     *node,
+                Batch        *batch,
+                gchar       **line_properties,
+                gchar       **error)
+{
+  guint i;
+
+  for (i = 0; i < batch->properties->len; i++)
+    if (! set_property (node, g_ptr_array_index (batch->properties, i), error))
+      return FALSE;
+
+  for (i = 0; line_properties && line_properties[i]; i++)
+    if (! set_property (node, line_properties[i], error))
+      return FALSE;
+
+  return TRUE;
+}
+
+/* path into a new buffer in the format of the file, NULL when it cannot
+ * be read
+ */
+static GeglBuffer *
+load_buffer (const gchar *path)
+{
+  GeglBuffer    *buffer = NULL;
+  GeglNode      *graph  = gegl_node_new ();
+  GeglNode      *load   = gegl_node_new_child (graph, "operation", "gegl:load", "path", path, NULL);
+  GeglNode      *sink   = gegl_node_new_child (graph, "operation", "gegl:buffer-sink", "buffer", &buffer, NULL);
+  GeglRectangle  extent;
+
+  gegl_node_link (load, sink);
+
+  /* gegl:load has an empty extent for files it cannot read */
+  extent = gegl_node_get_bounding_box (load);
+  if (! gegl_rectangle_is_empty (&extent))
+    gegl_node_process (sink);
+
+  g_object_unref (graph);
+
+  return buffer;
+}
+
+static void
+job_free (BatchJob *job)
+{
+  g_clear_object (&job->input);
+  g_clear_object (&job->aux);
+  g_clear_object (&job->output);
+  g_free (job->input_path);
+  g_free (job->aux_path);
+  g_free (job->output_path);
+  g_strfreev (job->properties);
+  g_free (job->error);
+  g_free (job);
+}
+
+/* reports the job and lets the next one in */
+static void
+job_finish (BatchJob *job)
+{
+  Batch *batch = job->batch;
+
+  g_mutex_lock (&batch->mutex);
+
+  batch->n_done++;
+
+  if (job->error)
+    {
+      batch->n_failed++;
+      printf ("[%d/%d] %s: %s\n", batch->n_done, batch->n_jobs, job->input_path, job->error);
+    }
+  else
+    {
+      const GeglRectangle *extent     = gegl_buffer_get_extent (job->output);
+      const gdouble        megapixels = extent->width * (gdouble) extent->height * 1e-6;
+
+      batch->megapixels += megapixels;
+      batch->map_s      += job->map_s;
+
+      printf ("[%d/%d] %s  %dx%d  decode %.2f s  map %.2f s (%.1f Mpix/s)  encode %.2f s  total %.2f s\n",
+              batch->n_done, batch->n_jobs, job->output_path, extent->width, extent->height,
+              job->decode_s, job->map_s, job->map_s > 0.0 ? megapixels / job->map_s : 0.0,
+              job->encode_s, seconds_since (job->start));
+    }
+  fflush (stdout);
+
+  batch->in_flight--;
+  g_cond_broadcast (&batch->cond);
+
+  g_mutex_unlock (&batch->mutex);
+
+  job_free (job);
+}
+
+static void
+decode_job (gpointer data,
+            gpointer user_data)
+{
+  BatchJob *job   = data;
+  Batch    *batch = user_data;
+  gint64    start = g_get_monotonic_time ();
+
+  job->input = load_buffer (job->input_path);
+  job->aux   = job->input ? load_buffer (job->aux_path) : NULL;
+
+  job->decode_s = seconds_since (start);
+
+  if (! job->input || ! job->aux)
+    {
+      job->error = g_strdup_printf ("cannot read %s", job->input ? job->aux_path : job->input_path);
+      job_finish (job);
+      return;
+    }
+
+  g_thread_pool_push (batch->mappers, job, NULL);
+}
+
+static void
+map_job (gpointer data,
+         gpointer user_data)
+{
+  BatchJob *job   = data;
+  Batch    *batch = user_data;
+  gint64    start = g_get_monotonic_time ();
+  GeglNode *graph, *input, *aux, *op, *sink;
+
+  graph = gegl_node_new ();
+  input = gegl_node_new_child (graph, "operation", "gegl:buffer-source", "buffer", job->input, NULL);
+  aux   = gegl_node_new_child (graph, "operation", "gegl:buffer-source", "buffer", job->aux, NULL);
+  op    = gegl_node_new_child (graph, "operation", OP_NAME, NULL);
+  sink  = gegl_node_new_child (graph, "operation", "gegl:buffer-sink", "buffer", &job->output, NULL);
+
+  gegl_node_link_many (input, op, sink, NULL);
+  gegl_node_connect_to (aux, "output", op, "aux");
+
+  if (set_properties (op, batch, job->properties, &job->error))
+    gegl_node_process (sink);
+
+  g_object_unref (graph);
+
+  /* the sources are not needed any more */
+  g_clear_object (&job->input);
+  g_clear_object (&job->aux);
+
+  job->map_s = seconds_since (start);
+
+  if (job->error || ! job->output)
+    {
+      if (! job->error)
+        job->error = g_strdup ("no output");
+      job_finish (job);
+      return;
+    }
+
+  g_thread_pool_push (batch->encoders, job, NULL);
+}
+
+/* hidden file in the directory of the output, with the extension that
+ * tells gegl:save the format
+ */
+static gchar *
+temporary_path (const BatchJob *job)
+{
+  gchar *dir  = g_path_get_dirname (job->output_path);
+  gchar *name = g_path_get_basename (job->output_path);
+  gchar *temp = g_strdup_printf (".color-mapper-batch-%d-%d-%s", (gint) getpid (), job->number, name);
+  gchar *path = g_build_filename (dir, temp, NULL);
+
+  g_free (dir);
+  g_free (name);
+  g_free (temp);
+
+  return path;
+}
+
+static void
+encode_job (gpointer data,
+            gpointer user_data)
+{
+  BatchJob  *job   = data;
+  gint64     start = g_get_monotonic_time ();
+  gchar     *temp  = temporary_path (job);
+  GeglNode  *graph, *source, *save;
+  GStatBuf   st;
+
+  /* gegl:save does not report errors, only a complete file counts */
+  g_unlink (temp);
+
+  graph  = gegl_node_new ();
+  source = gegl_node_new_child (graph, "operation", "gegl:buffer-source", "buffer", job->output, NULL);
+  save   = gegl_node_new_child (graph, "operation", "gegl:save", "path", temp, NULL);
+
+  gegl_node_link (source, save);
+  gegl_node_process (save);
+
+  g_object_unref (graph);
+
+  if (g_stat (temp, &st) != 0 || st.st_size == 0)
+    job->error = g_strdup_printf ("cannot write %s", job->output_path);
+  else if (g_rename (temp, job->output_path) != 0)
+    job->error = g_strdup_printf ("cannot write %s: %s", job->output_path, g_strerror (errno));
+
+  if (job->error)
+    g_unlink (temp);
+  g_free (temp);
+
+  job->encode_s = seconds_since (start);
+
+  job_finish (job);
+}
+
+/* TRUE when a and b name the same file, existing or not */
+static gboolean
+same_file (const gchar *a,
+           const gchar *b)
+{
+  gchar    *canonical_a = g_canonicalize_filename (a, NULL);
+  gchar    *canonical_b = g_canonicalize_filename (b, NULL);
+  gboolean  same        = ! strcmp (canonical_a, canonical_b);
+  GStatBuf  st_a, st_b;
+
+  /* links and hard links */
+  if (! same && g_stat (a, &st_a) == 0 && g_stat (b, &st_b) == 0)
+    same = st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino;
+
+  g_free (canonical_a);
+  g_free (canonical_b);
+
+  return same;
+}
+
+/* a job per manifest line, NULL for lines without one */
+static BatchJob *
+parse_line (Batch        *batch,
+            const gchar  *line,
+            const gchar  *output_dir,
+            gint          number,
+            gchar       **error)
+{
+  gchar     *text = g_strstrip (g_strdup (line));
+  gchar    **fields;
+  GPtrArray *properties;
+  BatchJob  *job;
+  gint       n_paths = 0;
+  gchar     *paths[3] = { NULL, };
+  gint       i;
+
+  if (! *text || *text == '#')
+    {
+      g_free (text);
+      return NULL;
+    }
+
+  if (strchr (text, '\t'))
+    fields = g_strsplit (text, "\t", -1);
+  else
+    fields = g_regex_split_simple ("\\s+", text, 0, 0);
+  g_free (text);
+
+  properties = g_ptr_array_new ();
+
+  for (i = 0; fields[i]; i++)
+    {
+      if (! *fields[i])
+        continue;
+
+      if (n_paths >= 2 && strchr (fields[i], '=') && ! strchr (fields[i], G_DIR_SEPARATOR))
+        g_ptr_array_add (properties, g_strdup (fields[i]));
+      else if (n_paths < 3)
+        paths[n_paths++] = fields[i];
+    }
+  g_ptr_array_add (properties, NULL);
+
+  job = g_new0 (BatchJob, 1);
+  job->batch      = batch;
+  job->number     = number;
+  job->properties = (gchar **) g_ptr_array_free (properties, FALSE);
+
+  if (n_paths >= 2)
+    {
+      job->input_path = g_strdup (paths[0]);
+      job->aux_path   = g_strdup (paths[1]);
+
+      if (paths[2])
+        {
+          job->output_path = g_strdup (paths[2]);
+        }
+      else if (output_dir)
+        {
+          gchar *name = g_path_get_basename (paths[0]);
+
+          job->output_path = g_build_filename (output_dir, name, NULL);
+          g_free (name);
+        }
+    }
+
+  g_strfreev (fields);
+
+  if (! job->output_path)
+    {
+      *error = g_strdup_printf ("line %d: %s", number,
+                                n_paths < 2 ? "needs INPUT and AUX" : "needs OUTPUT or --output-dir");
+      job_free (job);
+      return NULL;
+    }
+
+  /* e.g. --output-dir the directory of the inputs */
+  if (same_file (job->output_path, job->input_path) ||
+      same_file (job->output_path, job->aux_path))
+    {
+      *error = g_strdup_printf ("line %d: output %s would overwrite %s", number, job->output_path,
+                                same_file (job->output_path, job->input_path) ? "INPUT" : "AUX");
+      job_free (job);
+      return NULL;
+    }
+
+  return job;
+}
+
+static void
+usage (const gchar *program)
+{
+  g_printerr ("usage: %s [--plugins DIR]... [--set PROPERTY=VALUE]... [--output-dir DIR]\n"
+              "       [--decoders N] [--mappers N] [--encoders N] [--in-flight N] [--threads N]\n"
+              "       MANIFEST\n", program);
+}
+
+gint
+main (gint    argc,
+      gchar **argv)
+{
+  Batch        batch       = { NULL, };
+  GPtrArray   *jobs        = g_ptr_array_new ();
+  const gchar *manifest    = NULL;
+  const gchar *output_dir  = NULL;
+  gint         n_decoders  = 2;
+  gint         n_mappers   = 1;
+  gint         n_encoders  = 2;
+  gint         in_flight   = 0;
+  gint         threads     = 0;
+  gchar       *contents    = NULL;
+  gchar      **lines;
+  gchar       *error       = NULL;
+  gchar       *program_dir;
+  gint64       start;
+  gdouble      wall_s;
+  guint        j;
+  gint         i;
+
+  gegl_init (&argc, &argv);
+
+  batch.properties = g_ptr_array_new ();
+
+  /* the plug-in is built next to this program */
+  program_dir = g_path_get_dirname (argv[0]);
+  gegl_load_module_directory (program_dir);
+  g_free (program_dir);
+
+  for (i = 1; i < argc; i++)
+    {
+      if (! strcmp (argv[i], "--plugins") && i + 1 < argc)
+        gegl_load_module_directory (argv[++i]);
+      else if (! strcmp (argv[i], "--set") && i + 1 < argc)
+        g_ptr_array_add (batch.properties, argv[++i]);
+      else if (! strcmp (argv[i], "--output-dir") && i + 1 < argc)
+        output_dir = argv[++i];
+      else if (! strcmp (argv[i], "--decoders") && i + 1 < argc)
+        n_decoders = MAX (atoi (argv[++i]), 1);
+      else if (! strcmp (argv[i], "--mappers") && i + 1 < argc)
+        n_mappers = MAX (atoi (argv[++i]), 1);
+      else if (! strcmp (argv[i], "--encoders") && i + 1 < argc)
+        n_encoders = MAX (atoi (argv[++i]), 1);
+      else if (! strcmp (argv[i], "--in-flight") && i + 1 < argc)
+        in_flight = MAX (atoi (argv[++i]), 1);
+      else if (! strcmp (argv[i], "--threads") && i + 1 < argc)
+        threads = MAX (atoi (argv[++i]), 1);
+      else if (! manifest && (argv[i][0] != '-' || ! strcmp (argv[i], "-")))
+        manifest = argv[i];
+      else
+        {
+          usage (argv[0]);
+          return 2;
+        }
+    }
+
+  if (! manifest)
+    {
+      usage (argv[0]);
+      return 2;
+    }
+
+  if (! gegl_has_operation (OP_NAME))
+    {
+      g_printerr ("operation %s not found, pass its build directory with --plugins\n", OP_NAME);
+      return 1;
+    }
+
+  if (threads)
+    g_object_set (gegl_config (), "threads", threads, NULL);
+
+  /* every stage busy and one pair waiting in front of each */
+  batch.max_in_flight = in_flight ? in_flight : n_decoders + n_mappers + n_encoders + 2;
+
+  /* catch bad --set values before the first file */
+  {
+    GeglNode *graph = gegl_node_new ();
+    GeglNode *op    = gegl_node_new_child (graph, "operation", OP_NAME, NULL);
+    gboolean  ok    = set_properties (op, &batch, NULL, &error);
+
+    g_object_unref (graph);
+
+    if (! ok)
+      {
+        g_printerr ("%s\n", error);
+        return 2;
+      }
+  }
+
+  if (! strcmp (manifest, "-"))
+    {
+      GString *text = g_string_new (NULL);
+      gchar    chunk[4096];
+      size_t   n;
+
+      while ((n = fread (chunk, 1, sizeof (chunk), stdin)) > 0)
+        g_string_append_len (text, chunk, n);
+
+      contents = g_string_free (text, FALSE);
+    }
+  else if (! g_file_get_contents (manifest, &contents, NULL, NULL))
+    {
+      g_printerr ("cannot read %s\n", manifest);
+      return 1;
+    }
+
+  lines = g_strsplit (contents, "\n", -1);
+  g_free (contents);
+
+  for (i = 0; lines[i]; i++)
+    {
+      BatchJob *job = parse_line (&batch, lines[i], output_dir, i + 1, &error);
+
+      if (error)
+        {
+          g_printerr ("%s: %s\n", manifest, error);
+          return 2;
+        }
+
+      if (job)
+        g_ptr_array_add (jobs, job);
+    }
+  g_strfreev (lines);
+
+  batch.n_jobs   = jobs->len;
+  batch.decoders = g_thread_pool_new (decode_job, &batch, n_decoders, FALSE, NULL);
+  batch.mappers  = g_thread_pool_new (map_job,    &batch, n_mappers,  FALSE, NULL);
+  batch.encoders = g_thread_pool_new (encode_job, &batch, n_encoders, FALSE, NULL);
+
+  start = g_get_monotonic_time ();
+
+  for (j = 0; j < jobs->len; j++)
+    {
+      BatchJob *job = g_ptr_array_index (jobs, j);
+
+      g_mutex_lock (&batch.mutex);
+      while (batch.in_flight >= batch.max_in_flight)
+        g_cond_wait (&batch.cond, &batch.mutex);
+      batch.in_flight++;
+      g_mutex_unlock (&batch.mutex);
+
+      job->start = g_get_monotonic_time ();
+      g_thread_pool_push (batch.decoders, job, NULL);
+    }
+
+  g_mutex_lock (&batch.mutex);
+  while (batch.n_done < batch.n_jobs)
+    g_cond_wait (&batch.cond, &batch.mutex);
+  g_mutex_unlock (&batch.mutex);
+
+  wall_s = seconds_since (start);
+
+  g_thread_pool_free (batch.decoders, FALSE, TRUE);
+  g_thread_pool_free (batch.mappers,  FALSE, TRUE);
+  g_thread_pool_free (batch.encoders, FALSE, TRUE);
+
+  printf ("%d files, %d failed, %.1f Mpix in %.2f s: %.2f files/s, %.1f Mpix/s (map alone %.1f Mpix/s)\n",
+          batch.n_jobs, batch.n_failed, batch.megapixels, wall_s,
+          wall_s > 0.0 ? (batch.n_jobs - batch.n_failed) / wall_s : 0.0,
+          wall_s > 0.0 ? batch.megapixels / wall_s : 0.0,
+          batch.map_s > 0.0 ? batch.megapixels / batch.map_s : 0.0);
+
+  g_ptr_array_free (jobs, TRUE);
+  g_ptr_array_free (batch.properties, TRUE);
+
+  gegl_exit ();
+
+  return batch.n_failed ? 1 : 0;
+}
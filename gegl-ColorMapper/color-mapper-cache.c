@@ -0,0 +1,277 @@
+/* This file is part of the color-mapper GEGL operation
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+#include "color-mapper-cache.h"
+
+struct _ColorMapperCache
+{
+  GMutex                 mutex;
+  GHashTable            *entries;     /* ColorMapperCacheEntry, by tile and level */
+  GQueue                 lru;         /* most recently used first */
+  gint                   n_planes;
+  gsize                  size;
+  gsize                  max_size;
+  gboolean               have_stamp;
+  ColorMapperCacheStamp  stamp;
+};
+
+static guint
+entry_hash (gconstpointer key)
+{
+  const ColorMapperCacheEntry *entry = key;
+
+  return ((guint) entry->tile_x * 73856093u) ^
+         ((guint) entry->tile_y * 19349663u) ^
+         ((guint) entry->level  * 83492791u);
+}
+
+static gboolean
+entry_equal (gconstpointer a,
+             gconstpointer b)
+{
+  const ColorMapperCacheEntry *entry_a = a;
+  const ColorMapperCacheEntry *entry_b = b;
+
+  return entry_a->tile_x == entry_b->tile_x &&
+         entry_a->tile_y == entry_b->tile_y &&
+         entry_a->level  == entry_b->level;
+}
+
+static void
+entry_unref (ColorMapperCacheEntry *entry)
+{
+  if (g_atomic_int_dec_and_test (&entry->ref_count))
+    {
+      g_free (entry->planes);
+      g_slice_free (ColorMapperCacheEntry, entry);
+    }
+}
+
+/* call with the mutex held */
+static void
+cache_remove (ColorMapperCache      *cache,
+              ColorMapperCacheEntry *entry)
+{
+  g_hash_table_remove (cache->entries, entry);
+  g_queue_delete_link (&cache->lru, entry->lru_link);
+  entry->lru_link = NULL;
+  cache->size -= entry->size;
+
+  /* planes still in use are freed by the last release */
+  entry_unref (entry);
+}
+
+static gboolean
+stamp_equal (const ColorMapperCacheStamp *a,
+             const ColorMapperCacheStamp *b)
+{
+  return a->input_source      == b->input_source      &&
+         a->aux_source        == b->aux_source        &&
+         a->contrast_source   == b->contrast_source   &&
+         a->format            == b->format            &&
+         a->neutral2tinted[0] == b->neutral2tinted[0] &&
+         a->neutral2tinted[1] == b->neutral2tinted[1] &&
+         a->neutral2tinted[2] == b->neutral2tinted[2] &&
+         a->perceptual        == b->perceptual        &&
+         a->fast_math         == b->fast_math         &&
+         a->tone_curve        == b->tone_curve        &&
+         a->grid_cell         == b->grid_cell         &&
+         a->border            == b->border;
+}
+
+static void
+cache_clear (ColorMapperCache *cache)
+{
+  while (cache->lru.head)
+    cache_remove (cache, cache->lru.head->data);
+}
+
+ColorMapperCache *
+color_mapper_cache_new (gint n_planes)
+{
+  ColorMapperCache *cache = g_slice_new0 (ColorMapperCache);
+  const gchar      *env   = g_getenv ("COLOR_MAPPER_CACHE_MB");
+  gint64            mb    = COLOR_MAPPER_CACHE_DEFAULT_MB;
+
+  if (env)
+    mb = MAX (g_ascii_strtoll (env, NULL, 10), 0);
+
+  g_mutex_init (&cache->mutex);
+  g_queue_init (&cache->lru);
+  cache->entries  = g_hash_table_new (entry_hash, entry_equal);
+  cache->n_planes = n_planes;
+  cache->max_size = (gsize) mb << 20;
+
+  return cache;
+}
+
+void
+color_mapper_cache_free (ColorMapperCache *cache)
+{
+  if (! cache)
+    return;
+
+  cache_clear (cache);
+  g_hash_table_destroy (cache->entries);
+  g_mutex_clear (&cache->mutex);
+  g_slice_free (ColorMapperCache, cache);
+}
+
+gboolean
+color_mapper_cache_enabled (ColorMapperCache *cache)
+{
+  return cache && cache->max_size > 0;
+}
+
+void
+color_mapper_cache_validate (ColorMapperCache            *cache,
+                             const ColorMapperCacheStamp *stamp)
+{
+  g_mutex_lock (&cache->mutex);
+
+  if (! cache->have_stamp || ! stamp_equal (&cache->stamp, stamp))
+    {
+      cache_clear (cache);
+      cache->stamp      = *stamp;
+      cache->have_stamp = TRUE;
+    }
+
+  g_mutex_unlock (&cache->mutex);
+}
+
+void
+color_mapper_cache_invalidate (ColorMapperCache    *cache,
+                               const GeglRectangle *region,
+                               gint                 border)
+{
+  GList *link;
+
+  g_mutex_lock (&cache->mutex);
+
+  link = cache->lru.head;
+  while (link)
+    {
+      ColorMapperCacheEntry *entry = link->data;
+      gint                   scale = 1 << entry->level;
+      GeglRectangle          entry_rect;
+
+      link = link->next;
+
+      /* entry at level 0, including the pixels its planes were computed from */
+      entry_rect.x      = (entry->rect.x - border) * scale;
+      entry_rect.y      = (entry->rect.y - border) * scale;
+      entry_rect.width  = (entry->rect.width  + 2 * border) * scale;
+      entry_rect.height = (entry->rect.height + 2 * border) * scale;
+
+      if (gegl_rectangle_intersect (NULL, &entry_rect, region))
+        cache_remove (cache, entry);
+    }
+
+  g_mutex_unlock (&cache->mutex);
+}
+
+ColorMapperCacheEntry *
+color_mapper_cache_lookup (ColorMapperCache    *cache,
+                           const GeglRectangle *tile,
+                           const GeglRectangle *roi,
+                           gint                 level)
+{
+  ColorMapperCacheEntry  key = { { 0, }, };
+  ColorMapperCacheEntry *entry;
+
+  if (! color_mapper_cache_enabled (cache))
+    return NULL;
+
+  key.tile_x = tile->x;
+  key.tile_y = tile->y;
+  key.level  = level;
+
+  g_mutex_lock (&cache->mutex);
+
+  entry = g_hash_table_lookup (cache->entries, &key);
+
+  if (entry && gegl_rectangle_contains (&entry->rect, roi))
+    {
+      g_atomic_int_inc (&entry->ref_count);
+
+      g_queue_unlink (&cache->lru, entry->lru_link);
+      g_queue_push_head_link (&cache->lru, entry->lru_link);
+    }
+  else
+    {
+      entry = NULL;
+    }
+
+  g_mutex_unlock (&cache->mutex);
+
+  return entry;
+}
+
+ColorMapperCacheEntry *
+color_mapper_cache_insert (ColorMapperCache    *cache,
+                           const GeglRectangle *tile,
+                           const GeglRectangle *rect,
+                           gint                 level,
+                           gfloat              *planes)
+{
+  ColorMapperCacheEntry *entry = g_slice_new0 (ColorMapperCacheEntry);
+  ColorMapperCacheEntry *old;
+
+  entry->rect      = *rect;
+  entry->level     = level;
+  entry->planes    = planes;
+  entry->tile_x    = tile->x;
+  entry->tile_y    = tile->y;
+  entry->ref_count = 1;
+  if (! color_mapper_cache_enabled (cache))
+    return entry;
+
+  entry->size      = (gsize) rect->width * rect->height *
+                     cache->n_planes * sizeof (gfloat);
+
+  if (entry->size > cache->max_size)
+    return entry;
+
+  g_mutex_lock (&cache->mutex);
+
+  /* the latest planes of a tile replace the previous ones */
+  old = g_hash_table_lookup (cache->entries, entry);
+  if (old)
+    cache_remove (cache, old);
+
+  while (cache->size + entry->size > cache->max_size && cache->lru.tail)
+    cache_remove (cache, cache->lru.tail->data);
+
+  /* one reference for the cache, one for the caller */
+  entry->ref_count++;
+  g_hash_table_add (cache->entries, entry);
+  g_queue_push_head (&cache->lru, entry);
+  entry->lru_link = cache->lru.head;
+  cache->size    += entry->size;
+
+  g_mutex_unlock (&cache->mutex);
+
+  return entry;
+}
+
+void
+color_mapper_cache_release (ColorMapperCache      *cache,
+                            ColorMapperCacheEntry *entry)
+{
+  entry_unref (entry);
+}
@@ -0,0 +1,111 @@
+/* This file is part of the color-mapper GEGL operation
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* memory bounded cache of the aux and feature stage planes of color-mapper
+  *
+  * Entries are keyed by the output tile they belong to and the mipmap
+  * level, and hold the planes of the part of that tile computed last.
+  * All entries are dropped when the stamp (sources, working space, white
+  * representation, perceptual, fast math, contrast source, tone curve,
+  * contrast grid, border) changes, entries touched by a change of a
+  * source are dropped through get_invalidated_by_change.
+  *
+  * The size limit of each cache defaults to COLOR_MAPPER_CACHE_DEFAULT_MB
+  * and can be set with the environment variable COLOR_MAPPER_CACHE_MB,
+  * 0 disables caching.
+  */
+
+#ifndef __COLOR_MAPPER_CACHE_H__
+#define __COLOR_MAPPER_CACHE_H__
+
+#include <gegl.h>
+
+#define COLOR_MAPPER_CACHE_DEFAULT_MB 512
+
+typedef struct _ColorMapperCache ColorMapperCache;
+
+typedef struct
+{
+  GeglRectangle  rect;      /* pixels covered by planes, at level */
+  gint           level;
+  gfloat        *planes;    /* n_planes planes of rect */
+
+  /*< private >*/
+  gint           tile_x;
+  gint           tile_y;
+  gint           ref_count;
+  gsize          size;
+  GList         *lru_link;
+} ColorMapperCacheEntry;
+
+/* everything besides source pixels the cached planes depend on, fields
+ * a cache does not depend on are left zero
+ */
+typedef struct
+{
+  gconstpointer  input_source;
+  gconstpointer  aux_source;
+  gconstpointer  contrast_source;
+  const Babl    *format;
+  gfloat         neutral2tinted[3];
+  gboolean       perceptual;
+  gboolean       fast_math;
+  guint          tone_curve;   /* serial of the tone curve table, 0 without */
+  gint           grid_cell;
+  gint           border;       /* pixels read around the planes, 0 without gradients */
+} ColorMapperCacheStamp;
+
+ColorMapperCache      *color_mapper_cache_new        (gint                         n_planes);
+void                   color_mapper_cache_free       (ColorMapperCache            *cache);
+
+/* FALSE when caching is disabled */
+gboolean               color_mapper_cache_enabled    (ColorMapperCache            *cache);
+
+/* drops all entries when stamp differs from the one of the last call */
+void                   color_mapper_cache_validate   (ColorMapperCache            *cache,
+                                                      const ColorMapperCacheStamp *stamp);
+
+/* drops the entries that read pixels of region, given at level 0; border
+ * is the one get_enlarged_input () adds, in pixels at the level of an entry
+ */
+void                   color_mapper_cache_invalidate (ColorMapperCache            *cache,
+                                                      const GeglRectangle         *region,
+                                                      gint                         border);
+
+/* entry of tile covering roi, NULL when there is none; release the
+ * returned entry with color_mapper_cache_release ()
+ */
+ColorMapperCacheEntry *color_mapper_cache_lookup     (ColorMapperCache            *cache,
+                                                      const GeglRectangle         *tile,
+                                                      const GeglRectangle         *roi,
+                                                      gint                         level);
+
+/* stores planes (allocated with g_malloc) of rect for tile, taking
+ * ownership of them; the returned entry is to be released like a looked up
+ * one
+ */
+ColorMapperCacheEntry *color_mapper_cache_insert     (ColorMapperCache            *cache,
+                                                      const GeglRectangle         *tile,
+                                                      const GeglRectangle         *rect,
+                                                      gint                         level,
+                                                      gfloat                      *planes);
+
+void                   color_mapper_cache_release    (ColorMapperCache            *cache,
+                                                      ColorMapperCacheEntry       *entry);
+
+#endif
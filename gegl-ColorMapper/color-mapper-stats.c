@@ -0,0 +1,326 @@
+/* This file is part of the color-mapper GEGL operation
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "color-mapper-stats.h"
+
+/* the largest globalSaturation the operation takes */
+#define GLOBAL_SATURATION_MAX 5.0
+
+static const float quantiles[] = { 0.01f, 0.05f, 0.25f, 0.5f, 0.75f, 0.95f, 0.99f };
+
+#define N_QUANTILES ((int) (sizeof (quantiles) / sizeof (quantiles[0])))
+
+static void
+histogram_init (ColorMapperHistogram *histogram,
+                const char           *name,
+                float                 min,
+                float                 max,
+                int                   log2)
+{
+  memset (histogram, 0, sizeof (*histogram));
+  histogram->name = name;
+  histogram->min  = min;
+  histogram->max  = max;
+  histogram->log2 = log2;
+}
+
+static inline void
+histogram_add (ColorMapperHistogram *histogram,
+               float                 value)
+{
+  float v = histogram->log2 ? (value > 0.0f ? log2f (value) : -INFINITY) : value;
+  int   bin;
+
+  /* infinities fall into the first or last bin, NaN into none */
+  if (isnan (v))
+    {
+      histogram->n_nan++;
+      return;
+    }
+
+  histogram->n++;
+
+  if (isfinite (v))
+    {
+      histogram->n_finite++;
+      histogram->sum += v;
+    }
+
+  v   = (v - histogram->min) * (COLOR_MAPPER_STATS_BINS / (histogram->max - histogram->min));
+  bin = v < 0.0f ? 0 : v >= COLOR_MAPPER_STATS_BINS ? COLOR_MAPPER_STATS_BINS - 1 : (int) v;
+
+  histogram->bins[bin]++;
+}
+
+void
+color_mapper_stats_init (ColorMapperStats *stats)
+{
+  memset (stats, 0, sizeof (*stats));
+
+  histogram_init (&stats->histograms[COLOR_MAPPER_STATS_GRADIENT_RATIO],  "gradient ratio",   -8.0f, 8.0f, 1);
+  histogram_init (&stats->histograms[COLOR_MAPPER_STATS_CHROMA_ADOPTION], "chroma adoption",  -4.0f, 4.0f, 1);
+  histogram_init (&stats->histograms[COLOR_MAPPER_STATS_SATURATION],      "saturation",        0.0f, 1.0f, 0);
+  histogram_init (&stats->histograms[COLOR_MAPPER_STATS_HEADROOM],        "headroom",         -6.0f, 6.0f, 1);
+}
+
+void
+color_mapper_stats_merge (ColorMapperStats       *stats,
+                          const ColorMapperStats *other)
+{
+  int h, i;
+
+  for (h = 0; h < COLOR_MAPPER_STATS_N_HISTOGRAMS; h++)
+    {
+      ColorMapperHistogram       *dst = &stats->histograms[h];
+      const ColorMapperHistogram *src = &other->histograms[h];
+
+      for (i = 0; i < COLOR_MAPPER_STATS_BINS; i++)
+        dst->bins[i] += src->bins[i];
+
+      dst->n        += src->n;
+      dst->n_nan    += src->n_nan;
+      dst->n_finite += src->n_finite;
+      dst->sum      += src->sum;
+    }
+
+  stats->n_pixels           += other->n_pixels;
+  stats->n_clipped_negative += other->n_clipped_negative;
+  stats->n_clipped_positive += other->n_clipped_positive;
+  stats->n_clipped          += other->n_clipped;
+
+  for (i = 0; i < COLOR_MAPPER_STATS_SCALES; i++)
+    stats->n_clipped_at_scale[i] += other->n_clipped_at_scale[i];
+}
+
+/* ChromaAdoptionFactor of color_mapper_combine_scalar () */
+static inline float
+chroma_adoption_factor (float base,
+                        int   invert,
+                        float scale)
+{
+  float caf = 1.0f + scale * base;
+
+  if (caf > FLT_MIN)
+    return invert ? 1.0f / caf : caf;
+
+  return 1.0f;
+}
+
+/* ChromaAdoptionFactor_global and chromafactor_aux2target */
+static inline float
+chroma_factor (const ColorMapperParams *params,
+               float                    caf,
+               float                    saturation,
+               float                    luminance_ratio)
+{
+  const float dz     = fmaxf (saturation - params->saturation_min, 0.0f);
+  const float sat_dz = saturation > FLT_MIN ? dz / saturation : 0.0f;
+  float       global = caf * params->globalSaturation;
+
+  global = 1.0f + (global - 1.0f) *
+           (params->saturation_weighting_factor * (saturation - 1.0f) + 1.0f) * sat_dz;
+
+  return luminance_ratio * global;
+}
+
+void
+color_mapper_stats_row (const ColorMapperParams     *params,
+                        const ColorMapperFeatureRow *features,
+                        const ColorMapperAuxRow     *aux,
+                        ColorMapperStats            *stats,
+                        int                          width)
+{
+  int x, c, k;
+
+  for (x = 0; x < width; x++)
+    {
+      const float base       = features->base[x];
+      const int   invert     = features->invert[x] > 0.5f;
+      const float saturation = aux->saturation[x];
+      const float ratio      = features->luminance_ratio[x];
+      float       caf, f, headroom;
+      float       up = INFINITY, down = INFINITY;   /* headroom at a factor of +1, -1 */
+      int         up_negative = 0, down_negative = 0;
+
+      /* how far the chroma of aux can be scaled, either way, before a
+       * channel of tinted gray plus chroma leaves [0, max (1, gray)]
+       */
+      for (c = 0; c < 3; c++)
+        {
+          const float gray   = features->Y[x] * params->neutral2tinted[c];
+          const float chroma = aux->chroma[c][x];
+          const float top    = fmaxf (1.0f, gray) - gray;
+          float       limit;
+
+          if (chroma > 0.0f)
+            {
+              limit = top / chroma;
+              if (limit < up)
+                up = limit, up_negative = 0;
+              limit = gray / chroma;
+              if (limit < down)
+                down = limit, down_negative = 1;
+            }
+          else if (chroma < 0.0f)
+            {
+              limit = gray / -chroma;
+              if (limit < up)
+                up = limit, up_negative = 1;
+              limit = top / -chroma;
+              if (limit < down)
+                down = limit, down_negative = 0;
+            }
+        }
+
+      up   = fmaxf (up, 0.0f);
+      down = fmaxf (down, 0.0f);
+
+      caf      = chroma_adoption_factor (base, invert, params->scale);
+      f        = chroma_factor (params, caf, saturation, ratio);
+      headroom = f > 0.0f ? up / f : f < 0.0f ? down / -f : INFINITY;
+
+      histogram_add (&stats->histograms[COLOR_MAPPER_STATS_GRADIENT_RATIO],  features->gradient_ratio[x]);
+      histogram_add (&stats->histograms[COLOR_MAPPER_STATS_CHROMA_ADOPTION], caf);
+      histogram_add (&stats->histograms[COLOR_MAPPER_STATS_SATURATION],      saturation);
+      histogram_add (&stats->histograms[COLOR_MAPPER_STATS_HEADROOM],        headroom);
+
+      stats->n_pixels++;
+
+      if (headroom < 1.0f)
+        {
+          const int negative = f > 0.0f ? up_negative : down_negative;
+
+          stats->n_clipped++;
+          stats->n_clipped_negative += negative;
+          stats->n_clipped_positive += ! negative;
+        }
+
+      for (k = 0; k < COLOR_MAPPER_STATS_SCALES; k++)
+        {
+          const float scale = k / (float) (COLOR_MAPPER_STATS_SCALES - 1);
+
+          f = chroma_factor (params, chroma_adoption_factor (base, invert, scale), saturation, ratio);
+
+          if ((f > 0.0f && up < f) || (f < 0.0f && down < -f))
+            stats->n_clipped_at_scale[k]++;
+        }
+    }
+}
+
+double
+color_mapper_histogram_quantile (const ColorMapperHistogram *histogram,
+                                 double                      fraction)
+{
+  const double width  = (histogram->max - histogram->min) / COLOR_MAPPER_STATS_BINS;
+  const double target = fraction * histogram->n;
+  double       seen   = 0.0;
+  double       v      = histogram->max;
+  int          i;
+
+  for (i = 0; i < COLOR_MAPPER_STATS_BINS; i++)
+    {
+      if (histogram->bins[i] && seen + histogram->bins[i] >= target)
+        {
+          v = histogram->min + width * (i + (target - seen) / histogram->bins[i]);
+          break;
+        }
+      seen += histogram->bins[i];
+    }
+
+  return histogram->log2 ? exp2 (v) : v;
+}
+
+void
+color_mapper_stats_suggest (const ColorMapperStats  *stats,
+                            const ColorMapperParams *params,
+                            double                   target_clip,
+                            ColorMapperSuggestion   *suggestion)
+{
+  const ColorMapperHistogram *headroom = &stats->histograms[COLOR_MAPPER_STATS_HEADROOM];
+  const double                n        = stats->n_pixels ? stats->n_pixels : 1;
+  int                         k;
+
+  suggestion->clip_fraction = stats->n_clipped / n;
+
+  /* chroma grows with globalSaturation, the pixels whose headroom is below
+   * the target quantile clip at globalSaturation times that quantile
+   */
+  suggestion->globalSaturation = params->globalSaturation *
+                                 color_mapper_histogram_quantile (headroom, target_clip);
+  suggestion->globalSaturation = fmin (suggestion->globalSaturation, GLOBAL_SATURATION_MAX);
+
+  suggestion->scale = -1.0;
+  for (k = 0; k < COLOR_MAPPER_STATS_SCALES; k++)
+    if (stats->n_clipped_at_scale[k] / n <= target_clip)
+      suggestion->scale = k / (double) (COLOR_MAPPER_STATS_SCALES - 1);
+}
+
+void
+color_mapper_stats_print (const ColorMapperStats      *stats,
+                          const ColorMapperParams     *params,
+                          const ColorMapperSuggestion *suggestion,
+                          FILE                        *out)
+{
+  const double n = stats->n_pixels ? stats->n_pixels : 1;
+  int          h, q, k;
+
+  fprintf (out, "%llu pixels at scale %.2f, globalSaturation %.2f\n",
+           (unsigned long long) stats->n_pixels, params->scale, params->globalSaturation);
+  fprintf (out, "clipped by saturation_clip: %.2f %% (below 0: %.2f %%, above 1: %.2f %%)\n\n",
+           100.0 * stats->n_clipped / n, 100.0 * stats->n_clipped_negative / n,
+           100.0 * stats->n_clipped_positive / n);
+
+  fprintf (out, "%-16s", "");
+  for (q = 0; q < N_QUANTILES; q++)
+    fprintf (out, " %7s%-2d", "p", (int) (quantiles[q] * 100.0f + 0.5f));
+  fprintf (out, " %9s\n", "mean");
+
+  for (h = 0; h < COLOR_MAPPER_STATS_N_HISTOGRAMS; h++)
+    {
+      const ColorMapperHistogram *histogram = &stats->histograms[h];
+      double                      mean      = histogram->n_finite ? histogram->sum / histogram->n_finite : 0.0;
+
+      fprintf (out, "%-16s", histogram->name);
+      for (q = 0; q < N_QUANTILES; q++)
+        fprintf (out, " %9.4g", color_mapper_histogram_quantile (histogram, quantiles[q]));
+
+      /* geometric mean of the ratios */
+      fprintf (out, " %9.4g", histogram->log2 ? exp2 (mean) : mean);
+
+      if (histogram->n_nan)
+        fprintf (out, "  (%llu NaN left out)", (unsigned long long) histogram->n_nan);
+      fprintf (out, "\n");
+    }
+
+  fprintf (out, "\nclipped at scale:");
+  for (k = 0; k < COLOR_MAPPER_STATS_SCALES; k++)
+    fprintf (out, " %.1f %.2f%%", k / (double) (COLOR_MAPPER_STATS_SCALES - 1),
+             100.0 * stats->n_clipped_at_scale[k] / n);
+  fprintf (out, "\n\n");
+
+  fprintf (out, "suggested for the target clip fraction:\n");
+  fprintf (out, "  globalSaturation %.2f (at scale %.2f)\n", suggestion->globalSaturation, params->scale);
+  if (suggestion->scale >= 0.0)
+    fprintf (out, "  scale            %.2f (at globalSaturation %.2f)\n", suggestion->scale, params->globalSaturation);
+  else
+    fprintf (out, "  scale            none clips little enough at globalSaturation %.2f\n", params->globalSaturation);
+}
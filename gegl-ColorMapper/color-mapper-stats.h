@@ -0,0 +1,122 @@
+/* This file is part of the color-mapper GEGL operation
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* statistics of the color-mapper intermediates, instead of trial renders
+  *
+  * color_mapper_stats_row () takes the aux and feature planes of a row,
+  * as the default technology computes them, and adds to histograms of
+  *
+  *   gradient ratio            GradientRatio, log2
+  *   chroma adoption factor    ChromaAdoptionFactor at the current scale, log2
+  *   saturation                Saturation_HSY_aux
+  *   headroom                  factor the chroma of the pixel could grow
+  *                             by before saturation_clip kicks in, log2;
+  *                             below 1 (0 in log2) the pixel is clipped
+  *
+  * plus the pixels that would be clipped at every scale of
+  * COLOR_MAPPER_STATS_SCALES.  Every thread fills its own ColorMapperStats,
+  * color_mapper_stats_merge () adds them up afterwards, so no locks or
+  * atomics are needed while counting.
+  *
+  * The suggestions assume saturation_min and saturation_weighting_factor
+  * at 0, where the chroma of every pixel grows in proportion to
+  * globalSaturation; with those sliders set they are approximations.
+  */
+
+#ifndef __COLOR_MAPPER_STATS_H__
+#define __COLOR_MAPPER_STATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "color-mapper-kernel.h"
+
+#define COLOR_MAPPER_STATS_BINS   64
+#define COLOR_MAPPER_STATS_SCALES 11    /* scale 0.0, 0.1, ... 1.0 */
+
+typedef struct
+{
+  const char *name;
+  float       min;        /* range of the bins, values outside count in */
+  float       max;        /* the first and last one */
+  int         log2;       /* bins over log2 of the value */
+  uint64_t    bins[COLOR_MAPPER_STATS_BINS];
+  uint64_t    n;          /* binned values, the quantiles are of those */
+  uint64_t    n_nan;      /* NaN values, in no bin and not in n */
+  uint64_t    n_finite;
+  double      sum;        /* of the finite binned values */
+} ColorMapperHistogram;
+
+enum
+{
+  COLOR_MAPPER_STATS_GRADIENT_RATIO,
+  COLOR_MAPPER_STATS_CHROMA_ADOPTION,
+  COLOR_MAPPER_STATS_SATURATION,
+  COLOR_MAPPER_STATS_HEADROOM,
+
+  COLOR_MAPPER_STATS_N_HISTOGRAMS
+};
+
+typedef struct
+{
+  ColorMapperHistogram histograms[COLOR_MAPPER_STATS_N_HISTOGRAMS];
+  uint64_t             n_pixels;
+  uint64_t             n_clipped_negative;   /* a channel below 0 */
+  uint64_t             n_clipped_positive;   /* a channel above 1 */
+  uint64_t             n_clipped;            /* either one */
+  uint64_t             n_clipped_at_scale[COLOR_MAPPER_STATS_SCALES];
+} ColorMapperStats;
+
+typedef struct
+{
+  double clip_fraction;     /* of the pixels at the current sliders */
+  double globalSaturation;  /* at most target of the pixels clipped */
+  double scale;             /* strongest one with at most target clipped,
+                             * -1 if even scale 0 clips more */
+} ColorMapperSuggestion;
+
+void color_mapper_stats_init    (ColorMapperStats            *stats);
+
+/* stats += other */
+void color_mapper_stats_merge   (ColorMapperStats            *stats,
+                                 const ColorMapperStats      *other);
+
+/* features and aux of the default technology at params */
+void color_mapper_stats_row     (const ColorMapperParams     *params,
+                                 const ColorMapperFeatureRow *features,
+                                 const ColorMapperAuxRow     *aux,
+                                 ColorMapperStats            *stats,
+                                 int                          width);
+
+/* value below which a fraction of the histogram lies, linear */
+double color_mapper_histogram_quantile (const ColorMapperHistogram *histogram,
+                                        double                      fraction);
+
+/* sliders that clip at most target_clip of the pixels */
+void color_mapper_stats_suggest (const ColorMapperStats      *stats,
+                                 const ColorMapperParams     *params,
+                                 double                       target_clip,
+                                 ColorMapperSuggestion       *suggestion);
+
+/* human readable report of stats and suggestion */
+void color_mapper_stats_print   (const ColorMapperStats      *stats,
+                                 const ColorMapperParams     *params,
+                                 const ColorMapperSuggestion *suggestion,
+                                 FILE                        *out);
+
+#endif
@@ -0,0 +1,1365 @@
+/* This file is part of the color-mapper GEGL operation
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* color-mapper for images that do not fit in memory
+  *
+  * Runs the color-mapper row kernels over input and aux band by band,
+  * straight from the memory mapped files, and streams the output to disk.
+  * A band holds its rows plus the row above and below it, the one pixel
+  * border the kernels need (get_enlarged_input () of the operation); the
+  * last two rows of a band are carried over as the first two of the next
+  * one, so every source row is decoded once.  Mapped source pages a band
+  * is done with are dropped again, so the memory in use depends on the
+  * width of the image and on --memory, not on its area.
+  *
+  * Sources are uncompressed TIFF (classic or BigTIFF, tiled or in strips,
+  * chunky, 1, 3 or 4 samples of u16, half or float) or PFM, both linear
+  * rgb with the primaries of --luminance (linear sRGB by default), and
+  * borders are clamped like GEGL_ABYSS_CLAMP.  The output is RGBA float
+  * BigTIFF, or rgb PFM when its name ends in .pfm.  Uncompress a TIFF
+  * with e.g. tiffcp -c none first.
+  *
+  *   color-mapper-stream [--technology NAME] [--scale X]
+  *                       [--saturation-min X] [--saturation-weighting X]
+  *                       [--global-saturation X] [--perceptual]
+  *                       [--fast-math] [--white R,G,B]
+  *                       [--tone-curve POINTS]
+  *                       [--luminance R,G,B] [--memory MB]
+  *                       [--threads N] [--quiet]
+  *                       INPUT AUX OUTPUT
+  *   color-mapper-stream --analyze [--clip-target PERCENT] [...]
+  *                       INPUT AUX
+  *
+  * --analyze writes no image; it collects statistics of the intermediates
+  * of the default technology over the whole image instead (see
+  * color-mapper-stats.h) and prints them to stdout with the scale and
+  * globalSaturation that clip at most --clip-target percent of the
+  * pixels, 1 by default.
+  *
+  * --tone-curve takes the contrast change from a luminance tone curve of
+  * aux to input instead of from the gradients (see color-mapper-kernel.h),
+  * as points "x,y x,y ..." or evenly spaced values "y y ...", over linear Y.
+  *
+  * The kernels are plain C, so this builds without GEGL; see meson.build.
+  */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "color-mapper-kernel.h"
+#include "color-mapper-stats.h"
+
+#define MAX_THREADS 64
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static const char *technology_names[COLOR_MAPPER_N_TECHNOLOGIES] =
+{
+  "default",
+  "default-rgb-unlimited",
+  "gradient-ratio",
+  "chroma-adoption-base",
+  "chroma-adoption-factor",
+  "chromaticity",
+  "saturation",
+  "ygrad-aux",
+};
+
+
+/* sources */
+
+/* a memory mapped image; strips and PFM rows count as tiles as wide as
+ * the image, so every layout is read the same way
+ */
+typedef struct
+{
+  const char    *path;
+  const uint8_t *map;
+  size_t         map_size;
+  int            width;
+  int            height;
+  int            channels;       /* samples per pixel, 1, 3 or 4 */
+  int            sample_bytes;   /* 2 or 4 */
+  int            is_float;       /* half or float samples */
+  int            swap;           /* byte order other than the host one */
+
+  int            tile_width;
+  int            tile_height;
+  int            tiles_across;
+
+  /* TIFF: the tile or strip offset and byte count arrays in the file */
+  int            big;
+  size_t         offsets_pos;
+  size_t         counts_pos;
+  int            offsets_type;
+  int            counts_type;
+  size_t         n_tiles;
+
+  /* PFM: first byte of the bottom row, rows are stored bottom to top */
+  int            pfm;
+  size_t         data_pos;
+
+  int            released;       /* rows whose pages were dropped */
+} Source;
+
+static int
+host_is_big_endian (void)
+{
+  const uint16_t one = 1;
+
+  return *(const uint8_t *) &one == 0;
+}
+
+static uint16_t
+get_u16 (const uint8_t *p,
+         int            swap)
+{
+  uint16_t v;
+
+  memcpy (&v, p, 2);
+
+  return swap ? __builtin_bswap16 (v) : v;
+}
+
+static uint32_t
+get_u32 (const uint8_t *p,
+         int            swap)
+{
+  uint32_t v;
+
+  memcpy (&v, p, 4);
+
+  return swap ? __builtin_bswap32 (v) : v;
+}
+
+static uint64_t
+get_u64 (const uint8_t *p,
+         int            swap)
+{
+  uint64_t v;
+
+  memcpy (&v, p, 8);
+
+  return swap ? __builtin_bswap64 (v) : v;
+}
+
+static float
+half_to_float (uint16_t h)
+{
+  const uint32_t sign     = (uint32_t) (h & 0x8000) << 16;
+  const int      exponent = (h >> 10) & 0x1f;
+  const uint32_t mantissa = h & 0x3ff;
+  union { uint32_t i; float f; } bits;
+
+  if (exponent == 0)
+    {
+      /* zero and subnormals */
+      bits.f = mantissa * (1.0f / 16777216.0f);
+      bits.i |= sign;
+    }
+  else if (exponent == 31)
+    {
+      bits.i = sign | 0x7f800000u | (mantissa << 13);
+    }
+  else
+    {
+      bits.i = sign | ((uint32_t) (exponent + 112) << 23) | (mantissa << 13);
+    }
+
+  return bits.f;
+}
+
+/* TIFF field types by size */
+static int
+tiff_type_size (int type)
+{
+  switch (type)
+    {
+    case 1: case 2: case 6: case 7: return 1;   /* BYTE, ASCII, SBYTE, UNDEFINED */
+    case 3: case 8:                 return 2;   /* SHORT, SSHORT */
+    case 4: case 9: case 11:        return 4;   /* LONG, SLONG, FLOAT */
+    case 16: case 17:               return 8;   /* LONG8, SLONG8 */
+    default:                        return 8;   /* RATIONAL, DOUBLE, IFD8 */
+    }
+}
+
+/* element index of an unsigned integer array of type at pos */
+static uint64_t
+tiff_array_get (const Source *source,
+                size_t        pos,
+                int           type,
+                size_t        index)
+{
+  const uint8_t *p = source->map + pos + index * tiff_type_size (type);
+
+  switch (type)
+    {
+    case 3:  return get_u16 (p, source->swap);
+    case 4:  return get_u32 (p, source->swap);
+    default: return get_u64 (p, source->swap);
+    }
+}
+
+static int
+source_fail (const Source *source,
+             const char   *message)
+{
+  fprintf (stderr, "%s: %s\n", source->path, message);
+
+  return 0;
+}
+
+static int
+source_open_tiff (Source *source)
+{
+  const uint8_t *map          = source->map;
+  const int      entry_size   = source->big ? 20 : 12;
+  const int      inline_size  = source->big ? 8 : 4;
+  uint64_t       ifd;
+  uint64_t       n_entries, i;
+  int            bits         = 0;
+  int            sample_format = 1;
+  int            compression  = 1;
+  int            planar       = 1;
+  int            rows_per_strip = 0;
+  int            tiled        = 0;
+  size_t         n_offsets    = 0;
+
+  source->swap = (map[0] == 'M') != host_is_big_endian ();
+
+  if (source->big)
+    ifd = get_u64 (map + 8, source->swap);
+  else
+    ifd = get_u32 (map + 4, source->swap);
+
+  if (ifd + 8 > source->map_size)
+    return source_fail (source, "truncated TIFF");
+
+  n_entries = source->big ? get_u64 (map + ifd, source->swap) : get_u16 (map + ifd, source->swap);
+  ifd      += source->big ? 8 : 2;
+
+  if (ifd + n_entries * entry_size > source->map_size)
+    return source_fail (source, "truncated TIFF");
+
+  for (i = 0; i < n_entries; i++)
+    {
+      const uint8_t *entry = map + ifd + i * entry_size;
+      const int      tag   = get_u16 (entry, source->swap);
+      const int      type  = get_u16 (entry + 2, source->swap);
+      const uint64_t count = source->big ? get_u64 (entry + 4, source->swap) : get_u32 (entry + 4, source->swap);
+      const uint8_t *value = entry + (source->big ? 12 : 8);
+      size_t         pos;
+      uint64_t       first;
+
+      /* the value itself when it fits, the offset of it otherwise */
+      if (count * tiff_type_size (type) <= (uint64_t) inline_size)
+        pos = value - map;
+      else
+        pos = source->big ? get_u64 (value, source->swap) : get_u32 (value, source->swap);
+
+      if (pos + count * tiff_type_size (type) > source->map_size)
+        return source_fail (source, "truncated TIFF");
+
+      first = count ? tiff_array_get (source, pos, type, 0) : 0;
+
+      switch (tag)
+        {
+        case 256: source->width    = first;  break;
+        case 257: source->height   = first;  break;
+        case 258: bits             = first;  break;
+        case 259: compression      = first;  break;
+        case 277: source->channels = first;  break;
+        case 278: rows_per_strip   = first;  break;
+        case 284: planar           = first;  break;
+        case 322: source->tile_width  = first; tiled = 1; break;
+        case 323: source->tile_height = first; tiled = 1; break;
+        case 339: sample_format    = first;  break;
+
+        case 273:   /* StripOffsets */
+        case 324:   /* TileOffsets */
+          source->offsets_pos  = pos;
+          source->offsets_type = type;
+          n_offsets            = count;
+          break;
+
+        case 279:   /* StripByteCounts */
+        case 325:   /* TileByteCounts */
+          source->counts_pos  = pos;
+          source->counts_type = type;
+          break;
+        }
+    }
+
+  if (source->width < 1 || source->height < 1 || ! n_offsets || ! source->counts_pos)
+    return source_fail (source, "no image data");
+  if (compression != 1)
+    return source_fail (source, "compressed TIFF, uncompress it first, e.g. tiffcp -c none");
+  if (planar != 1 && source->channels > 1)
+    return source_fail (source, "planar TIFF, only chunky (contiguous) samples are read");
+  if (source->channels != 1 && source->channels != 3 && source->channels != 4)
+    return source_fail (source, "1, 3 or 4 samples per pixel are read");
+  if (! ((bits == 16 && (sample_format == 1 || sample_format == 3)) ||
+         (bits == 32 && sample_format == 3)))
+    return source_fail (source, "u16, half or float samples are read");
+
+  source->sample_bytes = bits / 8;
+  source->is_float     = sample_format == 3;
+
+  if (! tiled)
+    {
+      source->tile_width  = source->width;
+      source->tile_height = rows_per_strip > 0 && rows_per_strip < source->height ?
+                            rows_per_strip : source->height;
+    }
+
+  if (source->tile_width < 1 || source->tile_height < 1)
+    return source_fail (source, "bad tile size");
+
+  source->tiles_across = (source->width + source->tile_width - 1) / source->tile_width;
+  source->n_tiles      = (size_t) source->tiles_across *
+                         ((source->height + source->tile_height - 1) / source->tile_height);
+
+  if (n_offsets < source->n_tiles)
+    return source_fail (source, "fewer tiles or strips than the image needs");
+
+  for (i = 0; i < source->n_tiles; i++)
+    {
+      const uint64_t offset = tiff_array_get (source, source->offsets_pos, source->offsets_type, i);
+      const uint64_t need   = (uint64_t) source->tile_width * source->channels * source->sample_bytes *
+                              (tiled ? source->tile_height :
+                               MIN (source->tile_height, source->height - (int) (i * source->tile_height)));
+
+      if (offset + need > source->map_size)
+        return source_fail (source, "truncated TIFF");
+    }
+
+  return 1;
+}
+
+static int
+source_open_pfm (Source *source)
+{
+  const char *header = (const char *) source->map;
+  char        text[256];
+  char       *end;
+  double      scale;
+  size_t      n = MIN (source->map_size, sizeof (text) - 1);
+  size_t      row_bytes;
+  int         lines = 0;
+  size_t      i;
+
+  /* "PF" or "Pf", width and height, scale, each followed by one white
+   * space; the scale always has a '.', not the decimal point of the locale
+   */
+  memcpy (text, header, n);
+  text[n] = '\0';
+
+  source->channels = header[1] == 'F' ? 3 : 1;
+  source->width    = strtol (text + 2, &end, 10);
+  source->height   = strtol (end, &end, 10);
+  while (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n')
+    end++;
+  scale            = color_mapper_parse_number (end, &end);
+
+  for (i = 0; i < n && lines < 3; i++)
+    if (text[i] == '\n')
+      lines++;
+
+  if (lines < 3 || source->width < 1 || source->height < 1 || scale == 0.0)
+    return source_fail (source, "bad PFM header");
+
+  source->pfm          = 1;
+  source->data_pos     = i;
+  source->sample_bytes = 4;
+  source->is_float     = 1;
+  source->swap         = (scale < 0.0) == host_is_big_endian ();
+  source->tile_width   = source->width;
+  source->tile_height  = 1;
+  source->tiles_across = 1;
+  source->n_tiles      = source->height;
+
+  row_bytes = (size_t) source->width * source->channels * 4;
+  if (source->data_pos + row_bytes * source->height > source->map_size)
+    return source_fail (source, "truncated PFM");
+
+  return 1;
+}
+
+static int
+source_open (Source     *source,
+             const char *path)
+{
+  struct stat st;
+  int         fd;
+  int         ok;
+
+  memset (source, 0, sizeof (*source));
+  source->path = path;
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0 || fstat (fd, &st) < 0 || st.st_size < 16)
+    {
+      fprintf (stderr, "%s: %s\n", path, fd < 0 ? strerror (errno) : "not an image");
+      if (fd >= 0)
+        close (fd);
+      return 0;
+    }
+
+  source->map_size = st.st_size;
+  source->map      = mmap (NULL, source->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (source->map == MAP_FAILED)
+    {
+      source->map = NULL;
+      fprintf (stderr, "%s: %s\n", path, strerror (errno));
+      return 0;
+    }
+
+  /* read once from top to bottom */
+  madvise ((void *) source->map, source->map_size, MADV_SEQUENTIAL);
+
+  if ((source->map[0] == 'I' && source->map[1] == 'I') ||
+      (source->map[0] == 'M' && source->map[1] == 'M'))
+    {
+      const int magic = get_u16 (source->map + 2, (source->map[0] == 'M') != host_is_big_endian ());
+
+      source->big = magic == 43;
+      ok = (magic == 42 || magic == 43) ? source_open_tiff (source) :
+                                          source_fail (source, "not a TIFF");
+    }
+  else if (source->map[0] == 'P' && (source->map[1] == 'F' || source->map[1] == 'f'))
+    {
+      ok = source_open_pfm (source);
+    }
+  else
+    {
+      ok = source_fail (source, "neither TIFF nor PFM");
+    }
+
+  return ok;
+}
+
+static void
+source_close (Source *source)
+{
+  if (source->map)
+    munmap ((void *) source->map, source->map_size);
+}
+
+/* first byte and size of tile index */
+static const uint8_t *
+source_tile (const Source *source,
+             size_t        index,
+             size_t       *size)
+{
+  size_t offset;
+
+  if (source->pfm)
+    {
+      *size  = (size_t) source->width * source->channels * 4;
+      offset = source->data_pos + (source->height - 1 - index) * *size;
+    }
+  else
+    {
+      *size  = tiff_array_get (source, source->counts_pos, source->counts_type, index);
+      offset = tiff_array_get (source, source->offsets_pos, source->offsets_type, index);
+      *size  = MIN (*size, source->map_size - offset);
+    }
+
+  return source->map + offset;
+}
+
+/* bytes of one image row mapped while it is read */
+static size_t
+source_row_bytes (const Source *source)
+{
+  return (size_t) source->tiles_across * source->tile_width * source->channels * source->sample_bytes;
+}
+
+/* n pixels of samples to RGBA float */
+static void
+decode_pixels (const Source  *source,
+               const uint8_t *src,
+               float         *dst,
+               int            n)
+{
+  const int channels = source->channels;
+  const int bytes    = source->sample_bytes;
+  int       i, c;
+
+  if (bytes == 4 && ! source->swap && channels == 4)
+    {
+      memcpy (dst, src, (size_t) n * 16);
+      return;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      float v[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+
+      for (c = 0; c < channels; c++)
+        {
+          const uint8_t *p = src + (i * channels + c) * bytes;
+
+          if (bytes == 4)
+            {
+              union { uint32_t i; float f; } bits = { get_u32 (p, source->swap) };
+
+              v[c] = bits.f;
+            }
+          else if (source->is_float)
+            {
+              v[c] = half_to_float (get_u16 (p, source->swap));
+            }
+          else
+            {
+              v[c] = get_u16 (p, source->swap) * (1.0f / 65535.0f);
+            }
+        }
+
+      if (channels == 1)
+        v[1] = v[2] = v[0];
+
+      memcpy (dst + i * 4, v, sizeof (v));
+    }
+}
+
+/* row y as width RGBA float pixels */
+static void
+source_read_row (const Source *source,
+                 int           y,
+                 float        *rgba)
+{
+  const size_t pixel_bytes = (size_t) source->channels * source->sample_bytes;
+  const int    tile_row    = y / source->tile_height;
+  int          tx;
+
+  for (tx = 0; tx < source->tiles_across; tx++)
+    {
+      const int      x0 = tx * source->tile_width;
+      const int      n  = MIN (source->tile_width, source->width - x0);
+      size_t         size;
+      const uint8_t *tile;
+
+      tile = source_tile (source, (size_t) tile_row * source->tiles_across + tx, &size);
+
+      if (! source->pfm)
+        tile += (size_t) (y % source->tile_height) * source->tile_width * pixel_bytes;
+
+      decode_pixels (source, tile, rgba + (size_t) x0 * 4, n);
+    }
+}
+
+/* drops the mapped pages of the rows above row y; of a tile row the band
+ * is in, the rows above y of each tile, without the pages they share with
+ * rows below, so tall tiles hold no more than a page or two per tile of
+ * rows already read.  A page shared with a tile still needed is mapped
+ * again when that one is read.
+ */
+static void
+source_release (Source *source,
+                int     y)
+{
+  const size_t page      = sysconf (_SC_PAGESIZE);
+  const size_t row_bytes = (size_t) source->tile_width * source->channels * source->sample_bytes;
+
+  y = MIN (y, source->height);
+
+  while (source->released < y)
+    {
+      const int tile_row = source->released / source->tile_height;
+      const int first    = source->released - tile_row * source->tile_height;
+      const int end      = MIN (y - tile_row * source->tile_height, source->tile_height);
+      const int whole    = end == source->tile_height ||
+                           tile_row * source->tile_height + end == source->height;
+      int       tx;
+
+      for (tx = 0; tx < source->tiles_across; tx++)
+        {
+          size_t         size;
+          const uint8_t *tile = source_tile (source, (size_t) tile_row * source->tiles_across + tx, &size);
+          uintptr_t      start, stop;
+
+          if (whole)
+            {
+              start = (uintptr_t) tile & ~(page - 1);
+              stop  = ((uintptr_t) tile + size + page - 1) & ~(page - 1);
+            }
+          else
+            {
+              start = ((uintptr_t) tile + first * row_bytes + page - 1) & ~(page - 1);
+              stop  = ((uintptr_t) tile + end * row_bytes) & ~(page - 1);
+            }
+
+          stop = MIN (stop, (uintptr_t) source->map + source->map_size);
+          if (stop > start)
+            madvise ((void *) start, stop - start, MADV_DONTNEED);
+        }
+
+      source->released = tile_row * source->tile_height + end;
+    }
+}
+
+
+/* output */
+
+typedef struct
+{
+  const char *path;
+  int         fd;
+  int         pfm;
+  int         width;
+  int         height;
+  off_t       data_pos;
+  float      *rgb;    /* one PFM row, or a byte swapped TIFF row */
+} Output;
+
+static int
+write_all (int         fd,
+           const void *data,
+           size_t      size,
+           off_t       pos)
+{
+  const uint8_t *p = data;
+
+  while (size)
+    {
+      ssize_t n = pwrite (fd, p, size, pos);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return 0;
+
+      p    += n;
+      pos  += n;
+      size -= n;
+    }
+
+  return 1;
+}
+
+static void
+put_u16 (uint8_t  *p,
+         uint16_t  v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void
+put_u64 (uint8_t  *p,
+         uint64_t  v)
+{
+  int i;
+
+  for (i = 0; i < 8; i++)
+    p[i] = v >> (8 * i);
+}
+
+/* little endian BigTIFF, RGBA float with unassociated alpha, one strip
+ * per row; the strip arrays go between directory and pixels
+ */
+#define TIFF_N_ENTRIES  12
+#define TIFF_IFD_SIZE   (8 + TIFF_N_ENTRIES * 20 + 8)
+
+static int
+output_write_tiff_header (Output *output)
+{
+  const uint64_t height    = output->height;
+  const uint64_t row_bytes = (uint64_t) output->width * 16;
+  const uint64_t arrays    = 16 + TIFF_IFD_SIZE;
+  const uint64_t offsets   = height > 1 ? arrays : 0;
+  const uint64_t counts    = height > 1 ? arrays + 8 * height : 0;
+  uint8_t        header[16 + TIFF_IFD_SIZE];
+  uint8_t        chunk[8 * 1024];
+  uint8_t       *entry;
+  uint64_t       row, i;
+  int            pass;
+
+  output->data_pos = (arrays + (height > 1 ? 16 * height : 0) + 15) & ~(uint64_t) 15;
+
+  memset (header, 0, sizeof (header));
+  memcpy (header, "II", 2);
+  put_u16 (header + 2, 43);
+  put_u16 (header + 4, 8);
+  put_u64 (header + 8, 16);
+  put_u64 (header + 16, TIFF_N_ENTRIES);
+
+  entry = header + 24;
+
+#define ENTRY(tag, type, count, value) \
+  (put_u16 (entry, tag), put_u16 (entry + 2, type), put_u64 (entry + 4, count), \
+   put_u64 (entry + 12, value), entry += 20)
+
+  ENTRY (256, 16, 1, output->width);                        /* ImageWidth */
+  ENTRY (257, 16, 1, output->height);                       /* ImageLength */
+  ENTRY (258, 3, 4, 0x0020002000200020ull);                 /* BitsPerSample 32 */
+  ENTRY (259, 3, 1, 1);                                     /* no Compression */
+  ENTRY (262, 3, 1, 2);                                     /* RGB */
+  ENTRY (273, 16, height, height > 1 ? offsets : (uint64_t) output->data_pos);
+  ENTRY (277, 3, 1, 4);                                     /* SamplesPerPixel */
+  ENTRY (278, 16, 1, 1);                                    /* RowsPerStrip */
+  ENTRY (279, 16, height, height > 1 ? counts : row_bytes);
+  ENTRY (284, 3, 1, 1);                                     /* chunky */
+  ENTRY (338, 3, 1, 2);                                     /* unassociated alpha */
+  ENTRY (339, 3, 4, 0x0003000300030003ull);                 /* float */
+
+#undef ENTRY
+
+  if (! write_all (output->fd, header, sizeof (header), 0))
+    return 0;
+
+  if (height < 2)
+    return 1;
+
+  /* strip offsets, then byte counts, a chunk at a time */
+  for (pass = 0; pass < 2; pass++)
+    for (row = 0; row < height; row += sizeof (chunk) / 8)
+      {
+        const uint64_t n = MIN (sizeof (chunk) / 8, height - row);
+
+        for (i = 0; i < n; i++)
+          put_u64 (chunk + 8 * i, pass ? row_bytes : output->data_pos + (row + i) * row_bytes);
+
+        if (! write_all (output->fd, chunk, n * 8, (pass ? counts : offsets) + row * 8))
+          return 0;
+      }
+
+  return 1;
+}
+
+static int
+output_open (Output     *output,
+             const char *path,
+             int         width,
+             int         height)
+{
+  const size_t length = strlen (path);
+  off_t        size;
+
+  memset (output, 0, sizeof (*output));
+  output->path   = path;
+  output->width  = width;
+  output->height = height;
+  output->pfm    = length > 4 && ! strcasecmp (path + length - 4, ".pfm");
+  output->fd     = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (output->fd < 0)
+    {
+      fprintf (stderr, "%s: %s\n", path, strerror (errno));
+      return 0;
+    }
+
+  if (output->pfm)
+    {
+      char header[64];
+      int  n = snprintf (header, sizeof (header), "PF\n%d %d\n%s\n", width, height,
+                         host_is_big_endian () ? "1.0" : "-1.0");
+
+      output->data_pos = n;
+      output->rgb      = malloc ((size_t) width * 3 * sizeof (float));
+
+      if (! write_all (output->fd, header, n, 0))
+        goto fail;
+
+      size = output->data_pos + (off_t) width * height * 12;
+    }
+  else
+    {
+      if (! output_write_tiff_header (output))
+        goto fail;
+
+      /* the header says little endian, big endian hosts swap the rows */
+      if (host_is_big_endian ())
+        output->rgb = malloc ((size_t) width * 16);
+
+      size = output->data_pos + (off_t) width * height * 16;
+    }
+
+  /* the full size up front, the rows are written in place */
+  if (ftruncate (output->fd, size) < 0)
+    goto fail;
+
+  return 1;
+
+fail:
+  fprintf (stderr, "%s: %s\n", path, strerror (errno));
+  return 0;
+}
+
+/* rows y .. y + n - 1, width RGBA float pixels each */
+static int
+output_write (Output      *output,
+              int          y,
+              int          n,
+              const float *rgba)
+{
+  const size_t width = output->width;
+  int          r;
+  size_t       x;
+
+  if (! output->pfm && ! output->rgb)
+    return write_all (output->fd, rgba, width * n * 16, output->data_pos + (off_t) y * width * 16);
+
+  if (! output->pfm)
+    {
+      for (r = 0; r < n; r++)
+        {
+          const float *src = rgba + r * width * 4;
+
+          for (x = 0; x < width * 4; x++)
+            {
+              uint32_t v;
+
+              memcpy (&v, src + x, 4);
+              v = __builtin_bswap32 (v);
+              memcpy (output->rgb + x, &v, 4);
+            }
+
+          if (! write_all (output->fd, output->rgb, width * 16,
+                           output->data_pos + (off_t) (y + r) * width * 16))
+            return 0;
+        }
+
+      return 1;
+    }
+
+  /* PFM stores the rows bottom to top */
+  for (r = 0; r < n; r++)
+    {
+      const float *src = rgba + r * width * 4;
+
+      for (x = 0; x < width; x++)
+        {
+          output->rgb[x * 3 + 0] = src[x * 4 + 0];
+          output->rgb[x * 3 + 1] = src[x * 4 + 1];
+          output->rgb[x * 3 + 2] = src[x * 4 + 2];
+        }
+
+      if (! write_all (output->fd, output->rgb, width * 12,
+                       output->data_pos + (off_t) (output->height - 1 - y - r) * width * 12))
+        return 0;
+    }
+
+  return 1;
+}
+
+static int
+output_close (Output *output)
+{
+  int ok = output->fd >= 0 && close (output->fd) == 0;
+
+  free (output->rgb);
+
+  return ok;
+}
+
+
+/* bands */
+
+/* rows y0 - 1 .. y0 + n of a band sit in slots 0 .. n + 1; the rgba rows
+ * are width pixels wide, the Y rows width + 2 with the clamped left and
+ * right neighbour, like the buffers color-mapper reads
+ */
+typedef struct
+{
+  ColorMapperParams       params;
+  ColorMapperAuxFunc      aux_func;
+  ColorMapperFeatureFunc  features_func;
+  ColorMapperCombineFunc  combine_func;
+  double                  luminance[3];
+
+  Source                 *sources[2];   /* input, aux */
+  int                     width;
+  int                     height;
+  int                     y0;           /* first row of the band */
+  int                     n_rows;       /* rows of the band */
+
+  float                  *rgba[2];
+  float                  *Y[2];
+  float                  *out;          /* n_rows rows of RGBA */
+  int                     analyze;      /* stats instead of out */
+} Stream;
+
+typedef struct
+{
+  Stream           *stream;
+  pthread_t         thread;
+  int               started;
+  int               first;     /* slots or rows of this worker */
+  int               last;
+  int               load;      /* load slots instead of computing rows */
+  float            *planes;    /* aux and feature planes of one row */
+  ColorMapperStats  stats;     /* of the rows of this worker, --analyze */
+} Worker;
+
+static float *
+slot_rgba (const Stream *stream,
+           int           s,
+           int           slot)
+{
+  return stream->rgba[s] + (size_t) slot * stream->width * 4;
+}
+
+static float *
+slot_Y (const Stream *stream,
+        int           s,
+        int           slot)
+{
+  return stream->Y[s] + (size_t) slot * (stream->width + 2);
+}
+
+/* decodes image row y into slot, rows below the image repeat the last one */
+static void
+load_slot (Stream *stream,
+           int     slot,
+           int     y)
+{
+  int s;
+
+  for (s = 0; s < 2; s++)
+    {
+      float *rgba = slot_rgba (stream, s, slot);
+      float *Y    = slot_Y (stream, s, slot);
+
+      source_read_row (stream->sources[s], MIN (y, stream->height - 1), rgba);
+      color_mapper_luminance (rgba, Y + 1, stream->width, stream->luminance);
+
+      Y[0]                 = Y[1];
+      Y[stream->width + 1] = Y[stream->width];
+    }
+}
+
+static void
+compute_row (Stream *stream,
+             Worker *worker,
+             int     r)
+{
+  const int             width = stream->width;
+  ColorMapperSource     in_row, aux_row;
+  ColorMapperAuxRow     aux_planes;
+  ColorMapperFeatureRow feature_planes;
+  int                   i;
+
+  /* output row r of the band is slot r + 1 */
+  for (i = 0; i < 3; i++)
+    {
+      in_row.Y[i]  = slot_Y (stream, 0, r + i);
+      aux_row.Y[i] = slot_Y (stream, 1, r + i);
+    }
+  in_row.rgba      = slot_rgba (stream, 0, r + 1);
+  aux_row.rgba     = slot_rgba (stream, 1, r + 1);
+  in_row.contrast  = NULL;
+  aux_row.contrast = NULL;
+
+  color_mapper_aux_row_init (&aux_planes, worker->planes, width, width, 0, 0);
+  color_mapper_feature_row_init (&feature_planes, worker->planes + (size_t) width * COLOR_MAPPER_AUX_PLANES,
+                                 width, width, 0, 0);
+
+  stream->aux_func (&stream->params, &aux_row, &aux_planes, width);
+
+  /* the tone curve mode takes no gradients, like the operation; the debug
+   * output of the aux gradient still shows them
+   */
+  if (stream->params.tone_curve && stream->params.technology != COLOR_MAPPER_YGRAD_AUX)
+    memset (aux_planes.gradient, 0, width * sizeof (float));
+  stream->features_func (&stream->params, &in_row, &aux_planes, &feature_planes, width);
+
+  if (stream->analyze)
+    {
+      color_mapper_stats_row (&stream->params, &feature_planes, &aux_planes, &worker->stats, width);
+      return;
+    }
+
+  stream->combine_func (&stream->params, &feature_planes, &aux_planes,
+                        stream->out + (size_t) r * width * 4, width);
+}
+
+static void *
+worker_run (void *data)
+{
+  Worker *worker = data;
+  Stream *stream = worker->stream;
+  int     i;
+
+  for (i = worker->first; i < worker->last; i++)
+    {
+      if (worker->load)
+        load_slot (stream, i, stream->y0 - 1 + i);
+      else
+        compute_row (stream, worker, i);
+    }
+
+  return NULL;
+}
+
+/* items first .. last - 1 split over the workers, the calling thread
+ * takes the first share
+ */
+static void
+run_workers (Worker *workers,
+             int     n_workers,
+             int     first,
+             int     last,
+             int     load)
+{
+  const int n = last - first;
+  int       w;
+
+  for (w = 0; w < n_workers; w++)
+    {
+      workers[w].first = first + (int) ((long) n * w / n_workers);
+      workers[w].last  = first + (int) ((long) n * (w + 1) / n_workers);
+      workers[w].load  = load;
+
+      workers[w].started = w > 0 &&
+                           pthread_create (&workers[w].thread, NULL, worker_run, &workers[w]) == 0;
+    }
+
+  /* the share of a worker without thread is done here */
+  for (w = 0; w < n_workers; w++)
+    if (! workers[w].started)
+      worker_run (&workers[w]);
+
+  for (w = 1; w < n_workers; w++)
+    if (workers[w].started)
+      pthread_join (workers[w].thread, NULL);
+}
+
+static double
+now_seconds (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+parse_triple (const char *text,
+              double      v[3])
+{
+  return sscanf (text, "%lf,%lf,%lf", &v[0], &v[1], &v[2]) == 3;
+}
+
+static void
+usage (const char *program)
+{
+  fprintf (stderr,
+           "usage: %s [--technology NAME] [--scale X] [--saturation-min X]\n"
+           "       [--saturation-weighting X] [--global-saturation X] [--perceptual]\n"
+           "       [--fast-math] [--white R,G,B] [--tone-curve POINTS]\n"
+           "       [--luminance R,G,B] [--memory MB]\n"
+           "       [--threads N] [--quiet] INPUT AUX OUTPUT\n"
+           "       %s --analyze [--clip-target PERCENT] [...] INPUT AUX\n", program, program);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  Stream        stream;
+  Source        sources[2];
+  Output        output;
+  Worker        workers[MAX_THREADS];
+  const char   *paths[3]   = { NULL, };
+  double        white[3]   = { 1.0, 1.0, 1.0 };
+  double        memory_mb  = 512.0;
+  double        clip_target = 1.0;
+  const char   *tone_curve = NULL;
+  float         curve_x[COLOR_MAPPER_TONE_CURVE_MAX_POINTS];
+  float         curve_y[COLOR_MAPPER_TONE_CURVE_MAX_POINTS];
+  int           n_curve_points = 0;
+  int           n_threads  = sysconf (_SC_NPROCESSORS_ONLN);
+  size_t        page       = sysconf (_SC_PAGESIZE);
+  int           quiet      = 0;
+  int           n_paths    = 0;
+  int           ok         = 1;
+  size_t        width, per_row, fixed, budget, src_bytes = 0;
+  int           band_rows, n_bands = 0;
+  double        Ywhite, t0, seconds;
+  struct rusage usage_self;
+  int           i, s, w;
+
+  memset (&stream, 0, sizeof (stream));
+  stream.params.technology        = COLOR_MAPPER_DEFAULT;
+  stream.params.scale             = 0.5f;
+  stream.params.globalSaturation  = 1.0f;
+  stream.params.gradient_scale    = 1.0f;
+
+  /* linear sRGB, as babl has it */
+  stream.luminance[0] = 0.2126729;
+  stream.luminance[1] = 0.7151522;
+  stream.luminance[2] = 0.0721750;
+
+  for (i = 1; i < argc; i++)
+    {
+      if (! strcmp (argv[i], "--technology") && i + 1 < argc)
+        {
+          const char *name = argv[++i];
+
+          stream.params.technology = -1;
+          for (s = 0; s < COLOR_MAPPER_N_TECHNOLOGIES; s++)
+            if (! strcmp (name, technology_names[s]))
+              stream.params.technology = s;
+
+          if (stream.params.technology < 0)
+            {
+              fprintf (stderr, "technologies:");
+              for (s = 0; s < COLOR_MAPPER_N_TECHNOLOGIES; s++)
+                fprintf (stderr, " %s", technology_names[s]);
+              fprintf (stderr, "\n");
+              return 2;
+            }
+        }
+      else if (! strcmp (argv[i], "--scale") && i + 1 < argc)
+        stream.params.scale = atof (argv[++i]);
+      else if (! strcmp (argv[i], "--saturation-min") && i + 1 < argc)
+        stream.params.saturation_min = atof (argv[++i]);
+      else if (! strcmp (argv[i], "--saturation-weighting") && i + 1 < argc)
+        stream.params.saturation_weighting_factor = atof (argv[++i]);
+      else if (! strcmp (argv[i], "--global-saturation") && i + 1 < argc)
+        stream.params.globalSaturation = atof (argv[++i]);
+      else if (! strcmp (argv[i], "--perceptual"))
+        stream.params.perceptual = 1;
+      else if (! strcmp (argv[i], "--fast-math"))
+        stream.params.fast_math = 1;
+      else if (! strcmp (argv[i], "--tone-curve") && i + 1 < argc)
+        tone_curve = argv[++i];
+      else if (! strcmp (argv[i], "--white") && i + 1 < argc && parse_triple (argv[i + 1], white))
+        i++;
+      else if (! strcmp (argv[i], "--luminance") && i + 1 < argc && parse_triple (argv[i + 1], stream.luminance))
+        i++;
+      else if (! strcmp (argv[i], "--memory") && i + 1 < argc)
+        memory_mb = atof (argv[++i]);
+      else if (! strcmp (argv[i], "--threads") && i + 1 < argc)
+        n_threads = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "--quiet"))
+        quiet = 1;
+      else if (! strcmp (argv[i], "--analyze"))
+        stream.analyze = 1;
+      else if (! strcmp (argv[i], "--clip-target") && i + 1 < argc)
+        clip_target = atof (argv[++i]);
+      else if (argv[i][0] != '-' && n_paths < 3)
+        paths[n_paths++] = argv[i];
+      else
+        {
+          usage (argv[0]);
+          return 2;
+        }
+    }
+
+  if (n_paths != (stream.analyze ? 2 : 3))
+    {
+      usage (argv[0]);
+      return 2;
+    }
+
+  n_threads = MAX (1, MIN (n_threads, MAX_THREADS));
+
+  /* the tint of the white representation, like color-mapper derives it */
+  Ywhite = white[0] * stream.luminance[0] + white[1] * stream.luminance[1] + white[2] * stream.luminance[2];
+  if (! (Ywhite > 0.0))
+    {
+      fprintf (stderr, "--white needs a luminance above 0\n");
+      return 2;
+    }
+  for (i = 0; i < 3; i++)
+    stream.params.neutral2tinted[i] = white[i] / Ywhite;
+
+  if (tone_curve)
+    {
+      ColorMapperToneCurve *curve = malloc (sizeof (ColorMapperToneCurve));
+
+      n_curve_points = color_mapper_tone_curve_parse (tone_curve, curve_x, curve_y,
+                                                      COLOR_MAPPER_TONE_CURVE_MAX_POINTS);
+      if (! n_curve_points)
+        {
+          fprintf (stderr, "--tone-curve takes \"x,y x,y ...\" with increasing x or \"y y ...\"\n");
+          return 2;
+        }
+
+      color_mapper_tone_curve_init (curve, curve_x, curve_y, n_curve_points,
+                                    stream.params.perceptual, stream.params.fast_math);
+      stream.params.tone_curve = curve;
+    }
+
+  if (! source_open (&sources[0], paths[0]) || ! source_open (&sources[1], paths[1]))
+    return 1;
+
+  if (sources[0].width != sources[1].width || sources[0].height != sources[1].height)
+    {
+      fprintf (stderr, "%s and %s differ in size\n", paths[0], paths[1]);
+      return 1;
+    }
+
+  stream.sources[0] = &sources[0];
+  stream.sources[1] = &sources[1];
+  stream.width      = sources[0].width;
+  stream.height     = sources[0].height;
+  width             = stream.width;
+
+  /* the statistics follow the math of the default technology */
+  if (stream.analyze)
+    stream.params.technology = COLOR_MAPPER_DEFAULT;
+
+  color_mapper_kernel_init ();
+  stream.aux_func      = color_mapper_kernel_get_aux (&stream.params);
+  stream.features_func = color_mapper_kernel_get_features (&stream.params);
+  stream.combine_func  = color_mapper_kernel_get_combine (&stream.params);
+
+  /* memory per band row: rgba and Y of both sources, the output row and
+   * the mapped source pages of the row; fixed: the planes of every worker,
+   * the PFM or swapped TIFF row, and per source a row and the pages at
+   * either end of a band that source_release () keeps of every tile
+   */
+  for (s = 0; s < 2; s++)
+    src_bytes += source_row_bytes (&sources[s]);
+
+  per_row = 2 * (width * 16 + (width + 2) * 4) + width * 16 + src_bytes;
+  fixed   = n_threads * width * (COLOR_MAPPER_AUX_PLANES + COLOR_MAPPER_FEATURE_PLANES) * 4 + width * 16;
+  for (s = 0; s < 2; s++)
+    fixed += 2 * source_row_bytes (&sources[s]) + (size_t) sources[s].tiles_across * 4 * page;
+  fixed  += 2 * per_row;
+
+  budget = memory_mb * 1024 * 1024;
+  if (budget < fixed + per_row)
+    {
+      fprintf (stderr, "--memory %g is too small for %zu pixels wide images, it needs %.0f MB\n",
+               memory_mb, width, ceil ((fixed + per_row) / (1024.0 * 1024.0)));
+      return 1;
+    }
+
+  band_rows = MIN ((budget - fixed) / per_row, (size_t) stream.height);
+  band_rows = MAX (band_rows, 1);
+
+  for (s = 0; s < 2; s++)
+    {
+      stream.rgba[s] = malloc ((size_t) (band_rows + 2) * width * 16);
+      stream.Y[s]    = malloc ((size_t) (band_rows + 2) * (width + 2) * 4);
+    }
+  stream.out = malloc ((size_t) band_rows * width * 16);
+
+  for (w = 0; w < n_threads; w++)
+    {
+      workers[w].stream = &stream;
+      workers[w].planes = malloc (width * (COLOR_MAPPER_AUX_PLANES + COLOR_MAPPER_FEATURE_PLANES) * 4);
+      color_mapper_stats_init (&workers[w].stats);
+    }
+
+  if (! stream.analyze && ! output_open (&output, paths[2], stream.width, stream.height))
+    return 1;
+
+  if (! quiet)
+    fprintf (stderr, "%d x %d, bands of %d rows, %d threads, %s\n",
+             stream.width, stream.height, band_rows, n_threads, color_mapper_kernel_isa ());
+
+  t0 = now_seconds ();
+
+  /* the first band starts with row 0 above itself, every later one with
+   * the last two rows of the band before it
+   */
+  stream.y0 = 0;
+  load_slot (&stream, 1, 0);
+  for (s = 0; s < 2; s++)
+    {
+      memcpy (slot_rgba (&stream, s, 0), slot_rgba (&stream, s, 1), width * 16);
+      memcpy (slot_Y (&stream, s, 0), slot_Y (&stream, s, 1), (width + 2) * 4);
+    }
+
+  for (stream.y0 = 0; stream.y0 < stream.height && ok; stream.y0 += stream.n_rows)
+    {
+      stream.n_rows = MIN (band_rows, stream.height - stream.y0);
+
+      /* rows y0 + 1 .. y0 + n_rows */
+      run_workers (workers, n_threads, 2, stream.n_rows + 2, 1);
+      run_workers (workers, n_threads, 0, stream.n_rows, 0);
+
+      if (! stream.analyze)
+        ok = output_write (&output, stream.y0, stream.n_rows, stream.out);
+
+      /* carry rows y0 + n_rows - 1 and y0 + n_rows, the next band reads
+       * from y0 + n_rows + 1 on
+       */
+      for (s = 0; s < 2; s++)
+        {
+          memmove (slot_rgba (&stream, s, 0), slot_rgba (&stream, s, stream.n_rows), 2 * width * 16);
+          memmove (slot_Y (&stream, s, 0), slot_Y (&stream, s, stream.n_rows), 2 * (width + 2) * 4);
+          source_release (&sources[s], stream.y0 + stream.n_rows + 1);
+        }
+
+      n_bands++;
+    }
+
+  if (stream.analyze)
+    {
+      ColorMapperSuggestion suggestion;
+
+      /* every worker counted into its own stats, add them up */
+      for (w = 1; w < n_threads; w++)
+        color_mapper_stats_merge (&workers[0].stats, &workers[w].stats);
+
+      color_mapper_stats_suggest (&workers[0].stats, &stream.params, clip_target / 100.0, &suggestion);
+      color_mapper_stats_print (&workers[0].stats, &stream.params, &suggestion, stdout);
+    }
+  else
+    {
+      if (! ok)
+        fprintf (stderr, "%s: %s\n", paths[2], strerror (errno));
+
+      ok = output_close (&output) && ok;
+    }
+  seconds = now_seconds () - t0;
+
+  getrusage (RUSAGE_SELF, &usage_self);
+  if (! quiet)
+    fprintf (stderr, "%d bands in %.2f s, %.1f Mpix/s, peak RSS %.1f MB\n",
+             n_bands, seconds, (double) width * stream.height / seconds * 1e-6,
+             usage_self.ru_maxrss / 1024.0);
+
+  for (s = 0; s < 2; s++)
+    {
+      free (stream.rgba[s]);
+      free (stream.Y[s]);
+      source_close (&sources[s]);
+    }
+  free (stream.out);
+  free ((void *) stream.params.tone_curve);
+  for (w = 0; w < n_threads; w++)
+    free (workers[w].planes);
+
+  return ok ? 0 : 1;
+}
@@ -20,6 +20,7 @@
  /* compensate for chromaticity effects in luminance remapping operations */
 
 #include "config.h"
+#include <string.h>
 #include <glib/gi18n-lib.h>
 
 #ifdef GEGL_PROPERTIES
@@ -35,9 +36,16 @@ enum_start (gegl_colormapper_technology)
    enum_value (GEGL_COLORMAPPER_YGRAD_AUX, "linear aux gradient", N_("Linerar Gradient of aux"))
 enum_end (GeglColorMapperTechology)
 
+enum_start (gegl_colormapper_grid)
+   enum_value (GEGL_COLORMAPPER_GRID_FULL,    "full",    N_("Full resolution"))
+   enum_value (GEGL_COLORMAPPER_GRID_HALF,    "half",    N_("1/2"))
+   enum_value (GEGL_COLORMAPPER_GRID_QUARTER, "quarter", N_("1/4"))
+   enum_value (GEGL_COLORMAPPER_GRID_EIGHTH,  "eighth",  N_("1/8"))
+enum_end (GeglColorMapperGrid)
+
 property_color (WhiteRepresentation, _("neutral / white representation"), "white")
     description (_("Chose a color that represents white or neutral gray."))
-    
+
 property_enum (technology, _("output mode"),
                GeglColorMapperTechology, gegl_colormapper_technology,
                GEGL_COLORMAPPER_DEFAULT)
@@ -74,26 +82,257 @@ property_double (globalSaturation, _("global Saturation"), 1.0)
 property_boolean (perceptual, _("perceptual chroma adoption"), FALSE)
   description (_("chroma compensation based on perceptual lightness"))
 
+property_boolean (fast_math, _("fast math"), FALSE)
+  description (_("approximate square roots, divisions and the perceptual gamma, relative error below 5e-7 each"))
+
+property_enum (contrast_grid, _("contrast grid"),
+               GeglColorMapperGrid, gegl_colormapper_grid,
+               GEGL_COLORMAPPER_GRID_FULL)
+  description (_("Compare the gradients of input and aux on a grid this much coarser and upsample the chroma adoption guided by the luminance of aux: smoother, fewer halos and dead pixels, a fraction of the stencil work"))
+
+property_string (tone_curve, _("tone curve"), "")
+  description (_("Luminance tone curve from aux to input over linear Y, as points \"x,y x,y ...\" or evenly spaced values \"y y ...\". When set, chroma adoption follows the slope of the curve instead of the image gradients and no neighbouring pixels are read; empty takes the gradients"))
+
 
 #else
 
-#define GEGL_OP_COMPOSER
+#define GEGL_OP_COMPOSER3
 #define GEGL_OP_NAME         color_mapper
 #define GEGL_OP_C_SOURCE     color-mapper.c
 
 #define POW2(x) ((x)*(x))
 
 #include "gegl-op.h"
+#include "color-mapper-kernel.h"
+#include "color-mapper-cache.h"
+#include "immanuel-trace.h"
+#include "immanuel-scratch.h"
+
+/* planes kept across renders, in o->user_data */
+typedef struct
+{
+  ColorMapperCache *aux;       /* aux stage */
+  ColorMapperCache *features;  /* feature stage */
+
+  /* prepare () replaces the tables below while renders of the previous
+   * properties may still be running; process () takes a reference on
+   * them under lock, so a replaced table lives until its last render ends
+   */
+  GMutex            lock;
+
+  /* linear rgb of every R'G'B' u16 value, 3 floats each */
+  GBytes           *trc_lut;
+  const Babl       *trc_lut_space;
+
+  /* ColorMapperToneCurve of the tone_curve property, NULL without one */
+  GBytes               *tone_curve;
+  gchar                *tone_curve_text;
+  gboolean              tone_curve_perceptual;
+  gboolean              tone_curve_fast_math;
+  guint                 tone_curve_serial;
+} ColorMapperCaches;
+
+/* range weights of the contrast grid, the same for every render */
+static ColorMapperGridRange grid_range;
+
+/* format a source of format source is read in: half and u16 sources stay
+ * 2 bytes per component until color_mapper_load (), everything else is
+ * converted to float by babl
+ */
+static const Babl *
+storage_format (const Babl *source,
+                const Babl *space,
+                gint       *storage)
+{
+  const Babl *type = source ? babl_format_get_type (source, 0) : NULL;
+
+  if (type == babl_type ("half"))
+    {
+      *storage = COLOR_MAPPER_STORAGE_HALF;
+      return babl_format_with_space ("RGBA half", space);
+    }
+
+  if (type == babl_type ("u16"))
+    {
+      const gchar *model = babl_get_name (babl_format_get_model (source));
+
+      /* linearizing into u16 would lose the shadows, a lut does it instead */
+      if (strchr (model, '\'') || strchr (model, '~'))
+        {
+          *storage = COLOR_MAPPER_STORAGE_U16_PERCEPTUAL;
+          return babl_format_with_space ("R'G'B'A u16", space);
+        }
+
+      *storage = COLOR_MAPPER_STORAGE_U16;
+      return babl_format_with_space ("RGBA u16", space);
+    }
+
+  *storage = COLOR_MAPPER_STORAGE_FLOAT;
+  return babl_format_with_space ("RGBA float", space);
+}
+
+static GBytes *
+trc_lut_new (const Babl *space)
+{
+  guint16 *values = g_new (guint16, 65536 * 3);
+  gfloat  *lut    = g_new (gfloat, 65536 * 3);
+  gint     i;
+
+  for (i = 0; i < 65536; i++)
+    values[i * 3 + 0] = values[i * 3 + 1] = values[i * 3 + 2] = i;
+
+  babl_process (babl_fish (babl_format_with_space ("R'G'B' u16", space),
+                           babl_format_with_space ("RGB float", space)),
+                values, lut, 65536);
+
+  g_free (values);
+
+  return g_bytes_new_take (lut, 65536 * 3 * sizeof (gfloat));
+}
+
+/* replaces *table by new_table under lock and counts serial up, when
+ * given; the old table is freed by its last reference
+ */
+static void
+swap_table (ColorMapperCaches  *caches,
+            GBytes            **table,
+            GBytes             *new_table,
+            guint              *serial)
+{
+  GBytes *old_table;
+
+  g_mutex_lock (&caches->lock);
+  old_table = *table;
+  *table    = new_table;
+  if (serial)
+    (*serial)++;
+  g_mutex_unlock (&caches->lock);
+
+  if (old_table)
+    g_bytes_unref (old_table);
+}
+
+/* (re)builds the table of the tone_curve property when it or the options
+ * the table depends on changed
+ */
+static void
+update_tone_curve (GeglProperties    *o,
+                   ColorMapperCaches *caches)
+{
+  const gchar *text = o->tone_curve ? o->tone_curve : "";
+  gfloat       x[COLOR_MAPPER_TONE_CURVE_MAX_POINTS];
+  gfloat       y[COLOR_MAPPER_TONE_CURVE_MAX_POINTS];
+  gint         n_points;
+
+  if (caches->tone_curve_text &&
+      ! strcmp (caches->tone_curve_text, text) &&
+      caches->tone_curve_perceptual == o->perceptual &&
+      caches->tone_curve_fast_math  == o->fast_math)
+    return;
+
+  g_free (caches->tone_curve_text);
+  caches->tone_curve_text       = g_strdup (text);
+  caches->tone_curve_perceptual = o->perceptual;
+  caches->tone_curve_fast_math  = o->fast_math;
+
+  n_points = color_mapper_tone_curve_parse (text, x, y, COLOR_MAPPER_TONE_CURVE_MAX_POINTS);
+
+  if (n_points)
+    {
+      ColorMapperToneCurve *curve = g_new (ColorMapperToneCurve, 1);
+
+      color_mapper_tone_curve_init (curve, x, y, n_points, o->perceptual, o->fast_math);
+      swap_table (caches, &caches->tone_curve,
+                  g_bytes_new_take (curve, sizeof (ColorMapperToneCurve)),
+                  &caches->tone_curve_serial);
+      return;
+    }
+
+  swap_table (caches, &caches->tone_curve, NULL, &caches->tone_curve_serial);
+
+  if (*text)
+    {
+      g_warning ("immanuel:color-mapper: tone-curve \"%s\" is no curve, "
+                 "taking the gradients", text);
+    }
+}
+
+/* TRUE when the tone curve gives the contrast, color-mapper is a point
+ * operation then
+ */
+static gboolean
+is_point_operation (GeglOperation *operation)
+{
+  GeglProperties    *o      = GEGL_PROPERTIES (operation);
+  ColorMapperCaches *caches = o->user_data;
+
+  return caches && caches->tone_curve;
+}
+
+/* pixels per cell of the contrast grid, 1 when every pixel compares its
+ * own gradients or the tone curve gives the contrast
+ */
+static gint
+grid_cell_size (GeglOperation *operation)
+{
+  GeglProperties *o = GEGL_PROPERTIES (operation);
+
+  if (is_point_operation (operation))
+    return 1;
+
+  return 1 << o->contrast_grid;
+}
 
 static void
 prepare (GeglOperation *operation)
 {
-  const Babl *format = babl_format_with_space ("RGBA float",
-                           gegl_operation_get_source_space (operation, "input"));
+  GeglProperties    *o     = GEGL_PROPERTIES (operation);
+  const Babl        *space = gegl_operation_get_source_space (operation, "input");
+  const Babl        *in_format, *aux_format, *out_format;
+  ColorMapperCaches *caches;
+  gint               in_storage, aux_storage;
+
+  in_format  = storage_format (gegl_operation_get_source_format (operation, "input"),
+                               space, &in_storage);
+  aux_format = storage_format (gegl_operation_get_source_format (operation, "aux"),
+                               space, &aux_storage);
+
+  /* the image output of half or linear u16 input is written the same way,
+   * debug outputs and unlimited rgb need the range of float
+   */
+  if (o->technology == GEGL_COLORMAPPER_DEFAULT &&
+      (in_storage == COLOR_MAPPER_STORAGE_HALF || in_storage == COLOR_MAPPER_STORAGE_U16))
+    out_format = in_format;
+  else
+    out_format = babl_format_with_space ("RGBA float", space);
+
+  gegl_operation_set_format (operation, "input",  in_format);
+  gegl_operation_set_format (operation, "aux",    aux_format);
+  gegl_operation_set_format (operation, "aux2",   babl_format_n (babl_type ("float"), 2));
+  gegl_operation_set_format (operation, "output", out_format);
+
+  if (! o->user_data)
+    {
+      caches = g_new0 (ColorMapperCaches, 1);
 
-  gegl_operation_set_format (operation, "input",  format);
-  gegl_operation_set_format (operation, "aux",    format);
-  gegl_operation_set_format (operation, "output", format);
+      g_mutex_init (&caches->lock);
+
+      caches->aux      = color_mapper_cache_new (COLOR_MAPPER_AUX_PLANES);
+      caches->features = color_mapper_cache_new (COLOR_MAPPER_FEATURE_PLANES);
+      o->user_data     = caches;
+    }
+
+  caches = o->user_data;
+
+  if ((in_storage  == COLOR_MAPPER_STORAGE_U16_PERCEPTUAL ||
+       aux_storage == COLOR_MAPPER_STORAGE_U16_PERCEPTUAL) &&
+      (! caches->trc_lut || caches->trc_lut_space != space))
+    {
+      swap_table (caches, &caches->trc_lut, trc_lut_new (space), NULL);
+      caches->trc_lut_space = space;
+    }
+
+  update_tone_curve (o, caches);
 }
 
 static GeglRectangle
@@ -111,18 +350,37 @@ get_bounding_box (GeglOperation *operation)
   return result;
 }
 
+/* pixels around a pixel its output depends on, at level */
+static gint
+input_border (GeglOperation *operation)
+{
+  GeglProperties *o = GEGL_PROPERTIES (operation);
+
+  /* the cells around a pixel and their neighbours */
+  if (grid_cell_size (operation) > 1)
+    return 3 * grid_cell_size (operation);
+
+  /* the tone curve reads no neighbours, unless the aux gradient it does
+   * not need is the output
+   */
+  if (is_point_operation (operation) && o->technology != GEGL_COLORMAPPER_YGRAD_AUX)
+    return 0;
+
+  /* relevant for output computation is pixel including the direct neigbouring pixels */
+  return 1;
+}
+
 static GeglRectangle
 get_enlarged_input (GeglOperation       *operation,
                     const GeglRectangle *input_region)
 {
-//  GeglProperties *o = GEGL_PROPERTIES (operation);
   GeglRectangle   rect;
+  gint            border = input_border (operation);
 
-  /* relevant for output computation is pixel including the direct neigbouring pixels */
-  rect.x       = input_region->x - 1;
-  rect.y       = input_region->y - 1;
-  rect.width   = input_region->width  + 2;
-  rect.height  = input_region->height + 2;
+  rect.x       = input_region->x - border;
+  rect.y       = input_region->y - border;
+  rect.width   = input_region->width  + 2 * border;
+  rect.height  = input_region->height + 2 * border;
 
   return rect;
 }
@@ -132,9 +390,14 @@ get_required_for_output (GeglOperation       *operation,
                          const gchar         *input_pad,
                          const GeglRectangle *region)
 {
-  GeglRectangle   rect;
+  GeglRectangle   rect = { 0, 0, 0, 0 };
   GeglRectangle   defined;
 
+  /* the contrast of aux2 is not needed with a tone curve or grid */
+  if (! strcmp (input_pad, "aux2") &&
+      (is_point_operation (operation) || grid_cell_size (operation) > 1))
+    return rect;
+
   defined = gegl_operation_get_bounding_box (operation);
   gegl_rectangle_intersect (&rect, region, &defined);
 
@@ -151,390 +414,723 @@ get_invalidated_by_change (GeglOperation       *operation,
                            const gchar         *input_pad,
                            const GeglRectangle *input_region)
 {
+  GeglProperties    *o      = GEGL_PROPERTIES (operation);
+  ColorMapperCaches *caches = o->user_data;
+
+  /* cached planes covering the change are stale now, the features depend
+   * on both sources
+   */
+  if (caches)
+    {
+      gint border = input_border (operation);
+
+      if (! strcmp (input_pad, "aux"))
+        color_mapper_cache_invalidate (caches->aux, input_region, border);
+
+      color_mapper_cache_invalidate (caches->features, input_region, border);
+    }
+
   return get_enlarged_input (operation, input_region);
 }
 
 
-static gboolean
-color_mapper (GeglBuffer                *input,
-              const GeglRectangle       *src_rect,
-              GeglBuffer                *aux,
-              GeglBuffer                *output,
-              const GeglRectangle       *dst_rect,
-              GeglColorMapperTechology  technology,
-              gboolean                  perceptual,
-              gdouble                   scale,
-              gdouble                   saturation_min,
-              gdouble                   saturation_weighting_factor,
-              GeglColor                 *WhiteRepresentation,
-              gdouble                   globalSaturation,
-              gint                      level)
+/* state shared by the row bands of one process () call */
+typedef struct
+{
+  GeglBuffer             *input;
+  GeglBuffer             *aux;
+  GeglBuffer             *contrast;      /* aux2, relative contrast of input and aux */
+  GeglBuffer             *output;
+  gint                    level;
+  gdouble                 scale;         /* of level, to read the sources at */
+  const Babl             *format;        /* RGBA float, the working format */
+
+  /* formats of the pads and how their pixels are stored */
+  const Babl             *in_format;
+  const Babl             *aux_format;
+  const Babl             *out_format;
+  gint                    in_storage;
+  gint                    aux_storage;
+  gint                    out_storage;
+  const gfloat           *trc_lut;
+  gdouble                 luminance[3];
+  ColorMapperParams       params;
+
+  /* variants for params, picked once per process () */
+  ColorMapperAuxFunc      aux_func;
+  ColorMapperFeatureFunc  features_func;
+  ColorMapperCombineFunc  combine_func;
+
+  /* contrast grid, cells of grid_cell pixels; perceptual is applied
+   * after upsampling, so the cells are computed with grid_params
+   */
+  gint                    grid_cell;
+  ColorMapperParams       grid_params;
+  ColorMapperFeatureFunc  grid_features_func;
+  ColorMapperGridFunc     grid_func;     /* the pixels from the cells */
+
+  /* pixels read around each chunk: 1 for the gradients, none for the tone
+   * curve and the grid, which take no full resolution gradients
+   */
+  gint                    border;
+
+  ColorMapperCache       *aux_cache;
+  ColorMapperCache       *feature_cache;
+  gint                    tile_width;
+  gint                    tile_height;
+  GeglRectangle           region;        /* of the process () call */
+  ImmanuelTraceEvent     *trace;         /* of the process () call */
+} ColorMapperBand;
+
+static gint
+floor_to_multiple (gint value,
+                   gint multiple)
+{
+  return (value >= 0 ? value / multiple : (value - multiple + 1) / multiple) * multiple;
+}
 
+/* rect of source as RGBA float into dst, raw holds the pixels of rect in
+ * format when storage is not float
+ */
+static void
+read_source (GeglBuffer          *source,
+             const GeglRectangle *rect,
+             gdouble              scale,
+             const Babl          *format,
+             gint                 storage,
+             const gfloat        *trc_lut,
+             gpointer             raw,
+             gfloat              *dst)
 {
-  const Babl *space = gegl_buffer_get_format (output);
-  const Babl *gray_format = babl_format_with_space ("Y float", space);
-  const Babl *format = babl_format_with_space ("RGBA float", space);
-
-  
-  /* input grayscale */
-  gfloat *row1_in, *row2_in, *row3_in;
-  gfloat *top_ptr_Yin, *mid_ptr_Yin, *down_ptr_Yin, *tmp_ptr_Yin;
-
-  /* aux grayscale */
-  gfloat *row1_aux, *row2_aux, *row3_aux;
-  gfloat *top_ptr_Yaux, *mid_ptr_Yaux, *down_ptr_Yaux, *tmp_ptr_Yaux;
-
-  /* in, aux full buffer */
-  gfloat *row_in_buf, *row_aux_buf;
-  
-  gfloat *row_out;
-  gfloat NeutralRepresentation[4], NeutralRepresentationDesaturated[1], tinted2neutral[3], neutral2tinted[3];
-  gint    x, y;
-
-  GeglRectangle row_rect;
-  GeglRectangle out_rect;
-
-  gegl_color_get_pixel (WhiteRepresentation, format, &NeutralRepresentation);
-  gegl_color_get_pixel (WhiteRepresentation, gray_format, &NeutralRepresentationDesaturated);
-
-  row_in_buf  = g_new (gfloat, dst_rect->width * 4);
-  row_aux_buf = g_new0 (gfloat, dst_rect->width * 4);
-
-  row1_in = g_new (gfloat, src_rect->width);
-  row2_in = g_new (gfloat, src_rect->width);
-  row3_in = g_new (gfloat, src_rect->width);
-  row1_aux = g_new0 (gfloat, src_rect->width);
-  row2_aux = g_new0 (gfloat, src_rect->width);
-  row3_aux = g_new0 (gfloat, src_rect->width);
-
-  row_out = g_new0 (gfloat, dst_rect->width * 4);  
-  
-  top_ptr_Yin  = row1_in;
-  mid_ptr_Yin  = row2_in;
-  down_ptr_Yin = row3_in;
-  top_ptr_Yaux  = row1_aux;
-  mid_ptr_Yaux  = row2_aux;
-  down_ptr_Yaux = row3_aux;
-
-  row_rect.width = src_rect->width;
-  row_rect.height = 1;
-  row_rect.x = src_rect->x;
-  row_rect.y = src_rect->y;
-
-  out_rect.x      = dst_rect->x;
-  out_rect.width  = dst_rect->width;
-  out_rect.height = 1;
-
-  /* fill gegl buffer row-wise with grayscale data */  
-  gegl_buffer_get (input, &row_rect, 1.0, gray_format, top_ptr_Yin,
-                   GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
-  if (aux)
+  if (storage == COLOR_MAPPER_STORAGE_FLOAT)
     {
-      gegl_buffer_get (aux, &row_rect, 1.0, gray_format, top_ptr_Yaux,
+      gegl_buffer_get (source, rect, scale, format, dst,
                        GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
+      return;
     }
-    
-  row_rect.y++;
-  gegl_buffer_get (input, &row_rect, 1.0, gray_format, mid_ptr_Yin,
+
+  gegl_buffer_get (source, rect, scale, format, raw,
                    GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
-  if (aux)
+  color_mapper_load (storage, raw, dst, rect->width * rect->height, trc_lut);
+}
+
+/* Y of height rows of rgba, width pixels each, into rows of width + 2
+ * with the first and last pixel repeated, the layout of ColorMapperSource
+ */
+static void
+luminance_rows (const gfloat  *rgba,
+                gfloat        *Y,
+                gint           width,
+                gint           height,
+                const gdouble  luminance[3])
+{
+  gint y;
+
+  for (y = 0; y < height; y++)
     {
-      gegl_buffer_get (aux, &row_rect, 1.0, gray_format, mid_ptr_Yaux,
-                       GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
+      gfloat *row = Y + y * (width + 2);
+
+      color_mapper_luminance (rgba + y * width * 4, row + 1, width, luminance);
+      row[0]         = row[1];
+      row[width + 1] = row[width];
     }
+}
 
-  /* factor to tranform a tinted image to an neutral one */    
-  tinted2neutral[0] = NeutralRepresentationDesaturated[0] / NeutralRepresentation[0];  
-  tinted2neutral[1] = NeutralRepresentationDesaturated[0] / NeutralRepresentation[1];  
-  tinted2neutral[2] = NeutralRepresentationDesaturated[0] / NeutralRepresentation[2];  
-  neutral2tinted[0] = 1.0 / tinted2neutral[0];  
-  neutral2tinted[1] = 1.0 / tinted2neutral[1];  
-  neutral2tinted[2] = 1.0 / tinted2neutral[2];  
-    
-  /* loop rows and compute contrast ratio between both input and aux */    
-  for (y = dst_rect->y; y < dst_rect->y + dst_rect->height; y++)
+/* coarse buffers of the contrast grid of a band, grown on demand */
+typedef struct
+{
+  gint      pixels;       /* of the sources, the cells and their border */
+  gfloat   *in;
+  gfloat   *aux;
+  gpointer  raw;
+  gfloat   *Yin;
+  gfloat   *Yaux;
+  gfloat   *planes;       /* aux and feature planes of one row of cells */
+  gfloat   *log_ratio;
+  gfloat   *log_Y;
+} ColorMapperGridBuffers;
+
+/* the cells of the contrast grid around roi, from the mipmap of 1 / cell of
+ * input and aux; cells are aligned to multiples of cell, so a pixel gets
+ * the same cells in every tile
+ */
+static void
+compute_grid (const ColorMapperBand  *band,
+              const GeglRectangle    *roi,
+              ImmanuelScratch        *scratch,
+              ImmanuelTraceEvent     *event,
+              ColorMapperGridBuffers *buffers,
+              ColorMapperGrid        *grid)
+{
+  const gint             cell = band->grid_cell;
+  GeglRectangle          cells, src;
+  ColorMapperSource      in_row, aux_row;
+  ColorMapperAuxRow      aux_planes;
+  ColorMapperFeatureRow  feature_planes;
+  gint                   src_pixels, i, j;
+
+  /* every pixel lies between the centres of the cells left and right of it */
+  cells.x      = floor_to_multiple (roi->x, cell) / cell - 1;
+  cells.y      = floor_to_multiple (roi->y, cell) / cell - 1;
+  cells.width  = floor_to_multiple (roi->x + roi->width  - 1, cell) / cell + 2 - cells.x;
+  cells.height = floor_to_multiple (roi->y + roi->height - 1, cell) / cell + 2 - cells.y;
+
+  /* plus the neighbours of the gradients */
+  src.x      = cells.x - 1;
+  src.y      = cells.y - 1;
+  src.width  = cells.width  + 2;
+  src.height = cells.height + 2;
+  src_pixels = src.width * src.height;
+
+  if (src_pixels > buffers->pixels)
     {
-      row_rect.y = y + 1;
-      out_rect.y = y;
+      buffers->pixels    = src_pixels;
+      buffers->in        = immanuel_scratch_new (scratch, gfloat, src_pixels * 4);
+      buffers->aux       = immanuel_scratch_new0 (scratch, gfloat, src_pixels * 4);
+      buffers->raw       = (band->in_storage  != COLOR_MAPPER_STORAGE_FLOAT ||
+                            band->aux_storage != COLOR_MAPPER_STORAGE_FLOAT) ?
+                           immanuel_scratch_new (scratch, guint16, src_pixels * 4) : NULL;
+      buffers->Yin       = immanuel_scratch_new (scratch, gfloat, src_pixels);
+      buffers->Yaux      = immanuel_scratch_new (scratch, gfloat, src_pixels);
+      buffers->planes    = immanuel_scratch_new (scratch, gfloat, src.width *
+                                                 (COLOR_MAPPER_AUX_PLANES + COLOR_MAPPER_FEATURE_PLANES));
+      buffers->log_ratio = immanuel_scratch_new (scratch, gfloat, src_pixels);
+      buffers->log_Y     = immanuel_scratch_new (scratch, gfloat, src_pixels);
+
+      immanuel_trace_scratch (event, immanuel_scratch_used (scratch));
+    }
 
-      gegl_buffer_get (input, &row_rect, 1.0, gray_format, down_ptr_Yin,
-                       GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
-      gegl_buffer_get (input, &out_rect, 1.0, format, row_in_buf,
-                       GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
-      if (aux)
+  read_source (band->input, &src, band->scale / cell, band->in_format,
+               band->in_storage, band->trc_lut, buffers->raw, buffers->in);
+  if (band->aux)
+    read_source (band->aux, &src, band->scale / cell, band->aux_format,
+                 band->aux_storage, band->trc_lut, buffers->raw, buffers->aux);
+
+  color_mapper_luminance (buffers->in,  buffers->Yin,  src_pixels, band->luminance);
+  color_mapper_luminance (buffers->aux, buffers->Yaux, src_pixels, band->luminance);
+  immanuel_trace_mark (event, IMMANUEL_TRACE_FETCH);
+
+  color_mapper_aux_row_init (&aux_planes, buffers->planes, cells.width, cells.width, 0, 0);
+  color_mapper_feature_row_init (&feature_planes, buffers->planes + cells.width * COLOR_MAPPER_AUX_PLANES,
+                                 cells.width, cells.width, 0, 0);
+
+  for (j = 0; j < cells.height; j++)
+    {
+      for (i = 0; i < 3; i++)
         {
-          gegl_buffer_get (aux, &row_rect, 1.0, gray_format, down_ptr_Yaux,
-                           GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
-          gegl_buffer_get (aux, &out_rect, 1.0, format, row_aux_buf,
-                           GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
+          in_row.Y[i]  = buffers->Yin  + (j + i) * src.width;
+          aux_row.Y[i] = buffers->Yaux + (j + i) * src.width;
         }
+      in_row.rgba      = buffers->in  + ((j + 1) * src.width + 1) * 4;
+      aux_row.rgba     = buffers->aux + ((j + 1) * src.width + 1) * 4;
+      in_row.contrast  = NULL;
+      aux_row.contrast = NULL;
+
+      band->aux_func (&band->grid_params, &aux_row, &aux_planes, cells.width);
+      band->grid_features_func (&band->grid_params, &in_row, &aux_planes, &feature_planes, cells.width);
+
+      color_mapper_grid_cells (&aux_planes, &feature_planes,
+                               buffers->log_ratio + j * cells.width,
+                               buffers->log_Y     + j * cells.width,
+                               cells.width);
+    }
+
+  grid->log_ratio = buffers->log_ratio;
+  grid->log_Y     = buffers->log_Y;
+  grid->width     = cells.width;
+  grid->height    = cells.height;
+  grid->cell      = cell;
+  grid->x         = cells.x * cell;
+  grid->y         = cells.y * cell;
+  grid->range     = &grid_range;
+}
+
+static void
+color_mapper (const ColorMapperBand *band,
+              const GeglRectangle   *dst_rect)
+{
+  GeglBuffer         *input  = band->input;
+  GeglBuffer         *aux    = band->aux;
+  GeglBufferIterator *iter;
+
+  /* in, aux full buffer of the current chunk, including its one pixel border */
+  gfloat *in_buf = NULL, *aux_buf = NULL;
+
+  /* the same in the storage of in and aux, when that is not float */
+  gpointer raw_buf = NULL;
+
+  /* one output row, when output is not float */
+  gfloat *out_row = NULL;
+
+  /* in, aux grayscale, derived from the full buffers */
+  gfloat *Yin_buf = NULL, *Yaux_buf = NULL;
+
+  /* contrast of in and aux of the current chunk, without border */
+  gfloat *contrast_buf = NULL;
+  gint    buf_pixels = 0;
+  gint    y;
+
+  /* pixels read around each chunk */
+  const gint border = band->border;
 
-      for (x = 1; x < row_rect.width - 1; x++)
+  ColorMapperGridBuffers grid_buffers = { 0, };
+  ColorMapperGrid        grid;
+
+  ColorMapperSource      in_row, aux_row;
+  ColorMapperAuxRow      aux_planes;
+  ColorMapperFeatureRow  feature_planes;
+  ImmanuelTraceEvent     event;
+  ImmanuelScratch       *scratch;
+
+  immanuel_trace_begin (&event, band->trace, NULL, NULL, dst_rect, band->level);
+  scratch = immanuel_scratch_begin ();
+
+  /* write straight into the tiles of output */
+  iter = gegl_buffer_iterator_new (band->output, dst_rect, band->level, band->out_format,
+                                   GEGL_ACCESS_WRITE, GEGL_ABYSS_NONE, 1);
+
+  if (band->out_storage != COLOR_MAPPER_STORAGE_FLOAT)
+    out_row = immanuel_scratch_new (scratch, gfloat, dst_rect->width * 4);
+
+  while (gegl_buffer_iterator_next (iter))
+    {
+      const GeglRectangle   *roi = &iter->items[0].roi;
+      gpointer               out = iter->items[0].data;
+      ColorMapperCacheEntry *aux_entry;
+      ColorMapperCacheEntry *feature_entry;
+      GeglRectangle          src_rect;
+      GeglRectangle          tile;
+      gint                   src_pixels;
+      gint                   Y_stride;
+      gint                   n_pixels = roi->width * roi->height;
+
+      /* the iterator wrote back the last tile and mapped this one */
+      immanuel_trace_mark (&event, IMMANUEL_TRACE_STORE);
+
+      /* relevant for output computation is pixel including the direct neigbouring pixels */
+      src_rect.x      = roi->x - border;
+      src_rect.y      = roi->y - border;
+      src_rect.width  = roi->width  + 2 * border;
+      src_rect.height = roi->height + 2 * border;
+      src_pixels      = src_rect.width * src_rect.height;
+
+      /* Y rows are width + 2 wide either way, as ColorMapperSource has them */
+      Y_stride        = roi->width + 2;
+
+      if (src_pixels > buf_pixels)
         {
-          gfloat dx_in, dx_aux;
-          gfloat dy_in, dy_aux;
-          gfloat luminanceblended[3], luminanceblended_colorscaled[3], tinted_gray[3], tinted_gray_aux[3];
-          gfloat chroma_aux[3];
-          gfloat GradientRatio;
-          gfloat ChromaAdoptionFactor, ChromaAdoptionFactor_base, ChromaAdoptionFactor_sat_dz, ChromaAdoptionFactor_global;
-          gint idx = 0;
-          
-          /* contrast of input div by aux */
-          gfloat luminance_ratio;
-          gfloat saturation_clip_negative[3], saturation_clip_positive[3];
-          gfloat saturation_clip_negative_min, saturation_clip_positive_min, saturation_clip;
-          gfloat Chroma_HSY_aux, Saturation_HSY_aux, Saturation_HSY_aux_dz;
-          gfloat GradientYin, GradientYaux;
-          gfloat GradientYin_Yaux, GradientYaux_Yin;
-          gfloat chromafactor_aux2target;
-          
-          /* compute dx, dy and YSum for input and aux buffer */          
-          dx_in  = (mid_ptr_Yin[(x-1)]  - mid_ptr_Yin[(x+1)]);
-          dx_aux = (mid_ptr_Yaux[(x-1)] - mid_ptr_Yaux[(x+1)]);
-          dy_in  = (top_ptr_Yin[x]  - down_ptr_Yin[x]);
-          dy_aux = (top_ptr_Yaux[x] - down_ptr_Yaux[x]);
-          GradientYin  = 0.5 * sqrtf (POW2(dx_in)  + POW2(dy_in));
-          GradientYaux = 0.5 * sqrtf (POW2(dx_aux) + POW2(dy_aux));
-
-          /* computing luminance ratio */                    
-          // luminance_ratio = (fabs(mid_ptr_Yaux[x]) > FLT_MIN) ? (mid_ptr_Yin[x] / mid_ptr_Yaux[x]) : 1000.0;
-          luminance_ratio = mid_ptr_Yin[x] / fmax (FLT_MIN, mid_ptr_Yaux[x]);
-          
-          /* computing gradient ratio */
-          // GradientRatio = (GradientYaux > FLT_MIN) ? (GradientYin / GradientYaux) : 1000.0;
-          GradientRatio = GradientYin / fmax (FLT_MIN, GradientYaux);
-          
-          /* ChromaAdoptionFactor_base (ratio of gradient-scaled luminance vs. luminance_in) */
-          // ChromaAdoptionFactor_base = (mid_ptr_Yin[x]) > FLT_MIN) ? (mid_ptr_Yaux[x] * GradientRatio / mid_ptr_Yin[x]) : 1000.0;
-          // ChromaAdoptionFactor_base = mid_ptr_Yaux[x] * GradientYin / GradientYaux / mid_ptr_Yin[x];
-          
-          GradientYaux_Yin = GradientYaux * mid_ptr_Yin[x];
-          GradientYin_Yaux = GradientYin * mid_ptr_Yaux[x];
-          
-          if (GradientYin_Yaux > GradientYaux_Yin)
+          /* sized for a whole tile, so a band allocates once */
+          buf_pixels = MAX (src_pixels, (MIN (dst_rect->width,  band->tile_width)  + 2) *
+                                        (MIN (dst_rect->height, band->tile_height) + 2));
+
+          /* without aux, aux stays black */
+          in_buf     = immanuel_scratch_new (scratch, gfloat, buf_pixels * 4);
+          aux_buf    = immanuel_scratch_new0 (scratch, gfloat, buf_pixels * 4);
+          raw_buf    = (band->in_storage  != COLOR_MAPPER_STORAGE_FLOAT ||
+                        band->aux_storage != COLOR_MAPPER_STORAGE_FLOAT) ?
+                       immanuel_scratch_new (scratch, guint16, buf_pixels * 4) : NULL;
+          Yin_buf    = immanuel_scratch_new (scratch, gfloat, buf_pixels);
+          Yaux_buf   = immanuel_scratch_new0 (scratch, gfloat, buf_pixels);
+          contrast_buf = band->contrast ? immanuel_scratch_new (scratch, gfloat, buf_pixels * 2) : NULL;
+
+          immanuel_trace_scratch (&event, immanuel_scratch_used (scratch));
+        }
+
+      /* output tile the roi lies in, key of the cached planes */
+      tile.x      = floor_to_multiple (roi->x, band->tile_width);
+      tile.y      = floor_to_multiple (roi->y, band->tile_height);
+      tile.width  = band->tile_width;
+      tile.height = band->tile_height;
+
+      aux_entry     = color_mapper_cache_lookup (band->aux_cache, &tile, roi, band->level);
+      feature_entry = color_mapper_cache_lookup (band->feature_cache, &tile, roi, band->level);
+
+      if (! aux_entry)
+        {
+          gfloat *planes = g_new (gfloat, n_pixels * COLOR_MAPPER_AUX_PLANES);
+
+          if (aux)
             {
-              ChromaAdoptionFactor_base = GradientYaux_Yin / GradientYin_Yaux;
+              read_source (aux, &src_rect, band->scale, band->aux_format,
+                           band->aux_storage, band->trc_lut, raw_buf, aux_buf);
+
+              if (border)
+                color_mapper_luminance (aux_buf, Yaux_buf, src_pixels, band->luminance);
+              else
+                luminance_rows (aux_buf, Yaux_buf, roi->width, roi->height, band->luminance);
             }
-          else if (GradientYaux_Yin > GradientYin_Yaux)
+          immanuel_trace_mark (&event, IMMANUEL_TRACE_FETCH);
+
+          /* everything that only depends on aux */
+          for (y = 0; y < roi->height; y++)
             {
-              ChromaAdoptionFactor_base = GradientYin_Yaux / GradientYaux_Yin;
+              aux_row.Y[0] = Yaux_buf + (y + 0 * border) * Y_stride;
+              aux_row.Y[1] = Yaux_buf + (y + 1 * border) * Y_stride;
+              aux_row.Y[2] = Yaux_buf + (y + 2 * border) * Y_stride;
+              aux_row.rgba = aux_buf  + ((y + border) * src_rect.width + border) * 4;
+              aux_row.contrast = NULL;
+
+              color_mapper_aux_row_init (&aux_planes, planes, n_pixels, roi->width, 0, y);
+              band->aux_func (&band->params, &aux_row, &aux_planes, roi->width);
+
+              /* the tone curve and the grid take no full resolution
+               * gradients, the row above and below are the row itself
+               */
+              if (! border)
+                memset (aux_planes.gradient, 0, roi->width * sizeof (gfloat));
             }
+
+          aux_entry = color_mapper_cache_insert (band->aux_cache, &tile, roi, band->level, planes);
+          immanuel_trace_mark (&event, IMMANUEL_TRACE_COMPUTE);
+        }
+
+      if (! feature_entry)
+        {
+          gfloat *planes = g_new (gfloat, n_pixels * COLOR_MAPPER_FEATURE_PLANES);
+
+          /* read every input pixel once, in the working format */
+          read_source (input, &src_rect, band->scale, band->in_format,
+                       band->in_storage, band->trc_lut, raw_buf, in_buf);
+
+          if (border)
+            color_mapper_luminance (in_buf, Yin_buf, src_pixels, band->luminance);
           else
-            ChromaAdoptionFactor_base = 1.0;
-                    
-          // ChromaAdoptionFactor_base = 1.0 / fmax (FLT_MIN, ChromaAdoptionFactor_base);
-
-          ChromaAdoptionFactor_base = (perceptual == TRUE) ? powf (ChromaAdoptionFactor_base, 1.0 / 2.2) : ChromaAdoptionFactor_base;
-          ChromaAdoptionFactor_base -= 1.0;
-
-          /*
-          if (mid_ptr_Yin[x] > FLT_MIN)
-          {
-            ChromaAdoptionFactor_Lightness = mid_ptr_Yaux[x] * GradientRatio / mid_ptr_Yin[x];
-            ChromaAdoptionFactor_Lightness = (perceptual == TRUE) ? powf (ChromaAdoptionFactor_Lightness, 1.0 / 2.2) : ChromaAdoptionFactor_Lightness;
-          }
-          else
-            ChromaAdoptionFactor_Lightness = 1.0;
-                    
-          if (ChromaAdoptionFactor_Lightness > 1.0)
-            ChromaAdoptionFactor = 1.0 + scale * (ChromaAdoptionFactor_Lightness - 1.0) / (m_scale * powf ((ChromaAdoptionFactor_Lightness - 1.0), p_scale) + 1.0);
-          else if (ChromaAdoptionFactor_Lightness < 1.0)
-            if (ChromaAdoptionFactor_Lightness < FLT_MIN)
-              ChromaAdoptionFactor = 1.0;
-            else
-              ChromaAdoptionFactor = 1.0 / (1.0 + scale * (1.0 / ChromaAdoptionFactor_Lightness - 1.0) / (m_scale * powf ((1.0 / ChromaAdoptionFactor_Lightness - 1.0), p_scale) + 1.0));
-          else
-            ChromaAdoptionFactor = 1.0;
-          */
-                    
-          /* compute R (+0), G (+1), B (+2) */
-          idx = (x-1) * 4;
-
-          /* scale exposure (analogue to luminance layer mode) */
-          luminanceblended[0] = luminance_ratio * row_aux_buf[idx + 0];
-          luminanceblended[1] = luminance_ratio * row_aux_buf[idx + 1];
-          luminanceblended[2] = luminance_ratio * row_aux_buf[idx + 2];
-
-          /* grayscale image under current lighting condiditions */
-          tinted_gray[0] = mid_ptr_Yin[x] * neutral2tinted[0];
-          tinted_gray[1] = mid_ptr_Yin[x] * neutral2tinted[1];
-          tinted_gray[2] = mid_ptr_Yin[x] * neutral2tinted[2];
-
-          /* grayscale image aux under current lighting condiditions */
-          tinted_gray_aux[0] = mid_ptr_Yaux[x] * neutral2tinted[0];
-          tinted_gray_aux[1] = mid_ptr_Yaux[x] * neutral2tinted[1];
-          tinted_gray_aux[2] = mid_ptr_Yaux[x] * neutral2tinted[2];
-
-          chroma_aux[0] = row_aux_buf[idx + 0] - tinted_gray_aux[0];
-          chroma_aux[1] = row_aux_buf[idx + 1] - tinted_gray_aux[1];
-          chroma_aux[2] = row_aux_buf[idx + 2] - tinted_gray_aux[2];
-
-          /* chromaticity equivalent in HSY Color Model of in-buffer - before chroma scaling */
-          Chroma_HSY_aux = sqrtf (POW2(chroma_aux[0]) + POW2(chroma_aux[1]) + POW2(chroma_aux[2]) - (chroma_aux[0] * chroma_aux[1] + chroma_aux[0] * chroma_aux[2] + chroma_aux[1] * chroma_aux[2]));
-
-          /* saturation analogue definition Eva Luebbe */
-          Saturation_HSY_aux = (mid_ptr_Yaux[x] > FLT_MIN) ? (Chroma_HSY_aux / sqrtf (POW2 (mid_ptr_Yaux[x]) + POW2 (Chroma_HSY_aux) )) : 0.0;
-          
-          Saturation_HSY_aux_dz = fmax (Saturation_HSY_aux - saturation_min, 0.0);
-          ChromaAdoptionFactor_sat_dz = (Saturation_HSY_aux > FLT_MIN) ? (Saturation_HSY_aux_dz / Saturation_HSY_aux) : 0.0;
-
-          ChromaAdoptionFactor = 1.0 + scale * ChromaAdoptionFactor_base;
-
-          if (ChromaAdoptionFactor > FLT_MIN)
-            ChromaAdoptionFactor = (GradientYin_Yaux > GradientYaux_Yin) ? (1.0 / ChromaAdoptionFactor) : ChromaAdoptionFactor;
-          else
-            ChromaAdoptionFactor = 1.0;
-
-          ChromaAdoptionFactor_global = ChromaAdoptionFactor * globalSaturation;
-          ChromaAdoptionFactor_global = 1.0 + (ChromaAdoptionFactor_global - 1.0 ) * (saturation_weighting_factor * (Saturation_HSY_aux - 1.0) + 1.0) * ChromaAdoptionFactor_sat_dz;
-
-          /* new algorithm */
-          // luminanceblended_colorscaled[0] = (tinted_gray[0] + GradientRatio * chroma_aux[0]) * scale + luminanceblended[0] * (1.0 - scale);
-          // luminanceblended_colorscaled[1] = (tinted_gray[1] + GradientRatio * chroma_aux[1]) * scale + luminanceblended[1] * (1.0 - scale);
-          // luminanceblended_colorscaled[2] = (tinted_gray[2] + GradientRatio * chroma_aux[2]) * scale + luminanceblended[2] * (1.0 - scale);
-
-          /* new algorithm perceptual*/
-          // luminanceblended_colorscaled[0] = (tinted_gray[0] + luminance_ratio * chroma_aux[0] * ChromaAdoptionFactor) * scale + luminanceblended[0] * (1.0 - scale);
-          // luminanceblended_colorscaled[1] = (tinted_gray[1] + luminance_ratio * chroma_aux[1] * ChromaAdoptionFactor) * scale + luminanceblended[1] * (1.0 - scale);
-          // luminanceblended_colorscaled[2] = (tinted_gray[2] + luminance_ratio * chroma_aux[2] * ChromaAdoptionFactor) * scale + luminanceblended[2] * (1.0 - scale);
-
-          /* new algorithm perceptual - new scaling*/
-          chromafactor_aux2target = luminance_ratio * ChromaAdoptionFactor_global;
-          luminanceblended_colorscaled[0] = tinted_gray[0] + chroma_aux[0] * chromafactor_aux2target;
-          luminanceblended_colorscaled[1] = tinted_gray[1] + chroma_aux[1] * chromafactor_aux2target;
-          luminanceblended_colorscaled[2] = tinted_gray[2] + chroma_aux[2] * chromafactor_aux2target;
-          
-          /* reduce saturation to better fit in rgb-range [0...1] */
-          saturation_clip_negative[0] = tinted_gray[0] / (tinted_gray[0] - fmin ( luminanceblended_colorscaled[0], -0.00001f));
-          saturation_clip_negative[1] = tinted_gray[1] / (tinted_gray[1] - fmin ( luminanceblended_colorscaled[1], -0.00001f));
-          saturation_clip_negative[2] = tinted_gray[2] / (tinted_gray[2] - fmin ( luminanceblended_colorscaled[2], -0.00001f));
-          saturation_clip_negative_min = fmin (saturation_clip_negative[0], fmin (saturation_clip_negative[1], saturation_clip_negative[2]));
-
-          saturation_clip_positive[0] = fmax (luminanceblended_colorscaled[0] - fmax (1.0f, tinted_gray[0]), 0.0f) / (luminanceblended_colorscaled[0] - tinted_gray[0] + 0.00001f);
-          saturation_clip_positive[1] = fmax (luminanceblended_colorscaled[1] - fmax (1.0f, tinted_gray[1]), 0.0f) / (luminanceblended_colorscaled[1] - tinted_gray[1] + 0.00001f);
-          saturation_clip_positive[2] = fmax (luminanceblended_colorscaled[2] - fmax (1.0f, tinted_gray[2]), 0.0f) / (luminanceblended_colorscaled[2] - tinted_gray[2] + 0.00001f);
-          saturation_clip_positive_min = 1.0f - fmax (saturation_clip_positive[0], fmax (saturation_clip_positive[1], saturation_clip_positive[2]));
-          
-          saturation_clip = fmin (saturation_clip_positive_min, saturation_clip_negative_min);
-          
-          if (technology == GEGL_COLORMAPPER_GRADIENT_RATIO)
-          {
-            row_out[idx + 0] = row_out[idx + 1] = row_out[idx + 2] = GradientRatio;
-          }
-          else if (technology == GEGL_COLORMAPPER_CHROMATICITY)
-          {
-            row_out[idx + 0] = row_out[idx + 1] = row_out[idx + 2] = Chroma_HSY_aux;
-          }
-          else if (technology == GEGL_COLORMAPPER_CHROMA_ADOPTION_FACTOR_BASE)
-          {
-            row_out[idx + 0] = row_out[idx + 1] = row_out[idx + 2] = ChromaAdoptionFactor_base;
-          }
-          else if (technology == GEGL_COLORMAPPER_CHROMA_ADOPTION_FACTOR)
-          {
-            row_out[idx + 0] = row_out[idx + 1] = row_out[idx + 2] = ChromaAdoptionFactor;
-          }
-          else if (technology == GEGL_COLORMAPPER_SATURATION)
-          {
-            row_out[idx + 0] = row_out[idx + 1] = row_out[idx + 2] = Saturation_HSY_aux;
-          }
-          else if (technology == GEGL_COLORMAPPER_YGRAD_AUX)
-          {
-            row_out[idx + 0] = row_out[idx + 1] = row_out[idx + 2] = GradientYaux;
-          }
-          else if (technology == GEGL_COLORMAPPER_DEFAULT_RGB_UNLIMITED)
-          {
-            row_out[idx + 0] = luminanceblended_colorscaled[0];
-            row_out[idx + 1] = luminanceblended_colorscaled[1];
-            row_out[idx + 2] = luminanceblended_colorscaled[2];
-          }
-          else
-          {
-            row_out[idx + 0] = (luminanceblended_colorscaled[0] - tinted_gray[0]) * saturation_clip + tinted_gray[0];
-            row_out[idx + 1] = (luminanceblended_colorscaled[1] - tinted_gray[1]) * saturation_clip + tinted_gray[1];
-            row_out[idx + 2] = (luminanceblended_colorscaled[2] - tinted_gray[2]) * saturation_clip + tinted_gray[2];
-          }
-
-          /* keep alpha from in */
-          row_out[idx + 3] = row_in_buf[idx + 3];
+            luminance_rows (in_buf, Yin_buf, roi->width, roi->height, band->luminance);
+
+          if (band->contrast)
+            gegl_buffer_get (band->contrast, roi, band->scale,
+                             babl_format_n (babl_type ("float"), 2), contrast_buf,
+                             GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
+          immanuel_trace_mark (&event, IMMANUEL_TRACE_FETCH);
+
+          if (band->grid_cell > 1)
+            compute_grid (band, roi, scratch, &event, &grid_buffers, &grid);
+
+          /* compute contrast ratio between both input and aux */
+          for (y = 0; y < roi->height; y++)
+            {
+              in_row.Y[0] = Yin_buf + (y + 0 * border) * Y_stride;
+              in_row.Y[1] = Yin_buf + (y + 1 * border) * Y_stride;
+              in_row.Y[2] = Yin_buf + (y + 2 * border) * Y_stride;
+              in_row.rgba = in_buf  + ((y + border) * src_rect.width + border) * 4;
+              in_row.contrast = contrast_buf ? contrast_buf + y * roi->width * 2 : NULL;
+
+              color_mapper_aux_row_init (&aux_planes, aux_entry->planes,
+                                         aux_entry->rect.width * aux_entry->rect.height,
+                                         aux_entry->rect.width,
+                                         roi->x - aux_entry->rect.x,
+                                         roi->y - aux_entry->rect.y + y);
+              color_mapper_feature_row_init (&feature_planes, planes, n_pixels, roi->width, 0, y);
+
+              if (band->grid_cell > 1)
+                band->grid_func (&band->params, &grid, &in_row, &aux_planes, &feature_planes,
+                                 roi->x, roi->y + y, roi->width);
+              else
+                band->features_func (&band->params, &in_row, &aux_planes, &feature_planes, roi->width);
+            }
+
+          feature_entry = color_mapper_cache_insert (band->feature_cache, &tile, roi, band->level, planes);
+          immanuel_trace_mark (&event, IMMANUEL_TRACE_COMPUTE);
         }
 
-      gegl_buffer_set (output, &out_rect, level, format, row_out,
-                       GEGL_AUTO_ROWSTRIDE);
+      /* the sliders only enter here */
+      for (y = 0; y < roi->height; y++)
+        {
+          color_mapper_aux_row_init (&aux_planes, aux_entry->planes,
+                                     aux_entry->rect.width * aux_entry->rect.height,
+                                     aux_entry->rect.width,
+                                     roi->x - aux_entry->rect.x,
+                                     roi->y - aux_entry->rect.y + y);
+          color_mapper_feature_row_init (&feature_planes, feature_entry->planes,
+                                         feature_entry->rect.width * feature_entry->rect.height,
+                                         feature_entry->rect.width,
+                                         roi->x - feature_entry->rect.x,
+                                         roi->y - feature_entry->rect.y + y);
+
+          if (out_row)
+            {
+              guint16 *out16 = out;
 
-      tmp_ptr_Yin = top_ptr_Yin;
-      top_ptr_Yin = mid_ptr_Yin;
-      mid_ptr_Yin = down_ptr_Yin;
-      down_ptr_Yin = tmp_ptr_Yin;
+              band->combine_func (&band->params, &feature_planes, &aux_planes, out_row, roi->width);
+              immanuel_trace_mark (&event, IMMANUEL_TRACE_COMPUTE);
+              color_mapper_store (band->out_storage, out_row, out16 + y * roi->width * 4, roi->width);
+              immanuel_trace_mark (&event, IMMANUEL_TRACE_STORE);
+            }
+          else
+            {
+              gfloat *out32 = out;
+
+              band->combine_func (&band->params, &feature_planes, &aux_planes, out32 + y * roi->width * 4, roi->width);
+            }
+        }
 
-      tmp_ptr_Yaux = top_ptr_Yaux;
-      top_ptr_Yaux = mid_ptr_Yaux;
-      mid_ptr_Yaux = down_ptr_Yaux;
-      down_ptr_Yaux = tmp_ptr_Yaux;
+      color_mapper_cache_release (band->aux_cache, aux_entry);
+      color_mapper_cache_release (band->feature_cache, feature_entry);
+      immanuel_trace_mark (&event, IMMANUEL_TRACE_COMPUTE);
     }
 
-  g_free (row1_in);
-  g_free (row2_in);
-  g_free (row3_in);
-  g_free (row1_aux);
-  g_free (row2_aux);
-  g_free (row3_aux);
-  g_free (row_out);
-  g_free (row_in_buf);
-  g_free (row_aux_buf);
+  immanuel_trace_mark (&event, IMMANUEL_TRACE_STORE);
 
-  return TRUE;
+  immanuel_scratch_end (scratch);
+  immanuel_trace_end (&event);
+}
+
+/* one band of whole tile rows of the region, processed by one thread; the
+ * cache holds the planes of a tile, a band ending inside a tile would
+ * store part of it and the band below would miss or evict that entry
+ */
+static void
+process_band (gsize    offset,
+              gsize    size,
+              gpointer user_data)
+{
+  ColorMapperBand *band = user_data;
+  GeglRectangle    rows, band_rect;
+
+  rows.x      = band->region.x;
+  rows.y      = floor_to_multiple (band->region.y, band->tile_height) + (gint) offset * band->tile_height;
+  rows.width  = band->region.width;
+  rows.height = (gint) size * band->tile_height;
+
+  gegl_rectangle_intersect (&band_rect, &rows, &band->region);
+
+  color_mapper (band, &band_rect);
 }
 
 static gboolean
 process (GeglOperation       *operation,
          GeglBuffer          *input,
          GeglBuffer          *aux,
+         GeglBuffer          *aux2,
          GeglBuffer          *output,
          const GeglRectangle *result,
          gint                 level)
 {
-  GeglProperties *o = GEGL_PROPERTIES (operation);
-  gboolean        success;
-  GeglRectangle   compute;
-
-  compute = get_required_for_output (operation, "input", result);
-
-  success = color_mapper (input, &compute,
-                          aux,
-                          output, result,
-                          o->technology, o->perceptual,
-                          o->scale, o->saturation_min, o->saturation_weighting_factor, o->WhiteRepresentation, o->globalSaturation,
-                          level);
-  return success;
+  GeglProperties        *o           = GEGL_PROPERTIES (operation);
+  const Babl            *space       = gegl_buffer_get_format (output);
+  const Babl            *gray_format = babl_format_with_space ("Y float", space);
+  ColorMapperBand        band        = { input, aux, aux2, output, level, };
+  ColorMapperCaches     *caches      = o->user_data;
+  ColorMapperCacheStamp  stamp       = { NULL, };
+  GBytes                *trc_lut     = NULL;
+  GBytes                *tone_curve  = NULL;
+  guint                  tone_curve_serial = 0;
+  gint                   first_row, n_rows;
+  gsize                  row_pixels;
+  ImmanuelTraceEvent     trace;
+
+  gfloat  NeutralRepresentation[4], NeutralRepresentationDesaturated[1], tinted2neutral[3], neutral2tinted[3];
+
+  band.format = babl_format_with_space ("RGBA float", space);
+
+  band.in_format  = storage_format (gegl_operation_get_format (operation, "input"),
+                                    space, &band.in_storage);
+  band.aux_format = storage_format (gegl_operation_get_format (operation, "aux"),
+                                    space, &band.aux_storage);
+  band.out_format = storage_format (gegl_operation_get_format (operation, "output"),
+                                    space, &band.out_storage);
+
+  /* the tables of this render, prepare () may replace them meanwhile */
+  if (caches)
+    {
+      g_mutex_lock (&caches->lock);
+      trc_lut           = caches->trc_lut    ? g_bytes_ref (caches->trc_lut)    : NULL;
+      tone_curve        = caches->tone_curve ? g_bytes_ref (caches->tone_curve) : NULL;
+      tone_curve_serial = caches->tone_curve_serial;
+      g_mutex_unlock (&caches->lock);
+    }
+
+  band.trc_lut = trc_lut ? g_bytes_get_data (trc_lut, NULL) : NULL;
+
+  /* with a tone curve or a grid the contrast of aux2 is not read */
+  band.params.tone_curve = tone_curve ? g_bytes_get_data (tone_curve, NULL) : NULL;
+  band.grid_cell         = grid_cell_size (operation);
+  if (band.params.tone_curve || band.grid_cell > 1)
+    band.contrast = NULL;
+
+  /* the debug output of the aux gradient computes it in every mode */
+  band.border = band.params.tone_curve || band.grid_cell > 1 ? 0 : 1;
+  if (o->technology == GEGL_COLORMAPPER_YGRAD_AUX)
+    band.border = 1;
+
+  /* rectangles are at level, read the sources from their mipmap of it */
+  band.scale  = 1.0 / (1 << level);
+
+  gegl_color_get_pixel (o->WhiteRepresentation, band.format, &NeutralRepresentation);
+  gegl_color_get_pixel (o->WhiteRepresentation, gray_format, &NeutralRepresentationDesaturated);
+
+  /* CIE Y weights of the rgb primaries, same as babl uses for "Y float" */
+  babl_space_get_rgb_luminance (babl_format_get_space (band.format),
+                                &band.luminance[0], &band.luminance[1], &band.luminance[2]);
+
+  /* factor to tranform a tinted image to an neutral one */
+  tinted2neutral[0] = NeutralRepresentationDesaturated[0] / NeutralRepresentation[0];
+  tinted2neutral[1] = NeutralRepresentationDesaturated[0] / NeutralRepresentation[1];
+  tinted2neutral[2] = NeutralRepresentationDesaturated[0] / NeutralRepresentation[2];
+  neutral2tinted[0] = 1.0 / tinted2neutral[0];
+  neutral2tinted[1] = 1.0 / tinted2neutral[1];
+  neutral2tinted[2] = 1.0 / tinted2neutral[2];
+
+  band.params.technology                  = o->technology;
+  band.params.perceptual                  = o->perceptual;
+  band.params.fast_math                   = o->fast_math;
+  band.params.contrast_source             = band.contrast != NULL;
+  band.params.scale                       = o->scale;
+  band.params.saturation_min              = o->saturation_min;
+  band.params.saturation_weighting_factor = o->saturation_weighting_factor;
+  band.params.globalSaturation            = o->globalSaturation;
+  band.params.gradient_scale              = band.scale;
+  band.params.neutral2tinted[0]           = neutral2tinted[0];
+  band.params.neutral2tinted[1]           = neutral2tinted[1];
+  band.params.neutral2tinted[2]           = neutral2tinted[2];
+
+  /* pick the scalar or SIMD variant of every stage once for the whole region */
+  band.aux_func      = color_mapper_kernel_get_aux (&band.params);
+  band.features_func = color_mapper_kernel_get_features (&band.params);
+  band.combine_func  = color_mapper_kernel_get_combine (&band.params);
+
+  /* the cells keep the ratio of the gradients linear for upsampling */
+  band.grid_params                 = band.params;
+  band.grid_params.perceptual      = 0;
+  band.grid_params.contrast_source = 0;
+  band.grid_params.tone_curve      = NULL;
+  band.grid_features_func          = color_mapper_kernel_get_features (&band.grid_params);
+  band.grid_func                   = color_mapper_kernel_get_grid_features (&band.params);
+
+  if (immanuel_trace_enabled ())
+    {
+      GEnumClass *technologies = g_type_class_ref (gegl_colormapper_technology_get_type ());
+      GEnumValue *technology   = g_enum_get_value (technologies, o->technology);
+      gchar      *mode;
+
+      mode = g_strdup_printf ("%s %s%s%s%s", technology ? technology->value_nick : "",
+                              color_mapper_kernel_isa (),
+                              o->fast_math ? " fast" : "",
+                              band.params.tone_curve ? " tone-curve" :
+                              band.contrast          ? " contrast"   : "",
+                              band.grid_cell > 1 ? " grid" : "");
+      immanuel_trace_begin (&trace, NULL, "immanuel:color-mapper", mode, result, level);
+
+      g_free (mode);
+      g_type_class_unref (technologies);
+    }
+  else
+    {
+      immanuel_trace_begin (&trace, NULL, NULL, NULL, result, level);
+    }
+  band.trace = &trace;
+
+  g_object_get (output,
+                "tile-width",  &band.tile_width,
+                "tile-height", &band.tile_height,
+                NULL);
+
+  /* without aux there is nothing worth keeping */
+  if (aux && caches)
+    {
+      stamp.aux_source        = gegl_operation_get_source_node (operation, "aux");
+      stamp.format            = band.format;
+      stamp.neutral2tinted[0] = neutral2tinted[0];
+      stamp.neutral2tinted[1] = neutral2tinted[1];
+      stamp.neutral2tinted[2] = neutral2tinted[2];
+      stamp.fast_math         = o->fast_math;
+      stamp.tone_curve        = tone_curve ? tone_curve_serial : 0;
+      stamp.grid_cell         = band.grid_cell;
+      stamp.border            = band.border;
+
+      color_mapper_cache_validate (caches->aux, &stamp);
+      band.aux_cache = caches->aux;
+
+      /* the features depend on input, the contrast source and perceptual
+       * as well, but on none of the sliders
+       */
+      stamp.input_source    = gegl_operation_get_source_node (operation, "input");
+      stamp.contrast_source = band.contrast ? gegl_operation_get_source_node (operation, "aux2") : NULL;
+      stamp.perceptual      = o->perceptual;
+
+      color_mapper_cache_validate (caches->features, &stamp);
+      band.feature_cache = caches->features;
+    }
+
+  /* split into bands of tile rows, each one with its own chunk buffers */
+  band.region = *result;
+  first_row   = floor_to_multiple (result->y, band.tile_height);
+  n_rows      = (result->y + result->height - first_row + band.tile_height - 1) / band.tile_height;
+  row_pixels  = (gsize) result->width * band.tile_height;
+
+  gegl_parallel_distribute_range (n_rows,
+                                  MAX ((gsize) (gegl_operation_get_pixels_per_thread (operation) / row_pixels), 1),
+                                  process_band, &band);
+
+  immanuel_trace_end (&trace);
+
+  if (trc_lut)
+    g_bytes_unref (trc_lut);
+  if (tone_curve)
+    g_bytes_unref (tone_curve);
+
+  return TRUE;
+}
+
+static void
+finalize (GObject *object)
+{
+  GeglProperties    *o      = GEGL_PROPERTIES (object);
+  ColorMapperCaches *caches = o->user_data;
+
+  if (caches)
+    {
+      color_mapper_cache_free (caches->aux);
+      color_mapper_cache_free (caches->features);
+      if (caches->trc_lut)
+        g_bytes_unref (caches->trc_lut);
+      if (caches->tone_curve)
+        g_bytes_unref (caches->tone_curve);
+      g_free (caches->tone_curve_text);
+      g_mutex_clear (&caches->lock);
+      g_free (caches);
+      o->user_data = NULL;
+    }
+
+  G_OBJECT_CLASS (gegl_op_parent_class)->finalize (object);
 }
 
 static void
 gegl_op_class_init (GeglOpClass *klass)
 {
   GeglOperationClass              *operation_class;
-  GeglOperationComposerClass      *composer_class;
+  GeglOperationComposer3Class     *composer_class;
 
   operation_class = GEGL_OPERATION_CLASS (klass);
-  composer_class  = GEGL_OPERATION_COMPOSER_CLASS (klass);
-  
+  composer_class  = GEGL_OPERATION_COMPOSER3_CLASS (klass);
+
+  G_OBJECT_CLASS (klass)->finalize = finalize;
+
   operation_class->prepare                   = prepare;
   operation_class->get_required_for_output   = get_required_for_output;
   operation_class->get_invalidated_by_change = get_invalidated_by_change;
   operation_class->get_bounding_box          = get_bounding_box;
   operation_class->opencl_support            = FALSE;
+  operation_class->threaded                  = TRUE;
+
+  color_mapper_kernel_init ();
+  color_mapper_grid_range_init (&grid_range);
 
   composer_class->process           = process;
   composer_class->aux_label         = _("original colored image");
   composer_class->aux_description   = _("holds the original image with "
                                         "source colors.");
+  composer_class->aux2_label        = _("contrast");
+  composer_class->aux2_description  = _("optional relative contrast of input "
+                                        "and aux, 2 components, e.g. from "
+                                        "immanuel:contrast-pyramid; replaces "
+                                        "the gradients of neighbouring pixels");
 
 
   gegl_operation_class_set_keys (operation_class,
     "name",        "immanuel:color-mapper",
     "title",       _("Color Mapper"),
     "categories",  "photo",
-//    "reference-hash", "6cd95bf706d744b31b475b3500941f3c",
-//    "reference-hashB", "3bc1f4413a06969bf86606d621969651",
     "description", _("Do color remapping appropriate suitable to luminance remapping operations"
                      "(includes chroma adoption do avoid (de)saturation effect)"),
     NULL);
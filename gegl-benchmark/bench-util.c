@@ -0,0 +1,154 @@
+/* Helpers shared by the benchmarks of the immanuel:* GEGL operations
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "bench-util.h"
+
+static const gchar *content_names[BENCH_N_CONTENTS] =
+{
+  "ramps",
+  "flat",
+  "noisy",
+  "high-gradient"
+};
+
+const gchar *
+bench_content_name (BenchContent content)
+{
+  return content < BENCH_N_CONTENTS ? content_names[content] : "unknown";
+}
+
+BenchContent
+bench_content_parse (const gchar *name)
+{
+  BenchContent content;
+
+  for (content = 0; content < BENCH_N_CONTENTS; content++)
+    if (! strcmp (name, content_names[content]))
+      break;
+
+  return content;
+}
+
+void
+bench_fill (GeglBuffer   *buffer,
+            BenchContent  content,
+            gint          seed)
+{
+  const GeglRectangle *extent = gegl_buffer_get_extent (buffer);
+  GeglBufferIterator  *iter;
+  GRand               *rand = g_rand_new_with_seed (seed);
+
+  /* a different tint and stripe phase per seed, so input and aux differ */
+  const gfloat tint  = 0.1f * (seed % 5);
+  const gfloat phase = 0.7f * seed;
+
+  iter = gegl_buffer_iterator_new (buffer, extent, 0, babl_format ("RGBA float"),
+                                   GEGL_ACCESS_WRITE, GEGL_ABYSS_NONE, 1);
+
+  while (gegl_buffer_iterator_next (iter))
+    {
+      const GeglRectangle *roi = &iter->items[0].roi;
+      gfloat              *pixel = iter->items[0].data;
+      gint                 x, y;
+
+      for (y = roi->y; y < roi->y + roi->height; y++)
+        for (x = roi->x; x < roi->x + roi->width; x++)
+          {
+            gfloat u = (gfloat) x / extent->width;
+            gfloat v = (gfloat) y / extent->height;
+            gfloat noise;
+            gfloat stripes;
+
+            switch (content)
+              {
+              case BENCH_CONTENT_FLAT:
+                pixel[0] = 0.4f + tint;
+                pixel[1] = 0.3f;
+                pixel[2] = 0.2f + 0.5f * tint;
+                break;
+
+              case BENCH_CONTENT_NOISY:
+                pixel[0] = g_rand_double_range (rand, 0.0, 1.0);
+                pixel[1] = g_rand_double_range (rand, 0.0, 1.0);
+                pixel[2] = g_rand_double_range (rand, 0.0, 1.0);
+                break;
+
+              case BENCH_CONTENT_HIGH_GRADIENT:
+                /* stripes of about 6 pixels across both axes */
+                stripes = 0.5f + 0.5f * sinf (x * 1.05f + y * 0.45f + phase);
+
+                pixel[0] = CLAMP (stripes * (0.8f + tint), 0.0, 1.0);
+                pixel[1] = CLAMP (stripes * 0.6f + 0.1f * u, 0.0, 1.0);
+                pixel[2] = CLAMP ((1.0f - stripes) * 0.7f + 0.1f * v, 0.0, 1.0);
+                break;
+
+              case BENCH_CONTENT_RAMPS:
+              default:
+                noise = g_rand_double_range (rand, -0.02, 0.02);
+
+                pixel[0] = CLAMP (u + noise, 0.0, 1.0);
+                pixel[1] = CLAMP (v + noise, 0.0, 1.0);
+                pixel[2] = CLAMP (0.5 + 0.5 * sinf (10.0 * (u + v) + phase) + noise, 0.0, 1.0);
+                break;
+              }
+
+            pixel[3] = 1.0;
+            pixel += 4;
+          }
+    }
+
+  g_rand_free (rand);
+}
+
+gdouble
+bench_render (const gchar *op_name,
+              GeglBuffer  *input,
+              GeglBuffer  *aux,
+              GeglBuffer  *output,
+              const gchar *first_property,
+              ...)
+{
+  GeglNode *graph, *in_src, *aux_src, *op, *sink;
+  gint64    start;
+  va_list   args;
+
+  graph   = gegl_node_new ();
+  in_src  = gegl_node_new_child (graph, "operation", "gegl:buffer-source", "buffer", input, NULL);
+  aux_src = gegl_node_new_child (graph, "operation", "gegl:buffer-source", "buffer", aux, NULL);
+  op      = gegl_node_new_child (graph, "operation", op_name, NULL);
+  sink    = gegl_node_new_child (graph, "operation", "gegl:write-buffer", "buffer", output, NULL);
+
+  va_start (args, first_property);
+  gegl_node_set_valist (op, first_property, args);
+  va_end (args);
+
+  gegl_node_link_many (in_src, op, sink, NULL);
+  if (gegl_node_has_pad (op, "aux"))
+    gegl_node_connect_to (aux_src, "output", op, "aux");
+
+  start = g_get_monotonic_time ();
+  gegl_node_process (sink);
+  start = g_get_monotonic_time () - start;
+
+  g_object_unref (graph);
+
+  return start / 1000000.0;
+}
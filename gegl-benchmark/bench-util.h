@@ -0,0 +1,55 @@
+/* Helpers shared by the benchmarks of the immanuel:* GEGL operations
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+#ifndef __BENCH_UTIL_H__
+#define __BENCH_UTIL_H__
+
+#include <gegl.h>
+
+typedef enum
+{
+  BENCH_CONTENT_RAMPS,          /* smooth color ramps plus some noise */
+  BENCH_CONTENT_FLAT,           /* one color */
+  BENCH_CONTENT_NOISY,          /* strong per pixel noise */
+  BENCH_CONTENT_HIGH_GRADIENT,  /* fine stripes, an edge every few pixels */
+  BENCH_N_CONTENTS
+} BenchContent;
+
+const gchar *bench_content_name  (BenchContent  content);
+
+/* BENCH_N_CONTENTS for an unknown name */
+BenchContent bench_content_parse (const gchar  *name);
+
+/* fills the extent of buffer, seed tells input and aux apart */
+void         bench_fill          (GeglBuffer   *buffer,
+                                  BenchContent  content,
+                                  gint          seed);
+
+/* wall time in seconds of one render of op_name from input (and aux when
+ * the operation has an aux pad) into output; the graph is built fresh so
+ * nothing comes from a node cache.  The NULL terminated property list is
+ * set on the operation node.
+ */
+gdouble      bench_render        (const gchar  *op_name,
+                                  GeglBuffer   *input,
+                                  GeglBuffer   *aux,
+                                  GeglBuffer   *output,
+                                  const gchar  *first_property,
+                                  ...) G_GNUC_NULL_TERMINATED;
+
+#endif
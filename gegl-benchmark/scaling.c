@@ -0,0 +1,108 @@
+/* Thread scaling benchmark for the immanuel:* GEGL operations
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* renders one operation on a synthetic input / aux pair with 1 ... N GEGL
+  * threads and prints the throughput per thread count
+  *
+  *   scaling [--plugins DIR]... [--op NAME] [--size WxH] [--threads N] [--runs N]
+  */
+
+#include <gegl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench-util.h"
+
+int
+main (int    argc,
+      char **argv)
+{
+  const gchar   *op_name     = "immanuel:color-mapper";
+  gint           width       = 4000;
+  gint           height      = 3000;
+  gint           max_threads = g_get_num_processors ();
+  gint           runs        = 3;
+  GeglRectangle  extent;
+  GeglBuffer    *input, *aux, *output;
+  gdouble        base = 0.0;
+  gint           i, threads;
+
+  gegl_init (&argc, &argv);
+
+  for (i = 1; i < argc; i++)
+    {
+      if (! strcmp (argv[i], "--plugins") && i + 1 < argc)
+        gegl_load_module_directory (argv[++i]);
+      else if (! strcmp (argv[i], "--op") && i + 1 < argc)
+        op_name = argv[++i];
+      else if (! strcmp (argv[i], "--size") && i + 1 < argc)
+        sscanf (argv[++i], "%dx%d", &width, &height);
+      else if (! strcmp (argv[i], "--threads") && i + 1 < argc)
+        max_threads = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "--runs") && i + 1 < argc)
+        runs = atoi (argv[++i]);
+      else
+        {
+          g_printerr ("usage: %s [--plugins DIR]... [--op NAME] [--size WxH] [--threads N] [--runs N]\n", argv[0]);
+          return 1;
+        }
+    }
+
+  if (! gegl_has_operation (op_name))
+    {
+      g_printerr ("operation %s not found, pass its build directory with --plugins\n", op_name);
+      return 1;
+    }
+
+  extent = (GeglRectangle) { 0, 0, width, height };
+  input  = gegl_buffer_new (&extent, babl_format ("RGBA float"));
+  aux    = gegl_buffer_new (&extent, babl_format ("RGBA float"));
+  output = gegl_buffer_new (&extent, babl_format ("RGBA float"));
+
+  bench_fill (input, BENCH_CONTENT_RAMPS, 1);
+  bench_fill (aux, BENCH_CONTENT_RAMPS, 2);
+
+  printf ("# %s %dx%d, best of %d runs\n", op_name, width, height, runs);
+  printf ("# threads  seconds  Mpix/s  speedup\n");
+
+  for (threads = 1; threads <= max_threads; threads++)
+    {
+      gdouble best = G_MAXDOUBLE;
+      gint    run;
+
+      g_object_set (gegl_config (), "threads", threads, NULL);
+
+      for (run = 0; run < runs; run++)
+        best = MIN (best, bench_render (op_name, input, aux, output, NULL));
+
+      if (threads == 1)
+        base = best;
+
+      printf ("%9d  %7.3f  %6.1f  %7.2f\n",
+              threads, best, width * (gdouble) height / best / 1e6, base / best);
+    }
+
+  g_object_unref (input);
+  g_object_unref (aux);
+  g_object_unref (output);
+
+  gegl_exit ();
+
+  return 0;
+}
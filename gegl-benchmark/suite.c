@@ -0,0 +1,434 @@
+/* End-to-end benchmark suite for the immanuel:* GEGL operations
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* renders every operation on synthetic input / aux pairs of several sizes
+  * and contents, sweeping GEGL thread count, tile size and, for operations
+  * with a technology property, every technology; one JSON object per line:
+  *
+  *   {"type": "machine", ...}   once, what the numbers were measured on
+  *   {"type": "result", ...}    one per measurement
+  *
+  *   suite [--plugins DIR]... [--op NAME]... [--sizes LIST] [--contents LIST]
+  *         [--threads LIST] [--tile-sizes LIST] [--sweeps LIST]
+  *         [--format NAME] [--runs N] [--output FILE]
+  *
+  * Sweeps are taken one axis at a time, the other axes stay at their
+  * default: threads at the default tile size, tile sizes and technologies
+  * at the highest thread count.
+  */
+
+#include <gegl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+
+#include "bench-util.h"
+
+typedef struct
+{
+  const gchar *name;
+  gint         width;
+  gint         height;
+} BenchSize;
+
+static const BenchSize known_sizes[] =
+{
+  { "4k",    3840,  2160 },
+  { "24mp",  6000,  4000 },
+  { "100mp", 12240, 8160 },
+};
+
+static const gchar *default_ops[] =
+{
+  "immanuel:color-mapper",
+  "immanuel:exposure_map",
+  "immanuel:image-gradient-rel",
+  "immanuel:image-density",
+  "immanuel:contrast-pyramid",
+  "immanuel:gamut-desaturate",
+  "immanuel:hsy-saturation",
+  NULL
+};
+
+typedef struct
+{
+  FILE            *out;
+  gint             runs;
+  const gchar     *op_name;
+  const BenchSize *size;
+  BenchContent     content;
+  const Babl      *format;   /* of input, aux and output */
+} BenchRun;
+
+static gint
+compare_double (gconstpointer a,
+                gconstpointer b)
+{
+  const gdouble *da = a;
+  const gdouble *db = b;
+
+  return (*da > *db) - (*da < *db);
+}
+
+/* comma separated integers, NULL on a parse error */
+static GArray *
+parse_int_list (const gchar *list)
+{
+  GArray  *array = g_array_new (FALSE, FALSE, sizeof (gint));
+  gchar  **items = g_strsplit (list, ",", -1);
+  gint     i;
+
+  for (i = 0; items[i]; i++)
+    {
+      gchar *end;
+      gint   value = strtol (items[i], &end, 10);
+
+      if (*end || value <= 0)
+        {
+          g_array_free (array, TRUE);
+          array = NULL;
+          break;
+        }
+
+      g_array_append_val (array, value);
+    }
+
+  g_strfreev (items);
+
+  return array;
+}
+
+static gboolean
+parse_size (const gchar *name,
+            BenchSize   *size)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (known_sizes); i++)
+    if (! g_ascii_strcasecmp (name, known_sizes[i].name))
+      {
+        *size = known_sizes[i];
+        return TRUE;
+      }
+
+  size->name = name;
+  return sscanf (name, "%dx%d", &size->width, &size->height) == 2 &&
+         size->width > 0 && size->height > 0;
+}
+
+static void
+print_machine (FILE *out)
+{
+  struct utsname  host;
+  gint            major, minor, micro;
+  GDateTime      *now = g_date_time_new_now_utc ();
+  gchar          *date = g_date_time_format (now, "%Y-%m-%dT%H:%M:%SZ");
+
+  uname (&host);
+  gegl_get_version (&major, &minor, &micro);
+
+  fprintf (out,
+           "{\"type\": \"machine\", \"arch\": \"%s\", \"system\": \"%s %s\", "
+           "\"cpus\": %d, \"gegl\": \"%d.%d.%d\", \"date\": \"%s\"}\n",
+           host.machine, host.sysname, host.release,
+           g_get_num_processors (), major, minor, micro, date);
+
+  g_free (date);
+  g_date_time_unref (now);
+}
+
+/* renders runs times and prints one result line */
+static void
+measure (const BenchRun *run,
+         const gchar    *sweep,
+         gint            threads,
+         gint            tile_size,
+         const gchar    *technology,
+         gint            technology_value,
+         GeglBuffer     *input,
+         GeglBuffer     *aux,
+         GeglBuffer     *output)
+{
+  gdouble *seconds = g_new (gdouble, run->runs);
+  gdouble  pixels  = (gdouble) run->size->width * run->size->height;
+  gint     i;
+
+  g_object_set (gegl_config (), "threads", threads, NULL);
+
+  for (i = 0; i < run->runs; i++)
+    {
+      if (technology)
+        seconds[i] = bench_render (run->op_name, input, aux, output,
+                                   "technology", technology_value, NULL);
+      else
+        seconds[i] = bench_render (run->op_name, input, aux, output, NULL);
+    }
+
+  qsort (seconds, run->runs, sizeof (gdouble), compare_double);
+
+  fprintf (run->out,
+           "{\"type\": \"result\", \"op\": \"%s\", \"size\": \"%s\", "
+           "\"width\": %d, \"height\": %d, \"content\": \"%s\", \"format\": \"%s\", "
+           "\"sweep\": \"%s\", \"threads\": %d, \"tile\": %d, "
+           "\"technology\": \"%s\", \"runs\": %d, "
+           "\"best_s\": %.6f, \"median_s\": %.6f, \"mpix_s\": %.3f}\n",
+           run->op_name, run->size->name,
+           run->size->width, run->size->height,
+           bench_content_name (run->content), babl_get_name (run->format),
+           sweep, threads, tile_size,
+           technology ? technology : "", run->runs,
+           seconds[0], seconds[run->runs / 2], pixels / seconds[0] / 1e6);
+  fflush (run->out);
+
+  g_free (seconds);
+}
+
+/* input, aux and output with tiles of tile_size, filled for run */
+static void
+make_buffers (const BenchRun  *run,
+              gint             tile_size,
+              GeglBuffer     **input,
+              GeglBuffer     **aux,
+              GeglBuffer     **output)
+{
+  GeglRectangle extent = { 0, 0, run->size->width, run->size->height };
+
+  g_object_set (gegl_config (),
+                "tile-width",  tile_size,
+                "tile-height", tile_size,
+                NULL);
+
+  *input  = gegl_buffer_new (&extent, run->format);
+  *aux    = gegl_buffer_new (&extent, run->format);
+  *output = gegl_buffer_new (&extent, run->format);
+
+  bench_fill (*input, run->content, 1);
+  bench_fill (*aux, run->content, 2);
+}
+
+static void
+free_buffers (GeglBuffer *input,
+              GeglBuffer *aux,
+              GeglBuffer *output)
+{
+  g_object_unref (input);
+  g_object_unref (aux);
+  g_object_unref (output);
+}
+
+static void
+usage (const gchar *program)
+{
+  g_printerr ("usage: %s [--plugins DIR]... [--op NAME]... [--sizes 4k,24mp,100mp,WxH]\n"
+              "       [--contents flat,noisy,high-gradient,ramps] [--threads 1,2,4]\n"
+              "       [--tile-sizes 128,256,512] [--sweeps threads,tiles,technology]\n"
+              "       [--format \"RGBA float\"] [--runs N] [--output FILE]\n", program);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  GPtrArray   *ops         = g_ptr_array_new ();
+  const gchar *sizes       = "4k,24mp,100mp";
+  const gchar *contents    = "flat,noisy,high-gradient";
+  const gchar *threads_arg = NULL;
+  const gchar *tiles_arg   = "128,256,512";
+  const gchar *sweeps      = "threads,tiles,technology";
+  const gchar *output_path = NULL;
+  const gchar *format_name = "RGBA float";
+  gint         runs        = 3;
+  gint         default_tile;
+  gint         max_threads;
+  GArray      *thread_counts;
+  GArray      *tile_sizes;
+  gchar      **size_names;
+  gchar      **content_names;
+  BenchRun     run;
+  gint         i, s, c;
+  guint        o;
+
+  gegl_init (&argc, &argv);
+
+  for (i = 1; i < argc; i++)
+    {
+      if (! strcmp (argv[i], "--plugins") && i + 1 < argc)
+        gegl_load_module_directory (argv[++i]);
+      else if (! strcmp (argv[i], "--op") && i + 1 < argc)
+        g_ptr_array_add (ops, argv[++i]);
+      else if (! strcmp (argv[i], "--sizes") && i + 1 < argc)
+        sizes = argv[++i];
+      else if (! strcmp (argv[i], "--contents") && i + 1 < argc)
+        contents = argv[++i];
+      else if (! strcmp (argv[i], "--threads") && i + 1 < argc)
+        threads_arg = argv[++i];
+      else if (! strcmp (argv[i], "--tile-sizes") && i + 1 < argc)
+        tiles_arg = argv[++i];
+      else if (! strcmp (argv[i], "--sweeps") && i + 1 < argc)
+        sweeps = argv[++i];
+      else if (! strcmp (argv[i], "--runs") && i + 1 < argc)
+        runs = MAX (atoi (argv[++i]), 1);
+      else if (! strcmp (argv[i], "--output") && i + 1 < argc)
+        output_path = argv[++i];
+      else if (! strcmp (argv[i], "--format") && i + 1 < argc)
+        format_name = argv[++i];
+      else
+        {
+          usage (argv[0]);
+          return 1;
+        }
+    }
+
+  if (ops->len == 0)
+    for (i = 0; default_ops[i]; i++)
+      g_ptr_array_add (ops, (gpointer) default_ops[i]);
+
+  /* 1, 2, 4, ... up to and including the number of processors */
+  if (threads_arg)
+    {
+      thread_counts = parse_int_list (threads_arg);
+    }
+  else
+    {
+      gint n = g_get_num_processors ();
+
+      thread_counts = g_array_new (FALSE, FALSE, sizeof (gint));
+      for (i = 1; i < n; i *= 2)
+        g_array_append_val (thread_counts, i);
+      g_array_append_val (thread_counts, n);
+    }
+
+  tile_sizes = parse_int_list (tiles_arg);
+
+  if (! thread_counts || ! tile_sizes)
+    {
+      usage (argv[0]);
+      return 1;
+    }
+
+  max_threads = g_array_index (thread_counts, gint, thread_counts->len - 1);
+  g_object_get (gegl_config (), "tile-width", &default_tile, NULL);
+
+  run.out    = output_path ? fopen (output_path, "w") : stdout;
+  run.runs   = runs;
+  run.format = babl_format (format_name);
+
+  if (! run.out)
+    {
+      g_printerr ("cannot write %s\n", output_path);
+      return 1;
+    }
+
+  print_machine (run.out);
+
+  size_names    = g_strsplit (sizes, ",", -1);
+  content_names = g_strsplit (contents, ",", -1);
+
+  for (o = 0; o < ops->len; o++)
+    {
+      GParamSpec *technology;
+
+      run.op_name = g_ptr_array_index (ops, o);
+
+      if (! gegl_has_operation (run.op_name))
+        {
+          g_printerr ("operation %s not found, pass its build directory with --plugins\n",
+                      run.op_name);
+          continue;
+        }
+
+      technology = gegl_operation_find_property (run.op_name, "technology");
+      if (technology && ! G_IS_PARAM_SPEC_ENUM (technology))
+        technology = NULL;
+
+      for (s = 0; size_names[s]; s++)
+        {
+          BenchSize size;
+
+          if (! parse_size (size_names[s], &size))
+            {
+              g_printerr ("unknown size %s\n", size_names[s]);
+              continue;
+            }
+
+          run.size = &size;
+
+          for (c = 0; content_names[c]; c++)
+            {
+              GeglBuffer *input, *aux, *output;
+              guint       t;
+
+              run.content = bench_content_parse (content_names[c]);
+              if (run.content == BENCH_N_CONTENTS)
+                {
+                  g_printerr ("unknown content %s\n", content_names[c]);
+                  continue;
+                }
+
+              make_buffers (&run, default_tile, &input, &aux, &output);
+
+              if (strstr (sweeps, "threads"))
+                for (t = 0; t < thread_counts->len; t++)
+                  measure (&run, "threads", g_array_index (thread_counts, gint, t),
+                           default_tile, NULL, 0, input, aux, output);
+
+              if (strstr (sweeps, "technology") && technology)
+                {
+                  GEnumClass *klass = G_PARAM_SPEC_ENUM (technology)->enum_class;
+
+                  for (t = 0; t < klass->n_values; t++)
+                    measure (&run, "technology", max_threads, default_tile,
+                             klass->values[t].value_nick, klass->values[t].value,
+                             input, aux, output);
+                }
+
+              free_buffers (input, aux, output);
+
+              if (strstr (sweeps, "tiles"))
+                for (t = 0; t < tile_sizes->len; t++)
+                  {
+                    gint tile_size = g_array_index (tile_sizes, gint, t);
+
+                    make_buffers (&run, tile_size, &input, &aux, &output);
+                    measure (&run, "tiles", max_threads, tile_size, NULL, 0,
+                             input, aux, output);
+                    free_buffers (input, aux, output);
+                  }
+
+              g_object_set (gegl_config (),
+                            "tile-width",  default_tile,
+                            "tile-height", default_tile,
+                            NULL);
+            }
+        }
+    }
+
+  if (run.out != stdout)
+    fclose (run.out);
+
+  g_strfreev (size_names);
+  g_strfreev (content_names);
+  g_array_free (thread_counts, TRUE);
+  g_array_free (tile_sizes, TRUE);
+  g_ptr_array_free (ops, TRUE);
+
+  gegl_exit ();
+
+  return 0;
+}
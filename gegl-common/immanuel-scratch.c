@@ -0,0 +1,187 @@
+/* This file is part of the immanuel:* GEGL operations
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+#include <string.h>
+
+#include <gmodule.h>
+
+#include "immanuel-scratch.h"
+
+#define ALIGN_UP(size) (((size) + IMMANUEL_SCRATCH_ALIGN - 1) & ~(gsize) (IMMANUEL_SCRATCH_ALIGN - 1))
+
+typedef struct _ScratchBlock ScratchBlock;
+
+struct _ScratchBlock
+{
+  ScratchBlock *next;      /* blocks added during the current band */
+  gpointer      memory;    /* as allocated */
+  guint8       *data;      /* aligned */
+  gsize         size;
+  gsize         used;
+};
+
+struct _ImmanuelScratch
+{
+  ScratchBlock *blocks;    /* the current one first, the kept one last */
+  gint          depth;
+  gsize         used;
+};
+
+static void scratch_free (gpointer data);
+
+static GPrivate scratch_private = G_PRIVATE_INIT (scratch_free);
+
+/* called by g_module_open () when GEGL loads the plug-in; the destroy
+ * notify of scratch_private runs at the exit of every worker thread, so
+ * the code must not go away before them
+ */
+G_MODULE_EXPORT const gchar *
+g_module_check_init (GModule *module)
+{
+  g_module_make_resident (module);
+
+  return NULL;
+}
+
+static ScratchBlock *
+block_new (gsize size)
+{
+  ScratchBlock *block = g_new (ScratchBlock, 1);
+
+  size          = ALIGN_UP (MAX (size, 4096));
+  block->next   = NULL;
+  block->memory = g_malloc (size + IMMANUEL_SCRATCH_ALIGN - 1);
+  block->data   = (guint8 *) ALIGN_UP ((guintptr) block->memory);
+  block->size   = size;
+  block->used   = 0;
+
+  return block;
+}
+
+static void
+block_free (ScratchBlock *block)
+{
+  g_free (block->memory);
+  g_free (block);
+}
+
+static void
+scratch_free (gpointer data)
+{
+  ImmanuelScratch *scratch = data;
+
+  while (scratch->blocks)
+    {
+      ScratchBlock *next = scratch->blocks->next;
+
+      block_free (scratch->blocks);
+      scratch->blocks = next;
+    }
+
+  g_free (scratch);
+}
+
+ImmanuelScratch *
+immanuel_scratch_begin (void)
+{
+  ImmanuelScratch *scratch = g_private_get (&scratch_private);
+
+  if (! scratch)
+    {
+      scratch = g_new0 (ImmanuelScratch, 1);
+      g_private_set (&scratch_private, scratch);
+    }
+
+  scratch->depth++;
+
+  return scratch;
+}
+
+void
+immanuel_scratch_end (ImmanuelScratch *scratch)
+{
+  ScratchBlock *block;
+  gsize         total = 0;
+
+  if (--scratch->depth > 0)
+    return;
+
+  /* one block of the size of all of them serves the next band */
+  for (block = scratch->blocks; block; block = block->next)
+    total += block->size;
+
+  if (scratch->blocks && (scratch->blocks->next || total > IMMANUEL_SCRATCH_KEEP_MB * 1024 * 1024))
+    {
+      while (scratch->blocks)
+        {
+          ScratchBlock *next = scratch->blocks->next;
+
+          block_free (scratch->blocks);
+          scratch->blocks = next;
+        }
+
+      if (total <= IMMANUEL_SCRATCH_KEEP_MB * 1024 * 1024)
+        scratch->blocks = block_new (total);
+    }
+
+  if (scratch->blocks)
+    scratch->blocks->used = 0;
+
+  scratch->used = 0;
+}
+
+gpointer
+immanuel_scratch_alloc (ImmanuelScratch *scratch,
+                        gsize            size)
+{
+  ScratchBlock *block = scratch->blocks;
+  gpointer      data;
+
+  size = ALIGN_UP (MAX (size, 1));
+
+  if (! block || block->size - block->used < size)
+    {
+      /* the blocks in use stay valid, a new one goes in front */
+      block = block_new (MAX (size, block ? block->size : 0));
+      block->next     = scratch->blocks;
+      scratch->blocks = block;
+    }
+
+  data           = block->data + block->used;
+  block->used   += size;
+  scratch->used += size;
+
+  return data;
+}
+
+gpointer
+immanuel_scratch_alloc0 (ImmanuelScratch *scratch,
+                         gsize            size)
+{
+  gpointer data = immanuel_scratch_alloc (scratch, size);
+
+  memset (data, 0, size);
+
+  return data;
+}
+
+gsize
+immanuel_scratch_used (ImmanuelScratch *scratch)
+{
+  return scratch->used;
+}
@@ -0,0 +1,72 @@
+/* This file is part of the immanuel:* GEGL operations
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* per-thread scratch memory for the row and block buffers of a band
+  *
+  * Each thread owns one arena.  A band takes it with
+  * immanuel_scratch_begin (), carves its buffers out of it and hands it
+  * back with immanuel_scratch_end (), which frees everything at once.
+  * Allocations are aligned to IMMANUEL_SCRATCH_ALIGN bytes, enough for
+  * any SIMD load, and are not cleared unless asked for.
+  *
+  * The arena only grows: when a band needs more than its block holds, the
+  * extra comes from further blocks, which are merged into one big enough
+  * block once the band ends, so after the first tiles a thread allocates
+  * nothing.  A block above IMMANUEL_SCRATCH_KEEP_MB is given back instead
+  * of kept.  Begin / end pairs nest, the inner end frees nothing.
+  *
+  * Every plug-in compiles this file in, so each one has its own arena per
+  * thread; the ops of one plug-in share it.  The arenas are freed at
+  * thread exit by a destroy notify in the plug-in, which therefore makes
+  * itself resident when GEGL loads it and is never unloaded.
+  */
+
+#ifndef __IMMANUEL_SCRATCH_H__
+#define __IMMANUEL_SCRATCH_H__
+
+#include <gegl.h>
+
+#define IMMANUEL_SCRATCH_ALIGN   64
+#define IMMANUEL_SCRATCH_KEEP_MB 64
+
+typedef struct _ImmanuelScratch ImmanuelScratch;
+
+/* the arena of the calling thread */
+ImmanuelScratch *immanuel_scratch_begin (void);
+
+/* frees all allocations since the outermost begin */
+void             immanuel_scratch_end   (ImmanuelScratch *scratch);
+
+/* size bytes, aligned, uninitialized */
+gpointer         immanuel_scratch_alloc (ImmanuelScratch *scratch,
+                                         gsize            size);
+
+/* size bytes, aligned, cleared */
+gpointer         immanuel_scratch_alloc0 (ImmanuelScratch *scratch,
+                                          gsize            size);
+
+/* bytes handed out since the outermost begin */
+gsize            immanuel_scratch_used  (ImmanuelScratch *scratch);
+
+#define immanuel_scratch_new(scratch, type, n) \
+  ((type *) immanuel_scratch_alloc ((scratch), sizeof (type) * (gsize) (n)))
+
+#define immanuel_scratch_new0(scratch, type, n) \
+  ((type *) immanuel_scratch_alloc0 ((scratch), sizeof (type) * (gsize) (n)))
+
+#endif
@@ -0,0 +1,348 @@
+/* This file is part of the immanuel:* GEGL operations
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "immanuel-trace.h"
+
+#ifndef IMMANUEL_TRACE_MODULE
+#define IMMANUEL_TRACE_MODULE "immanuel"
+#endif
+
+static const gchar *phase_names[IMMANUEL_TRACE_N_PHASES] =
+{
+  "fetch",
+  "compute",
+  "store"
+};
+
+static gsize         trace_init   = 0;
+static gchar        *trace_prefix = NULL;
+static GMutex        trace_mutex;
+static GArray       *trace_events = NULL;   /* ImmanuelTraceEvent */
+static gint64        trace_dropped = 0;
+static gint          trace_n_threads = 0;
+static GPrivate      trace_tid;
+
+static gdouble
+now_us (void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+#else
+  return g_get_monotonic_time ();
+#endif
+}
+
+static gint
+thread_id (void)
+{
+  gint tid = GPOINTER_TO_INT (g_private_get (&trace_tid));
+
+  if (! tid)
+    {
+      tid = g_atomic_int_add (&trace_n_threads, 1) + 1;
+      g_private_set (&trace_tid, GINT_TO_POINTER (tid));
+    }
+
+  return tid;
+}
+
+gboolean
+immanuel_trace_enabled (void)
+{
+  if (g_once_init_enter (&trace_init))
+    {
+      const gchar *prefix = g_getenv ("IMMANUEL_TRACE");
+
+      if (prefix && *prefix)
+        {
+          trace_prefix = g_strdup (prefix);
+          trace_events = g_array_new (FALSE, FALSE, sizeof (ImmanuelTraceEvent));
+        }
+
+      g_once_init_leave (&trace_init, 1);
+    }
+
+  return trace_prefix != NULL;
+}
+
+void
+immanuel_trace_begin (ImmanuelTraceEvent  *event,
+                      ImmanuelTraceEvent  *parent,
+                      const gchar         *name,
+                      const gchar         *mode,
+                      const GeglRectangle *roi,
+                      gint                 level)
+{
+  memset (event, 0, sizeof (*event));
+
+  if (! immanuel_trace_enabled () || (parent && ! parent->enabled))
+    return;
+
+  if (parent)
+    {
+      name = parent->name;
+      mode = parent->mode;
+    }
+
+  event->enabled  = TRUE;
+  event->name     = name;
+  event->mode     = mode ? g_intern_string (mode) : "";
+  event->parent   = parent;
+  event->tid      = thread_id ();
+  event->level    = level;
+  event->roi      = *roi;
+  event->start_us = event->last_us = now_us ();
+}
+
+void
+immanuel_trace_mark (ImmanuelTraceEvent *event,
+                     ImmanuelTracePhase  phase)
+{
+  gdouble t;
+
+  if (! event->enabled)
+    return;
+
+  t = now_us ();
+  event->phase_us[phase] += t - event->last_us;
+  event->last_us          = t;
+}
+
+void
+immanuel_trace_scratch (ImmanuelTraceEvent *event,
+                        gsize               bytes)
+{
+  if (event->enabled)
+    event->scratch_bytes = MAX (event->scratch_bytes, bytes);
+}
+
+void
+immanuel_trace_end (ImmanuelTraceEvent *event)
+{
+  ImmanuelTraceEvent *parent = event->parent;
+  gint                i;
+
+  if (! event->enabled)
+    return;
+
+  event->end_us = now_us ();
+
+  if (! event->pixels && ! event->n_bands)
+    event->pixels = (gint64) event->roi.width * event->roi.height;
+
+  g_mutex_lock (&trace_mutex);
+
+  /* bands on different threads run at the same time, so their scratch
+   * adds up, bands on one thread reuse it one after the other
+   */
+  if (parent)
+    {
+      gsize *peak;
+
+      for (i = 0; i < IMMANUEL_TRACE_N_PHASES; i++)
+        parent->phase_us[i] += event->phase_us[i];
+
+      if (! parent->thread_scratch)
+        parent->thread_scratch = g_array_new (FALSE, TRUE, sizeof (gsize));
+      if (parent->thread_scratch->len <= (guint) event->tid)
+        g_array_set_size (parent->thread_scratch, event->tid + 1);
+
+      peak  = &g_array_index (parent->thread_scratch, gsize, event->tid);
+      *peak = MAX (*peak, event->scratch_bytes);
+
+      parent->pixels += event->pixels;
+      parent->n_bands++;
+    }
+  else if (event->thread_scratch)
+    {
+      gsize bands_scratch = 0;
+      guint t;
+
+      for (t = 0; t < event->thread_scratch->len; t++)
+        bands_scratch += g_array_index (event->thread_scratch, gsize, t);
+
+      event->scratch_bytes = MAX (event->scratch_bytes, bands_scratch);
+      g_array_free (event->thread_scratch, TRUE);
+      event->thread_scratch = NULL;
+    }
+
+  if (trace_events->len < IMMANUEL_TRACE_MAX_EVENTS)
+    g_array_append_val (trace_events, *event);
+  else
+    trace_dropped++;
+
+  g_mutex_unlock (&trace_mutex);
+}
+
+/* one line per operation and mode, over the process () events */
+typedef struct
+{
+  const gchar *name;
+  const gchar *mode;
+  gint         calls;
+  gint         bands;
+  gdouble      wall_us;
+  gdouble      phase_us[IMMANUEL_TRACE_N_PHASES];
+  gint64       pixels;
+  gsize        peak_scratch;
+} TraceSummary;
+
+static void
+write_summary (FILE *out)
+{
+  GArray *rows = g_array_new (FALSE, TRUE, sizeof (TraceSummary));
+  guint   i, j;
+
+  for (i = 0; i < trace_events->len; i++)
+    {
+      const ImmanuelTraceEvent *event = &g_array_index (trace_events, ImmanuelTraceEvent, i);
+      TraceSummary             *row   = NULL;
+      gint                      p;
+
+      if (event->parent)
+        continue;
+
+      for (j = 0; j < rows->len && ! row; j++)
+        {
+          TraceSummary *r = &g_array_index (rows, TraceSummary, j);
+
+          if (r->name == event->name && r->mode == event->mode)
+            row = r;
+        }
+
+      if (! row)
+        {
+          TraceSummary empty = { event->name, event->mode, };
+
+          g_array_append_val (rows, empty);
+          row = &g_array_index (rows, TraceSummary, rows->len - 1);
+        }
+
+      row->calls++;
+      row->bands   += event->n_bands;
+      row->wall_us += event->end_us - event->start_us;
+      row->pixels  += event->pixels;
+      row->peak_scratch = MAX (row->peak_scratch, event->scratch_bytes);
+
+      for (p = 0; p < IMMANUEL_TRACE_N_PHASES; p++)
+        row->phase_us[p] += event->phase_us[p];
+    }
+
+  fprintf (out, "%-28s %-24s %7s %7s %10s %10s %10s %10s %9s %9s %10s\n",
+           "operation", "mode", "calls", "bands", "wall ms",
+           "fetch ms", "compute ms", "store ms", "Mpix", "Mpix/s", "scratch KB");
+
+  for (j = 0; j < rows->len; j++)
+    {
+      const TraceSummary *r = &g_array_index (rows, TraceSummary, j);
+
+      fprintf (out, "%-28s %-24s %7d %7d %10.2f %10.2f %10.2f %10.2f %9.2f %9.1f %10.0f\n",
+               r->name, r->mode, r->calls, r->bands, r->wall_us * 1e-3,
+               r->phase_us[IMMANUEL_TRACE_FETCH] * 1e-3,
+               r->phase_us[IMMANUEL_TRACE_COMPUTE] * 1e-3,
+               r->phase_us[IMMANUEL_TRACE_STORE] * 1e-3,
+               r->pixels * 1e-6,
+               r->wall_us > 0.0 ? r->pixels / r->wall_us : 0.0,
+               r->peak_scratch / 1024.0);
+    }
+
+  if (trace_dropped)
+    fprintf (out, "%" G_GINT64_FORMAT " events beyond %d not recorded\n",
+             trace_dropped, IMMANUEL_TRACE_MAX_EVENTS);
+
+  g_array_free (rows, TRUE);
+}
+
+static void
+write_trace (FILE *out)
+{
+  gint  pid = getpid ();
+  guint i;
+  gint  p;
+
+  fprintf (out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+  for (i = 0; i < trace_events->len; i++)
+    {
+      const ImmanuelTraceEvent *event = &g_array_index (trace_events, ImmanuelTraceEvent, i);
+
+      fprintf (out, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d, \"args\": {"
+                    "\"mode\": \"%s\", \"level\": %d, \"roi\": [%d, %d, %d, %d], "
+                    "\"pixels\": %" G_GINT64_FORMAT ", \"scratch_bytes\": %" G_GSIZE_FORMAT,
+               i ? ",\n" : "",
+               event->name, event->parent ? "band" : "process",
+               event->start_us, event->end_us - event->start_us, pid, event->tid,
+               event->mode, event->level,
+               event->roi.x, event->roi.y, event->roi.width, event->roi.height,
+               event->pixels, event->scratch_bytes);
+
+      for (p = 0; p < IMMANUEL_TRACE_N_PHASES; p++)
+        fprintf (out, ", \"%s_us\": %.3f", phase_names[p], event->phase_us[p]);
+
+      if (! event->parent)
+        fprintf (out, ", \"bands\": %d", event->n_bands);
+
+      fprintf (out, "}}");
+    }
+
+  fprintf (out, "\n]}\n");
+}
+
+/* runs at exit and when the plug-in is unloaded */
+static void __attribute__ ((destructor))
+immanuel_trace_dump (void)
+{
+  gchar *path;
+  FILE  *out;
+
+  if (! trace_prefix || ! trace_events->len)
+    return;
+
+  g_mutex_lock (&trace_mutex);
+
+  path = g_strconcat (trace_prefix, IMMANUEL_TRACE_MODULE, ".json", NULL);
+  out  = fopen (path, "w");
+
+  if (out)
+    {
+      write_trace (out);
+      fclose (out);
+    }
+  else
+    {
+      fprintf (stderr, "%s: cannot write trace %s\n", IMMANUEL_TRACE_MODULE, path);
+    }
+
+  fprintf (stderr, "%s trace, %s:\n", IMMANUEL_TRACE_MODULE, path);
+  write_summary (stderr);
+
+  g_free (path);
+  g_array_set_size (trace_events, 0);
+
+  g_mutex_unlock (&trace_mutex);
+}
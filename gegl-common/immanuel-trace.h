@@ -0,0 +1,104 @@
+/* This file is part of the immanuel:* GEGL operations
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* optional timing of the process () calls of an operation
+  *
+  * Off unless the environment variable IMMANUEL_TRACE is set; it is the
+  * prefix of the trace file, each plug-in writes <prefix><module>.json in
+  * the Chrome trace event format (chrome://tracing, ui.perfetto.dev) and
+  * a summary table to stderr when it is unloaded or the process exits.
+  *
+  * One event covers one process () call, its child events the row bands
+  * run on the worker threads.  A band splits its time into the fetch
+  * (gegl_buffer_get, babl conversion), compute and store (gegl_buffer_set,
+  * tile write back) phases by marking the end of each; the phases and
+  * pixels of the bands add up in their parent.  The peak scratch bytes of
+  * the parent are the sum over the threads of the largest band each ran,
+  * bands that run one after the other on a thread reuse its scratch.
+  *
+  * Every plug-in compiles this file in, with IMMANUEL_TRACE_MODULE set to
+  * its name.
+  */
+
+#ifndef __IMMANUEL_TRACE_H__
+#define __IMMANUEL_TRACE_H__
+
+#include <gegl.h>
+
+/* events beyond this are counted, not recorded */
+#define IMMANUEL_TRACE_MAX_EVENTS (1 << 20)
+
+typedef enum
+{
+  IMMANUEL_TRACE_FETCH,
+  IMMANUEL_TRACE_COMPUTE,
+  IMMANUEL_TRACE_STORE,
+  IMMANUEL_TRACE_N_PHASES
+} ImmanuelTracePhase;
+
+typedef struct _ImmanuelTraceEvent ImmanuelTraceEvent;
+
+struct _ImmanuelTraceEvent
+{
+  gboolean             enabled;
+  const gchar         *name;       /* operation name */
+  const gchar         *mode;       /* interned, e.g. technology and ISA */
+  ImmanuelTraceEvent  *parent;     /* the process () event of a band, only
+                                    * valid until that one ends */
+  gint                 tid;        /* small number per thread */
+  gint                 level;
+  GeglRectangle        roi;
+  gdouble              start_us;
+  gdouble              end_us;
+  gdouble              last_us;    /* end of the last marked phase */
+  gdouble              phase_us[IMMANUEL_TRACE_N_PHASES];
+  gint64               pixels;
+  gsize                scratch_bytes;
+  GArray              *thread_scratch;  /* gsize per tid, largest band of
+                                         * each thread, while bands run */
+  gint                 n_bands;
+};
+
+/* TRUE when IMMANUEL_TRACE is set */
+gboolean immanuel_trace_enabled (void);
+
+/* starts event for a process () call (parent NULL) or a band of one, which
+ * takes name and mode of its parent; mode may be NULL; does nothing but
+ * clear enabled when tracing is off
+ */
+void     immanuel_trace_begin   (ImmanuelTraceEvent  *event,
+                                 ImmanuelTraceEvent  *parent,
+                                 const gchar         *name,
+                                 const gchar         *mode,
+                                 const GeglRectangle *roi,
+                                 gint                 level);
+
+/* adds the time since the last mark (or begin) to phase */
+void     immanuel_trace_mark    (ImmanuelTraceEvent  *event,
+                                 ImmanuelTracePhase   phase);
+
+/* scratch memory the event holds at the moment, the peak is kept */
+void     immanuel_trace_scratch (ImmanuelTraceEvent  *event,
+                                 gsize                bytes);
+
+/* records event, a band adds its phases, pixels and scratch to its parent;
+ * the pixels default to the area of roi
+ */
+void     immanuel_trace_end     (ImmanuelTraceEvent  *event);
+
+#endif
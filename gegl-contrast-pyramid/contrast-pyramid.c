@@ -0,0 +1,390 @@
+/* This file is an image processing operation for GEGL
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* relative contrast of Y aggregated over the octaves of a luminance pyramid */
+
+#include "config.h"
+#include <glib/gi18n-lib.h>
+
+#ifdef GEGL_PROPERTIES
+
+property_int (min_octave, _("finest octave"), 1)
+   description (_("finest octave the contrast is taken from, octave k has pixels 2^k full resolution pixels wide"))
+   value_range (0, 8)
+
+property_int (max_octave, _("coarsest octave"), 4)
+   description (_("coarsest octave the contrast is taken from"))
+   value_range (0, 8)
+
+#else
+
+#define GEGL_OP_COMPOSER
+#define GEGL_OP_NAME     contrast_pyramid
+#define GEGL_OP_C_SOURCE contrast-pyramid.c
+
+#define POW2(x) ((x)*(x))
+
+/* octave pixels read around a band: the blur, the gradient and the
+ * bilinear neighbour
+ */
+#define OCTAVE_BORDER 3
+
+#include "gegl-op.h"
+#include "immanuel-trace.h"
+#include "immanuel-scratch.h"
+
+/* The pyramid is the mipmap of the sources: octave k is read with
+ * gegl_buffer_get () at scale 1 / 2^k, a 2x2 box reduction per octave that
+ * GEGL builds once for the whole buffer, O(N) over all octaves.  A [1 2 1]
+ * blur on top of the box turns each octave into a binomial, close to a
+ * gaussian, level.  The relative gradient of every octave, per full
+ * resolution pixel like immanuel:image-gradient-rel, is interpolated
+ * bilinearly to the output pixels and averaged over the octaves.
+ *
+ * With aux connected the output holds the contrast of input and of aux,
+ * the contrast source of immanuel:color-mapper.
+ */
+
+static void
+prepare (GeglOperation *operation)
+{
+  const Babl *space      = gegl_operation_get_source_space (operation, "input");
+  const Babl *Y_format   = babl_format_with_space ("Y float", space);
+  gint        n_sources  = gegl_operation_get_source_node (operation, "aux") ? 2 : 1;
+
+  gegl_operation_set_format (operation, "input",  Y_format);
+  gegl_operation_set_format (operation, "aux",    Y_format);
+  gegl_operation_set_format (operation, "output", babl_format_n (babl_type ("float"), n_sources));
+}
+
+static GeglRectangle
+get_bounding_box (GeglOperation *operation)
+{
+  GeglRectangle  result = { 0, 0, 0, 0 };
+  GeglRectangle *in_rect;
+
+  in_rect = gegl_operation_source_get_bounding_box (operation, "input");
+  if (in_rect)
+    {
+      result = *in_rect;
+    }
+
+  return result;
+}
+
+static GeglRectangle
+get_enlarged_input (GeglOperation       *operation,
+                    const GeglRectangle *input_region)
+{
+  GeglProperties *o      = GEGL_PROPERTIES (operation);
+  gint            border = (OCTAVE_BORDER + 1) << MAX (o->min_octave, o->max_octave);
+  GeglRectangle   rect;
+
+  /* the border of the coarsest octave, in full resolution pixels; the
+   * octave rects of process_band () are snapped outward to octave pixels,
+   * which reaches up to one more octave pixel beyond the region.  It
+   * doubles with every octave, the octaves end at 8 so that it stays at
+   * most 1024 pixels
+   */
+  rect.x       = input_region->x - border;
+  rect.y       = input_region->y - border;
+  rect.width   = input_region->width  + 2 * border;
+  rect.height  = input_region->height + 2 * border;
+
+  return rect;
+}
+
+static GeglRectangle
+get_required_for_output (GeglOperation       *operation,
+                         const gchar         *input_pad,
+                         const GeglRectangle *region)
+{
+  GeglRectangle   rect;
+  GeglRectangle   defined;
+
+  defined = gegl_operation_get_bounding_box (operation);
+  gegl_rectangle_intersect (&rect, region, &defined);
+
+  if (rect.width  != 0 && rect.height != 0)
+    {
+      rect = get_enlarged_input (operation, &rect);
+    }
+
+  return rect;
+}
+
+static GeglRectangle
+get_invalidated_by_change (GeglOperation       *operation,
+                           const gchar         *input_pad,
+                           const GeglRectangle *input_region)
+{
+  return get_enlarged_input (operation, input_region);
+}
+
+/* floor (value / 2^shift) for negative values as well */
+static inline gint
+floor_shift (gint value,
+             gint shift)
+{
+  return value >= 0 ? value >> shift : -((-value + (1 << shift) - 1) >> shift);
+}
+
+/* one band of rows, processed by one thread */
+typedef struct
+{
+  GeglOperation *operation;
+  GeglBuffer    *sources[2];
+  gint           n_sources;
+  GeglBuffer    *output;
+  gint           level;
+  gint           first_octave;   /* both at least level */
+  gint           last_octave;
+  ImmanuelTraceEvent *trace;     /* of the process () call */
+} PyramidBand;
+
+/* [1 2 1] / 4 along rows and columns of the width x height block into tmp
+ * and back, the block edges continue as constant
+ */
+static void
+binomial_blur (gfloat *block,
+               gfloat *tmp,
+               gint    width,
+               gint    height)
+{
+  gint x, y;
+
+  for (y = 0; y < height; y++)
+    {
+      const gfloat *src = block + (gsize) y * width;
+      gfloat       *dst = tmp   + (gsize) y * width;
+
+      for (x = 0; x < width; x++)
+        dst[x] = 0.25f * (src[MAX (x - 1, 0)] + 2.0f * src[x] + src[MIN (x + 1, width - 1)]);
+    }
+
+  for (y = 0; y < height; y++)
+    {
+      const gfloat *up   = tmp   + (gsize) MAX (y - 1, 0) * width;
+      const gfloat *mid  = tmp   + (gsize) y * width;
+      const gfloat *down = tmp   + (gsize) MIN (y + 1, height - 1) * width;
+      gfloat       *dst  = block + (gsize) y * width;
+
+      for (x = 0; x < width; x++)
+        dst[x] = 0.25f * (up[x] + 2.0f * mid[x] + down[x]);
+    }
+}
+
+/* relative gradient of the blurred block into contrast, the outermost
+ * pixels are left out
+ */
+static void
+relative_gradient (const gfloat *block,
+                   gfloat       *contrast,
+                   gint          width,
+                   gint          height,
+                   gfloat        scale)
+{
+  gint x, y;
+
+  for (y = 1; y < height - 1; y++)
+    {
+      const gfloat *top_ptr  = block + (gsize) (y - 1) * width;
+      const gfloat *mid_ptr  = block + (gsize) y * width;
+      const gfloat *down_ptr = block + (gsize) (y + 1) * width;
+      gfloat       *dst      = contrast + (gsize) y * width;
+
+      for (x = 1; x < width - 1; x++)
+        {
+          gfloat  dx;
+          gfloat  dy;
+          gdouble YSum; // sum of CIE Y values
+
+          dx = (mid_ptr[(x-1)] - mid_ptr[(x+1)]);
+          dy = (top_ptr[x] - down_ptr[x]);
+          YSum = (mid_ptr[(x-1)] + mid_ptr[(x+1)] + top_ptr[x] + down_ptr[x]);
+
+          if (fabs (YSum) > 0.0001)
+            dst[x] = sqrt (POW2(dx) + POW2(dy)) * (4.0 / YSum) * 0.5 * scale;
+          else
+            dst[x] = 0.0;
+        }
+    }
+}
+
+static void
+process_band (const GeglRectangle *roi,
+              gpointer             user_data)
+{
+  PyramidBand   *band       = user_data;
+  const Babl    *in_format  = gegl_operation_get_format (band->operation, "input");
+  const Babl    *out_format = gegl_operation_get_format (band->operation, "output");
+  const gint     n_sources  = band->n_sources;
+  const gint     n_octaves  = band->last_octave - band->first_octave + 1;
+  gfloat        *out;
+  gfloat        *block    = NULL;
+  gfloat        *tmp      = NULL;
+  gfloat        *contrast = NULL;
+  gsize          block_size = 0;
+  gint           k, s, x, y;
+  ImmanuelTraceEvent event;
+  ImmanuelScratch   *scratch;
+
+  immanuel_trace_begin (&event, band->trace, NULL, NULL, roi, band->level);
+  scratch = immanuel_scratch_begin ();
+
+  out = immanuel_scratch_new0 (scratch, gfloat, (gsize) roi->width * roi->height * n_sources);
+
+  for (k = band->first_octave; k <= band->last_octave; k++)
+    {
+      /* octave k relative to the level the band is at */
+      const gint    shift = k - band->level;
+      const gfloat  f     = 1 << shift;
+      GeglRectangle octave_rect;
+      gint          x1, y1;
+
+      octave_rect.x = floor_shift (roi->x, shift) - OCTAVE_BORDER;
+      octave_rect.y = floor_shift (roi->y, shift) - OCTAVE_BORDER;
+      x1            = floor_shift (roi->x + roi->width  - 1, shift) + OCTAVE_BORDER + 1;
+      y1            = floor_shift (roi->y + roi->height - 1, shift) + OCTAVE_BORDER + 1;
+      octave_rect.width  = x1 - octave_rect.x;
+      octave_rect.height = y1 - octave_rect.y;
+
+      if ((gsize) octave_rect.width * octave_rect.height > block_size)
+        {
+          block_size = (gsize) octave_rect.width * octave_rect.height;
+          block      = immanuel_scratch_new (scratch, gfloat, block_size);
+          tmp        = immanuel_scratch_new (scratch, gfloat, block_size);
+          contrast   = immanuel_scratch_new0 (scratch, gfloat, block_size);
+
+          immanuel_trace_scratch (&event, immanuel_scratch_used (scratch));
+        }
+
+      for (s = 0; s < n_sources && band->sources[s]; s++)
+        {
+          gegl_buffer_get (band->sources[s], &octave_rect, 1.0 / (1 << k), in_format, block,
+                           GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
+          immanuel_trace_mark (&event, IMMANUEL_TRACE_FETCH);
+
+          binomial_blur (block, tmp, octave_rect.width, octave_rect.height);
+
+          /* per full resolution pixel, the octave pixels are 2^k apart */
+          relative_gradient (block, contrast, octave_rect.width, octave_rect.height,
+                             1.0 / (1 << k));
+
+          /* bilinear from the octave pixel centers to the ones of the band */
+          for (y = 0; y < roi->height; y++)
+            {
+              const gfloat v  = (roi->y + y + 0.5f) / f - 0.5f - octave_rect.y;
+              const gint   j  = (gint) floorf (v);
+              const gfloat tv = v - j;
+              const gfloat *c0 = contrast + (gsize) j * octave_rect.width;
+              const gfloat *c1 = c0 + octave_rect.width;
+              gfloat       *dst = out + (gsize) y * roi->width * n_sources + s;
+
+              for (x = 0; x < roi->width; x++)
+                {
+                  const gfloat u  = (roi->x + x + 0.5f) / f - 0.5f - octave_rect.x;
+                  const gint   i  = (gint) floorf (u);
+                  const gfloat tu = u - i;
+                  const gfloat top    = c0[i] + (c0[i + 1] - c0[i]) * tu;
+                  const gfloat bottom = c1[i] + (c1[i + 1] - c1[i]) * tu;
+
+                  dst[x * n_sources] += top + (bottom - top) * tv;
+                }
+            }
+          immanuel_trace_mark (&event, IMMANUEL_TRACE_COMPUTE);
+        }
+    }
+
+  for (x = 0; x < roi->width * roi->height * n_sources; x++)
+    out[x] /= n_octaves;
+  immanuel_trace_mark (&event, IMMANUEL_TRACE_COMPUTE);
+
+  gegl_buffer_set (band->output, roi, band->level, out_format, out,
+                   GEGL_AUTO_ROWSTRIDE);
+  immanuel_trace_mark (&event, IMMANUEL_TRACE_STORE);
+
+  immanuel_scratch_end (scratch);
+  immanuel_trace_end (&event);
+}
+
+static gboolean
+process (GeglOperation       *operation,
+         GeglBuffer          *input,
+         GeglBuffer          *aux,
+         GeglBuffer          *output,
+         const GeglRectangle *result,
+         gint                 level)
+{
+  GeglProperties *o    = GEGL_PROPERTIES (operation);
+  PyramidBand     band = { operation, { input, aux }, 1, output, level };
+  ImmanuelTraceEvent trace;
+
+  immanuel_trace_begin (&trace, NULL, "immanuel:contrast-pyramid", NULL, result, level);
+  band.trace = &trace;
+
+  /* with an aux pad that has no buffer its component stays zero */
+  band.n_sources = babl_format_get_n_components (gegl_operation_get_format (operation, "output"));
+
+  /* a level is as fine as the pyramid gets, octaves below it are the level */
+  band.first_octave = MAX (MIN (o->min_octave, o->max_octave), level);
+  band.last_octave  = MAX (MAX (o->min_octave, o->max_octave), level);
+
+  /* split into row bands, each one reading the octaves it covers */
+  gegl_parallel_distribute_area (result,
+                                 gegl_operation_get_pixels_per_thread (operation),
+                                 GEGL_SPLIT_STRATEGY_HORIZONTAL,
+                                 process_band, &band);
+
+  immanuel_trace_end (&trace);
+
+  return TRUE;
+}
+
+static void
+gegl_op_class_init (GeglOpClass *klass)
+{
+  GeglOperationClass         *operation_class;
+  GeglOperationComposerClass *composer_class;
+
+  operation_class = GEGL_OPERATION_CLASS (klass);
+  composer_class  = GEGL_OPERATION_COMPOSER_CLASS (klass);
+
+  operation_class->prepare                   = prepare;
+  operation_class->get_required_for_output   = get_required_for_output;
+  operation_class->get_invalidated_by_change = get_invalidated_by_change;
+  operation_class->get_bounding_box          = get_bounding_box;
+  operation_class->opencl_support            = FALSE;
+  operation_class->threaded                  = TRUE;
+
+  composer_class->process         = process;
+  composer_class->aux_label       = _("original colored image");
+  composer_class->aux_description = _("optional, its contrast is output "
+                                      "as second component");
+
+  gegl_operation_class_set_keys (operation_class,
+    "name",        "immanuel:contrast-pyramid",
+    "title",       _("Contrast Pyramid"),
+    "categories",  "edge-detect",
+    "description", _("Relative gradient of lightness averaged over the octaves "
+                     "of a luminance pyramid, large scale contrast at the cost "
+                     "of a few small images"),
+    NULL);
+}
+
+#endif
@@ -51,212 +51,307 @@ property_color (wp_color, _("neutral / white representation"), "white")
 
 #else
 
-#include <gegl-plugin.h>
-
-#define GEGL_OP_META
+#define GEGL_OP_COMPOSER
 #define GEGL_OP_NAME     exposure_map
 #define GEGL_OP_C_SOURCE exposure_map.c
 
+#define POW2(x) ((x)*(x))
+
 #include "gegl-op.h"
+#include "immanuel-trace.h"
+#include "immanuel-scratch.h"
+
+/* The op used to be a meta graph of ~45 child nodes (gegl:saturation, divide,
+ * multiply, rgb-clip, invert-linear, component-extract, darken and two
+ * immanuel:image-gradient-rel), each materializing a full RGBA float buffer.
+ * It now computes the same math in one streaming pass over input and aux:
+ *
+ *   Yn, Yo          CIE Y of input (new) and aux (old)
+ *   cn, co          relative gradient of Yn and Yo (image-gradient-rel)
+ *   scale_contrast  ((2 cn + co) / (2 co + cn)) ^ strength
+ *   factor2neutral  Y (wp) / wp
+ *   final           (Yn + (old * factor2neutral * Yn / Yo - Yn) * scale_contrast) / factor2neutral
+ *   gray            Yn / factor2neutral
+ *   k_neg           min over rgb of  gray / (gray - min (final, 0))
+ *   k_pos           1 - max over rgb of  max (final - 1, 0) / (final - gray)
+ *   output          (final - gray) * min (k_pos, k_neg) + gray
+ *
+ * Divisions by zero yield zero, like gegl:divide.
+ */
+
+static void
+prepare (GeglOperation *operation)
+{
+  const Babl *format = babl_format_with_space ("RGBA float",
+                           gegl_operation_get_source_space (operation, "input"));
+
+  gegl_operation_set_format (operation, "input",  format);
+  gegl_operation_set_format (operation, "aux",    format);
+  gegl_operation_set_format (operation, "output", format);
+}
+
+static GeglRectangle
+get_bounding_box (GeglOperation *operation)
+{
+  GeglRectangle  result = { 0, 0, 0, 0 };
+  GeglRectangle *in_rect;
+
+  in_rect = gegl_operation_source_get_bounding_box (operation, "input");
+  if (in_rect)
+    {
+      result = *in_rect;
+    }
+
+  return result;
+}
+
+static GeglRectangle
+get_enlarged_input (GeglOperation       *operation,
+                    const GeglRectangle *input_region)
+{
+  GeglRectangle   rect;
+
+  /* the image gradients need the direct neigbouring pixels */
+  rect.x       = input_region->x - 1;
+  rect.y       = input_region->y - 1;
+  rect.width   = input_region->width  + 2;
+  rect.height  = input_region->height + 2;
+
+  return rect;
+}
 
+static GeglRectangle
+get_required_for_output (GeglOperation       *operation,
+                         const gchar         *input_pad,
+                         const GeglRectangle *region)
+{
+  GeglRectangle   rect;
+  GeglRectangle   defined;
+
+  defined = gegl_operation_get_bounding_box (operation);
+  gegl_rectangle_intersect (&rect, region, &defined);
+
+  if (rect.width  != 0 && rect.height != 0)
+    {
+      rect = get_enlarged_input (operation, &rect);
+    }
 
-static void attach(GeglOperation *operation)
+  return rect;
+}
+
+static GeglRectangle
+get_invalidated_by_change (GeglOperation       *operation,
+                           const gchar         *input_pad,
+                           const GeglRectangle *input_region)
 {
-  GeglNode *gegl = operation->node;
-  GeglNode *yNew_in;                            // input
-  GeglNode *output;                             // output
-  GeglNode *old;                                // aux
-  GeglNode *old_wb;                             // aux whitebalanced
-  GeglNode *new_unc, *new_comp;                 // image new with chromaticity unchanged and chromacity compensated
-  GeglNode *yNew, *yOld;                        // luminance
-  GeglNode *cNew, *cOld;                        // contrast (image gradient relative to luminance)
-  GeglNode *scale_exposure;                     // ratio of luminance and of contrast new vs old
-  GeglNode *scale_contrast_without_gamma;       // ratio of luminance and of contrast new vs old
-  GeglNode *scale_contrast;                     // adds gamma tuning of chromaticity adoption
-  GeglNode *color_new, *color_new_comp, *final; // extracted color information of new image (rgb-y) and scaled (contrast-compensated) color information
-  GeglNode *whitepoint, *y_whitepoint, *wp;     // color considered as white - untouched with regard to saturation adaption
-  GeglNode *factor2neutral;                     // factor to convert to neutral
-  GeglNode *clip_neg, *clip_pos;
-  GeglNode *gray, *white, *white_plane;
-  GeglNode *subtract_gray, *desaturate_color, *add_desaturated;
-  GeglNode *overcolor_neg, *overcolor_pos;
-  GeglNode *div_by_overcolor_neg, *div_by_overcolor_pos;
-  GeglNode *invert_linear, *reinvert_linear;
-  GeglNode *HSV_neg, *HSV_pos;
-  GeglNode *image_minus_white;
-  GeglNode *k_pos, *min_kPosNeg;
-  GeglNode *gradient_offset, *cNew_raw, *cOld_raw;
-  GeglNode *debug;
-  GeglColor *white_color;
-  
-
-// map current layer (yNew_in), reference layer (original) and output (result of gegl op)
-  yNew_in      = gegl_node_get_input_proxy (gegl, "input");
-  old          = gegl_node_get_input_proxy (gegl, "aux");
-  output       = gegl_node_get_output_proxy (gegl, "output");
-  white_color  = gegl_color_new ("rgb(1.0,1.0,1.0)");
- 
-// graph branch 0:
-  white_plane = gegl_node_new_child (gegl, "operation", "gegl:color", "value", white_color, NULL);
-  white = gegl_node_new_child (gegl, "operation", "gegl:crop", NULL);
-  gegl_node_connect_from (white, "aux", old, "output");
-  gegl_node_link (white_plane, white);
-  
-//  whitepoint = gegl_node_new_child (gegl, "operation", "gegl:color", "value", gegl_color_new ("rgb(1.0,1.0,1.0)"), NULL);
-  wp = gegl_node_new_child (gegl, "operation", "gegl:color", NULL);
-  whitepoint = gegl_node_new_child (gegl, "operation", "gegl:crop", NULL);
-  gegl_node_connect_from (whitepoint, "aux", old, "output");
-//  y_whitepoint = gegl_node_new_child (gegl, "operation", "gegl:gray", NULL);
-  y_whitepoint = gegl_node_new_child (gegl, "operation", "gegl:saturation", "scale", 0.0, NULL);
-
-  factor2neutral = gegl_node_new_child (gegl, "operation", "gegl:divide", NULL);
-  gegl_node_connect_from (factor2neutral, "aux", whitepoint, "output");
-  gegl_node_link_many (wp, whitepoint, y_whitepoint, factor2neutral, NULL);
-
-  old_wb = gegl_node_new_child (gegl, "operation", "gegl:multiply", NULL);
-  gegl_node_connect_from (old_wb, "aux", factor2neutral, "output");
-  gegl_node_link (old, old_wb);
-
-// graph branch 1:
-  // make sure new image / current layer is grayscale
-  yNew = gegl_node_new_child (gegl, "operation", "gegl:saturation", "scale", 0.0, NULL);
-  cNew_raw = gegl_node_new_child (gegl, "operation", "immanuel:image-gradient-rel", NULL);
-//  cNew = gegl_node_new_child (gegl, "operation", "immanuel:image-density", NULL);
-  gegl_node_link_many (yNew_in, yNew, cNew_raw, NULL);
-
-// graph branch 2:
-  // make sure reference image / "aux" is grayscale
-
-  //  yOld = gegl_node_new_child (gegl, "operation", "gegl:gray", NULL);
-  yOld = gegl_node_new_child (gegl, "operation", "gegl:saturation", "scale", 0.0, NULL);
-//  yOldY = gegl_node_new_child (gegl, "operation", "gegl:convert-format", "format", "Y float", NULL);
-  cOld_raw = gegl_node_new_child (gegl, "operation", "immanuel:image-gradient-rel", NULL); 
-// cOld = gegl_node_new_child (gegl, "operation", "immanuel:image-density", NULL);  //image dimension ranzig
-
-  gradient_offset = gegl_node_new_child (gegl, "operation", "gegl:add", NULL);
-  gegl_node_connect_from (gradient_offset, "aux", cNew_raw, "output");
-
-  cOld = gegl_node_new_child (gegl, "operation", "gegl:add", NULL);
-  gegl_node_connect_from (cOld, "aux", cOld_raw, "output");
-
-  gegl_node_link_many (old, yOld, cOld_raw, gradient_offset, cOld, NULL);
-
-  cNew = gegl_node_new_child (gegl, "operation", "gegl:add", NULL);
-  gegl_node_connect_from (cNew, "aux", gradient_offset, "output");
-  gegl_node_link (cNew_raw, cNew);
-
-
-// link graph branches to determine both scaling factors
-  // divide new luminance by old luminance
-  scale_exposure = gegl_node_new_child (gegl, "operation", "gegl:divide", NULL);
-  gegl_node_connect_from (scale_exposure, "aux", yOld, "output");
-  gegl_node_link (yNew, scale_exposure);
-
-
-  scale_contrast_without_gamma = gegl_node_new_child (gegl, "operation", "gegl:divide", NULL);
-  scale_contrast = gegl_node_new_child (gegl, "operation", "gegl:gamma", NULL);
-  gegl_node_connect_from (scale_contrast_without_gamma, "aux", cOld, "output");
-  gegl_node_link_many (cNew, scale_contrast_without_gamma, scale_contrast, NULL);
-
-// graph branch 3:
-  // scale exposure (all rgb values) of original/old/aux with exposure scaling factor exactly like gimp:layermode "layer-mode" "luminance"
-  new_unc = gegl_node_new_child (gegl, "operation", "gegl:multiply", NULL);
-  gegl_node_connect_from (new_unc, "aux", scale_exposure, "output");
-
-  // extract color from uncompensated new image (rgb-y)
-  color_new = gegl_node_new_child (gegl, "operation", "gegl:subtract", NULL);
-  gegl_node_connect_from (color_new, "aux", yNew, "output");
-
-  // scale extracted color with scale_contrast
-  color_new_comp = gegl_node_new_child (gegl, "operation", "gegl:multiply", NULL);
-  gegl_node_connect_from (color_new_comp, "aux", scale_contrast, "output");
-
-  // add scaled color back to grayscale image
-  new_comp = gegl_node_new_child (gegl, "operation", "gegl:add", NULL);
-  gegl_node_connect_from (new_comp, "aux", yNew, "output");
-
-  // invert WhiteBalance
-  final = gegl_node_new_child (gegl, "operation", "gegl:divide", NULL);
-  gegl_node_connect_from (final, "aux", factor2neutral, "output");
-  
-  gegl_node_link_many (old_wb, new_unc, color_new, color_new_comp, new_comp, final, NULL);
-
-// graph branch 4.1 (k_neg)
-  clip_neg = gegl_node_new_child (gegl, "operation", "gegl:rgb-clip", "clip-high", TRUE, "clip-low", FALSE, "high-limit", 0.0, NULL);
-  gray = gegl_node_new_child (gegl, "operation", "gegl:divide", NULL);
-  gegl_node_connect_from (gray, "aux", factor2neutral, "output");
-  overcolor_neg = gegl_node_new_child (gegl, "operation", "gegl:subtract", NULL);
-  gegl_node_connect_from (overcolor_neg, "aux", clip_neg, "output");
-  div_by_overcolor_neg = gegl_node_new_child (gegl, "operation", "gegl:divide", NULL);
-  gegl_node_connect_from (div_by_overcolor_neg, "aux", overcolor_neg, "output");
-  invert_linear = gegl_node_new_child (gegl, "operation", "gegl:invert-linear", NULL);
-  HSV_neg = gegl_node_new_child (gegl, "operation", "gegl:component-extract", "component", 5, NULL);
-  reinvert_linear = gegl_node_new_child (gegl, "operation", "gegl:invert-linear", NULL);
-
-  gegl_node_link (final, clip_neg);
-  gegl_node_link_many (yNew, gray, overcolor_neg, NULL);
-// k_neg
-  gegl_node_link_many (gray, div_by_overcolor_neg, invert_linear, HSV_neg, reinvert_linear, NULL);
-
-
-// graph branch 4.2 (k_pos)
-  overcolor_pos = gegl_node_new_child (gegl, "operation", "gegl:subtract", NULL);
-  gegl_node_connect_from (overcolor_pos, "aux", gray, "output");
-
-  image_minus_white = gegl_node_new_child (gegl, "operation", "gegl:subtract", NULL);
-  gegl_node_connect_from (image_minus_white, "aux", white, "output");
-  
-  clip_pos = gegl_node_new_child (gegl, "operation", "gegl:rgb-clip", "clip-low", TRUE, "clip-high", FALSE, "low-limit", 0.0, NULL);
-  div_by_overcolor_pos = gegl_node_new_child (gegl, "operation", "gegl:divide", NULL);
-  gegl_node_connect_from (div_by_overcolor_pos, "aux", overcolor_pos, "output");
-  HSV_pos = gegl_node_new_child (gegl, "operation", "gegl:component-extract", "component", 5, NULL);
-// k_pos
-  k_pos = gegl_node_new_child (gegl, "operation", "gegl:subtract", NULL);
-  gegl_node_connect_from (k_pos, "aux", HSV_pos, "output");
-
-// construct graph
-  gegl_node_link (final, overcolor_pos);
-  gegl_node_link_many (final, image_minus_white, clip_pos, div_by_overcolor_pos, HSV_pos, NULL);
-  gegl_node_link (white, k_pos);
-  
-// graph branch 5: reduce saturation
-// kombine pos and neg desaturation factors
-  min_kPosNeg = gegl_node_new_child (gegl, "operation", "gegl:darken", NULL);
-  gegl_node_connect_from (min_kPosNeg, "aux", reinvert_linear, "output");
-
-  subtract_gray = gegl_node_new_child (gegl, "operation", "gegl:subtract", NULL);
-  gegl_node_connect_from (subtract_gray, "aux", gray, "output");
-  desaturate_color = gegl_node_new_child (gegl, "operation", "gegl:multiply", NULL);
-  gegl_node_connect_from (desaturate_color, "aux", min_kPosNeg, "output");
-  add_desaturated = gegl_node_new_child (gegl, "operation", "gegl:add", NULL);
-  gegl_node_connect_from (add_desaturated, "aux", gray, "output");
-
-//  debug = gegl_node_new_child (gegl, "operation", "gegl:component-extract", "component", 5, NULL);
-//  gegl_node_link (final, debug);
-
-  gegl_node_link (k_pos, min_kPosNeg);
-
-  gegl_node_link_many (final, subtract_gray, desaturate_color, add_desaturated, NULL);
-  gegl_node_link (add_desaturated, output);
-//  gegl_node_link (final, output);
-//  gegl_node_link (min_kPosNeg, output);
-   
-// meta redirects
-  
-gegl_operation_meta_redirect (operation, "wp_color", wp, "value");
-gegl_operation_meta_redirect (operation, "chroma_scale_gamma", scale_contrast, "value");
-// gegl_operation_meta_redirect (operation, "gradient_min", gradient_offset, "value");
+  return get_enlarged_input (operation, input_region);
+}
 
+static inline gfloat
+safe_divide (gfloat a,
+             gfloat b)
+{
+  return (b == 0.0f) ? 0.0f : a / b;
+}
+
+/* central differences relative to lightness, same as immanuel:image-gradient-rel */
+static inline gfloat
+gradient_rel (const gfloat *top_ptr,
+              const gfloat *mid_ptr,
+              const gfloat *down_ptr,
+              gint          x)
+{
+  gfloat  dx;
+  gfloat  dy;
+  gdouble YSum; // sum of CIE Y values
+
+  dx = (mid_ptr[(x-1)] - mid_ptr[(x+1)]);
+  dy = (top_ptr[x] - down_ptr[x]);
+  YSum = (mid_ptr[(x-1)] + mid_ptr[(x+1)] + top_ptr[x] + down_ptr[x]);
+
+  if (fabs (YSum) > 0.0001)
+    return sqrt (POW2(dx) + POW2(dy)) * (4.0 / YSum) * 0.5;
+
+  return 0.0;
+}
+
+static inline void
+luminance_row (const gfloat  *rgba,
+               gfloat        *Y,
+               gint           n_pixels,
+               const gdouble *luminance)
+{
+  gint i;
+
+  for (i = 0; i < n_pixels; i++)
+    Y[i] = rgba[i * 4 + 0] * luminance[0] + rgba[i * 4 + 1] * luminance[1] + rgba[i * 4 + 2] * luminance[2];
+}
+
+static gboolean
+process (GeglOperation       *operation,
+         GeglBuffer          *input,
+         GeglBuffer          *aux,
+         GeglBuffer          *output,
+         const GeglRectangle *result,
+         gint                 level)
+{
+  GeglProperties *o           = GEGL_PROPERTIES (operation);
+  const Babl     *format      = gegl_operation_get_format (operation, "output");
+  const Babl     *gray_format = babl_format_with_space ("Y float", format);
+  GeglBufferIterator *iter;
+  gfloat *in_buf = NULL, *aux_buf = NULL;
+  gfloat *Yin_buf = NULL, *Yaux_buf = NULL;
+  gint    buf_pixels = 0;
+  gdouble luminance[3];
+  gfloat  wp[4], Ywp[1];
+  gfloat  factor2neutral[3];
+  gdouble scale = 1.0 / (1 << level);   /* rectangles are at level */
+  gint    c;
+  ImmanuelTraceEvent trace;
+  ImmanuelScratch   *scratch;
+
+  immanuel_trace_begin (&trace, NULL, "immanuel:exposure_map", NULL, result, level);
+  scratch = immanuel_scratch_begin ();
+
+  gegl_color_get_pixel (o->wp_color, format, wp);
+  gegl_color_get_pixel (o->wp_color, gray_format, Ywp);
+
+  babl_space_get_rgb_luminance (babl_format_get_space (format),
+                                &luminance[0], &luminance[1], &luminance[2]);
+
+  /* factor to convert the whitepoint tinted image to neutral */
+  for (c = 0; c < 3; c++)
+    factor2neutral[c] = safe_divide (Ywp[0], wp[c]);
+
+  iter = gegl_buffer_iterator_new (output, result, level, format,
+                                   GEGL_ACCESS_WRITE, GEGL_ABYSS_NONE, 1);
+
+  while (gegl_buffer_iterator_next (iter))
+    {
+      const GeglRectangle *roi = &iter->items[0].roi;
+      gfloat              *out = iter->items[0].data;
+      GeglRectangle        src_rect = get_enlarged_input (operation, roi);
+      gint                 src_pixels = src_rect.width * src_rect.height;
+      gint                 x, y;
+
+      /* the iterator wrote back the last tile and mapped this one */
+      immanuel_trace_mark (&trace, IMMANUEL_TRACE_STORE);
+
+      if (src_pixels > buf_pixels)
+        {
+          in_buf     = immanuel_scratch_new (scratch, gfloat, src_pixels * 4);
+          aux_buf    = immanuel_scratch_new0 (scratch, gfloat, src_pixels * 4);
+          Yin_buf    = immanuel_scratch_new (scratch, gfloat, src_pixels);
+          Yaux_buf   = immanuel_scratch_new0 (scratch, gfloat, src_pixels);
+          buf_pixels = src_pixels;
+          immanuel_trace_scratch (&trace, immanuel_scratch_used (scratch));
+        }
+
+      gegl_buffer_get (input, &src_rect, scale, format, in_buf,
+                       GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
+      luminance_row (in_buf, Yin_buf, src_pixels, luminance);
+
+      if (aux)
+        {
+          gegl_buffer_get (aux, &src_rect, scale, format, aux_buf,
+                           GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
+          luminance_row (aux_buf, Yaux_buf, src_pixels, luminance);
+        }
+
+      immanuel_trace_mark (&trace, IMMANUEL_TRACE_FETCH);
+
+      for (y = 0; y < roi->height; y++)
+        {
+          const gfloat *top_ptr_Yin   = Yin_buf  + (y + 0) * src_rect.width;
+          const gfloat *mid_ptr_Yin   = Yin_buf  + (y + 1) * src_rect.width;
+          const gfloat *down_ptr_Yin  = Yin_buf  + (y + 2) * src_rect.width;
+          const gfloat *top_ptr_Yaux  = Yaux_buf + (y + 0) * src_rect.width;
+          const gfloat *mid_ptr_Yaux  = Yaux_buf + (y + 1) * src_rect.width;
+          const gfloat *down_ptr_Yaux = Yaux_buf + (y + 2) * src_rect.width;
+          const gfloat *row_aux       = aux_buf + (y + 1) * src_rect.width * 4;
+          gfloat       *row_out       = out + y * roi->width * 4;
+
+          for (x = 1; x < src_rect.width - 1; x++)
+            {
+              const gfloat *old  = row_aux + x * 4;
+              gfloat       *dst  = row_out + (x - 1) * 4;
+              gfloat        yNew = mid_ptr_Yin[x];
+              gfloat        yOld = mid_ptr_Yaux[x];
+              gfloat        cNew_raw, cOld_raw;
+              gfloat        scale_exposure, scale_contrast;
+              gfloat        final[3], gray[3];
+              gfloat        k_neg = G_MAXFLOAT;
+              gfloat        k_pos_max = -G_MAXFLOAT;
+              gfloat        k;
+
+              /* contrast (image gradient relative to luminance), each one
+               * offset by the sum of both
+               */
+              cNew_raw = gradient_rel (top_ptr_Yin,  mid_ptr_Yin,  down_ptr_Yin,  x);
+              cOld_raw = gradient_rel (top_ptr_Yaux, mid_ptr_Yaux, down_ptr_Yaux, x);
+
+              scale_exposure = safe_divide (yNew, yOld);
+              scale_contrast = powf (safe_divide (2.0f * cNew_raw + cOld_raw,
+                                                  2.0f * cOld_raw + cNew_raw),
+                                     o->chroma_scale_gamma);
+
+              for (c = 0; c < 3; c++)
+                {
+                  gfloat new_unc;
+
+                  /* scale exposure of whitebalanced old like layer mode "luminance",
+                   * scale its color by the contrast ratio and invert the whitebalance
+                   */
+                  new_unc  = old[c] * factor2neutral[c] * scale_exposure;
+                  final[c] = safe_divide (yNew + (new_unc - yNew) * scale_contrast,
+                                          factor2neutral[c]);
+                  gray[c]  = safe_divide (yNew, factor2neutral[c]);
+
+                  /* desaturation factors for negative and positive gamut overshoot */
+                  k_neg     = fminf (k_neg, safe_divide (gray[c], gray[c] - fminf (final[c], 0.0f)));
+                  k_pos_max = fmaxf (k_pos_max, safe_divide (fmaxf (final[c] - 1.0f, 0.0f), final[c] - gray[c]));
+                }
+
+              k = fminf (1.0f - k_pos_max, k_neg);
+
+              for (c = 0; c < 3; c++)
+                dst[c] = (final[c] - gray[c]) * k + gray[c];
+
+              dst[3] = old[3];
+            }
+        }
+
+      immanuel_trace_mark (&trace, IMMANUEL_TRACE_COMPUTE);
+    }
+
+  immanuel_trace_mark (&trace, IMMANUEL_TRACE_STORE);
+
+  immanuel_scratch_end (scratch);
+  immanuel_trace_end (&trace);
+
+  return TRUE;
 }
 
 
 static void
 gegl_op_class_init (GeglOpClass *klass)
 {
-  GeglOperationMetaClass *operation_meta_class = GEGL_OPERATION_META_CLASS (klass);
-  GeglOperationClass       *operation_class = GEGL_OPERATION_CLASS (klass);
-
-  operation_class->attach = attach;
+  GeglOperationClass         *operation_class;
+  GeglOperationComposerClass *composer_class;
+
+  operation_class = GEGL_OPERATION_CLASS (klass);
+  composer_class  = GEGL_OPERATION_COMPOSER_CLASS (klass);
+
+  operation_class->prepare                   = prepare;
+  operation_class->get_required_for_output   = get_required_for_output;
+  operation_class->get_invalidated_by_change = get_invalidated_by_change;
+  operation_class->get_bounding_box          = get_bounding_box;
+  operation_class->opencl_support            = FALSE;
+
+  composer_class->process           = process;
+  composer_class->aux_label         = _("original colored image");
+  composer_class->aux_description   = _("holds the original image with "
+                                        "source colors.");
 
   gegl_operation_class_set_keys (operation_class,
     "title",          _("HDR ColorMapper"),
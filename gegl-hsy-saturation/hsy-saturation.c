@@ -0,0 +1,164 @@
+/* This file is an image processing operation for GEGL
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+#include "config.h"
+#include <glib/gi18n-lib.h>
+
+#ifdef GEGL_PROPERTIES
+
+/* define gegl properties
+ * for whitepoint in case the algo runs on non-whitebalanced images.
+ * Select the color that normally represents white / neutral gray
+ */
+property_color (wp_color, _("neutral / white representation"), "white")
+    description (_("Chose a color that represents white or neutral gray. "
+                   "Pixels of this tint have zero saturation."))
+
+#else
+
+#define GEGL_OP_POINT_FILTER
+#define GEGL_OP_NAME     hsy_saturation
+#define GEGL_OP_C_SOURCE hsy-saturation.c
+
+#include "gegl-op.h"
+#include "immanuel-trace.h"
+
+/* Native version of the hsy_saturation.txt graph recipe (saturation,
+ * multiply, component-extract, divide and subtract nodes):
+ *
+ *   Y               CIE Y of the pixel
+ *   factor2neutral  Y (wp) / wp
+ *   saturation      1 - min over rgb of (image * factor2neutral) / Y
+ *
+ * the saturation of the HSL(cie) model, 0 for gray and 1 where a channel
+ * is 0.  It is written to all three color channels, alpha is kept.
+ * Divisions by zero yield zero, like gegl:divide.
+ */
+
+static void
+prepare (GeglOperation *operation)
+{
+  const Babl *format = babl_format_with_space ("RGBA float",
+                           gegl_operation_get_source_space (operation, "input"));
+
+  gegl_operation_set_format (operation, "input",  format);
+  gegl_operation_set_format (operation, "output", format);
+}
+
+static inline gfloat
+safe_divide (gfloat a,
+             gfloat b)
+{
+  return (b == 0.0f) ? 0.0f : a / b;
+}
+
+/* plain compares instead of fminf () and fmaxf (), which have no vector
+ * instruction for NaN arguments
+ */
+static inline gfloat
+min_float (gfloat a,
+           gfloat b)
+{
+  return a < b ? a : b;
+}
+
+static gboolean
+process (GeglOperation       *operation,
+         void                *in_buf,
+         void                *out_buf,
+         glong                n_pixels,
+         const GeglRectangle *roi,
+         gint                 level)
+{
+  GeglProperties *o           = GEGL_PROPERTIES (operation);
+  const Babl     *format      = gegl_operation_get_format (operation, "output");
+  const Babl     *gray_format = babl_format_with_space ("Y float", format);
+  const gfloat   *in          = in_buf;
+  gfloat         *out         = out_buf;
+  gdouble         luminance[3];
+  gfloat          lum_r, lum_g, lum_b;
+  gfloat          wp[4], Ywp[1];
+  gfloat          factor2neutral[3];
+  glong           i;
+  gint            c;
+  ImmanuelTraceEvent trace;
+
+  immanuel_trace_begin (&trace, NULL, "immanuel:hsy-saturation", NULL, roi, level);
+
+  gegl_color_get_pixel (o->wp_color, format, wp);
+  gegl_color_get_pixel (o->wp_color, gray_format, Ywp);
+
+  babl_space_get_rgb_luminance (babl_format_get_space (format),
+                                &luminance[0], &luminance[1], &luminance[2]);
+  lum_r = luminance[0];
+  lum_g = luminance[1];
+  lum_b = luminance[2];
+
+  for (c = 0; c < 3; c++)
+    factor2neutral[c] = safe_divide (Ywp[0], wp[c]);
+
+  for (i = 0; i < n_pixels; i++)
+    {
+      const gfloat *src = in  + i * 4;
+      gfloat       *dst = out + i * 4;
+      gfloat        Y   = src[0] * lum_r + src[1] * lum_g + src[2] * lum_b;
+      gfloat        Ymin;
+      gfloat        saturation;
+
+      Ymin = min_float (min_float (src[0] * factor2neutral[0],
+                                   src[1] * factor2neutral[1]),
+                        src[2] * factor2neutral[2]);
+
+      saturation = 1.0f - safe_divide (Ymin, Y);
+
+      dst[0] = saturation;
+      dst[1] = saturation;
+      dst[2] = saturation;
+      dst[3] = src[3];
+    }
+
+  immanuel_trace_mark (&trace, IMMANUEL_TRACE_COMPUTE);
+  immanuel_trace_end (&trace);
+
+  return TRUE;
+}
+
+
+static void
+gegl_op_class_init (GeglOpClass *klass)
+{
+  GeglOperationClass            *operation_class;
+  GeglOperationPointFilterClass *point_filter_class;
+
+  operation_class    = GEGL_OPERATION_CLASS (klass);
+  point_filter_class = GEGL_OPERATION_POINT_FILTER_CLASS (klass);
+
+  operation_class->prepare        = prepare;
+  operation_class->opencl_support = FALSE;
+
+  point_filter_class->process = process;
+
+  gegl_operation_class_set_keys (operation_class,
+    "title",          _("HSY Saturation"),
+    "name",           "immanuel:hsy-saturation",
+    "categories",     "color",
+    "description",  _("saturation of the HSL(cie) color model, 1 - min(r,g,b) / Y, as gray image - native version of hsy_saturation.txt"),
+    NULL);
+}
+
+#endif
@@ -24,15 +24,20 @@
 
 #ifdef GEGL_PROPERTIES
 
-// property_double (viewing_angle, _("image viewing angle in degree"), 360.0)
-// description (_("viewing angle in horizontal direction in degree"))
-// value_range (1.0, 360.0) /* arbitrarily large number */
-// ui_range(5.0, 150.0) /* for the slider in the user interface */
+property_double (radius, _("radius"), 0.0)
+   description (_("radius of the window the density is averaged over, in pixels; 0 for the density of each pixel"))
+   value_range (0.0, 1000.0)
+   ui_range    (0.0, 200.0)
+   ui_gamma    (2.0)
 
-// property_double (image_width, _("Image Width"), 5196)
-//    description (_("horizontal width of image in pixels"))
-//    value_range (1.0, 10000) /* arbitrarily large number */
-//    ui_range(300, 8000) /* for the slider in the user interface */
+property_double (viewing_angle, _("image viewing angle in degree"), 0.0)
+   description (_("angle the longer image side covers when viewed, in degree; sets the radius to the foveal field of view instead, 0 for the radius property"))
+   value_range (0.0, 360.0)
+   ui_range    (0.0, 150.0)
+
+property_int (scales, _("scales"), 1)
+   description (_("number of windows output as components, each one about twice the size of the one before: radius (radius + 1) * 2^i - 1"))
+   value_range (1, 4)
 
 #else
 
@@ -40,9 +45,70 @@
 #define GEGL_OP_NAME         image_density
 #define GEGL_OP_C_SOURCE     image-density.c
 
-#define POW2(x) ((x)*(x))
+/* the field of view of the fovea, in degree, the window the density is
+ * perceived over when viewing_angle is set
+ */
+#define FOVEA_ANGLE 2.0
+
+/* widest window radius in pixels of the level it is averaged on; wider
+ * windows are averaged on the coarser mipmap level that brings them
+ * below, so the block and summed area table of a band stay about the
+ * size of the band whatever the radius
+ */
+#define WINDOW_MAX_RADIUS 64
+
+/* level pixels read around the windows of a band: the neighbours of the
+ * window border pixels, the window pixels snapped outward to the coarser
+ * level and the bilinear neighbour
+ */
+#define WINDOW_BORDER 3
 
 #include "gegl-op.h"
+#include "immanuel-trace.h"
+#include "immanuel-scratch.h"
+#include "immanuel-stencils.h"
+
+static gdouble
+max_dimension (GeglOperation *operation)
+{
+  GeglRectangle *in_rect = gegl_operation_source_get_bounding_box (operation, "input");
+
+  return in_rect ? MAX (in_rect->width, in_rect->height) : 0.0;
+}
+
+/* radius of scale i in full resolution pixels */
+static gdouble
+scale_radius (GeglProperties *o,
+              gdouble         dimension,
+              gint            i)
+{
+  gdouble radius = o->radius;
+
+  if (o->viewing_angle > 0.0)
+    radius = 0.5 * dimension * FOVEA_ANGLE / o->viewing_angle;
+
+  return (radius + 1.0) * (1 << i) - 1.0;
+}
+
+/* mipmap level scale i is averaged on at full resolution, its radius
+ * there at most WINDOW_MAX_RADIUS pixels
+ */
+static gint
+scale_octave (GeglProperties *o,
+              gdouble         dimension,
+              gint            i)
+{
+  gdouble radius = scale_radius (o, dimension, i);
+  gint    octave = 0;
+
+  while (radius > WINDOW_MAX_RADIUS)
+    {
+      radius /= 2.0;
+      octave++;
+    }
+
+  return octave;
+}
 
 static void
 prepare (GeglOperation *operation)
@@ -50,14 +116,28 @@ prepare (GeglOperation *operation)
   const Babl *space = gegl_operation_get_source_space (operation, "input");
   GeglOperationAreaFilter *area       = GEGL_OPERATION_AREA_FILTER (operation);
   const Babl              *rgb_format = babl_format_with_space ("Y float", space);
-  const Babl              *out_format = babl_format_n (babl_type ("float"), 1);
+  GeglProperties          *o          = GEGL_PROPERTIES (operation);
+  const Babl              *out_format = babl_format_n (babl_type ("float"), o->scales);
+  gdouble                  dimension  = max_dimension (operation);
+  gint                     halo       = 1;
+  gint                     i;
+
+  /* the border of every window at its octave, in full resolution pixels;
+   * process () averages on the level or the octave, whichever is coarser
+   */
+  if (o->scales > 1 || o->radius > 0.0 || o->viewing_angle > 0.0)
+    for (i = 0; i < o->scales; i++)
+      {
+        gint octave = scale_octave (o, dimension, i);
+        gint radius = (gint) ceil (scale_radius (o, dimension, i) / (1 << octave));
+
+        halo = MAX (halo, (radius + WINDOW_BORDER) << octave);
+      }
 
   area->left   =
   area->top    =
   area->right  =
-  area->bottom = 1;
-
-//  out_format = babl_format_n (babl_type ("float"), 1);
+  area->bottom = halo;
 
   gegl_operation_set_format (operation, "input",  rgb_format);
   gegl_operation_set_format (operation, "output", out_format);
@@ -78,16 +158,152 @@ get_bounding_box (GeglOperation *operation)
   return result;
 }
 
-static gboolean
-process (GeglOperation       *operation,
-         GeglBuffer          *input,
-         GeglBuffer          *output,
-         const GeglRectangle *roi,
-         gint                 level)
+/* floor (value / 2^shift) for negative values as well */
+static inline gint
+floor_shift (gint value,
+             gint shift)
+{
+  return value >= 0 ? value >> shift : -((-value + (1 << shift) - 1) >> shift);
+}
+
+/* one band of rows, processed by one thread */
+typedef struct
 {
-//  GeglProperties  *o          = GEGL_PROPERTIES (operation);
-  const Babl      *in_format  = gegl_operation_get_format (operation, "input");
-  const Babl      *out_format = gegl_operation_get_format (operation, "output");
+  GeglOperation *operation;
+  GeglBuffer    *input;
+  GeglBuffer    *output;
+  gint           level;
+  gfloat         max_dimension;
+  gint           n_scales;
+  gint           shift[4];    /* of each scale, octaves above level */
+  gint           radius[4];   /* of each scale, in pixels at level + shift */
+  ImmanuelTraceEvent *trace;  /* of the process () call */
+} DensityBand;
+
+/* with windows: the scales of the same shift are averaged together, the
+ * pixels of the band at level + shift and their halo are read as one
+ * block and the windows computed from it, then interpolated bilinearly
+ * from the window pixel centers to the ones of the band
+ */
+static void
+process_band_windowed (DensityBand         *band,
+                       ImmanuelTraceEvent  *event,
+                       ImmanuelScratch     *scratch,
+                       const GeglRectangle *roi,
+                       const Babl          *in_format,
+                       const Babl          *out_format)
+{
+  const gint     n_scales     = band->n_scales;
+  gfloat        *out;
+  gfloat        *block        = NULL;
+  gdouble       *sat          = NULL;
+  gfloat        *windows      = NULL;
+  gsize          block_size   = 0;
+  gsize          sat_size     = 0;
+  gsize          windows_size = 0;
+  gint           first, last, i, x, y;
+
+  out = immanuel_scratch_new (scratch, gfloat, (gsize) roi->width * roi->height * n_scales);
+
+  for (first = 0; first < n_scales; first = last)
+    {
+      const gint    shift = band->shift[first];
+      const gfloat  f     = 1 << shift;
+      gint          n_group;
+      gint          R;
+      gint          x1, y1;
+      GeglRectangle window_rect;   /* at level + shift */
+      GeglRectangle block_rect;
+
+      for (last = first + 1; last < n_scales && band->shift[last] == shift; last++);
+      n_group = last - first;
+      R       = band->radius[last - 1];
+
+      /* the window pixels around the band pixel centers and their
+       * bilinear neighbours
+       */
+      window_rect.x      = floor_shift (roi->x, shift) - 1;
+      window_rect.y      = floor_shift (roi->y, shift) - 1;
+      x1                 = floor_shift (roi->x + roi->width  - 1, shift) + 2;
+      y1                 = floor_shift (roi->y + roi->height - 1, shift) + 2;
+      window_rect.width  = x1 - window_rect.x;
+      window_rect.height = y1 - window_rect.y;
+
+      block_rect.x      = window_rect.x - R - 1;
+      block_rect.y      = window_rect.y - R - 1;
+      block_rect.width  = window_rect.width  + 2 * R + 2;
+      block_rect.height = window_rect.height + 2 * R + 2;
+
+      if ((gsize) block_rect.width * block_rect.height > block_size)
+        {
+          block_size = (gsize) block_rect.width * block_rect.height;
+          block      = immanuel_scratch_new (scratch, gfloat, block_size);
+        }
+      if (immanuel_density_sat_size (window_rect.width, window_rect.height, R) > sat_size)
+        {
+          sat_size = immanuel_density_sat_size (window_rect.width, window_rect.height, R);
+          sat      = immanuel_scratch_new (scratch, gdouble, sat_size);
+        }
+      if ((gsize) window_rect.width * window_rect.height * n_group > windows_size)
+        {
+          windows_size = (gsize) window_rect.width * window_rect.height * n_group;
+          windows      = immanuel_scratch_new (scratch, gfloat, windows_size);
+        }
+      immanuel_trace_scratch (event, immanuel_scratch_used (scratch));
+
+      gegl_buffer_get (band->input, &block_rect, 1.0 / (1 << (band->level + shift)),
+                       in_format, block, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
+      immanuel_trace_mark (event, IMMANUEL_TRACE_FETCH);
+
+      immanuel_density_windows (block, window_rect.width, window_rect.height,
+                                band->radius + first, n_group, band->max_dimension / f,
+                                sat, windows, (ptrdiff_t) window_rect.width * n_group);
+
+      for (y = 0; y < roi->height; y++)
+        {
+          const gfloat  v   = (roi->y + y + 0.5f) / f - 0.5f - window_rect.y;
+          const gint    j   = (gint) floorf (v);
+          const gfloat  tv  = v - j;
+          const gfloat *w0  = windows + (gsize) j * window_rect.width * n_group;
+          const gfloat *w1  = w0 + (gsize) window_rect.width * n_group;
+          gfloat       *dst = out + (gsize) y * roi->width * n_scales + first;
+
+          for (x = 0; x < roi->width; x++)
+            {
+              const gfloat u  = (roi->x + x + 0.5f) / f - 0.5f - window_rect.x;
+              const gint   k  = (gint) floorf (u);
+              const gfloat tu = u - k;
+
+              for (i = 0; i < n_group; i++)
+                {
+                  const gfloat *c0     = w0 + k * n_group + i;
+                  const gfloat *c1     = w1 + k * n_group + i;
+                  const gfloat  top    = c0[0] + (c0[n_group] - c0[0]) * tu;
+                  const gfloat  bottom = c1[0] + (c1[n_group] - c1[0]) * tu;
+
+                  dst[x * n_scales + i] = top + (bottom - top) * tv;
+                }
+            }
+        }
+      immanuel_trace_mark (event, IMMANUEL_TRACE_COMPUTE);
+    }
+
+  gegl_buffer_set (band->output, roi, band->level, out_format, out,
+                   GEGL_AUTO_ROWSTRIDE);
+  immanuel_trace_mark (event, IMMANUEL_TRACE_STORE);
+}
+
+static void
+process_band (const GeglRectangle *roi,
+              gpointer             user_data)
+{
+  DensityBand     *band       = user_data;
+  GeglBuffer      *input      = band->input;
+  GeglBuffer      *output     = band->output;
+  gint             level      = band->level;
+  gdouble          scale      = 1.0 / (1 << level);   /* rows are at level */
+  const Babl      *in_format  = gegl_operation_get_format (band->operation, "input");
+  const Babl      *out_format = gegl_operation_get_format (band->operation, "output");
   gfloat *row1;
   gfloat *row2;
   gfloat *row3;
@@ -96,19 +312,30 @@ process (GeglOperation       *operation,
   gfloat *mid_ptr;
   gfloat *down_ptr;
   gfloat *tmp_ptr;
-  gint    x, y;
-//  gint    n_components;
-  gfloat max_dimension = fmax (get_bounding_box (operation).width, get_bounding_box (operation).height);
+  gint    y;
+  gfloat max_dimension = band->max_dimension;
 
   GeglRectangle row_rect;
   GeglRectangle out_rect;
-//  GeglRectangle boundary = *gegl_operation_source_get_bounding_box (operation, "input");
+  ImmanuelTraceEvent event;
+  ImmanuelScratch   *scratch;
+
+  immanuel_trace_begin (&event, band->trace, NULL, NULL, roi, level);
+  scratch = immanuel_scratch_begin ();
 
-//  n_components = babl_format_get_n_components (out_format);
-  row1 = g_new (gfloat, (roi->width + 2) );
-  row2 = g_new (gfloat, (roi->width + 2) );
-  row3 = g_new (gfloat, (roi->width + 2) );
-  row4 = g_new0 (gfloat, roi->width);
+  if (band->n_scales > 1 || band->radius[0] > 0)
+    {
+      process_band_windowed (band, &event, scratch, roi, in_format, out_format);
+      immanuel_scratch_end (scratch);
+      immanuel_trace_end (&event);
+      return;
+    }
+
+  row1 = immanuel_scratch_new (scratch, gfloat, roi->width + 2);
+  row2 = immanuel_scratch_new (scratch, gfloat, roi->width + 2);
+  row3 = immanuel_scratch_new (scratch, gfloat, roi->width + 2);
+  row4 = immanuel_scratch_new0 (scratch, gfloat, roi->width);
+  immanuel_trace_scratch (&event, immanuel_scratch_used (scratch));
 
   top_ptr  = row1;
   mid_ptr  = row2;
@@ -124,11 +351,11 @@ process (GeglOperation       *operation,
   out_rect.height = 1;
 
 
-  gegl_buffer_get (input, &row_rect, 1.0, in_format, top_ptr,
+  gegl_buffer_get (input, &row_rect, scale, in_format, top_ptr,
                    GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
 
   row_rect.y++;
-  gegl_buffer_get (input, &row_rect, 1.0, in_format, mid_ptr,
+  gegl_buffer_get (input, &row_rect, scale, in_format, mid_ptr,
                    GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
 
   for (y = roi->y; y < roi->y + roi->height; y++)
@@ -136,32 +363,16 @@ process (GeglOperation       *operation,
       row_rect.y = y + 1;
       out_rect.y = y;
 
-      gegl_buffer_get (input, &row_rect, 1.0, in_format, down_ptr,
+      gegl_buffer_get (input, &row_rect, scale, in_format, down_ptr,
                        GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
+      immanuel_trace_mark (&event, IMMANUEL_TRACE_FETCH);
 
-      for (x = 1; x < row_rect.width - 1; x++)
-        {
-          gfloat dx;
-          gfloat dy;
-          gfloat magnitude;
-          gdouble recip_avgY; // reciprocal of averaged luminance
-          gdouble delta_rel_sqr;
-
-          dx = (mid_ptr[(x-1)] - mid_ptr[(x+1)]);
-          dy = (top_ptr[x] - down_ptr[x]);
-          recip_avgY = 4.0 / (mid_ptr[(x-1)] + mid_ptr[(x+1)] + top_ptr[x] + down_ptr[x]);
-          /*
-           * FIXME: div_by_zero handling
-           */
-//          magnitude = sqrtf ( ((POW2(dx) + POW2(dy)) / 4.0 / POW2 ( fmax (yAvg, 0.00001f)) * max_dimension) + 1.0 );
-          delta_rel_sqr = 0.25 * (POW2(dx) + POW2(dy)) * POW2(recip_avgY);
-          magnitude = sqrtf (1.0 + (delta_rel_sqr * POW2(max_dimension)));
-
-          row4[(x-1)] = magnitude;
-        }
+      immanuel_density_row (top_ptr, mid_ptr, down_ptr, row4, roi->width, max_dimension);
+      immanuel_trace_mark (&event, IMMANUEL_TRACE_COMPUTE);
 
       gegl_buffer_set (output, &out_rect, level, out_format, row4,
                        GEGL_AUTO_ROWSTRIDE);
+      immanuel_trace_mark (&event, IMMANUEL_TRACE_STORE);
 
       tmp_ptr = top_ptr;
       top_ptr = mid_ptr;
@@ -169,10 +380,48 @@ process (GeglOperation       *operation,
       down_ptr = tmp_ptr;
     }
 
-  g_free (row1);
-  g_free (row2);
-  g_free (row3);
-  g_free (row4);
+  immanuel_scratch_end (scratch);
+  immanuel_trace_end (&event);
+}
+
+static gboolean
+process (GeglOperation       *operation,
+         GeglBuffer          *input,
+         GeglBuffer          *output,
+         const GeglRectangle *roi,
+         gint                 level)
+{
+  GeglProperties *o         = GEGL_PROPERTIES (operation);
+  gdouble         dimension = max_dimension (operation);
+  /* the relative gradient is per pixel of level, so is the dimension */
+  DensityBand     band      = { operation, input, output, level,
+                                dimension / (1 << level), o->scales };
+  gint            i;
+  ImmanuelTraceEvent trace;
+
+  immanuel_trace_begin (&trace, NULL, "immanuel:image-density",
+                        o->scales > 1 || o->radius > 0.0 || o->viewing_angle > 0.0 ? "windowed" : NULL,
+                        roi, level);
+  band.trace = &trace;
+
+  /* windows in full resolution pixels, as pixels at their octave, or at
+   * level when that is coarser
+   */
+  for (i = 0; i < band.n_scales; i++)
+    {
+      band.shift[i]  = MAX (scale_octave (o, dimension, i) - level, 0);
+      band.radius[i] = (gint) floor (scale_radius (o, dimension, i) / (1 << (level + band.shift[i])) + 0.5);
+    }
+
+  /* split into row bands, each one with its own 3-row ring buffer, or its
+   * blocks of rows with the window halo and summed area table per shift
+   */
+  gegl_parallel_distribute_area (roi,
+                                 gegl_operation_get_pixels_per_thread (operation),
+                                 GEGL_SPLIT_STRATEGY_HORIZONTAL,
+                                 process_band, &band);
+
+  immanuel_trace_end (&trace);
 
   return TRUE;
 }
@@ -190,13 +439,15 @@ gegl_op_class_init (GeglOpClass *klass)
   operation_class->prepare          = prepare;
   operation_class->get_bounding_box = get_bounding_box;
   operation_class->opencl_support   = FALSE;
+  operation_class->threaded         = TRUE;
 
   gegl_operation_class_set_keys (operation_class,
     "name",        "immanuel:image-density",
     "title",       _("Image Density"),
     "categories",  "HDR",
     "description", _("expresses contrast as compression ratio"
-                     "image compression compared to flatmap"),
+                     "image compression compared to flatmap, "
+                     "optionally averaged over windows of one or more radii"),
     NULL);
 }
 
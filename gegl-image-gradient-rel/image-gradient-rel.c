@@ -23,6 +23,22 @@
 
 #ifdef GEGL_PROPERTIES
 
+enum_start (gegl_image_gradient_rel_output)
+   enum_value (GEGL_IMAGE_GRADIENT_REL_OUTPUT_GRADIENT, "gradient", N_("relative gradient"))
+   enum_value (GEGL_IMAGE_GRADIENT_REL_OUTPUT_Y_GRADIENT, "y-gradient", N_("Y, relative gradient"))
+   enum_value (GEGL_IMAGE_GRADIENT_REL_OUTPUT_Y_GRADIENT_DXDY, "y-gradient-dxdy", N_("Y, relative gradient, dY/dx, dY/dy"))
+enum_end (GeglImageGradientRelOutput)
+
+property_enum (output, _("output"),
+               GeglImageGradientRelOutput, gegl_image_gradient_rel_output,
+               GEGL_IMAGE_GRADIENT_REL_OUTPUT_GRADIENT)
+   description (_("components of the output: the relative gradient |grad Y| / Y alone, or packed with the (smoothed) Y it was taken from and the gradient of Y per full resolution pixel, so consumers get lightness and contrast from one pass"))
+
+property_double (sigma, _("smoothing sigma"), 0.0)
+   description (_("standard deviation of a gaussian smoothing Y before the gradient, in pixels; 0 for none"))
+   value_range (0.0, 100.0)
+   ui_range    (0.0, 10.0)
+   ui_gamma    (1.5)
 
 #else
 
@@ -30,9 +46,10 @@
 #define GEGL_OP_NAME         image_gradient_rel
 #define GEGL_OP_C_SOURCE     image-gradient-rel.c
 
-#define POW2(x) ((x)*(x))
-
 #include "gegl-op.h"
+#include "immanuel-trace.h"
+#include "immanuel-scratch.h"
+#include "immanuel-stencils.h"
 
 static void
 prepare (GeglOperation *operation)
@@ -40,14 +57,26 @@ prepare (GeglOperation *operation)
   const Babl *space = gegl_operation_get_source_space (operation, "input");
   GeglOperationAreaFilter *area       = GEGL_OPERATION_AREA_FILTER (operation);
   const Babl              *rgb_format = babl_format_with_space ("Y float", space);
-  const Babl              *out_format = babl_format_n (babl_type ("float"), 2);
+  GeglProperties          *o          = GEGL_PROPERTIES (operation);
+  const Babl              *out_format;
 
   area->left   =
   area->top    =
   area->right  =
-  area->bottom = 1;
+  area->bottom = immanuel_gradient_halo (o->sigma);
 
-  out_format = babl_format_n (babl_type ("float"), 1);
+  switch (o->output)
+    {
+    case GEGL_IMAGE_GRADIENT_REL_OUTPUT_Y_GRADIENT:
+      out_format = babl_format_n (babl_type ("float"), 2);
+      break;
+    case GEGL_IMAGE_GRADIENT_REL_OUTPUT_Y_GRADIENT_DXDY:
+      out_format = babl_format_n (babl_type ("float"), 4);
+      break;
+    default:
+      out_format = babl_format_n (babl_type ("float"), 1);
+      break;
+    }
 
   gegl_operation_set_format (operation, "input",  rgb_format);
   gegl_operation_set_format (operation, "output", out_format);
@@ -68,15 +97,86 @@ get_bounding_box (GeglOperation *operation)
   return result;
 }
 
-static gboolean
-process (GeglOperation       *operation,
-         GeglBuffer          *input,
-         GeglBuffer          *output,
-         const GeglRectangle *roi,
-         gint                 level)
+/* one band of rows, processed by one thread */
+typedef struct
+{
+  GeglOperation        *operation;
+  GeglBuffer           *input;
+  GeglBuffer           *output;
+  gint                  level;
+  gboolean              smooth;   /* gauss and halo are set */
+  ImmanuelGaussian      gauss;
+  gint                  halo;     /* pixels at level around the band */
+  ImmanuelTraceEvent   *trace;    /* of the process () call */
+} GradientBand;
+
+/* with smoothing: the band and its halo are read as one block, smoothed
+ * in place and the gradient rows taken from it
+ */
+static void
+process_band_smoothed (GradientBand        *band,
+                       ImmanuelTraceEvent  *event,
+                       ImmanuelScratch     *scratch,
+                       const GeglRectangle *roi,
+                       gdouble              scale,
+                       const Babl          *in_format,
+                       const Babl          *out_format,
+                       gint                 n_components)
+{
+  const gint     halo = band->halo;
+  GeglRectangle  block_rect;
+  GeglRectangle  out_rect;
+  gfloat        *block;
+  gfloat        *out_row;
+  gint           y;
+
+  block_rect.x      = roi->x - halo;
+  block_rect.y      = roi->y - halo;
+  block_rect.width  = roi->width  + 2 * halo;
+  block_rect.height = roi->height + 2 * halo;
+
+  block   = immanuel_scratch_new (scratch, gfloat, (gsize) block_rect.width * block_rect.height);
+  out_row = immanuel_scratch_new0 (scratch, gfloat, roi->width * n_components);
+  immanuel_trace_scratch (event, immanuel_scratch_used (scratch));
+
+  gegl_buffer_get (band->input, &block_rect, scale, in_format, block,
+                   GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
+  immanuel_trace_mark (event, IMMANUEL_TRACE_FETCH);
+
+  immanuel_gaussian_rows    (block, block_rect.width, block_rect.height, &band->gauss);
+  immanuel_gaussian_columns (block, block_rect.width, block_rect.height, &band->gauss);
+
+  out_rect.x      = roi->x;
+  out_rect.width  = roi->width;
+  out_rect.height = 1;
+
+  for (y = 0; y < roi->height; y++)
+    {
+      /* row y of the band and its neighbours, from one pixel left of it */
+      const gfloat *mid_ptr = block + (gsize) (y + halo) * block_rect.width + halo - 1;
+
+      immanuel_gradient_row (mid_ptr - block_rect.width, mid_ptr, mid_ptr + block_rect.width,
+                             out_row, roi->width, n_components, scale);
+      immanuel_trace_mark (event, IMMANUEL_TRACE_COMPUTE);
+
+      out_rect.y = roi->y + y;
+      gegl_buffer_set (band->output, &out_rect, band->level, out_format, out_row,
+                       GEGL_AUTO_ROWSTRIDE);
+      immanuel_trace_mark (event, IMMANUEL_TRACE_STORE);
+    }
+}
+
+static void
+process_band (const GeglRectangle *roi,
+              gpointer             user_data)
 {
-  const Babl      *in_format  = gegl_operation_get_format (operation, "input");
-  const Babl      *out_format = gegl_operation_get_format (operation, "output");
+  GradientBand    *band       = user_data;
+  GeglBuffer      *input      = band->input;
+  GeglBuffer      *output     = band->output;
+  gint             level      = band->level;
+  gdouble          scale      = 1.0 / (1 << level);   /* rows are at level */
+  const Babl      *in_format  = gegl_operation_get_format (band->operation, "input");
+  const Babl      *out_format = gegl_operation_get_format (band->operation, "output");
   gfloat *row1;
   gfloat *row2;
   gfloat *row3;
@@ -85,17 +185,32 @@ process (GeglOperation       *operation,
   gfloat *mid_ptr;
   gfloat *down_ptr;
   gfloat *tmp_ptr;
-  gint    x, y;
+  gint    y;
   gint    n_components;
 
   GeglRectangle row_rect;
   GeglRectangle out_rect;
+  ImmanuelTraceEvent event;
+  ImmanuelScratch   *scratch;
 
   n_components = babl_format_get_n_components (out_format);
-  row1 = g_new (gfloat, (roi->width + 2) );
-  row2 = g_new (gfloat, (roi->width + 2) );
-  row3 = g_new (gfloat, (roi->width + 2) );
-  row4 = g_new0 (gfloat, roi->width * n_components);
+
+  immanuel_trace_begin (&event, band->trace, NULL, NULL, roi, level);
+  scratch = immanuel_scratch_begin ();
+
+  if (band->smooth)
+    {
+      process_band_smoothed (band, &event, scratch, roi, scale, in_format, out_format, n_components);
+      immanuel_scratch_end (scratch);
+      immanuel_trace_end (&event);
+      return;
+    }
+
+  row1 = immanuel_scratch_new (scratch, gfloat, roi->width + 2);
+  row2 = immanuel_scratch_new (scratch, gfloat, roi->width + 2);
+  row3 = immanuel_scratch_new (scratch, gfloat, roi->width + 2);
+  row4 = immanuel_scratch_new0 (scratch, gfloat, roi->width * n_components);
+  immanuel_trace_scratch (&event, immanuel_scratch_used (scratch));
 
   top_ptr  = row1;
   mid_ptr  = row2;
@@ -110,11 +225,11 @@ process (GeglOperation       *operation,
   out_rect.width  = roi->width;
   out_rect.height = 1;
 
-  gegl_buffer_get (input, &row_rect, 1.0, in_format, top_ptr,
+  gegl_buffer_get (input, &row_rect, scale, in_format, top_ptr,
                    GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
 
   row_rect.y++;
-  gegl_buffer_get (input, &row_rect, 1.0, in_format, mid_ptr,
+  gegl_buffer_get (input, &row_rect, scale, in_format, mid_ptr,
                    GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
 
   for (y = roi->y; y < roi->y + roi->height; y++)
@@ -122,37 +237,16 @@ process (GeglOperation       *operation,
       row_rect.y = y + 1;
       out_rect.y = y;
 
-      gegl_buffer_get (input, &row_rect, 1.0, in_format, down_ptr,
+      gegl_buffer_get (input, &row_rect, scale, in_format, down_ptr,
                        GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_CLAMP);
+      immanuel_trace_mark (&event, IMMANUEL_TRACE_FETCH);
 
-      for (x = 1; x < row_rect.width - 1; x++)
-        {
-          gfloat dx;
-          gfloat dy;
-          gfloat magnitude;
-          gdouble YSum; // sum of CIE Y values
-          gdouble recip_avgY; // reciprocal of averaged luminance
-
-          dx = (mid_ptr[(x-1)] - mid_ptr[(x+1)]);
-          dy = (top_ptr[x] - down_ptr[x]);
-          YSum = (mid_ptr[(x-1)] + mid_ptr[(x+1)] + top_ptr[x] + down_ptr[x]);
-
-          if (fabs(YSum) > 0.0001)
-          {
-            recip_avgY = 4.0 / YSum;
-//            magnitude = fmax (sqrt (POW2(dx) + POW2(dy)), 0.001) * recip_avgY * 0.5;
-            magnitude = sqrt (POW2(dx) + POW2(dy)) * recip_avgY * 0.5;
-          }
-          else
-          {
-            magnitude = 0.0;
-          }
-
-          row4[(x-1) * n_components] = magnitude;
-        }
+      immanuel_gradient_row (top_ptr, mid_ptr, down_ptr, row4, roi->width, n_components, scale);
+      immanuel_trace_mark (&event, IMMANUEL_TRACE_COMPUTE);
 
       gegl_buffer_set (output, &out_rect, level, out_format, row4,
                        GEGL_AUTO_ROWSTRIDE);
+      immanuel_trace_mark (&event, IMMANUEL_TRACE_STORE);
 
       tmp_ptr = top_ptr;
       top_ptr = mid_ptr;
@@ -160,10 +254,42 @@ process (GeglOperation       *operation,
       down_ptr = tmp_ptr;
     }
 
-  g_free (row1);
-  g_free (row2);
-  g_free (row3);
-  g_free (row4);
+  immanuel_scratch_end (scratch);
+  immanuel_trace_end (&event);
+}
+
+static gboolean
+process (GeglOperation       *operation,
+         GeglBuffer          *input,
+         GeglBuffer          *output,
+         const GeglRectangle *roi,
+         gint                 level)
+{
+  GeglProperties     *o     = GEGL_PROPERTIES (operation);
+  GradientBand        band  = { operation, input, output, level };
+  gdouble             sigma = o->sigma / (1 << level);   /* in pixels at level */
+  ImmanuelTraceEvent  trace;
+
+  immanuel_trace_begin (&trace, NULL, "immanuel:image-gradient-rel",
+                        sigma >= IMMANUEL_GAUSSIAN_SIGMA_MIN ? "smoothed" : NULL, roi, level);
+  band.trace = &trace;
+
+  if (sigma >= IMMANUEL_GAUSSIAN_SIGMA_MIN)
+    {
+      band.smooth = TRUE;
+      band.halo   = immanuel_gradient_halo (sigma);
+      immanuel_gaussian_init (&band.gauss, sigma);
+    }
+
+  /* split into row bands, each one with its own 3-row ring buffer, or its
+   * block of rows with halo when smoothing
+   */
+  gegl_parallel_distribute_area (roi,
+                                 gegl_operation_get_pixels_per_thread (operation),
+                                 GEGL_SPLIT_STRATEGY_HORIZONTAL,
+                                 process_band, &band);
+
+  immanuel_trace_end (&trace);
 
   return TRUE;
 }
@@ -181,13 +307,15 @@ gegl_op_class_init (GeglOpClass *klass)
   operation_class->prepare          = prepare;
   operation_class->get_bounding_box = get_bounding_box;
   operation_class->opencl_support   = FALSE;
+  operation_class->threaded         = TRUE;
 
   gegl_operation_class_set_keys (operation_class,
     "name",        "immanuel:image-gradient-rel",
     "title",       _("image gradient relative"),
     "categories",  "edge-detect",
     "description", _("Compute gradient magnitude "
-                     "central differences relative to its lightness"),
+                     "central differences relative to its lightness, "
+                     "optionally of a gaussian smoothed lightness"),
     NULL);
 }
 
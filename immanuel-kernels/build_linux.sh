@@ -0,0 +1,11 @@
+#!/bin/bash
+
+# Install under $HOME/opt by default, like the plug-ins:
+export PREFIX=$HOME/opt
+
+SRC_DIR=$(pwd)
+BUILD_DIR=${SRC_DIR}/obj-$(arch)
+mkdir -p $BUILD_DIR && cd $BUILD_DIR && meson -Dprefix=$PREFIX --buildtype=release $SRC_DIR && ninja && ninja install
+
+# time the kernels alone, without GEGL
+meson test --benchmark --verbose
@@ -0,0 +1,117 @@
+/* This file is part of the color-mapper GEGL operation
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* 8-wide AVX2 kernels, compiled with -mavx2 */
+
+#include <immintrin.h>
+
+#define VW                8
+#define VF                __m256
+#define VM                __m256
+#define VSET1(f)          _mm256_set1_ps (f)
+#define VLOADU(p)         _mm256_loadu_ps (p)
+#define VSTOREU(p, v)     _mm256_storeu_ps ((p), (v))
+#define VADD(a, b)        _mm256_add_ps ((a), (b))
+#define VSUB(a, b)        _mm256_sub_ps ((a), (b))
+#define VMUL(a, b)        _mm256_mul_ps ((a), (b))
+#define VDIV(a, b)        _mm256_div_ps ((a), (b))
+#define VSQRT(a)          _mm256_sqrt_ps (a)
+#define VMIN(a, b)        _mm256_min_ps ((a), (b))
+#define VMAX(a, b)        _mm256_max_ps ((a), (b))
+#define VGT(a, b)         _mm256_cmp_ps ((a), (b), _CMP_GT_OQ)
+#define VNE(a, b)         _mm256_cmp_ps ((a), (b), _CMP_NEQ_OQ)
+#define VSELECT(m, a, b)  _mm256_blendv_ps ((b), (a), (m))
+
+/* fast_math: 12 bit estimates refined by one Newton-Raphson step */
+static inline __m256
+vrcp_avx2 (__m256 a)
+{
+  const __m256 r = _mm256_rcp_ps (a);
+
+  return _mm256_mul_ps (r, _mm256_sub_ps (_mm256_set1_ps (2.0f), _mm256_mul_ps (a, r)));
+}
+
+static inline __m256
+vrsqrt_avx2 (__m256 a)
+{
+  const __m256 r = _mm256_rsqrt_ps (a);
+
+  return _mm256_mul_ps (r, _mm256_sub_ps (_mm256_set1_ps (1.5f),
+                                          _mm256_mul_ps (_mm256_mul_ps (_mm256_set1_ps (0.5f), a),
+                                                         _mm256_mul_ps (r, r))));
+}
+
+#define VRCP(a)           vrcp_avx2 (a)
+#define VRSQRT(a)         vrsqrt_avx2 (a)
+#define VROUND(a)         _mm256_round_ps ((a), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define VFLOOR(a)         _mm256_floor_ps (a)
+#define VGATHER(t, i)     _mm256_i32gather_ps ((t), _mm256_cvttps_epi32 (i), 4)
+#define VLDEXP(a, e)      _mm256_castsi256_ps (_mm256_add_epi32 (_mm256_castps_si256 (a),            \
+                                                                 _mm256_slli_epi32 (_mm256_cvtps_epi32 (e), 23)))
+
+#define VFREXP(x, m, e)                                               \
+  do {                                                                \
+    const __m256i bits_ = _mm256_castps_si256 ((x));                  \
+    (e) = _mm256_cvtepi32_ps (_mm256_sub_epi32 (_mm256_srli_epi32 (bits_, 23), \
+                                                _mm256_set1_epi32 (127)));     \
+    (m) = _mm256_castsi256_ps (_mm256_or_si256 (_mm256_and_si256 (bits_, _mm256_set1_epi32 (0x7fffff)), \
+                                                _mm256_set1_epi32 (0x3f800000))); \
+  } while (0)
+
+/* 8 RGBA pixels are four registers of two pixels each, transpose them
+ * as two 4x4 blocks, one per 128 bit lane
+ */
+#define VLOAD_RGBA(p, r, g, b, a)                                     \
+  do {                                                                \
+    const __m256 v0_ = _mm256_loadu_ps ((p));                         \
+    const __m256 v1_ = _mm256_loadu_ps ((p) + 8);                     \
+    const __m256 v2_ = _mm256_loadu_ps ((p) + 16);                    \
+    const __m256 v3_ = _mm256_loadu_ps ((p) + 24);                    \
+    const __m256 u0_ = _mm256_permute2f128_ps (v0_, v2_, 0x20);       \
+    const __m256 u1_ = _mm256_permute2f128_ps (v0_, v2_, 0x31);       \
+    const __m256 u2_ = _mm256_permute2f128_ps (v1_, v3_, 0x20);       \
+    const __m256 u3_ = _mm256_permute2f128_ps (v1_, v3_, 0x31);       \
+    const __m256 t0_ = _mm256_unpacklo_ps (u0_, u1_);                 \
+    const __m256 t1_ = _mm256_unpackhi_ps (u0_, u1_);                 \
+    const __m256 t2_ = _mm256_unpacklo_ps (u2_, u3_);                 \
+    const __m256 t3_ = _mm256_unpackhi_ps (u2_, u3_);                 \
+    (r) = _mm256_shuffle_ps (t0_, t2_, _MM_SHUFFLE (1, 0, 1, 0));     \
+    (g) = _mm256_shuffle_ps (t0_, t2_, _MM_SHUFFLE (3, 2, 3, 2));     \
+    (b) = _mm256_shuffle_ps (t1_, t3_, _MM_SHUFFLE (1, 0, 1, 0));     \
+    (a) = _mm256_shuffle_ps (t1_, t3_, _MM_SHUFFLE (3, 2, 3, 2));     \
+  } while (0)
+
+#define VSTORE_RGBA(p, r, g, b, a)                                    \
+  do {                                                                \
+    const __m256 t0_ = _mm256_unpacklo_ps ((r), (g));                 \
+    const __m256 t1_ = _mm256_unpackhi_ps ((r), (g));                 \
+    const __m256 t2_ = _mm256_unpacklo_ps ((b), (a));                 \
+    const __m256 t3_ = _mm256_unpackhi_ps ((b), (a));                 \
+    const __m256 u0_ = _mm256_shuffle_ps (t0_, t2_, _MM_SHUFFLE (1, 0, 1, 0)); \
+    const __m256 u1_ = _mm256_shuffle_ps (t0_, t2_, _MM_SHUFFLE (3, 2, 3, 2)); \
+    const __m256 u2_ = _mm256_shuffle_ps (t1_, t3_, _MM_SHUFFLE (1, 0, 1, 0)); \
+    const __m256 u3_ = _mm256_shuffle_ps (t1_, t3_, _MM_SHUFFLE (3, 2, 3, 2)); \
+    _mm256_storeu_ps ((p),      _mm256_permute2f128_ps (u0_, u1_, 0x20)); \
+    _mm256_storeu_ps ((p) + 8,  _mm256_permute2f128_ps (u2_, u3_, 0x20)); \
+    _mm256_storeu_ps ((p) + 16, _mm256_permute2f128_ps (u0_, u1_, 0x31)); \
+    _mm256_storeu_ps ((p) + 24, _mm256_permute2f128_ps (u2_, u3_, 0x31)); \
+  } while (0)
+
+#define COLOR_MAPPER_SIMD_ISA avx2
+
+#include "color-mapper-simd.h"
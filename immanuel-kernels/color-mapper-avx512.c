@@ -0,0 +1,96 @@
+/* This file is part of the color-mapper GEGL operation
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* 16-wide AVX-512 kernels, compiled with -mavx512f */
+
+#include <immintrin.h>
+
+#define VW                16
+#define VF                __m512
+#define VM                __mmask16
+#define VSET1(f)          _mm512_set1_ps (f)
+#define VLOADU(p)         _mm512_loadu_ps (p)
+#define VSTOREU(p, v)     _mm512_storeu_ps ((p), (v))
+#define VADD(a, b)        _mm512_add_ps ((a), (b))
+#define VSUB(a, b)        _mm512_sub_ps ((a), (b))
+#define VMUL(a, b)        _mm512_mul_ps ((a), (b))
+#define VDIV(a, b)        _mm512_div_ps ((a), (b))
+#define VSQRT(a)          _mm512_sqrt_ps (a)
+#define VMIN(a, b)        _mm512_min_ps ((a), (b))
+#define VMAX(a, b)        _mm512_max_ps ((a), (b))
+#define VGT(a, b)         _mm512_cmp_ps_mask ((a), (b), _CMP_GT_OQ)
+#define VNE(a, b)         _mm512_cmp_ps_mask ((a), (b), _CMP_NEQ_OQ)
+#define VSELECT(m, a, b)  _mm512_mask_blend_ps ((m), (b), (a))
+
+/* fast_math: 14 bit estimates refined by one Newton-Raphson step */
+static inline __m512
+vrcp_avx512 (__m512 a)
+{
+  const __m512 r = _mm512_rcp14_ps (a);
+
+  return _mm512_mul_ps (r, _mm512_sub_ps (_mm512_set1_ps (2.0f), _mm512_mul_ps (a, r)));
+}
+
+static inline __m512
+vrsqrt_avx512 (__m512 a)
+{
+  const __m512 r = _mm512_rsqrt14_ps (a);
+
+  return _mm512_mul_ps (r, _mm512_sub_ps (_mm512_set1_ps (1.5f),
+                                          _mm512_mul_ps (_mm512_mul_ps (_mm512_set1_ps (0.5f), a),
+                                                         _mm512_mul_ps (r, r))));
+}
+
+#define VRCP(a)           vrcp_avx512 (a)
+#define VRSQRT(a)         vrsqrt_avx512 (a)
+#define VROUND(a)         _mm512_roundscale_ps ((a), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define VFLOOR(a)         _mm512_roundscale_ps ((a), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)
+#define VLDEXP(a, e)      _mm512_scalef_ps ((a), (e))
+#define VGATHER(t, i)     _mm512_i32gather_ps (_mm512_cvttps_epi32 (i), (t), 4)
+
+#define VFREXP(x, m, e)                                               \
+  do {                                                                \
+    (e) = _mm512_getexp_ps ((x));                                     \
+    (m) = _mm512_getmant_ps ((x), _MM_MANT_NORM_1_2, _MM_MANT_SIGN_src); \
+  } while (0)
+
+/* channel c of pixel i sits at float index 4 * i + c */
+#define RGBA_INDEX        _mm512_setr_epi32 (0, 4, 8, 12, 16, 20, 24, 28, \
+                                             32, 36, 40, 44, 48, 52, 56, 60)
+
+#define VLOAD_RGBA(p, r, g, b, a)                                     \
+  do {                                                                \
+    const __m512i idx_ = RGBA_INDEX;                                  \
+    (r) = _mm512_i32gather_ps (idx_, (p),     4);                     \
+    (g) = _mm512_i32gather_ps (idx_, (p) + 1, 4);                     \
+    (b) = _mm512_i32gather_ps (idx_, (p) + 2, 4);                     \
+    (a) = _mm512_i32gather_ps (idx_, (p) + 3, 4);                     \
+  } while (0)
+
+#define VSTORE_RGBA(p, r, g, b, a)                                    \
+  do {                                                                \
+    const __m512i idx_ = RGBA_INDEX;                                  \
+    _mm512_i32scatter_ps ((p),     idx_, (r), 4);                     \
+    _mm512_i32scatter_ps ((p) + 1, idx_, (g), 4);                     \
+    _mm512_i32scatter_ps ((p) + 2, idx_, (b), 4);                     \
+    _mm512_i32scatter_ps ((p) + 3, idx_, (a), 4);                     \
+  } while (0)
+
+#define COLOR_MAPPER_SIMD_ISA avx512
+
+#include "color-mapper-simd.h"
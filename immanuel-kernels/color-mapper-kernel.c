@@ -0,0 +1,1191 @@
+/* This file is part of the color-mapper GEGL operation
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* scalar kernels of all stages and run-time selection of the SIMD kernels
+  *
+  * The stage bodies take technology, perceptual, fast and neutral as
+  * arguments and are inlined into one function per combination with
+  * constant arguments, so every variant only keeps the math its output
+  * needs.
+  */
+
+#include <float.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "color-mapper-kernel.h"
+
+#define POW2(x) ((x)*(x))
+
+#if defined(__GNUC__)
+#define COLOR_MAPPER_SPECIALIZE static inline __attribute__ ((always_inline))
+#else
+#define COLOR_MAPPER_SPECIALIZE static inline
+#endif
+
+/* white representations closer to white than this skip the tint multiplies */
+#define COLOR_MAPPER_NEUTRAL_EPSILON 1e-6f
+
+void
+color_mapper_luminance (const float  *rgba,
+                        float        *Y,
+                        int           n_pixels,
+                        const double  luminance[3])
+{
+  const float r = luminance[0];
+  const float g = luminance[1];
+  const float b = luminance[2];
+  int         i;
+
+  for (i = 0; i < n_pixels; i++)
+    Y[i] = rgba[i * 4 + 0] * r + rgba[i * 4 + 1] * g + rgba[i * 4 + 2] * b;
+}
+
+/* IEEE half conversions on the bits, exact for every half value and
+ * rounding to nearest even the other way; plain integer and float math the
+ * compiler can vectorize, no F16C needed
+ */
+static inline float
+half_to_float (uint16_t h)
+{
+  const uint32_t exp_mask = 0x7c00u << 13;
+  uint32_t       bits     = (h & 0x7fffu) << 13;
+  const uint32_t exp      = bits & exp_mask;
+  float          f;
+
+  bits += (127 - 15) << 23;
+
+  if (exp == exp_mask)          /* Inf, NaN */
+    {
+      bits += (128 - 16) << 23;
+      memcpy (&f, &bits, sizeof (f));
+    }
+  else if (exp == 0)            /* zero, denormal: renormalize by float math */
+    {
+      const uint32_t magic_bits = 113u << 23;
+      float          magic;
+
+      bits += 1u << 23;
+      memcpy (&f, &bits, sizeof (f));
+      memcpy (&magic, &magic_bits, sizeof (magic));
+      f -= magic;
+    }
+  else
+    {
+      memcpy (&f, &bits, sizeof (f));
+    }
+
+  return (h & 0x8000u) ? -f : f;
+}
+
+static inline uint16_t
+float_to_half (float f)
+{
+  const uint32_t f16_max      = (127 + 16) << 23;
+  const uint32_t denorm_bits  = ((127 - 15) + (23 - 10) + 1) << 23;
+  uint32_t       bits;
+  uint32_t       sign;
+  uint16_t       h;
+
+  memcpy (&bits, &f, sizeof (bits));
+  sign  = bits & 0x80000000u;
+  bits ^= sign;
+
+  if (bits >= f16_max)          /* overflow to Inf, NaN stays NaN */
+    {
+      h = (bits > 0x7f800000u) ? 0x7e00 : 0x7c00;
+    }
+  else if (bits < (113u << 23)) /* denormal half, the float add rounds */
+    {
+      float denorm_magic;
+
+      memcpy (&denorm_magic, &denorm_bits, sizeof (denorm_magic));
+      memcpy (&f, &bits, sizeof (f));
+      f += denorm_magic;
+      memcpy (&bits, &f, sizeof (bits));
+      h = bits - denorm_bits;
+    }
+  else
+    {
+      const uint32_t mant_odd = (bits >> 13) & 1;
+
+      bits += ((uint32_t) (15 - 127) << 23) + 0xfff + mant_odd;
+      h = bits >> 13;
+    }
+
+  return h | (sign >> 16);
+}
+
+void
+color_mapper_load (int          storage,
+                   const void  *src,
+                   float       *dst,
+                   int          n_pixels,
+                   const float *lut)
+{
+  const uint16_t *src16 = src;
+  int             i;
+
+  switch (storage)
+    {
+    case COLOR_MAPPER_STORAGE_HALF:
+      for (i = 0; i < n_pixels * 4; i++)
+        dst[i] = half_to_float (src16[i]);
+      break;
+
+    case COLOR_MAPPER_STORAGE_U16:
+      for (i = 0; i < n_pixels * 4; i++)
+        dst[i] = src16[i] * (1.0f / 65535.0f);
+      break;
+
+    case COLOR_MAPPER_STORAGE_U16_PERCEPTUAL:
+      for (i = 0; i < n_pixels; i++)
+        {
+          dst[i * 4 + 0] = lut[src16[i * 4 + 0] * 3 + 0];
+          dst[i * 4 + 1] = lut[src16[i * 4 + 1] * 3 + 1];
+          dst[i * 4 + 2] = lut[src16[i * 4 + 2] * 3 + 2];
+          dst[i * 4 + 3] = src16[i * 4 + 3] * (1.0f / 65535.0f);
+        }
+      break;
+
+    default:
+      memcpy (dst, src, n_pixels * 4 * sizeof (float));
+      break;
+    }
+}
+
+void
+color_mapper_store (int          storage,
+                    const float *src,
+                    void        *dst,
+                    int          n_pixels)
+{
+  uint16_t *dst16 = dst;
+  int       i;
+
+  switch (storage)
+    {
+    case COLOR_MAPPER_STORAGE_HALF:
+      for (i = 0; i < n_pixels * 4; i++)
+        dst16[i] = float_to_half (src[i]);
+      break;
+
+    case COLOR_MAPPER_STORAGE_U16:
+      for (i = 0; i < n_pixels * 4; i++)
+        {
+          const float v = src[i] * 65535.0f + 0.5f;
+
+          /* written so NaN ends up as 0 */
+          dst16[i] = (v >= 65535.0f) ? 65535 : (v > 0.0f) ? (uint16_t) v : 0;
+        }
+      break;
+
+    default:
+      memcpy (dst, src, n_pixels * 4 * sizeof (float));
+      break;
+    }
+}
+
+int
+color_mapper_white_is_neutral (const ColorMapperParams *params)
+{
+  return fabsf (params->neutral2tinted[0] - 1.0f) < COLOR_MAPPER_NEUTRAL_EPSILON &&
+         fabsf (params->neutral2tinted[1] - 1.0f) < COLOR_MAPPER_NEUTRAL_EPSILON &&
+         fabsf (params->neutral2tinted[2] - 1.0f) < COLOR_MAPPER_NEUTRAL_EPSILON;
+}
+
+void
+color_mapper_aux_row_init (ColorMapperAuxRow *row,
+                           float             *planes,
+                           int                plane_size,
+                           int                stride,
+                           int                x,
+                           int                y)
+{
+  float *p = planes + y * stride + x;
+
+  row->Y          = p + 0 * plane_size;
+  row->gradient   = p + 1 * plane_size;
+  row->chroma[0]  = p + 2 * plane_size;
+  row->chroma[1]  = p + 3 * plane_size;
+  row->chroma[2]  = p + 4 * plane_size;
+  row->chroma_hsy = p + 5 * plane_size;
+  row->saturation = p + 6 * plane_size;
+}
+
+void
+color_mapper_feature_row_init (ColorMapperFeatureRow *row,
+                               float                 *planes,
+                               int                    plane_size,
+                               int                    stride,
+                               int                    x,
+                               int                    y)
+{
+  float *p = planes + y * stride + x;
+
+  row->Y               = p + 0 * plane_size;
+  row->luminance_ratio = p + 1 * plane_size;
+  row->base            = p + 2 * plane_size;
+  row->invert          = p + 3 * plane_size;
+  row->gradient_ratio  = p + 4 * plane_size;
+  row->alpha           = p + 5 * plane_size;
+}
+
+/* a decimal number like strtof (), but always with a '.' as the decimal
+ * point: strtof () takes the one of the locale, which is ',' in many GIMP
+ * sessions and would split "0.5" or misread "0,5"
+ */
+float
+color_mapper_parse_number (const char  *text,
+                           char       **end)
+{
+  const char *p        = text;
+  double      mantissa = 0.0;
+  int         exponent = 0;
+  int         digits   = 0;
+  int         negative = 0;
+
+  if (*p == '+' || *p == '-')
+    negative = *p++ == '-';
+
+  for (; *p >= '0' && *p <= '9'; p++, digits++)
+    mantissa = mantissa * 10.0 + (*p - '0');
+
+  if (*p == '.')
+    for (p++; *p >= '0' && *p <= '9'; p++, digits++, exponent--)
+      mantissa = mantissa * 10.0 + (*p - '0');
+
+  if (! digits)
+    {
+      *end = (char *) text;
+      return 0.0f;
+    }
+
+  if (*p == 'e' || *p == 'E')
+    {
+      const char *e     = p + 1;
+      int         sign  = 1;
+      int         value = 0;
+
+      if (*e == '+' || *e == '-')
+        sign = *e++ == '-' ? -1 : 1;
+
+      if (*e >= '0' && *e <= '9')
+        {
+          for (; *e >= '0' && *e <= '9'; e++)
+            value = value < 10000 ? value * 10 + (*e - '0') : value;
+          exponent += sign * value;
+          p         = e;
+        }
+    }
+
+  *end = (char *) p;
+
+  mantissa *= pow (10.0, exponent);
+
+  return negative ? -mantissa : mantissa;
+}
+
+int
+color_mapper_tone_curve_parse (const char *text,
+                               float      *x,
+                               float      *y,
+                               int         max_points)
+{
+  int pairs = -1;
+  int n     = 0;
+  int i;
+
+  while (text && *text)
+    {
+      char  *end;
+      float  value;
+
+      if (*text == ' ' || *text == '\t' || *text == '\n' || *text == ';')
+        {
+          text++;
+          continue;
+        }
+
+      if (n == max_points)
+        return 0;
+
+      value = color_mapper_parse_number (text, &end);
+      if (end == text)
+        return 0;
+      text = end;
+
+      /* all points are pairs or none is */
+      if (pairs < 0)
+        pairs = *text == ',';
+      if (pairs != (*text == ','))
+        return 0;
+
+      if (pairs)
+        {
+          x[n]  = value;
+          text += 1;
+          y[n]  = color_mapper_parse_number (text, &end);
+          if (end == text)
+            return 0;
+          text = end;
+        }
+      else
+        {
+          y[n] = value;
+        }
+
+      if (! isfinite (y[n]) || (pairs && ! isfinite (x[n])))
+        return 0;
+      n++;
+    }
+
+  if (n < 2)
+    return 0;
+
+  if (! pairs)
+    for (i = 0; i < n; i++)
+      x[i] = i / (float) (n - 1);
+
+  for (i = 1; i < n; i++)
+    if (! (x[i] > x[i - 1]))
+      return 0;
+
+  return n;
+}
+
+void
+color_mapper_tone_curve_init (ColorMapperToneCurve *curve,
+                              const float          *x,
+                              const float          *y,
+                              int                   n_points,
+                              int                   perceptual,
+                              int                   fast_math)
+{
+  double m[COLOR_MAPPER_TONE_CURVE_MAX_POINTS];
+  double d[COLOR_MAPPER_TONE_CURVE_MAX_POINTS];
+  int    i, k = 0;
+
+  /* fewer points than a line, no contrast change */
+  if (n_points < 2 || n_points > COLOR_MAPPER_TONE_CURVE_MAX_POINTS)
+    {
+      for (i = 0; i < COLOR_MAPPER_TONE_CURVE_SIZE; i++)
+        {
+          curve->ratio[i] = 1.0f;
+          curve->base[i]  = 0.0f;
+        }
+      return;
+    }
+
+  /* tangents of a monotone cubic (Fritsch-Carlson), so the slope is
+   * continuous and no overshoot adds contrast the curve does not have
+   */
+  for (i = 0; i < n_points - 1; i++)
+    d[i] = (y[i + 1] - y[i]) / (double) (x[i + 1] - x[i]);
+
+  m[0]            = d[0];
+  m[n_points - 1] = d[n_points - 2];
+  for (i = 1; i < n_points - 1; i++)
+    m[i] = d[i - 1] * d[i] > 0.0 ? (d[i - 1] + d[i]) / 2.0 : 0.0;
+
+  for (i = 0; i < n_points - 1; i++)
+    {
+      double a, b, h;
+
+      if (d[i] == 0.0)
+        {
+          m[i] = m[i + 1] = 0.0;
+          continue;
+        }
+
+      a = m[i] / d[i];
+      b = m[i + 1] / d[i];
+      h = a * a + b * b;
+      if (h > 9.0)
+        {
+          h         = 3.0 / sqrt (h);
+          m[i]      = h * a * d[i];
+          m[i + 1]  = h * b * d[i];
+        }
+    }
+
+  for (i = 0; i < COLOR_MAPPER_TONE_CURVE_SIZE; i++)
+    {
+      const double Y = exp2 (COLOR_MAPPER_TONE_CURVE_LOG2_MIN +
+                             i / (double) COLOR_MAPPER_TONE_CURVE_PER_STOP);
+      double       T, slope, ratio, base;
+
+      if (Y <= x[0])
+        {
+          T     = y[0] + m[0] * (Y - x[0]);
+          slope = m[0];
+        }
+      else if (Y >= x[n_points - 1])
+        {
+          T     = y[n_points - 1] + m[n_points - 1] * (Y - x[n_points - 1]);
+          slope = m[n_points - 1];
+        }
+      else
+        {
+          double h, t, t2, t3;
+
+          while (Y > x[k + 1])
+            k++;
+
+          h  = x[k + 1] - x[k];
+          t  = (Y - x[k]) / h;
+          t2 = t * t;
+          t3 = t2 * t;
+
+          /* cubic Hermite segment and its derivative */
+          T     = (2 * t3 - 3 * t2 + 1) * y[k] + (t3 - 2 * t2 + t) * h * m[k] +
+                  (-2 * t3 + 3 * t2) * y[k + 1] + (t3 - t2) * h * m[k + 1];
+          slope = (6 * t2 - 6 * t) / h * y[k] + (3 * t2 - 4 * t + 1) * m[k] +
+                  (-6 * t2 + 6 * t) / h * y[k + 1] + (3 * t2 - 2 * t) * m[k + 1];
+        }
+
+      /* no contrast to compare where the curve maps to black */
+      ratio = T > FLT_MIN ? fabs (slope) * Y / T : 1.0;
+
+      /* the same as GradientYin_Yaux against GradientYaux_Yin */
+      base = ratio > 1.0 ? 1.0 / ratio : ratio;
+
+      if (perceptual && fast_math)
+        base = color_mapper_fast_gamma (base);
+      else if (perceptual)
+        base = powf (base, 1.0 / 2.2);
+
+      curve->ratio[i] = ratio;
+      curve->base[i]  = base - 1.0;
+    }
+}
+
+/* slope and ChromaAdoptionFactor_base of curve at Yaux */
+static inline void
+tone_curve_lookup (const ColorMapperToneCurve *curve,
+                   float                       Yaux,
+                   float                      *ratio,
+                   float                      *base)
+{
+  float t = (log2f (fmaxf (Yaux, FLT_MIN)) - COLOR_MAPPER_TONE_CURVE_LOG2_MIN) *
+            COLOR_MAPPER_TONE_CURVE_PER_STOP;
+  int   i;
+
+  t = fminf (fmaxf (t, 0.0f), COLOR_MAPPER_TONE_CURVE_SIZE - 1);
+  i = (int) t < COLOR_MAPPER_TONE_CURVE_SIZE - 2 ? (int) t : COLOR_MAPPER_TONE_CURVE_SIZE - 2;
+  t = t - i;
+
+  *ratio = curve->ratio[i] + (curve->ratio[i + 1] - curve->ratio[i]) * t;
+  *base  = curve->base[i]  + (curve->base[i + 1]  - curve->base[i])  * t;
+}
+
+void
+color_mapper_grid_cells (const ColorMapperAuxRow     *aux,
+                         const ColorMapperFeatureRow *features,
+                         float                       *log_ratio,
+                         float                       *log_Y,
+                         int                          width)
+{
+  int x;
+
+  for (x = 0; x < width; x++)
+    {
+      /* base + 1 is the smaller of the ratio and its inverse */
+      float l = -log2f (fmaxf (features->base[x] + 1.0f, FLT_MIN));
+
+      l = fminf (l, COLOR_MAPPER_GRID_LOG2_MAX);
+
+      log_ratio[x] = features->invert[x] > 0.5f ? l : -l;
+      log_Y[x]     = log2f (fmaxf (aux->Y[x], FLT_MIN));
+    }
+}
+
+/* index and weight of the cell left of (above) pixel p, cells are sampled
+ * at their centre
+ */
+static inline int
+grid_cell (int    p,
+           int    origin,
+           int    cell,
+           int    n_cells,
+           float *frac)
+{
+  float u = (p - origin + 0.5f) / cell - 0.5f;
+  int   i = (int) floorf (u);
+
+  if (i < 0)
+    {
+      *frac = 0.0f;
+      return 0;
+    }
+  if (i > n_cells - 2)
+    {
+      *frac = 1.0f;
+      return n_cells - 2;
+    }
+
+  *frac = u - i;
+  return i;
+}
+
+void
+color_mapper_grid_range_init (ColorMapperGridRange *range)
+{
+  const float per_stop2 = -1.0f / (2.0f * POW2 (COLOR_MAPPER_GRID_SIGMA));
+  int         i;
+
+  for (i = 0; i < COLOR_MAPPER_GRID_RANGE_SIZE - 1; i++)
+    range->weight[i] = expf ((float) i / COLOR_MAPPER_GRID_RANGE_PER_UNIT * per_stop2);
+
+  range->weight[COLOR_MAPPER_GRID_RANGE_SIZE - 1] = 0.0f;
+}
+
+/* range weight of a guide distance of d stops */
+static inline float
+grid_range_weight (const ColorMapperGridRange *range,
+                   float                       d)
+{
+  float t = fminf (d * d * COLOR_MAPPER_GRID_RANGE_PER_UNIT, COLOR_MAPPER_GRID_RANGE_SIZE - 1);
+  int   i = (int) t < COLOR_MAPPER_GRID_RANGE_SIZE - 2 ? (int) t : COLOR_MAPPER_GRID_RANGE_SIZE - 2;
+
+  t = t - i;
+
+  return range->weight[i] + (range->weight[i + 1] - range->weight[i]) * t;
+}
+
+void
+color_mapper_grid_features_span (const ColorMapperParams     *params,
+                                 const ColorMapperGrid       *grid,
+                                 const ColorMapperSource     *in,
+                                 const ColorMapperAuxRow     *aux,
+                                 const ColorMapperFeatureRow *dst,
+                                 int                          x,
+                                 int                          y,
+                                 int                          x_start,
+                                 int                          x_end)
+{
+  const float  gamma   = params->perceptual ? 1.0f / 2.2f : 1.0f;
+  const float *mid_Yin = in->Y[1];
+  float        fy;
+  int          j, i;
+
+  j = grid_cell (y, grid->y, grid->cell, grid->height, &fy);
+
+  for (i = x_start; i < x_end; i++)
+    {
+      const float  Yin  = mid_Yin[i + 1];
+      const float  Yaux = aux->Y[i];
+      const float  lY   = log2f (fmaxf (Yaux, FLT_MIN));
+      const float *ratio0, *ratio1, *Y0, *Y1;
+      float        fx, w[4], sum, l, luminance_ratio, r;
+      int          k, c;
+
+      k      = grid_cell (x + i, grid->x, grid->cell, grid->width, &fx);
+      c      = j * grid->width + k;
+      ratio0 = grid->log_ratio + c;
+      ratio1 = ratio0 + grid->width;
+      Y0     = grid->log_Y + c;
+      Y1     = Y0 + grid->width;
+
+      /* bilinear weight times the one of the guide */
+      w[0] = (1.0f - fx) * (1.0f - fy) * grid_range_weight (grid->range, lY - Y0[0]);
+      w[1] = fx          * (1.0f - fy) * grid_range_weight (grid->range, lY - Y0[1]);
+      w[2] = (1.0f - fx) * fy          * grid_range_weight (grid->range, lY - Y1[0]);
+      w[3] = fx          * fy          * grid_range_weight (grid->range, lY - Y1[1]);
+
+      sum = w[0] + w[1] + w[2] + w[3];
+
+      /* no cell is close in luminance, plain bilinear then */
+      if (! (sum > 1e-6f))
+        {
+          w[0] = (1.0f - fx) * (1.0f - fy);
+          w[1] = fx          * (1.0f - fy);
+          w[2] = (1.0f - fx) * fy;
+          w[3] = fx          * fy;
+          sum  = 1.0f;
+        }
+
+      l = (w[0] * ratio0[0] + w[1] * ratio0[1] + w[2] * ratio1[0] + w[3] * ratio1[1]) / sum;
+
+      luminance_ratio = Yin / fmaxf (COLOR_MAPPER_Y_MIN, Yaux);
+      r               = exp2f (l);
+
+      dst->Y[i]               = Yin;
+      dst->luminance_ratio[i] = luminance_ratio;
+      dst->base[i]            = exp2f (-fabsf (l) * gamma) - 1.0f;
+      dst->invert[i]          = l > 0.0f ? 1.0f : 0.0f;
+      dst->gradient_ratio[i]  = r * luminance_ratio;
+      dst->alpha[i]           = in->rgba[i * 4 + 3];
+    }
+}
+
+void
+color_mapper_grid_features (const ColorMapperParams     *params,
+                            const ColorMapperGrid       *grid,
+                            const ColorMapperSource     *in,
+                            const ColorMapperAuxRow     *aux,
+                            const ColorMapperFeatureRow *dst,
+                            int                          x,
+                            int                          y,
+                            int                          width)
+{
+  color_mapper_grid_features_span (params, grid, in, aux, dst, x, y, 0, width);
+}
+
+COLOR_MAPPER_SPECIALIZE void
+color_mapper_aux_body (const ColorMapperParams *params,
+                       const ColorMapperSource *aux,
+                       const ColorMapperAuxRow *dst,
+                       int                      x_start,
+                       int                      x_end,
+                       const int                neutral)
+{
+  const float *top_ptr_Yaux  = aux->Y[0];
+  const float *mid_ptr_Yaux  = aux->Y[1];
+  const float *down_ptr_Yaux = aux->Y[2];
+  const float *row_aux_buf   = aux->rgba;
+  const float *neutral2tinted = params->neutral2tinted;
+  int          x;
+
+  for (x = x_start; x < x_end; x++)
+    {
+      float dx_aux, dy_aux;
+      float tinted_gray_aux[3];
+      float chroma_aux[3];
+      float Chroma_HSY_aux, Saturation_HSY_aux;
+      float Yaux = mid_ptr_Yaux[x + 1];
+      int   idx  = x * 4;
+
+      /* gradient of aux, Y rows carry one pixel of border on each side */
+      dx_aux = (mid_ptr_Yaux[x] - mid_ptr_Yaux[x + 2]);
+      dy_aux = (top_ptr_Yaux[x + 1] - down_ptr_Yaux[x + 1]);
+
+      /* grayscale image aux under current lighting condiditions */
+      tinted_gray_aux[0] = neutral ? Yaux : Yaux * neutral2tinted[0];
+      tinted_gray_aux[1] = neutral ? Yaux : Yaux * neutral2tinted[1];
+      tinted_gray_aux[2] = neutral ? Yaux : Yaux * neutral2tinted[2];
+
+      chroma_aux[0] = row_aux_buf[idx + 0] - tinted_gray_aux[0];
+      chroma_aux[1] = row_aux_buf[idx + 1] - tinted_gray_aux[1];
+      chroma_aux[2] = row_aux_buf[idx + 2] - tinted_gray_aux[2];
+
+      /* chromaticity equivalent in HSY Color Model of in-buffer - before chroma scaling */
+      Chroma_HSY_aux = sqrtf (POW2(chroma_aux[0]) + POW2(chroma_aux[1]) + POW2(chroma_aux[2]) - (chroma_aux[0] * chroma_aux[1] + chroma_aux[0] * chroma_aux[2] + chroma_aux[1] * chroma_aux[2]));
+
+      /* saturation analogue definition Eva Luebbe */
+      Saturation_HSY_aux = (Yaux > FLT_MIN) ? (Chroma_HSY_aux / sqrtf (POW2 (Yaux) + POW2 (Chroma_HSY_aux) )) : 0.0;
+
+      dst->Y[x]          = Yaux;
+      dst->gradient[x]   = 0.5 * sqrtf (POW2(dx_aux) + POW2(dy_aux));
+      dst->chroma[0][x]  = chroma_aux[0];
+      dst->chroma[1][x]  = chroma_aux[1];
+      dst->chroma[2][x]  = chroma_aux[2];
+      dst->chroma_hsy[x] = Chroma_HSY_aux;
+      dst->saturation[x] = Saturation_HSY_aux;
+    }
+}
+
+COLOR_MAPPER_SPECIALIZE void
+color_mapper_features_body (const ColorMapperParams     *params,
+                            const ColorMapperSource     *in,
+                            const ColorMapperAuxRow     *aux,
+                            const ColorMapperFeatureRow *dst,
+                            int                          x_start,
+                            int                          x_end,
+                            const int                    perceptual,
+                            const int                    fast)
+{
+  const float *top_ptr_Yin   = in->Y[0];
+  const float *mid_ptr_Yin   = in->Y[1];
+  const float *down_ptr_Yin  = in->Y[2];
+  const float *row_in_buf    = in->rgba;
+  const float *contrast      = in->contrast;
+  const ColorMapperToneCurve *tone_curve = params->tone_curve;
+  int          x;
+
+  for (x = x_start; x < x_end; x++)
+    {
+      float dx_in;
+      float dy_in;
+      float GradientRatio;
+      float ChromaAdoptionFactor_base;
+      float Yin  = mid_ptr_Yin[x + 1];
+      float Yaux = aux->Y[x];
+
+      /* contrast of input div by aux */
+      float luminance_ratio;
+      float GradientYin, GradientYaux;
+      float GradientYin_Yaux, GradientYaux_Yin;
+
+      if (tone_curve)
+        {
+          /* the contrast change is the slope of the curve, a point operation */
+          tone_curve_lookup (tone_curve, Yaux, &GradientRatio, &ChromaAdoptionFactor_base);
+
+          luminance_ratio = Yin / fmaxf (COLOR_MAPPER_Y_MIN, Yaux);
+
+          dst->Y[x]               = Yin;
+          dst->luminance_ratio[x] = luminance_ratio;
+          dst->base[x]            = ChromaAdoptionFactor_base;
+          dst->invert[x]          = GradientRatio > 1.0f ? 1.0 : 0.0;
+          dst->gradient_ratio[x]  = GradientRatio * luminance_ratio;   /* T'(Yaux) */
+          dst->alpha[x]           = row_in_buf[x * 4 + 3];
+          continue;
+        }
+
+      if (contrast)
+        {
+          /* relative contrast of both from elsewhere, back to gradients */
+          GradientYin  = contrast[x * 2 + 0] * Yin;
+          GradientYaux = contrast[x * 2 + 1] * Yaux;
+        }
+      else
+        {
+          /* gradient of input, Y rows carry one pixel of border on each side */
+          dx_in = (mid_ptr_Yin[x] - mid_ptr_Yin[x + 2]);
+          dy_in = (top_ptr_Yin[x + 1] - down_ptr_Yin[x + 1]);
+          GradientYin  = 0.5 * sqrtf (POW2(dx_in) + POW2(dy_in));
+          GradientYaux = aux->gradient[x];
+        }
+
+      /* computing luminance ratio */
+      luminance_ratio = Yin / fmaxf (COLOR_MAPPER_Y_MIN, Yaux);
+
+      /* computing gradient ratio */
+      GradientRatio = GradientYin / fmax (FLT_MIN, GradientYaux);
+
+      /* ChromaAdoptionFactor_base (ratio of gradient-scaled luminance vs. luminance_in) */
+      GradientYaux_Yin = GradientYaux * Yin;
+      GradientYin_Yaux = GradientYin * Yaux;
+
+      if (GradientYin_Yaux > GradientYaux_Yin)
+        {
+          ChromaAdoptionFactor_base = GradientYaux_Yin / GradientYin_Yaux;
+        }
+      else if (GradientYaux_Yin > GradientYin_Yaux)
+        {
+          ChromaAdoptionFactor_base = GradientYin_Yaux / GradientYaux_Yin;
+        }
+      else
+        ChromaAdoptionFactor_base = 1.0;
+
+      if (perceptual && fast)
+        ChromaAdoptionFactor_base = color_mapper_fast_gamma (ChromaAdoptionFactor_base);
+      else if (perceptual)
+        ChromaAdoptionFactor_base = powf (ChromaAdoptionFactor_base, 1.0 / 2.2);
+      ChromaAdoptionFactor_base -= 1.0;
+
+      dst->Y[x]               = Yin;
+      dst->luminance_ratio[x] = luminance_ratio;
+      dst->base[x]            = ChromaAdoptionFactor_base;
+      dst->invert[x]          = (GradientYin_Yaux > GradientYaux_Yin) ? 1.0 : 0.0;
+      dst->gradient_ratio[x]  = GradientRatio;
+      dst->alpha[x]           = row_in_buf[x * 4 + 3];
+    }
+}
+
+COLOR_MAPPER_SPECIALIZE void
+color_mapper_combine_body (const ColorMapperParams     *params,
+                           const ColorMapperFeatureRow *features,
+                           const ColorMapperAuxRow     *aux,
+                           float                       *row_out,
+                           int                          x_start,
+                           int                          x_end,
+                           const int                    technology,
+                           const int                    neutral)
+{
+  const float *neutral2tinted = params->neutral2tinted;
+  const float  scale         = params->scale;
+  const float  saturation_min = params->saturation_min;
+  const float  saturation_weighting_factor = params->saturation_weighting_factor;
+  const float  globalSaturation = params->globalSaturation;
+  int          x;
+
+  for (x = x_start; x < x_end; x++)
+    {
+      float luminanceblended_colorscaled[3], tinted_gray[3];
+      float chroma_aux[3];
+      float ChromaAdoptionFactor, ChromaAdoptionFactor_base, ChromaAdoptionFactor_sat_dz, ChromaAdoptionFactor_global;
+      float Yin  = features->Y[x];
+      int   idx  = x * 4;
+
+      float saturation_clip_negative[3], saturation_clip_positive[3];
+      float saturation_clip_negative_min, saturation_clip_positive_min, saturation_clip;
+      float Saturation_HSY_aux, Saturation_HSY_aux_dz;
+      float chromafactor_aux2target;
+
+      /* keep alpha from in */
+      row_out[idx + 3] = features->alpha[x];
+
+      /* debug outputs of a single intermediate */
+      if (technology == COLOR_MAPPER_GRADIENT_RATIO)
+      {
+        row_out[idx + 0] = row_out[idx + 1] = row_out[idx + 2] = features->gradient_ratio[x];
+        continue;
+      }
+      else if (technology == COLOR_MAPPER_CHROMATICITY)
+      {
+        row_out[idx + 0] = row_out[idx + 1] = row_out[idx + 2] = aux->chroma_hsy[x];
+        continue;
+      }
+      else if (technology == COLOR_MAPPER_SATURATION)
+      {
+        row_out[idx + 0] = row_out[idx + 1] = row_out[idx + 2] = aux->saturation[x];
+        continue;
+      }
+      else if (technology == COLOR_MAPPER_YGRAD_AUX)
+      {
+        row_out[idx + 0] = row_out[idx + 1] = row_out[idx + 2] = aux->gradient[x] * params->gradient_scale;
+        continue;
+      }
+
+      ChromaAdoptionFactor_base = features->base[x];
+
+      if (technology == COLOR_MAPPER_CHROMA_ADOPTION_FACTOR_BASE)
+      {
+        row_out[idx + 0] = row_out[idx + 1] = row_out[idx + 2] = ChromaAdoptionFactor_base;
+        continue;
+      }
+
+      ChromaAdoptionFactor = 1.0 + scale * ChromaAdoptionFactor_base;
+
+      if (ChromaAdoptionFactor > FLT_MIN)
+        ChromaAdoptionFactor = (features->invert[x] > 0.5f) ? (1.0 / ChromaAdoptionFactor) : ChromaAdoptionFactor;
+      else
+        ChromaAdoptionFactor = 1.0;
+
+      if (technology == COLOR_MAPPER_CHROMA_ADOPTION_FACTOR)
+      {
+        row_out[idx + 0] = row_out[idx + 1] = row_out[idx + 2] = ChromaAdoptionFactor;
+        continue;
+      }
+
+      /* grayscale image under current lighting condiditions */
+      tinted_gray[0] = neutral ? Yin : Yin * neutral2tinted[0];
+      tinted_gray[1] = neutral ? Yin : Yin * neutral2tinted[1];
+      tinted_gray[2] = neutral ? Yin : Yin * neutral2tinted[2];
+
+      chroma_aux[0] = aux->chroma[0][x];
+      chroma_aux[1] = aux->chroma[1][x];
+      chroma_aux[2] = aux->chroma[2][x];
+
+      Saturation_HSY_aux = aux->saturation[x];
+
+      Saturation_HSY_aux_dz = fmax (Saturation_HSY_aux - saturation_min, 0.0);
+      ChromaAdoptionFactor_sat_dz = (Saturation_HSY_aux > FLT_MIN) ? (Saturation_HSY_aux_dz / Saturation_HSY_aux) : 0.0;
+
+      ChromaAdoptionFactor_global = ChromaAdoptionFactor * globalSaturation;
+      ChromaAdoptionFactor_global = 1.0 + (ChromaAdoptionFactor_global - 1.0 ) * (saturation_weighting_factor * (Saturation_HSY_aux - 1.0) + 1.0) * ChromaAdoptionFactor_sat_dz;
+
+      /* new algorithm perceptual - new scaling*/
+      chromafactor_aux2target = features->luminance_ratio[x] * ChromaAdoptionFactor_global;
+      luminanceblended_colorscaled[0] = tinted_gray[0] + chroma_aux[0] * chromafactor_aux2target;
+      luminanceblended_colorscaled[1] = tinted_gray[1] + chroma_aux[1] * chromafactor_aux2target;
+      luminanceblended_colorscaled[2] = tinted_gray[2] + chroma_aux[2] * chromafactor_aux2target;
+
+      if (technology == COLOR_MAPPER_DEFAULT_RGB_UNLIMITED)
+      {
+        row_out[idx + 0] = luminanceblended_colorscaled[0];
+        row_out[idx + 1] = luminanceblended_colorscaled[1];
+        row_out[idx + 2] = luminanceblended_colorscaled[2];
+        continue;
+      }
+
+      /* reduce saturation to better fit in rgb-range [0...1] */
+      saturation_clip_negative[0] = tinted_gray[0] / (tinted_gray[0] - fmin ( luminanceblended_colorscaled[0], -0.00001f));
+      saturation_clip_negative[1] = tinted_gray[1] / (tinted_gray[1] - fmin ( luminanceblended_colorscaled[1], -0.00001f));
+      saturation_clip_negative[2] = tinted_gray[2] / (tinted_gray[2] - fmin ( luminanceblended_colorscaled[2], -0.00001f));
+      saturation_clip_negative_min = fmin (saturation_clip_negative[0], fmin (saturation_clip_negative[1], saturation_clip_negative[2]));
+
+      saturation_clip_positive[0] = fmax (luminanceblended_colorscaled[0] - fmax (1.0f, tinted_gray[0]), 0.0f) / (luminanceblended_colorscaled[0] - tinted_gray[0] + 0.00001f);
+      saturation_clip_positive[1] = fmax (luminanceblended_colorscaled[1] - fmax (1.0f, tinted_gray[1]), 0.0f) / (luminanceblended_colorscaled[1] - tinted_gray[1] + 0.00001f);
+      saturation_clip_positive[2] = fmax (luminanceblended_colorscaled[2] - fmax (1.0f, tinted_gray[2]), 0.0f) / (luminanceblended_colorscaled[2] - tinted_gray[2] + 0.00001f);
+      saturation_clip_positive_min = 1.0f - fmax (saturation_clip_positive[0], fmax (saturation_clip_positive[1], saturation_clip_positive[2]));
+
+      saturation_clip = fmin (saturation_clip_positive_min, saturation_clip_negative_min);
+
+      row_out[idx + 0] = (luminanceblended_colorscaled[0] - tinted_gray[0]) * saturation_clip + tinted_gray[0];
+      row_out[idx + 1] = (luminanceblended_colorscaled[1] - tinted_gray[1]) * saturation_clip + tinted_gray[1];
+      row_out[idx + 2] = (luminanceblended_colorscaled[2] - tinted_gray[2]) * saturation_clip + tinted_gray[2];
+    }
+}
+
+
+/* the variants, one function per stage and combination of the flags it
+ * depends on
+ */
+
+#define COLOR_MAPPER_TECHNOLOGIES(X)            \
+  X (DEFAULT)                                   \
+  X (DEFAULT_RGB_UNLIMITED)                     \
+  X (GRADIENT_RATIO)                            \
+  X (CHROMA_ADOPTION_FACTOR_BASE)               \
+  X (CHROMA_ADOPTION_FACTOR)                    \
+  X (CHROMATICITY)                              \
+  X (SATURATION)                                \
+  X (YGRAD_AUX)
+
+#define COLOR_MAPPER_AUX_VARIANT(white, neutral)                                \
+static void                                                                     \
+color_mapper_aux_scalar_##white (const ColorMapperParams *params,               \
+                                 const ColorMapperSource *aux,                  \
+                                 const ColorMapperAuxRow *dst,                  \
+                                 int                      width)                \
+{                                                                               \
+  color_mapper_aux_body (params, aux, dst, 0, width, neutral);                  \
+}
+
+#define COLOR_MAPPER_FEATURES_VARIANT(lightness, perceptual, fast)              \
+static void                                                                     \
+color_mapper_features_scalar_##lightness (const ColorMapperParams     *params,  \
+                                          const ColorMapperSource     *in,      \
+                                          const ColorMapperAuxRow     *aux,     \
+                                          const ColorMapperFeatureRow *dst,     \
+                                          int                          width)   \
+{                                                                               \
+  color_mapper_features_body (params, in, aux, dst, 0, width, perceptual, fast);\
+}
+
+#define COLOR_MAPPER_COMBINE_VARIANT(technology, white, neutral)                \
+static void                                                                     \
+color_mapper_combine_scalar_##technology##_##white (                            \
+                                 const ColorMapperParams     *params,           \
+                                 const ColorMapperFeatureRow *features,         \
+                                 const ColorMapperAuxRow     *aux,              \
+                                 float                       *out,              \
+                                 int                          width)            \
+{                                                                               \
+  color_mapper_combine_body (params, features, aux, out, 0, width,              \
+                             COLOR_MAPPER_##technology, neutral);               \
+}
+
+#define COLOR_MAPPER_COMBINE_VARIANTS(technology)                               \
+  COLOR_MAPPER_COMBINE_VARIANT (technology, tinted,  0)                         \
+  COLOR_MAPPER_COMBINE_VARIANT (technology, neutral, 1)
+
+#define COLOR_MAPPER_COMBINE_ENTRY(technology)                                  \
+  [COLOR_MAPPER_##technology] = { color_mapper_combine_scalar_##technology##_tinted,   \
+                                  color_mapper_combine_scalar_##technology##_neutral },
+
+COLOR_MAPPER_AUX_VARIANT (tinted,  0)
+COLOR_MAPPER_AUX_VARIANT (neutral, 1)
+
+COLOR_MAPPER_FEATURES_VARIANT (linear,          0, 0)
+COLOR_MAPPER_FEATURES_VARIANT (perceptual,      1, 0)
+COLOR_MAPPER_FEATURES_VARIANT (perceptual_fast, 1, 1)
+
+COLOR_MAPPER_TECHNOLOGIES (COLOR_MAPPER_COMBINE_VARIANTS)
+
+static const ColorMapperAuxFunc aux_scalar[2] =
+{
+  color_mapper_aux_scalar_tinted,
+  color_mapper_aux_scalar_neutral
+};
+
+/* [fast_math][perceptual], only the perceptual gamma has a fast form here */
+static const ColorMapperFeatureFunc features_scalar[2][2] =
+{
+  { color_mapper_features_scalar_linear, color_mapper_features_scalar_perceptual },
+  { color_mapper_features_scalar_linear, color_mapper_features_scalar_perceptual_fast }
+};
+
+static const ColorMapperCombineFunc combine_scalar[COLOR_MAPPER_N_TECHNOLOGIES][2] =
+{
+  COLOR_MAPPER_TECHNOLOGIES (COLOR_MAPPER_COMBINE_ENTRY)
+};
+
+
+/* spans pick their variant per call, they only cover SIMD remainders */
+
+void
+color_mapper_aux_scalar_span (const ColorMapperParams *params,
+                              const ColorMapperSource *aux,
+                              const ColorMapperAuxRow *dst,
+                              int                      x_start,
+                              int                      x_end)
+{
+  if (color_mapper_white_is_neutral (params))
+    color_mapper_aux_body (params, aux, dst, x_start, x_end, 1);
+  else
+    color_mapper_aux_body (params, aux, dst, x_start, x_end, 0);
+}
+
+void
+color_mapper_features_scalar_span (const ColorMapperParams     *params,
+                                   const ColorMapperSource     *in,
+                                   const ColorMapperAuxRow     *aux,
+                                   const ColorMapperFeatureRow *dst,
+                                   int                          x_start,
+                                   int                          x_end)
+{
+  if (params->perceptual && params->fast_math)
+    color_mapper_features_body (params, in, aux, dst, x_start, x_end, 1, 1);
+  else if (params->perceptual)
+    color_mapper_features_body (params, in, aux, dst, x_start, x_end, 1, 0);
+  else
+    color_mapper_features_body (params, in, aux, dst, x_start, x_end, 0, 0);
+}
+
+void
+color_mapper_combine_scalar_span (const ColorMapperParams     *params,
+                                  const ColorMapperFeatureRow *features,
+                                  const ColorMapperAuxRow     *aux,
+                                  float                       *out,
+                                  int                          x_start,
+                                  int                          x_end)
+{
+  /* generic body, the technology and white tests stay in the loop */
+  color_mapper_combine_body (params, features, aux, out, x_start, x_end,
+                             params->technology,
+                             color_mapper_white_is_neutral (params));
+}
+
+void
+color_mapper_aux_scalar (const ColorMapperParams *params,
+                         const ColorMapperSource *aux,
+                         const ColorMapperAuxRow *dst,
+                         int                      width)
+{
+  color_mapper_aux_scalar_span (params, aux, dst, 0, width);
+}
+
+void
+color_mapper_features_scalar (const ColorMapperParams     *params,
+                              const ColorMapperSource     *in,
+                              const ColorMapperAuxRow     *aux,
+                              const ColorMapperFeatureRow *dst,
+                              int                          width)
+{
+  color_mapper_features_scalar_span (params, in, aux, dst, 0, width);
+}
+
+void
+color_mapper_combine_scalar (const ColorMapperParams     *params,
+                             const ColorMapperFeatureRow *features,
+                             const ColorMapperAuxRow     *aux,
+                             float                       *out,
+                             int                          width)
+{
+  color_mapper_combine_scalar_span (params, features, aux, out, 0, width);
+}
+
+
+/* run-time dispatch */
+
+static const ColorMapperSimdKernels *simd     = NULL;
+static const char                   *simd_isa = "scalar";
+
+#define COLOR_MAPPER_USE_SIMD(isa)              \
+  do {                                          \
+    simd     = &color_mapper_simd_##isa;        \
+    simd_isa = #isa;                            \
+  } while (0)
+
+void
+color_mapper_kernel_init (void)
+{
+  if (simd)
+    return;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init ();
+#endif
+
+#ifdef HAVE_COLOR_MAPPER_AVX512
+  if (__builtin_cpu_supports ("avx512f"))
+    {
+      COLOR_MAPPER_USE_SIMD (avx512);
+      return;
+    }
+#endif
+
+#ifdef HAVE_COLOR_MAPPER_AVX2
+  if (__builtin_cpu_supports ("avx2"))
+    {
+      COLOR_MAPPER_USE_SIMD (avx2);
+      return;
+    }
+#endif
+
+#ifdef HAVE_COLOR_MAPPER_NEON
+  /* Advanced SIMD is mandatory on aarch64 */
+  COLOR_MAPPER_USE_SIMD (neon);
+#endif
+}
+
+const char *
+color_mapper_kernel_isa (void)
+{
+  return simd_isa;
+}
+
+ColorMapperAuxFunc
+color_mapper_kernel_get_aux (const ColorMapperParams *params)
+{
+  const int neutral = color_mapper_white_is_neutral (params);
+  const int fast    = params->fast_math ? 1 : 0;
+
+  return simd ? simd->aux[fast][neutral] : aux_scalar[neutral];
+}
+
+ColorMapperFeatureFunc
+color_mapper_kernel_get_features (const ColorMapperParams *params)
+{
+  const int perceptual = params->perceptual ? 1 : 0;
+  const int fast       = params->fast_math ? 1 : 0;
+
+  if (simd && params->tone_curve)
+    return simd->tone_curve_features[fast];
+
+  /* the SIMD kernels take the gradients from the Y rows */
+  if (simd && ! params->contrast_source)
+    return simd->features[fast][perceptual];
+
+  return features_scalar[fast][perceptual];
+}
+
+ColorMapperCombineFunc
+color_mapper_kernel_get_combine (const ColorMapperParams *params)
+{
+  const int neutral = color_mapper_white_is_neutral (params);
+  const int fast    = params->fast_math ? 1 : 0;
+
+  /* the SIMD kernels cover the image producing technologies */
+  if (simd &&
+      (params->technology == COLOR_MAPPER_DEFAULT ||
+       params->technology == COLOR_MAPPER_DEFAULT_RGB_UNLIMITED))
+    {
+      return simd->combine[fast][params->technology][neutral];
+    }
+
+  if (params->technology < 0 || params->technology >= COLOR_MAPPER_N_TECHNOLOGIES)
+    return color_mapper_combine_scalar;
+
+  return combine_scalar[params->technology][neutral];
+}
+
+ColorMapperGridFunc
+color_mapper_kernel_get_grid_features (const ColorMapperParams *params)
+{
+  const int fast = params->fast_math ? 1 : 0;
+
+  return simd ? simd->grid_features[fast] : color_mapper_grid_features;
+}
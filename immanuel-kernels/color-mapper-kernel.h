@@ -0,0 +1,465 @@
+/* This file is part of the color-mapper GEGL operation
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* per-pixel math of color-mapper, one output row at a time
+  *
+  * The row kernels do not depend on GEGL, so they can be compiled once per
+  * instruction set and picked at load time by CPU feature detection.
+  *
+  * The math runs in three stages:
+  *   aux stage      everything that only depends on aux (and the white
+  *                  representation), written to planes that can be cached
+  *   feature stage  everything that depends on input and aux but none of
+  *                  the sliders, written to planes that can be cached
+  *   combine stage  point pass from feature and aux planes to the output,
+  *                  the only stage reading scale, saturation_min,
+  *                  saturation_weighting_factor and globalSaturation
+  */
+
+#ifndef __COLOR_MAPPER_KERNEL_H__
+#define __COLOR_MAPPER_KERNEL_H__
+
+/* keep in sync with enum gegl_colormapper_technology in color-mapper.c */
+enum
+{
+  COLOR_MAPPER_DEFAULT,
+  COLOR_MAPPER_DEFAULT_RGB_UNLIMITED,
+  COLOR_MAPPER_GRADIENT_RATIO,
+  COLOR_MAPPER_CHROMA_ADOPTION_FACTOR_BASE,
+  COLOR_MAPPER_CHROMA_ADOPTION_FACTOR,
+  COLOR_MAPPER_CHROMATICITY,
+  COLOR_MAPPER_SATURATION,
+  COLOR_MAPPER_YGRAD_AUX,
+
+  COLOR_MAPPER_N_TECHNOLOGIES
+};
+
+/* tone curve mode: instead of comparing the gradients of input and aux,
+ * the feature stage takes the contrast change from a luminance tone curve
+ * T that maps Y of aux to Y of input.  T changes the relative contrast at
+ * Yaux by its log-log slope Yaux T'(Yaux) / T(Yaux), the gradient ratio
+ * the gradients would measure on input = T (aux), so no neighbouring pixel
+ * is read.  The table holds that slope and the ChromaAdoptionFactor_base
+ * it gives at COLOR_MAPPER_TONE_CURVE_PER_STOP steps per stop of Yaux;
+ * values of Yaux beyond the table take its first or last entry.
+ */
+#define COLOR_MAPPER_TONE_CURVE_MAX_POINTS 256
+#define COLOR_MAPPER_TONE_CURVE_LOG2_MIN   -20
+#define COLOR_MAPPER_TONE_CURVE_LOG2_MAX   4
+#define COLOR_MAPPER_TONE_CURVE_PER_STOP   64
+#define COLOR_MAPPER_TONE_CURVE_SIZE       ((COLOR_MAPPER_TONE_CURVE_LOG2_MAX -           \
+                                             COLOR_MAPPER_TONE_CURVE_LOG2_MIN) *          \
+                                            COLOR_MAPPER_TONE_CURVE_PER_STOP + 1)
+
+typedef struct
+{
+  float ratio[COLOR_MAPPER_TONE_CURVE_SIZE];   /* Yaux T'(Yaux) / T(Yaux) */
+  float base[COLOR_MAPPER_TONE_CURVE_SIZE];    /* ChromaAdoptionFactor_base - 1.0 */
+} ColorMapperToneCurve;
+
+typedef struct
+{
+  int   technology;
+  int   perceptual;
+  float scale;
+  float saturation_min;
+  float saturation_weighting_factor;
+  float globalSaturation;
+  float neutral2tinted[3];
+  float gradient_scale;   /* 1 / 2^level, gradients per full resolution pixel */
+  int   fast_math;        /* approximate math, see COLOR_MAPPER_FAST_MATH_ERROR */
+  int   contrast_source;  /* the input rows carry contrast, see ColorMapperSource */
+  const ColorMapperToneCurve *tone_curve;  /* NULL, or the tone curve mode */
+} ColorMapperParams;
+
+/* fast_math replaces, in the SIMD kernels, square roots and divisions by
+ * hardware reciprocal (square root) estimates refined by Newton-Raphson
+ * steps, and the perceptual powf (x, 1 / 2.2) in all kernels by a
+ * polynomial log2 / exp2 pair.  Each replaced operation is within this
+ * relative error of the exact result for normal floats (measured: 2.0e-7
+ * reciprocal, 2.7e-7 reciprocal square root, 3.2e-7 gamma on AVX2, the
+ * gamma beats powf with its float exponent, 1.4e-6); operands and results
+ * up to FLT_MIN count as zero, Inf and NaN are not preserved.
+ */
+#define COLOR_MAPPER_FAST_MATH_ERROR 5e-7f
+
+/* the luminance ratio Yin / Yaux divides by at least this: Yin / FLT_MIN
+ * overflows for any Yin above 4, and a black aux, which has no chroma,
+ * then gave 0 * inf = NaN instead of the gray of Yin
+ */
+#define COLOR_MAPPER_Y_MIN 1e-20f
+
+/* fast_math gamma x^(1 / 2.2) = exp2 (log2 (x) / 2.2): log2 (1 + u) =
+ * u * LOG2 (u) for the mantissa 1 + u in [sqrt (0.5), sqrt (2)) and
+ * exp2 (f) = 1 + f * EXP2 (f) for f in [-0.5, 0.5], both polynomials fitted
+ * at Chebyshev nodes; exact for x = 1.  The exponent e of x is divided as
+ * 5 e / 11 = q + r / 11 with integer q, r, so the fraction exp2 sees keeps
+ * full precision for tiny x.
+ */
+#define COLOR_MAPPER_GAMMA_LOG2(P, C, u)                                      \
+  P (P (P (P (P (P (C (1.681865911e-01f), u, -2.679638705e-01f), u,           \
+  2.961195572e-01f), u, -3.595244555e-01f), u, 4.806131255e-01f), u,          \
+  -7.213601786e-01f), u, 1.442696523e+00f)
+
+#define COLOR_MAPPER_GAMMA_EXP2(P, C, f)                                      \
+  P (P (P (P (P (C (1.545316294e-04f), f, 1.339086336e-03f), f,               \
+  9.618082557e-03f), f, 5.550357114e-02f), f, 2.402265076e-01f), f,           \
+  6.931471880e-01f)
+
+#define COLOR_MAPPER_GAMMA_HORNER(c, x, d) ((c) * (x) + (d))
+#define COLOR_MAPPER_GAMMA_CONST(c)        (c)
+
+/* scalar fast_math gamma, x <= FLT_MIN gives 0 */
+static inline float
+color_mapper_fast_gamma (float x)
+{
+  union { float f; unsigned int i; } bits = { x };
+  float u, y, f;
+  int   e, q, i;
+
+  if (! (x > 1.17549435e-38f))
+    return 0.0f;
+
+  /* split x into 2^e * (1 + u) */
+  e      = (int) (bits.i >> 23) - 127;
+  bits.i = (bits.i & 0x7fffffu) | 0x3f800000u;
+  if (bits.f > 1.41421356f)
+    {
+      bits.f *= 0.5f;
+      e++;
+    }
+  u = bits.f - 1.0f;
+
+  /* log2 (x) / 2.2 = q + y */
+  q = (5 * e + (e < 0 ? -5 : 5)) / 11;
+  y = (5 * e - 11 * q) * (1.0f / 11.0f)
+      + u * COLOR_MAPPER_GAMMA_LOG2 (COLOR_MAPPER_GAMMA_HORNER, COLOR_MAPPER_GAMMA_CONST, u) * (1.0f / 2.2f);
+
+  /* 2^y = 2^i * (1 + f * EXP2 (f)) */
+  i = (int) (y < 0.0f ? y - 0.5f : y + 0.5f);
+  f = y - i;
+
+  bits.f  = 1.0f + f * COLOR_MAPPER_GAMMA_EXP2 (COLOR_MAPPER_GAMMA_HORNER, COLOR_MAPPER_GAMMA_CONST, f);
+  bits.i += (unsigned int) (q + i) << 23;
+
+  return bits.f;
+}
+
+/* one row of a source image
+ * Y holds the rows above, at and below the output row (index 0, 1, 2),
+ * each width + 2 pixels wide, so output pixel x sits at index x + 1.
+ * rgba is width pixels wide.
+ * contrast, NULL unless contrast_source is set, holds the relative contrast
+ * of input and of aux, 2 floats per pixel and width pixels wide; the feature
+ * stage then takes the gradients as contrast times Y instead of from the Y
+ * rows, e.g. from immanuel:contrast-pyramid.
+ */
+typedef struct
+{
+  const float *Y[3];
+  const float *rgba;
+  const float *contrast;
+} ColorMapperSource;
+
+/* planes computed by the aux stage, width pixels each */
+#define COLOR_MAPPER_AUX_PLANES 7
+
+typedef struct
+{
+  float *Y;           /* CIE Y of aux */
+  float *gradient;    /* GradientYaux */
+  float *chroma[3];   /* aux minus tinted gray aux */
+  float *chroma_hsy;  /* Chroma_HSY_aux */
+  float *saturation;  /* Saturation_HSY_aux */
+} ColorMapperAuxRow;
+
+/* planes computed by the feature stage, width pixels each */
+#define COLOR_MAPPER_FEATURE_PLANES 6
+
+typedef struct
+{
+  float *Y;               /* CIE Y of input */
+  float *luminance_ratio; /* Yin / Yaux */
+  float *base;            /* ChromaAdoptionFactor_base - 1.0 */
+  float *invert;          /* 1.0 where the input gradient is the stronger one */
+  float *gradient_ratio;  /* GradientRatio */
+  float *alpha;           /* alpha of input */
+} ColorMapperFeatureRow;
+
+typedef void (* ColorMapperAuxFunc) (const ColorMapperParams *params,
+                                     const ColorMapperSource *aux,
+                                     const ColorMapperAuxRow *dst,
+                                     int                      width);
+
+typedef void (* ColorMapperFeatureFunc) (const ColorMapperParams     *params,
+                                         const ColorMapperSource     *in,
+                                         const ColorMapperAuxRow     *aux,
+                                         const ColorMapperFeatureRow *dst,
+                                         int                          width);
+
+typedef void (* ColorMapperCombineFunc) (const ColorMapperParams     *params,
+                                         const ColorMapperFeatureRow *features,
+                                         const ColorMapperAuxRow     *aux,
+                                         float                       *out,
+                                         int                          width);
+
+/* how pixels are stored in the buffers read from and written to, the
+ * kernels work in float; half and u16 sources are read as they are and
+ * converted in the load loop, which halves the bytes moved per pixel
+ */
+enum
+{
+  COLOR_MAPPER_STORAGE_FLOAT,
+  COLOR_MAPPER_STORAGE_HALF,            /* "RGBA half" */
+  COLOR_MAPPER_STORAGE_U16,             /* "RGBA u16", linear */
+  COLOR_MAPPER_STORAGE_U16_PERCEPTUAL   /* "R'G'B'A u16", load only */
+};
+
+/* n_pixels RGBA pixels of storage to float; for U16_PERCEPTUAL lut holds
+ * the linear r, g and b of each of the 65536 values, alpha is linear
+ */
+void color_mapper_load            (int                      storage,
+                                   const void              *src,
+                                   float                   *dst,
+                                   int                      n_pixels,
+                                   const float             *lut);
+
+/* n_pixels RGBA float pixels to storage, u16 is clamped to [0, 1] */
+void color_mapper_store           (int                      storage,
+                                   const float             *src,
+                                   void                    *dst,
+                                   int                      n_pixels);
+
+/* CIE Y of n_pixels RGBA pixels, luminance holds the Y weights of the
+ * rgb primaries of the working space
+ */
+void color_mapper_luminance       (const float             *rgba,
+                                   float                   *Y,
+                                   int                      n_pixels,
+                                   const double             luminance[3]);
+
+/* points the aux planes at row y of planes laid out plane after plane,
+ * each one stride floats wide and plane_size floats long
+ */
+void color_mapper_aux_row_init    (ColorMapperAuxRow       *row,
+                                   float                   *planes,
+                                   int                      plane_size,
+                                   int                      stride,
+                                   int                      x,
+                                   int                      y);
+
+/* same for the feature planes */
+void color_mapper_feature_row_init (ColorMapperFeatureRow  *row,
+                                    float                  *planes,
+                                    int                     plane_size,
+                                    int                     stride,
+                                    int                     x,
+                                    int                     y);
+
+/* grid mode: the feature stage compares the gradients of input and aux
+ * on a grid of cells, cell pixels wide (the mipmap of 1 / cell), and every
+ * pixel takes the relative gradient ratio of the four cells around it,
+ * weighted bilinearly and by how close the luminance of aux is to the one
+ * of each cell (joint bilateral upsampling guided by aux), so only the
+ * cells read neighbours and edges of aux stay sharp.
+ */
+#define COLOR_MAPPER_GRID_SIGMA    0.5f   /* of the guide, in stops of Yaux */
+#define COLOR_MAPPER_GRID_LOG2_MAX 16.0f  /* relative gradient ratios beyond are clamped */
+
+/* the range weight of the guide only depends on the squared distance d^2
+ * of the luminances in stops, so it is tabulated at
+ * COLOR_MAPPER_GRID_RANGE_PER_UNIT steps per stop^2 and interpolated
+ * linearly (within 1.3e-4 of expf); beyond COLOR_MAPPER_GRID_RANGE_MAX,
+ * where expf is below 1.3e-14, far under the 1e-6 the weights have to sum
+ * up to, the weight is 0
+ */
+#define COLOR_MAPPER_GRID_RANGE_PER_UNIT 64
+#define COLOR_MAPPER_GRID_RANGE_MAX      16
+#define COLOR_MAPPER_GRID_RANGE_SIZE     (COLOR_MAPPER_GRID_RANGE_MAX * COLOR_MAPPER_GRID_RANGE_PER_UNIT + 1)
+
+typedef struct
+{
+  float weight[COLOR_MAPPER_GRID_RANGE_SIZE];  /* expf (-d^2 / (2 sigma^2)) */
+} ColorMapperGridRange;
+
+typedef struct
+{
+  const float *log_ratio;  /* log2 of GradientYin Yaux / (GradientYaux Yin), per cell */
+  const float *log_Y;      /* log2 of Yaux, per cell */
+  int          width;      /* cells per row */
+  int          height;
+  int          cell;       /* pixels per cell */
+  int          x;          /* pixel at the left and top edge of the first cell */
+  int          y;
+  const ColorMapperGridRange *range;  /* of color_mapper_grid_range_init () */
+} ColorMapperGrid;
+
+typedef void (* ColorMapperGridFunc) (const ColorMapperParams     *params,
+                                      const ColorMapperGrid       *grid,
+                                      const ColorMapperSource     *in,
+                                      const ColorMapperAuxRow     *aux,
+                                      const ColorMapperFeatureRow *dst,
+                                      int                          x,
+                                      int                          y,
+                                      int                          width);
+
+/* the range weights of COLOR_MAPPER_GRID_SIGMA */
+void color_mapper_grid_range_init  (ColorMapperGridRange        *range);
+
+/* log_ratio and log_Y of a row of cells, from the aux and feature planes
+ * of the cells computed with perceptual off
+ */
+void color_mapper_grid_cells       (const ColorMapperAuxRow     *aux,
+                                    const ColorMapperFeatureRow *features,
+                                    float                       *log_ratio,
+                                    float                       *log_Y,
+                                    int                          width);
+
+/* feature planes of width pixels from x on in row y, in the coordinates
+ * of grid; Y of input comes from the middle Y row of in, the neighbours
+ * are not read.  The scalar reference, color_mapper_kernel_get_grid_features ()
+ * picks the SIMD form.
+ */
+void color_mapper_grid_features    (const ColorMapperParams     *params,
+                                    const ColorMapperGrid       *grid,
+                                    const ColorMapperSource     *in,
+                                    const ColorMapperAuxRow     *aux,
+                                    const ColorMapperFeatureRow *dst,
+                                    int                          x,
+                                    int                          y,
+                                    int                          width);
+
+/* the same on the pixels [x_start, x_end) of the row, for SIMD remainders */
+void color_mapper_grid_features_span (const ColorMapperParams     *params,
+                                      const ColorMapperGrid       *grid,
+                                      const ColorMapperSource     *in,
+                                      const ColorMapperAuxRow     *aux,
+                                      const ColorMapperFeatureRow *dst,
+                                      int                          x,
+                                      int                          y,
+                                      int                          x_start,
+                                      int                          x_end);
+
+/* a decimal number like strtof (), but with '.' as the decimal point in
+ * every locale; end as for strtof ()
+ */
+float color_mapper_parse_number (const char  *text,
+                                 char       **end);
+
+/* control points of a tone curve from text, either pairs "x,y x,y ..."
+ * with increasing x or evenly spaced values "y y ..." over x in [0, 1],
+ * separated by spaces or semicolons; returns the number of points, 0 when
+ * text is no curve of 2 to max_points points
+ */
+int  color_mapper_tone_curve_parse (const char             *text,
+                                    float                  *x,
+                                    float                  *y,
+                                    int                     max_points);
+
+/* table of the monotone cubic through the n_points control points, linear
+ * beyond the first and last one, for perceptual and fast_math of params
+ */
+void color_mapper_tone_curve_init  (ColorMapperToneCurve   *curve,
+                                    const float            *x,
+                                    const float            *y,
+                                    int                     n_points,
+                                    int                     perceptual,
+                                    int                     fast_math);
+
+/* TRUE when neutral2tinted is white, the tint multiplies are skipped then */
+int  color_mapper_white_is_neutral    (const ColorMapperParams     *params);
+
+/* scalar reference of all stages, the combine stage handles every technology */
+void color_mapper_aux_scalar          (const ColorMapperParams     *params,
+                                       const ColorMapperSource     *aux,
+                                       const ColorMapperAuxRow     *dst,
+                                       int                          width);
+
+void color_mapper_features_scalar     (const ColorMapperParams     *params,
+                                       const ColorMapperSource     *in,
+                                       const ColorMapperAuxRow     *aux,
+                                       const ColorMapperFeatureRow *dst,
+                                       int                          width);
+
+void color_mapper_combine_scalar      (const ColorMapperParams     *params,
+                                       const ColorMapperFeatureRow *features,
+                                       const ColorMapperAuxRow     *aux,
+                                       float                       *out,
+                                       int                          width);
+
+/* scalar reference on pixels [x_start, x_end), used for SIMD remainders */
+void color_mapper_aux_scalar_span      (const ColorMapperParams     *params,
+                                        const ColorMapperSource     *aux,
+                                        const ColorMapperAuxRow     *dst,
+                                        int                          x_start,
+                                        int                          x_end);
+
+void color_mapper_features_scalar_span (const ColorMapperParams     *params,
+                                        const ColorMapperSource     *in,
+                                        const ColorMapperAuxRow     *aux,
+                                        const ColorMapperFeatureRow *dst,
+                                        int                          x_start,
+                                        int                          x_end);
+
+void color_mapper_combine_scalar_span  (const ColorMapperParams     *params,
+                                        const ColorMapperFeatureRow *features,
+                                        const ColorMapperAuxRow     *aux,
+                                        float                       *out,
+                                        int                          x_start,
+                                        int                          x_end);
+
+/* kernels of one instruction set, the first index is fast_math; the last
+ * index of aux and combine is 1 for a neutral white representation, the
+ * one of features is perceptual (a polynomial log2 / exp2 pair in place of
+ * powf without fast_math, within 1 ulp); the tone curve has
+ * perceptual in its table
+ */
+typedef struct
+{
+  ColorMapperAuxFunc     aux[2][2];
+  ColorMapperFeatureFunc features[2][2];
+  ColorMapperCombineFunc combine[2][2][2];  /* DEFAULT, DEFAULT_RGB_UNLIMITED */
+  ColorMapperGridFunc    grid_features[2];
+  ColorMapperFeatureFunc tone_curve_features[2];
+} ColorMapperSimdKernels;
+
+#ifdef HAVE_COLOR_MAPPER_AVX2
+extern const ColorMapperSimdKernels color_mapper_simd_avx2;
+#endif
+
+#ifdef HAVE_COLOR_MAPPER_AVX512
+extern const ColorMapperSimdKernels color_mapper_simd_avx512;
+#endif
+
+#ifdef HAVE_COLOR_MAPPER_NEON
+extern const ColorMapperSimdKernels color_mapper_simd_neon;
+#endif
+
+/* detect the CPU features once, call at class init */
+void                   color_mapper_kernel_init         (void);
+
+/* name of the instruction set picked by color_mapper_kernel_init () */
+const char            *color_mapper_kernel_isa          (void);
+
+/* fastest kernels able to compute params */
+ColorMapperAuxFunc     color_mapper_kernel_get_aux      (const ColorMapperParams *params);
+ColorMapperFeatureFunc color_mapper_kernel_get_features (const ColorMapperParams *params);
+ColorMapperCombineFunc color_mapper_kernel_get_combine  (const ColorMapperParams *params);
+ColorMapperGridFunc    color_mapper_kernel_get_grid_features (const ColorMapperParams *params);
+
+#endif
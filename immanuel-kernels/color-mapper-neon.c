@@ -0,0 +1,112 @@
+/* This file is part of the color-mapper GEGL operation
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* 4-wide NEON kernels, aarch64 only (needs vdivq_f32 and vsqrtq_f32) */
+
+#include <arm_neon.h>
+
+#define VW                4
+#define VF                float32x4_t
+#define VM                uint32x4_t
+#define VSET1(f)          vdupq_n_f32 (f)
+#define VLOADU(p)         vld1q_f32 (p)
+#define VSTOREU(p, v)     vst1q_f32 ((p), (v))
+#define VADD(a, b)        vaddq_f32 ((a), (b))
+#define VSUB(a, b)        vsubq_f32 ((a), (b))
+#define VMUL(a, b)        vmulq_f32 ((a), (b))
+#define VDIV(a, b)        vdivq_f32 ((a), (b))
+#define VSQRT(a)          vsqrtq_f32 (a)
+#define VMIN(a, b)        vminnmq_f32 ((a), (b))
+#define VMAX(a, b)        vmaxnmq_f32 ((a), (b))
+#define VGT(a, b)         vcgtq_f32 ((a), (b))
+#define VNE(a, b)         vandq_u32 (vmvnq_u32 (vceqq_f32 ((a), (b))), \
+                                     vandq_u32 (vceqq_f32 ((a), (a)),  \
+                                                vceqq_f32 ((b), (b))))
+#define VSELECT(m, a, b)  vbslq_f32 ((m), (a), (b))
+
+/* fast_math: 8 bit estimates refined by two Newton-Raphson steps */
+static inline float32x4_t
+vrcp_neon (float32x4_t a)
+{
+  float32x4_t r = vrecpeq_f32 (a);
+
+  r = vmulq_f32 (r, vrecpsq_f32 (a, r));
+  return vmulq_f32 (r, vrecpsq_f32 (a, r));
+}
+
+static inline float32x4_t
+vrsqrt_neon (float32x4_t a)
+{
+  float32x4_t r = vrsqrteq_f32 (a);
+
+  r = vmulq_f32 (r, vrsqrtsq_f32 (vmulq_f32 (a, r), r));
+  return vmulq_f32 (r, vrsqrtsq_f32 (vmulq_f32 (a, r), r));
+}
+
+/* no gather instruction, one load per lane */
+static inline float32x4_t
+vgather_neon (const float *t,
+              float32x4_t  i)
+{
+  const int32x4_t idx = vcvtq_s32_f32 (i);
+  float32x4_t     r   = vdupq_n_f32 (t[vgetq_lane_s32 (idx, 0)]);
+
+  r = vsetq_lane_f32 (t[vgetq_lane_s32 (idx, 1)], r, 1);
+  r = vsetq_lane_f32 (t[vgetq_lane_s32 (idx, 2)], r, 2);
+  return vsetq_lane_f32 (t[vgetq_lane_s32 (idx, 3)], r, 3);
+}
+
+#define VRCP(a)           vrcp_neon (a)
+#define VRSQRT(a)         vrsqrt_neon (a)
+#define VROUND(a)         vrndnq_f32 (a)
+#define VFLOOR(a)         vrndmq_f32 (a)
+#define VGATHER(t, i)     vgather_neon ((t), (i))
+#define VLDEXP(a, e)      vreinterpretq_f32_s32 (vaddq_s32 (vreinterpretq_s32_f32 (a),   \
+                                                            vshlq_n_s32 (vcvtq_s32_f32 (e), 23)))
+
+#define VFREXP(x, m, e)                                               \
+  do {                                                                \
+    const uint32x4_t bits_ = vreinterpretq_u32_f32 ((x));             \
+    (e) = vcvtq_f32_s32 (vsubq_s32 (vreinterpretq_s32_u32 (vshrq_n_u32 (bits_, 23)), \
+                                    vdupq_n_s32 (127)));              \
+    (m) = vreinterpretq_f32_u32 (vorrq_u32 (vandq_u32 (bits_, vdupq_n_u32 (0x7fffff)), \
+                                            vdupq_n_u32 (0x3f800000))); \
+  } while (0)
+
+#define VLOAD_RGBA(p, r, g, b, a)                                     \
+  do {                                                                \
+    const float32x4x4_t v_ = vld4q_f32 (p);                           \
+    (r) = v_.val[0];                                                  \
+    (g) = v_.val[1];                                                  \
+    (b) = v_.val[2];                                                  \
+    (a) = v_.val[3];                                                  \
+  } while (0)
+
+#define VSTORE_RGBA(p, r, g, b, a)                                    \
+  do {                                                                \
+    float32x4x4_t v_;                                                 \
+    v_.val[0] = (r);                                                  \
+    v_.val[1] = (g);                                                  \
+    v_.val[2] = (b);                                                  \
+    v_.val[3] = (a);                                                  \
+    vst4q_f32 ((p), v_);                                              \
+  } while (0)
+
+#define COLOR_MAPPER_SIMD_ISA neon
+
+#include "color-mapper-simd.h"
@@ -0,0 +1,730 @@
+/* This file is part of the color-mapper GEGL operation
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* SIMD kernels of color-mapper: the aux stage, the feature stage, the
+  * feature stages of the tone curve
+  * and of the contrast grid, and the combine stage for the DEFAULT and DEFAULT_RGB_UNLIMITED
+  * technologies, written once against a small set of vector macros.
+  *
+  * The including file defines, for its instruction set:
+  *   VF                      vector of VW floats
+  *   VM                      comparison mask
+  *   VSET1 (f)               broadcast
+  *   VLOADU (p), VSTOREU (p, v)
+  *   VADD, VSUB, VMUL, VDIV, VSQRT
+  *   VMIN (a, b), VMAX (a, b) returning b where a is NaN (like fmin / fmax
+  *                            with a constant second operand)
+  *   VGT (a, b)              mask of a > b
+  *   VNE (a, b)              mask of a != b, false for NaN
+  *   VSELECT (m, a, b)       a where m is set, b elsewhere
+  *   VLOAD_RGBA (p, r, g, b, a), VSTORE_RGBA (p, r, g, b, a)
+  *                           (de)interleave VW RGBA pixels
+  *   VRCP (a), VRSQRT (a)    1 / a and 1 / sqrt (a) within
+  *                           COLOR_MAPPER_FAST_MATH_ERROR
+  *   VFREXP (x, m, e)        x = m * 2^e, m in [1, 2), for normal x > 0
+  *   VROUND (a)              round to nearest integer
+  *   VFLOOR (a)              round down
+  *   VLDEXP (a, e)           a * 2^e, for integer e and normal results
+  *   VGATHER (t, i)          t[i] of the float table t per lane, i holds
+  *                           integers in [0, 2^24)
+  *   COLOR_MAPPER_SIMD_ISA   suffix of the generated kernel table,
+  *                           color_mapper_simd_<isa>
+  */
+
+#include <float.h>
+#include <math.h>
+#include <stddef.h>
+
+#include "color-mapper-kernel.h"
+
+#define COLOR_MAPPER_PASTE2(a, b)    a##_##b
+#define COLOR_MAPPER_PASTE(a, b)     COLOR_MAPPER_PASTE2 (a, b)
+#define COLOR_MAPPER_SIMD_FUNC(name) COLOR_MAPPER_PASTE (name, COLOR_MAPPER_SIMD_ISA)
+
+/* bodies inlined with constant flags into the variants at the end */
+#define COLOR_MAPPER_SIMD_BODY       static inline __attribute__ ((always_inline))
+
+/* the operations fast_math replaces, a flag of constant fast folds to one
+ * of both forms
+ */
+COLOR_MAPPER_SIMD_BODY VF
+simd_div (VF        a,
+          VF        b,
+          const int fast)
+{
+  return fast ? VMUL (a, VRCP (b)) : VDIV (a, b);
+}
+
+COLOR_MAPPER_SIMD_BODY VF
+simd_sqrt (VF        a,
+           const int fast)
+{
+  VM denormal;
+  VF r;
+
+  if (! fast)
+    return VSQRT (a);
+
+  /* a * 1 / sqrt (a), the estimates flush denormals, so those are scaled
+   * by 2^64 first; 0 stays 0 instead of 0 * Inf
+   */
+  denormal = VGT (VSET1 (FLT_MIN), a);
+  a = VSELECT (denormal, VMUL (a, VSET1 (0x1p64f)), a);
+  r = VMUL (a, VRSQRT (VMAX (a, VSET1 (FLT_MIN))));
+
+  return VSELECT (denormal, VMUL (r, VSET1 (0x1p-32f)), r);
+}
+
+#define SIMD_GAMMA_HORNER(c, x, d)   VADD (VMUL ((c), (x)), VSET1 (d))
+
+/* color_mapper_fast_gamma () on VW floats */
+COLOR_MAPPER_SIMD_BODY VF
+simd_fast_gamma (VF x)
+{
+  const VF one = VSET1 (1.0f);
+  VF       m, e, u, q, y, i, f, p;
+  VM       upper;
+
+  /* x = 2^e * (1 + u), 1 + u in [sqrt (0.5), sqrt (2)) */
+  VFREXP (x, m, e);
+  upper = VGT (m, VSET1 (1.41421356f));
+  m = VSELECT (upper, VMUL (m, VSET1 (0.5f)), m);
+  e = VSELECT (upper, VADD (e, one), e);
+  u = VSUB (m, one);
+
+  /* log2 (x) / 2.2 = q + y, 5 e - 11 q is exact in float */
+  e = VMUL (e, VSET1 (5.0f));
+  q = VROUND (VMUL (e, VSET1 (1.0f / 11.0f)));
+  y = VADD (VMUL (VSUB (e, VMUL (q, VSET1 (11.0f))), VSET1 (1.0f / 11.0f)),
+            VMUL (VMUL (u, COLOR_MAPPER_GAMMA_LOG2 (SIMD_GAMMA_HORNER, VSET1, u)),
+                  VSET1 (1.0f / 2.2f)));
+
+  i = VROUND (y);
+  f = VSUB (y, i);
+  p = VADD (one, VMUL (f, COLOR_MAPPER_GAMMA_EXP2 (SIMD_GAMMA_HORNER, VSET1, f)));
+
+  return VSELECT (VGT (x, VSET1 (FLT_MIN)), VLDEXP (p, VADD (q, i)), VSET1 (0.0f));
+}
+
+/* 0, 1, ... VW - 1 */
+static const float simd_iota[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+/* log2 (x) = e + the returned fraction in [-0.5, 0.5), for normal x > 0;
+ * the fraction is 2 / ln (2) atanh (s) with s = (m - 1) / (m + 1) of the
+ * mantissa m in [sqrt (0.5), sqrt (2)), so |s| < 0.1716 and the series
+ * up to s^9 is within 2e-9; e is exact, so the fraction keeps its full
+ * precision however large log2 (x) is
+ */
+COLOR_MAPPER_SIMD_BODY VF
+simd_log2_split (VF  x,
+                 VF *e)
+{
+  const VF one = VSET1 (1.0f);
+  VF       m, u, s, s2;
+  VM       upper;
+
+  VFREXP (x, m, *e);
+  upper = VGT (m, VSET1 (1.41421356f));
+  m  = VSELECT (upper, VMUL (m, VSET1 (0.5f)), m);
+  *e = VSELECT (upper, VADD (*e, one), *e);
+
+  u  = VSUB (m, one);
+  s  = VDIV (u, VADD (u, VSET1 (2.0f)));
+  s2 = VMUL (s, s);
+
+  return VMUL (s, SIMD_GAMMA_HORNER (SIMD_GAMMA_HORNER (SIMD_GAMMA_HORNER (SIMD_GAMMA_HORNER (
+                    VSET1 (0.320598898f), s2, 0.412198583f), s2, 0.577078016f), s2,
+                    0.961796694f), s2, 2.885390082f));
+}
+
+/* 2^y for 2^y normal, 2^i * 2^f with |f| <= 0.5 from the Taylor series up
+ * to f^7, within 6e-9 of 2^f
+ */
+COLOR_MAPPER_SIMD_BODY VF
+simd_exp2 (VF y)
+{
+  const VF i = VROUND (y);
+  const VF f = VSUB (y, i);
+  VF       p;
+
+  p = SIMD_GAMMA_HORNER (SIMD_GAMMA_HORNER (SIMD_GAMMA_HORNER (SIMD_GAMMA_HORNER (
+        SIMD_GAMMA_HORNER (SIMD_GAMMA_HORNER (VSET1 (1.525273380e-05f), f,
+        1.540353039e-04f), f, 1.333355815e-03f), f, 9.618129108e-03f), f,
+        5.550410866e-02f), f, 2.402265070e-01f), f, 6.931471806e-01f);
+
+  return VLDEXP (VADD (VSET1 (1.0f), VMUL (f, p)), i);
+}
+
+/* powf (x, 1 / 2.2) of the exact perceptual mode for x >= 0, from the
+ * log2 / exp2 above with the exponent split of simd_fast_gamma (), so
+ * tiny x keep full precision; denormal x are scaled into the normal range
+ * first, 0 stays 0
+ */
+COLOR_MAPPER_SIMD_BODY VF
+simd_gamma (VF x)
+{
+  const VF flt_min  = VSET1 (FLT_MIN);
+  const VM denormal = VGT (flt_min, x);
+  VF       e, l, q, y;
+
+  l = simd_log2_split (VSELECT (denormal, VMUL (x, VSET1 (0x1p64f)), x), &e);
+  e = VSELECT (denormal, VSUB (e, VSET1 (64.0f)), e);
+
+  /* log2 (x) / 2.2 = q + y, 5 e - 11 q is exact in float */
+  e = VMUL (e, VSET1 (5.0f));
+  q = VROUND (VMUL (e, VSET1 (1.0f / 11.0f)));
+  y = VADD (VMUL (VSUB (e, VMUL (q, VSET1 (11.0f))), VSET1 (1.0f / 11.0f)),
+            VMUL (l, VSET1 (1.0f / 2.2f)));
+
+  return VSELECT (VGT (x, VSET1 (0.0f)), VLDEXP (simd_exp2 (y), q), VSET1 (0.0f));
+}
+
+COLOR_MAPPER_SIMD_BODY void
+simd_aux_body (const ColorMapperParams *params,
+               const ColorMapperSource *aux,
+               const ColorMapperAuxRow *dst,
+               int                      width,
+               const int                neutral,
+               const int                fast)
+{
+  const VF zero     = VSET1 (0.0f);
+  const VF half     = VSET1 (0.5f);
+  const VF flt_min  = VSET1 (FLT_MIN);
+  const VF n2t_r    = VSET1 (params->neutral2tinted[0]);
+  const VF n2t_g    = VSET1 (params->neutral2tinted[1]);
+  const VF n2t_b    = VSET1 (params->neutral2tinted[2]);
+  int x;
+
+  for (x = 0; x + VW <= width; x += VW)
+    {
+      VF Yaux, dx, dy;
+      VF aux_r, aux_g, aux_b, aux_a;
+      VF chroma_r, chroma_g, chroma_b;
+      VF chroma_hsy;
+
+      Yaux = VLOADU (aux->Y[1] + x + 1);
+
+      dx = VSUB (VLOADU (aux->Y[1] + x), VLOADU (aux->Y[1] + x + 2));
+      dy = VSUB (VLOADU (aux->Y[0] + x + 1), VLOADU (aux->Y[2] + x + 1));
+
+      VLOAD_RGBA (aux->rgba + x * 4, aux_r, aux_g, aux_b, aux_a);
+      (void) aux_a;
+
+      chroma_r = VSUB (aux_r, neutral ? Yaux : VMUL (Yaux, n2t_r));
+      chroma_g = VSUB (aux_g, neutral ? Yaux : VMUL (Yaux, n2t_g));
+      chroma_b = VSUB (aux_b, neutral ? Yaux : VMUL (Yaux, n2t_b));
+
+      /* HSY chroma and saturation of aux */
+      chroma_hsy = simd_sqrt (VSUB (VADD (VADD (VMUL (chroma_r, chroma_r),
+                                            VMUL (chroma_g, chroma_g)),
+                                      VMUL (chroma_b, chroma_b)),
+                                VADD (VADD (VMUL (chroma_r, chroma_g),
+                                            VMUL (chroma_r, chroma_b)),
+                                      VMUL (chroma_g, chroma_b))),
+                              fast);
+
+      VSTOREU (dst->Y + x, Yaux);
+      VSTOREU (dst->gradient + x, VMUL (half, simd_sqrt (VADD (VMUL (dx, dx), VMUL (dy, dy)), fast)));
+      VSTOREU (dst->chroma[0] + x, chroma_r);
+      VSTOREU (dst->chroma[1] + x, chroma_g);
+      VSTOREU (dst->chroma[2] + x, chroma_b);
+      VSTOREU (dst->chroma_hsy + x, chroma_hsy);
+      if (fast)
+        {
+          /* chroma / sqrt (Y^2 + chroma^2) as one reciprocal square root */
+          const VF norm2 = VADD (VMUL (Yaux, Yaux), VMUL (chroma_hsy, chroma_hsy));
+
+          VSTOREU (dst->saturation + x,
+                   VSELECT (VGT (VMIN (Yaux, norm2), flt_min),
+                            VMUL (chroma_hsy, VRSQRT (norm2)),
+                            zero));
+        }
+      else
+        {
+          VSTOREU (dst->saturation + x,
+                   VSELECT (VGT (Yaux, flt_min),
+                            VDIV (chroma_hsy,
+                                  VSQRT (VADD (VMUL (Yaux, Yaux),
+                                               VMUL (chroma_hsy, chroma_hsy)))),
+                            zero));
+        }
+    }
+
+  color_mapper_aux_scalar_span (params, aux, dst, x, width);
+}
+
+COLOR_MAPPER_SIMD_BODY void
+simd_features_body (const ColorMapperParams     *params,
+                    const ColorMapperSource     *in,
+                    const ColorMapperAuxRow     *aux,
+                    const ColorMapperFeatureRow *dst,
+                    int                          width,
+                    const int                    perceptual,
+                    const int                    fast)
+{
+  const VF one      = VSET1 (1.0f);
+  const VF zero     = VSET1 (0.0f);
+  const VF half     = VSET1 (0.5f);
+  const VF flt_min  = VSET1 (FLT_MIN);
+  int x;
+
+  for (x = 0; x + VW <= width; x += VW)
+    {
+      VF Yin, Yaux, dx, dy, GradientYin, GradientYaux;
+      VF GradientYin_Yaux, GradientYaux_Yin, lo, hi, base;
+      VF in_r, in_g, in_b, in_a;
+      VM Yin_greater;
+
+      Yin  = VLOADU (in->Y[1] + x + 1);
+      Yaux = VLOADU (aux->Y + x);
+
+      /* gradient of input */
+      dx = VSUB (VLOADU (in->Y[1] + x), VLOADU (in->Y[1] + x + 2));
+      dy = VSUB (VLOADU (in->Y[0] + x + 1), VLOADU (in->Y[2] + x + 1));
+      GradientYin  = VMUL (half, simd_sqrt (VADD (VMUL (dx, dx), VMUL (dy, dy)), fast));
+      GradientYaux = VLOADU (aux->gradient + x);
+
+      /* ChromaAdoptionFactor_base, smaller of both cross products divided
+       * by the larger one, 1.0 if equal
+       */
+      GradientYaux_Yin = VMUL (GradientYaux, Yin);
+      GradientYin_Yaux = VMUL (GradientYin, Yaux);
+      Yin_greater = VGT (GradientYin_Yaux, GradientYaux_Yin);
+      lo = VSELECT (Yin_greater, GradientYaux_Yin, GradientYin_Yaux);
+      hi = VSELECT (Yin_greater, GradientYin_Yaux, GradientYaux_Yin);
+      if (fast)
+        {
+          /* products below FLT_MIN are scaled into the range of VRCP */
+          const VM denormal = VGT (flt_min, hi);
+
+          lo   = VSELECT (denormal, VMUL (lo, VSET1 (0x1p64f)), lo);
+          hi   = VSELECT (denormal, VMUL (hi, VSET1 (0x1p64f)), hi);
+          base = VMUL (lo, VRCP (hi));
+        }
+      else
+        base = VDIV (lo, hi);
+      base = VSELECT (VNE (GradientYin_Yaux, GradientYaux_Yin), base, one);
+
+      if (perceptual && fast)
+        base = simd_fast_gamma (base);
+      else if (perceptual)
+        base = simd_gamma (base);
+
+      VLOAD_RGBA (in->rgba + x * 4, in_r, in_g, in_b, in_a);
+      (void) in_r; (void) in_g; (void) in_b;
+
+      VSTOREU (dst->Y + x, Yin);
+      VSTOREU (dst->luminance_ratio + x, simd_div (Yin, VMAX (Yaux, VSET1 (COLOR_MAPPER_Y_MIN)), fast));
+      VSTOREU (dst->base + x, VSUB (base, one));
+      VSTOREU (dst->invert + x, VSELECT (Yin_greater, one, zero));
+      VSTOREU (dst->gradient_ratio + x, simd_div (GradientYin, VMAX (GradientYaux, flt_min), fast));
+      VSTOREU (dst->alpha + x, in_a);
+    }
+
+  color_mapper_features_scalar_span (params, in, aux, dst, x, width);
+}
+
+/* the tone curve branch of color_mapper_features_body (); the table index
+ * comes from the exponent and the mantissa of Yaux apart, so it is exact
+ * up to the fraction, and the four table entries are gathered
+ */
+COLOR_MAPPER_SIMD_BODY void
+simd_tone_curve_features_body (const ColorMapperParams     *params,
+                               const ColorMapperSource     *in,
+                               const ColorMapperAuxRow     *aux,
+                               const ColorMapperFeatureRow *dst,
+                               int                          width,
+                               const int                    fast)
+{
+  const ColorMapperToneCurve *curve = params->tone_curve;
+  const VF one      = VSET1 (1.0f);
+  const VF zero     = VSET1 (0.0f);
+  const VF flt_min  = VSET1 (FLT_MIN);
+  const VF per_stop = VSET1 (COLOR_MAPPER_TONE_CURVE_PER_STOP);
+  int x;
+
+  for (x = 0; x + VW <= width; x += VW)
+    {
+      VF Yin, Yaux, e, t, i, f, r0, r1, b0, b1, ratio, luminance_ratio;
+      VF in_r, in_g, in_b, in_a;
+
+      Yin  = VLOADU (in->Y[1] + x + 1);
+      Yaux = VLOADU (aux->Y + x);
+
+      /* (log2 (Yaux) - LOG2_MIN) * PER_STOP, clamped to the table */
+      t = VMUL (simd_log2_split (VMAX (Yaux, flt_min), &e), per_stop);
+      t = VADD (t, VMUL (VSUB (e, VSET1 (COLOR_MAPPER_TONE_CURVE_LOG2_MIN)), per_stop));
+      t = VMIN (VMAX (t, zero), VSET1 (COLOR_MAPPER_TONE_CURVE_SIZE - 1));
+      i = VMIN (VFLOOR (t), VSET1 (COLOR_MAPPER_TONE_CURVE_SIZE - 2));
+      f = VSUB (t, i);
+
+      r0 = VGATHER (curve->ratio, i);
+      r1 = VGATHER (curve->ratio + 1, i);
+      b0 = VGATHER (curve->base, i);
+      b1 = VGATHER (curve->base + 1, i);
+      ratio = VADD (r0, VMUL (VSUB (r1, r0), f));
+
+      luminance_ratio = simd_div (Yin, VMAX (Yaux, VSET1 (COLOR_MAPPER_Y_MIN)), fast);
+
+      VLOAD_RGBA (in->rgba + x * 4, in_r, in_g, in_b, in_a);
+      (void) in_r; (void) in_g; (void) in_b;
+
+      VSTOREU (dst->Y + x, Yin);
+      VSTOREU (dst->luminance_ratio + x, luminance_ratio);
+      VSTOREU (dst->base + x, VADD (b0, VMUL (VSUB (b1, b0), f)));
+      VSTOREU (dst->invert + x, VSELECT (VGT (ratio, one), one, zero));
+      VSTOREU (dst->gradient_ratio + x, VMUL (ratio, luminance_ratio));
+      VSTOREU (dst->alpha + x, in_a);
+    }
+
+  color_mapper_features_scalar_span (params, in, aux, dst, x, width);
+}
+
+/* grid_range_weight () of color-mapper-kernel.c on VW distances */
+COLOR_MAPPER_SIMD_BODY VF
+simd_grid_range_weight (const ColorMapperGridRange *range,
+                        VF                          d)
+{
+  VF t, i, w0, w1;
+
+  t  = VMIN (VMUL (VMUL (d, d), VSET1 (COLOR_MAPPER_GRID_RANGE_PER_UNIT)),
+             VSET1 (COLOR_MAPPER_GRID_RANGE_SIZE - 1));
+  i  = VMIN (VFLOOR (t), VSET1 (COLOR_MAPPER_GRID_RANGE_SIZE - 2));
+  w0 = VGATHER (range->weight, i);
+  w1 = VGATHER (range->weight + 1, i);
+
+  return VADD (w0, VMUL (VSUB (w1, w0), VSUB (t, i)));
+}
+
+/* color_mapper_grid_features_span () on VW pixels at a time; the cells
+ * around each pixel and their range weights are gathered, log2 and exp2
+ * are the polynomials above
+ */
+COLOR_MAPPER_SIMD_BODY void
+simd_grid_features_body (const ColorMapperParams     *params,
+                         const ColorMapperGrid       *grid,
+                         const ColorMapperSource     *in,
+                         const ColorMapperAuxRow     *aux,
+                         const ColorMapperFeatureRow *dst,
+                         int                          x0,
+                         int                          y,
+                         int                          width,
+                         const int                    fast)
+{
+  const VF     one      = VSET1 (1.0f);
+  const VF     zero     = VSET1 (0.0f);
+  const VF     flt_min  = VSET1 (FLT_MIN);
+  const VF     gamma    = VSET1 (params->perceptual ? 1.0f / 2.2f : 1.0f);
+  const VF     last     = VSET1 (grid->width - 2);
+  const float *ratio0, *Y0;
+  float        fy_s, v;
+  VF           fy, wy0;
+  int          j, x;
+
+  /* the row of cells above (and the one below) the row */
+  v = (y - grid->y + 0.5f) / grid->cell - 0.5f;
+  j = (int) floorf (v);
+  if (j < 0)
+    {
+      j    = 0;
+      fy_s = 0.0f;
+    }
+  else if (j > grid->height - 2)
+    {
+      j    = grid->height - 2;
+      fy_s = 1.0f;
+    }
+  else
+    fy_s = v - j;
+
+  ratio0 = grid->log_ratio + j * grid->width;
+  Y0     = grid->log_Y     + j * grid->width;
+  fy     = VSET1 (fy_s);
+  wy0    = VSET1 (1.0f - fy_s);
+
+  for (x = 0; x + VW <= width; x += VW)
+    {
+      VF Yin, Yaux, lY, e, u, k, fx, wx0;
+      VF w00, w01, w10, w11, sum, l, luminance_ratio;
+      VF in_r, in_g, in_b, in_a;
+      VM low, high, weighted;
+
+      Yin  = VLOADU (in->Y[1] + x + 1);
+      Yaux = VLOADU (aux->Y + x);
+      lY   = simd_log2_split (VMAX (Yaux, flt_min), &e);
+      lY   = VADD (lY, e);
+
+      /* cell left of each pixel, as grid_cell () */
+      u    = VSUB (VMUL (VADD (VLOADU (simd_iota), VSET1 (x0 + x - grid->x + 0.5f)),
+                         VSET1 (1.0f / grid->cell)),
+                   VSET1 (0.5f));
+      k    = VFLOOR (u);
+      fx   = VSUB (u, k);
+      low  = VGT (zero, k);
+      high = VGT (k, last);
+      k    = VSELECT (low, zero, VSELECT (high, last, k));
+      fx   = VSELECT (low, zero, VSELECT (high, one, fx));
+      wx0  = VSUB (one, fx);
+
+      /* bilinear weight times the one of the guide */
+      w00 = VMUL (VMUL (wx0, wy0), simd_grid_range_weight (grid->range, VSUB (lY, VGATHER (Y0, k))));
+      w01 = VMUL (VMUL (fx,  wy0), simd_grid_range_weight (grid->range, VSUB (lY, VGATHER (Y0 + 1, k))));
+      w10 = VMUL (VMUL (wx0, fy),  simd_grid_range_weight (grid->range, VSUB (lY, VGATHER (Y0 + grid->width, k))));
+      w11 = VMUL (VMUL (fx,  fy),  simd_grid_range_weight (grid->range, VSUB (lY, VGATHER (Y0 + grid->width + 1, k))));
+      sum = VADD (VADD (w00, w01), VADD (w10, w11));
+
+      /* no cell is close in luminance, plain bilinear then */
+      weighted = VGT (sum, VSET1 (1e-6f));
+      w00 = VSELECT (weighted, w00, VMUL (wx0, wy0));
+      w01 = VSELECT (weighted, w01, VMUL (fx,  wy0));
+      w10 = VSELECT (weighted, w10, VMUL (wx0, fy));
+      w11 = VSELECT (weighted, w11, VMUL (fx,  fy));
+      sum = VSELECT (weighted, sum, one);
+
+      l = VADD (VADD (VMUL (w00, VGATHER (ratio0, k)),
+                      VMUL (w01, VGATHER (ratio0 + 1, k))),
+                VADD (VMUL (w10, VGATHER (ratio0 + grid->width, k)),
+                      VMUL (w11, VGATHER (ratio0 + grid->width + 1, k))));
+      l = simd_div (l, sum, fast);
+
+      luminance_ratio = simd_div (Yin, VMAX (Yaux, VSET1 (COLOR_MAPPER_Y_MIN)), fast);
+
+      VLOAD_RGBA (in->rgba + x * 4, in_r, in_g, in_b, in_a);
+      (void) in_r; (void) in_g; (void) in_b;
+
+      VSTOREU (dst->Y + x, Yin);
+      VSTOREU (dst->luminance_ratio + x, luminance_ratio);
+      VSTOREU (dst->base + x, VSUB (simd_exp2 (VMUL (VMIN (l, VSUB (zero, l)), gamma)), one));
+      VSTOREU (dst->invert + x, VSELECT (VGT (l, zero), one, zero));
+      VSTOREU (dst->gradient_ratio + x, VMUL (simd_exp2 (l), luminance_ratio));
+      VSTOREU (dst->alpha + x, in_a);
+    }
+
+  color_mapper_grid_features_span (params, grid, in, aux, dst, x0, y, x, width);
+}
+
+COLOR_MAPPER_SIMD_BODY void
+simd_combine_body (const ColorMapperParams     *params,
+                   const ColorMapperFeatureRow *features,
+                   const ColorMapperAuxRow     *aux,
+                   float                       *out,
+                   int                          width,
+                   const int                    clip,
+                   const int                    neutral,
+                   const int                    fast)
+{
+  const VF one      = VSET1 (1.0f);
+  const VF zero     = VSET1 (0.0f);
+  const VF half     = VSET1 (0.5f);
+  const VF flt_min  = VSET1 (FLT_MIN);
+  const VF eps      = VSET1 (0.00001f);
+  const VF neg_eps  = VSET1 (-0.00001f);
+  const VF scale    = VSET1 (params->scale);
+  const VF sat_min  = VSET1 (params->saturation_min);
+  const VF sat_wf   = VSET1 (params->saturation_weighting_factor);
+  const VF global   = VSET1 (params->globalSaturation);
+  const VF n2t_r    = VSET1 (params->neutral2tinted[0]);
+  const VF n2t_g    = VSET1 (params->neutral2tinted[1]);
+  const VF n2t_b    = VSET1 (params->neutral2tinted[2]);
+  int x;
+
+  for (x = 0; x + VW <= width; x += VW)
+    {
+      VF Yin, base, factor, factor_global, chromafactor;
+      VF gray_r, gray_g, gray_b;
+      VF chroma_r, chroma_g, chroma_b;
+      VF sat_hsy, sat_dz;
+      VF out_r, out_g, out_b;
+
+      Yin  = VLOADU (features->Y + x);
+      base = VLOADU (features->base + x);
+
+      gray_r = neutral ? Yin : VMUL (Yin, n2t_r);
+      gray_g = neutral ? Yin : VMUL (Yin, n2t_g);
+      gray_b = neutral ? Yin : VMUL (Yin, n2t_b);
+
+      chroma_r = VLOADU (aux->chroma[0] + x);
+      chroma_g = VLOADU (aux->chroma[1] + x);
+      chroma_b = VLOADU (aux->chroma[2] + x);
+      sat_hsy  = VLOADU (aux->saturation + x);
+
+      sat_dz = VSELECT (VGT (sat_hsy, flt_min),
+                        simd_div (VMAX (VSUB (sat_hsy, sat_min), zero), sat_hsy, fast),
+                        zero);
+
+      /* chroma adoption factor */
+      factor = VADD (one, VMUL (scale, base));
+      factor = VSELECT (VGT (factor, flt_min),
+                        VSELECT (VGT (VLOADU (features->invert + x), half),
+                                 fast ? VRCP (factor) : VDIV (one, factor),
+                                 factor),
+                        one);
+
+      factor_global = VMUL (factor, global);
+      factor_global = VADD (one,
+                            VMUL (VMUL (VSUB (factor_global, one),
+                                        VADD (VMUL (sat_wf, VSUB (sat_hsy, one)), one)),
+                                  sat_dz));
+
+      chromafactor = VMUL (VLOADU (features->luminance_ratio + x), factor_global);
+      out_r = VADD (gray_r, VMUL (chroma_r, chromafactor));
+      out_g = VADD (gray_g, VMUL (chroma_g, chromafactor));
+      out_b = VADD (gray_b, VMUL (chroma_b, chromafactor));
+
+      if (clip)
+        {
+          VF clip_neg, clip_pos, saturation_clip;
+
+          /* reduce saturation to better fit in rgb-range [0...1]; exact
+           * divisions with fast_math too, the clip scales out - gray back
+           * from far outside the range and any error along with it
+           */
+          clip_neg = VMIN (VDIV (gray_r, VSUB (gray_r, VMIN (out_r, neg_eps))),
+                           VMIN (VDIV (gray_g, VSUB (gray_g, VMIN (out_g, neg_eps))),
+                                 VDIV (gray_b, VSUB (gray_b, VMIN (out_b, neg_eps)))));
+
+          clip_pos = VMAX (VDIV (VMAX (VSUB (out_r, VMAX (gray_r, one)), zero),
+                                 VADD (VSUB (out_r, gray_r), eps)),
+                           VMAX (VDIV (VMAX (VSUB (out_g, VMAX (gray_g, one)), zero),
+                                       VADD (VSUB (out_g, gray_g), eps)),
+                                 VDIV (VMAX (VSUB (out_b, VMAX (gray_b, one)), zero),
+                                       VADD (VSUB (out_b, gray_b), eps))));
+          clip_pos = VSUB (one, clip_pos);
+
+          saturation_clip = VMIN (clip_pos, clip_neg);
+
+          out_r = VADD (VMUL (VSUB (out_r, gray_r), saturation_clip), gray_r);
+          out_g = VADD (VMUL (VSUB (out_g, gray_g), saturation_clip), gray_g);
+          out_b = VADD (VMUL (VSUB (out_b, gray_b), saturation_clip), gray_b);
+        }
+
+      /* keep alpha from in */
+      VSTORE_RGBA (out + x * 4, out_r, out_g, out_b, VLOADU (features->alpha + x));
+    }
+
+  color_mapper_combine_scalar_span (params, features, aux, out, x, width);
+}
+
+
+/* the variants and their table, picked by color_mapper_kernel_get_* () */
+
+#define COLOR_MAPPER_SIMD_AUX_VARIANT(name, neutral, fast)                      \
+static void                                                                     \
+name (const ColorMapperParams *params,                                          \
+      const ColorMapperSource *aux,                                             \
+      const ColorMapperAuxRow *dst,                                             \
+      int                      width)                                           \
+{                                                                               \
+  simd_aux_body (params, aux, dst, width, neutral, fast);                       \
+}
+
+#define COLOR_MAPPER_SIMD_FEATURES_VARIANT(name, perceptual, fast)              \
+static void                                                                     \
+name (const ColorMapperParams     *params,                                      \
+      const ColorMapperSource     *in,                                          \
+      const ColorMapperAuxRow     *aux,                                         \
+      const ColorMapperFeatureRow *dst,                                         \
+      int                          width)                                       \
+{                                                                               \
+  simd_features_body (params, in, aux, dst, width, perceptual, fast);           \
+}
+
+#define COLOR_MAPPER_SIMD_COMBINE_VARIANT(name, clip, neutral, fast)            \
+static void                                                                     \
+name (const ColorMapperParams     *params,                                      \
+      const ColorMapperFeatureRow *features,                                    \
+      const ColorMapperAuxRow     *aux,                                         \
+      float                       *out,                                         \
+      int                          width)                                       \
+{                                                                               \
+  simd_combine_body (params, features, aux, out, width, clip, neutral, fast);   \
+}
+
+#define COLOR_MAPPER_SIMD_GRID_VARIANT(name, fast)                              \
+static void                                                                     \
+name (const ColorMapperParams     *params,                                      \
+      const ColorMapperGrid       *grid,                                        \
+      const ColorMapperSource     *in,                                          \
+      const ColorMapperAuxRow     *aux,                                         \
+      const ColorMapperFeatureRow *dst,                                         \
+      int                          x,                                           \
+      int                          y,                                           \
+      int                          width)                                       \
+{                                                                               \
+  simd_grid_features_body (params, grid, in, aux, dst, x, y, width, fast);      \
+}
+
+#define COLOR_MAPPER_SIMD_TONE_CURVE_VARIANT(name, fast)                        \
+static void                                                                     \
+name (const ColorMapperParams     *params,                                      \
+      const ColorMapperSource     *in,                                          \
+      const ColorMapperAuxRow     *aux,                                         \
+      const ColorMapperFeatureRow *dst,                                         \
+      int                          width)                                       \
+{                                                                               \
+  simd_tone_curve_features_body (params, in, aux, dst, width, fast);            \
+}
+
+COLOR_MAPPER_SIMD_AUX_VARIANT (simd_aux_tinted,       0, 0)
+COLOR_MAPPER_SIMD_AUX_VARIANT (simd_aux_neutral,      1, 0)
+COLOR_MAPPER_SIMD_AUX_VARIANT (simd_aux_tinted_fast,  0, 1)
+COLOR_MAPPER_SIMD_AUX_VARIANT (simd_aux_neutral_fast, 1, 1)
+
+COLOR_MAPPER_SIMD_FEATURES_VARIANT (simd_features_linear,          0, 0)
+COLOR_MAPPER_SIMD_FEATURES_VARIANT (simd_features_perceptual,      1, 0)
+COLOR_MAPPER_SIMD_FEATURES_VARIANT (simd_features_linear_fast,     0, 1)
+COLOR_MAPPER_SIMD_FEATURES_VARIANT (simd_features_perceptual_fast, 1, 1)
+
+COLOR_MAPPER_SIMD_COMBINE_VARIANT (simd_combine_clip_tinted,            1, 0, 0)
+COLOR_MAPPER_SIMD_COMBINE_VARIANT (simd_combine_clip_neutral,           1, 1, 0)
+COLOR_MAPPER_SIMD_COMBINE_VARIANT (simd_combine_unlimited_tinted,       0, 0, 0)
+COLOR_MAPPER_SIMD_COMBINE_VARIANT (simd_combine_unlimited_neutral,      0, 1, 0)
+COLOR_MAPPER_SIMD_COMBINE_VARIANT (simd_combine_clip_tinted_fast,       1, 0, 1)
+COLOR_MAPPER_SIMD_COMBINE_VARIANT (simd_combine_clip_neutral_fast,      1, 1, 1)
+COLOR_MAPPER_SIMD_COMBINE_VARIANT (simd_combine_unlimited_tinted_fast,  0, 0, 1)
+COLOR_MAPPER_SIMD_COMBINE_VARIANT (simd_combine_unlimited_neutral_fast, 0, 1, 1)
+
+COLOR_MAPPER_SIMD_GRID_VARIANT (simd_grid_features,      0)
+COLOR_MAPPER_SIMD_GRID_VARIANT (simd_grid_features_fast, 1)
+
+COLOR_MAPPER_SIMD_TONE_CURVE_VARIANT (simd_tone_curve_features,      0)
+COLOR_MAPPER_SIMD_TONE_CURVE_VARIANT (simd_tone_curve_features_fast, 1)
+
+const ColorMapperSimdKernels COLOR_MAPPER_SIMD_FUNC (color_mapper_simd) =
+{
+  {
+    { simd_aux_tinted,      simd_aux_neutral },
+    { simd_aux_tinted_fast, simd_aux_neutral_fast }
+  },
+  {
+    { simd_features_linear,      simd_features_perceptual },
+    { simd_features_linear_fast, simd_features_perceptual_fast }
+  },
+  {
+    {
+      [COLOR_MAPPER_DEFAULT]               = { simd_combine_clip_tinted,      simd_combine_clip_neutral },
+      [COLOR_MAPPER_DEFAULT_RGB_UNLIMITED] = { simd_combine_unlimited_tinted, simd_combine_unlimited_neutral },
+    },
+    {
+      [COLOR_MAPPER_DEFAULT]               = { simd_combine_clip_tinted_fast,      simd_combine_clip_neutral_fast },
+      [COLOR_MAPPER_DEFAULT_RGB_UNLIMITED] = { simd_combine_unlimited_tinted_fast, simd_combine_unlimited_neutral_fast },
+    }
+  },
+  { simd_grid_features, simd_grid_features_fast },
+  { simd_tone_curve_features, simd_tone_curve_features_fast }
+};
@@ -0,0 +1,793 @@
+/* This file is part of the immanuel:* GEGL operations
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "immanuel-kernels.h"
+
+#define MAX_THREADS 64
+
+/* rows per band, more when a halo is read around each band */
+#define BAND_ROWS   64
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* linear sRGB, as babl has it */
+static const double srgb_luminance[3] = { 0.2126729, 0.7151522, 0.0721750 };
+
+
+/* images */
+
+void
+immanuel_image_init_interleaved (ImmanuelImage *image,
+                                 float         *data,
+                                 int            n_components,
+                                 int            width,
+                                 int            height,
+                                 ptrdiff_t      row_stride)
+{
+  int c;
+
+  memset (image, 0, sizeof (*image));
+
+  for (c = 0; c < n_components && c < IMMANUEL_IMAGE_MAX_COMPONENTS; c++)
+    image->data[c] = data + c;
+
+  image->pixel_stride = n_components;
+  image->row_stride   = row_stride ? row_stride : (ptrdiff_t) width * n_components;
+  image->width        = width;
+  image->height       = height;
+}
+
+void
+immanuel_image_init_planar (ImmanuelImage *image,
+                            float * const *planes,
+                            int            n_components,
+                            int            width,
+                            int            height,
+                            ptrdiff_t      row_stride)
+{
+  int c;
+
+  memset (image, 0, sizeof (*image));
+
+  for (c = 0; c < n_components && c < IMMANUEL_IMAGE_MAX_COMPONENTS; c++)
+    image->data[c] = planes[c];
+
+  image->pixel_stride = 1;
+  image->row_stride   = row_stride ? row_stride : width;
+  image->width        = width;
+  image->height       = height;
+}
+
+int
+immanuel_image_n_components (const ImmanuelImage *image)
+{
+  int c = 0;
+
+  while (c < IMMANUEL_IMAGE_MAX_COMPONENTS && image->data[c])
+    c++;
+
+  return c;
+}
+
+/* n_components floats per pixel next to each other, rows can be read and
+ * written in place
+ */
+static int
+is_interleaved (const ImmanuelImage *image,
+                int                  n_components)
+{
+  int c;
+
+  if (image->pixel_stride != n_components)
+    return 0;
+
+  for (c = 1; c < n_components; c++)
+    if (image->data[c] != image->data[0] + c)
+      return 0;
+
+  return 1;
+}
+
+static const double *
+luminance_or_srgb (const double *luminance)
+{
+  return luminance ? luminance : srgb_luminance;
+}
+
+/* Y of pixels x0 .. x0 + n - 1 of row y into dst, x and y clamped to the
+ * image; one component is Y, else Y of rgb
+ */
+static void
+load_Y (const ImmanuelImage *image,
+        int                  n_components,
+        const double        *luminance,
+        int                  x0,
+        int                  y,
+        int                  n,
+        float               *dst)
+{
+  const ptrdiff_t row = (ptrdiff_t) MIN (MAX (y, 0), image->height - 1) * image->row_stride;
+  const ptrdiff_t ps  = image->pixel_stride;
+  const int       lo  = MIN (MAX (-x0, 0), n - 1);
+  const int       hi  = MAX (MIN (image->width - x0, n), lo + 1);
+  int             i;
+
+  if (n_components < 3)
+    {
+      const float *Y = image->data[0] + row + (ptrdiff_t) x0 * ps;
+
+      for (i = lo; i < hi; i++)
+        dst[i] = Y[i * ps];
+    }
+  else
+    {
+      const float  lr = luminance[0];
+      const float  lg = luminance[1];
+      const float  lb = luminance[2];
+      const float *r  = image->data[0] + row + (ptrdiff_t) x0 * ps;
+      const float *g  = image->data[1] + row + (ptrdiff_t) x0 * ps;
+      const float *b  = image->data[2] + row + (ptrdiff_t) x0 * ps;
+
+      for (i = lo; i < hi; i++)
+        dst[i] = r[i * ps] * lr + g[i * ps] * lg + b[i * ps] * lb;
+    }
+
+  for (i = 0; i < lo; i++)
+    dst[i] = dst[lo];
+  for (i = hi; i < n; i++)
+    dst[i] = dst[hi - 1];
+}
+
+/* RGBA of row y, clamped: the row itself when image is interleaved RGBA,
+ * else gathered into buf, with alpha 1 when image has none
+ */
+static const float *
+load_rgba (const ImmanuelImage *image,
+           int                  n_components,
+           int                  y,
+           float               *buf)
+{
+  const ptrdiff_t row = (ptrdiff_t) MIN (MAX (y, 0), image->height - 1) * image->row_stride;
+  const ptrdiff_t ps  = image->pixel_stride;
+  int             x, c;
+
+  if (n_components == 4 && is_interleaved (image, 4))
+    return image->data[0] + row;
+
+  for (c = 0; c < 4; c++)
+    {
+      if (c < n_components)
+        {
+          const float *src = image->data[c] + row;
+
+          for (x = 0; x < image->width; x++)
+            buf[x * 4 + c] = src[x * ps];
+        }
+      else
+        {
+          for (x = 0; x < image->width; x++)
+            buf[x * 4 + c] = 1.0f;
+        }
+    }
+
+  return buf;
+}
+
+/* row y of image, or NULL when rows of n_components interleaved floats
+ * cannot be written there directly
+ */
+static float *
+direct_row (const ImmanuelImage *image,
+            int                  n_components,
+            int                  y)
+{
+  if (! is_interleaved (image, n_components))
+    return NULL;
+
+  return image->data[0] + (ptrdiff_t) y * image->row_stride;
+}
+
+/* the first n_components of width pixels of src, src_components floats
+ * each, into row y of image
+ */
+static void
+store_row (const ImmanuelImage *image,
+           int                  n_components,
+           int                  y,
+           const float         *src,
+           int                  src_components)
+{
+  const ptrdiff_t row = (ptrdiff_t) y * image->row_stride;
+  const ptrdiff_t ps  = image->pixel_stride;
+  int             x, c;
+
+  for (c = 0; c < n_components; c++)
+    {
+      float *dst = image->data[c] + row;
+
+      for (x = 0; x < image->width; x++)
+        dst[x * ps] = src[x * src_components + c];
+    }
+}
+
+
+/* bands of rows on threads */
+
+typedef int (* BandFunc) (const void *job,
+                          int         y0,
+                          int         y1,
+                          void      **scratch);
+
+typedef struct
+{
+  BandFunc         func;
+  const void      *job;
+  int              height;
+  int              band_rows;
+  int              next_band;
+  int              failed;
+  pthread_mutex_t  mutex;
+} Bands;
+
+/* takes the next band until none is left; scratch is allocated by the
+ * band function on its first band and kept for the others
+ */
+static void *
+bands_worker (void *data)
+{
+  Bands *bands   = data;
+  void  *scratch = NULL;
+
+  for (;;)
+    {
+      int y0, failed;
+
+      pthread_mutex_lock (&bands->mutex);
+      y0     = bands->next_band++ * bands->band_rows;
+      failed = bands->failed;
+      pthread_mutex_unlock (&bands->mutex);
+
+      if (y0 >= bands->height || failed)
+        break;
+
+      if (! bands->func (bands->job, y0, MIN (y0 + bands->band_rows, bands->height), &scratch))
+        {
+          pthread_mutex_lock (&bands->mutex);
+          bands->failed = 1;
+          pthread_mutex_unlock (&bands->mutex);
+        }
+    }
+
+  free (scratch);
+
+  return NULL;
+}
+
+/* the calling thread is one of the n_threads, bands left by threads that
+ * could not be started are done by the others
+ */
+static int
+run_bands (BandFunc    func,
+           const void *job,
+           int         height,
+           int         band_rows,
+           int         n_threads)
+{
+  pthread_t threads[MAX_THREADS];
+  int       started[MAX_THREADS];
+  Bands     bands;
+  int       n_bands = (height + band_rows - 1) / band_rows;
+  int       t;
+
+  if (n_threads <= 0)
+    n_threads = sysconf (_SC_NPROCESSORS_ONLN);
+  n_threads = MAX (1, MIN (MIN (n_threads, MAX_THREADS), n_bands));
+
+  bands.func      = func;
+  bands.job       = job;
+  bands.height    = height;
+  bands.band_rows = band_rows;
+  bands.next_band = 0;
+  bands.failed    = 0;
+  pthread_mutex_init (&bands.mutex, NULL);
+
+  for (t = 1; t < n_threads; t++)
+    started[t] = pthread_create (&threads[t], NULL, bands_worker, &bands) == 0;
+
+  bands_worker (&bands);
+
+  for (t = 1; t < n_threads; t++)
+    if (started[t])
+      pthread_join (threads[t], NULL);
+
+  pthread_mutex_destroy (&bands.mutex);
+
+  return ! bands.failed;
+}
+
+
+/* color-mapper */
+
+typedef struct
+{
+  const ColorMapperParams *params;
+  const double            *luminance;
+  const ImmanuelImage     *sources[2];       /* input, aux */
+  int                      n_components[2];
+  const ImmanuelImage     *output;
+  int                      out_components;
+  ColorMapperAuxFunc       aux_func;
+  ColorMapperFeatureFunc   features_func;
+  ColorMapperCombineFunc   combine_func;
+} ColorMapperJob;
+
+/* per thread: of both sources three Y rows with their left and right
+ * neighbour and three rgba rows, the rows above, at and below the current
+ * one by y modulo 3; the aux and feature planes of one row; one output row
+ */
+typedef struct
+{
+  float       *Y[2][3];
+  float       *rgba_buf[2][3];
+  const float *rgba[2][3];
+  float       *planes;
+  float       *out_row;
+} ColorMapperScratch;
+
+static ColorMapperScratch *
+color_mapper_scratch_new (int width)
+{
+  ColorMapperScratch *scratch;
+  float              *p;
+  int                 s, i;
+
+  scratch = malloc (sizeof (ColorMapperScratch) +
+                    sizeof (float) * ((size_t) 6 * (width + 2) + (size_t) 6 * width * 4 +
+                                      (size_t) width * (COLOR_MAPPER_AUX_PLANES + COLOR_MAPPER_FEATURE_PLANES) +
+                                      (size_t) width * 4));
+  if (! scratch)
+    return NULL;
+
+  p = (float *) (scratch + 1);
+  for (s = 0; s < 2; s++)
+    for (i = 0; i < 3; i++)
+      {
+        scratch->Y[s][i]        = p;
+        p                      += width + 2;
+        scratch->rgba_buf[s][i] = p;
+        p                      += width * 4;
+      }
+
+  scratch->planes  = p;
+  p               += (size_t) width * (COLOR_MAPPER_AUX_PLANES + COLOR_MAPPER_FEATURE_PLANES);
+  scratch->out_row = p;
+
+  return scratch;
+}
+
+static void
+color_mapper_load_row (const ColorMapperJob *job,
+                       ColorMapperScratch   *scratch,
+                       int                   y)
+{
+  const int slot = (y + 3) % 3;
+  int       s;
+
+  for (s = 0; s < 2; s++)
+    {
+      load_Y (job->sources[s], job->n_components[s], job->luminance,
+              -1, y, job->sources[s]->width + 2, scratch->Y[s][slot]);
+      scratch->rgba[s][slot] = load_rgba (job->sources[s], job->n_components[s], y,
+                                          scratch->rgba_buf[s][slot]);
+    }
+}
+
+static int
+color_mapper_band (const void  *data,
+                   int          y0,
+                   int          y1,
+                   void       **scratch_ptr)
+{
+  const ColorMapperJob  *job    = data;
+  const int              width  = job->output->width;
+  ColorMapperScratch    *scratch = *scratch_ptr;
+  ColorMapperSource      in_row, aux_row;
+  ColorMapperAuxRow      aux_planes;
+  ColorMapperFeatureRow  feature_planes;
+  int                    y, i;
+
+  if (! scratch)
+    scratch = *scratch_ptr = color_mapper_scratch_new (width);
+  if (! scratch)
+    return 0;
+
+  color_mapper_aux_row_init (&aux_planes, scratch->planes, width, width, 0, 0);
+  color_mapper_feature_row_init (&feature_planes, scratch->planes + (size_t) width * COLOR_MAPPER_AUX_PLANES,
+                                 width, width, 0, 0);
+
+  color_mapper_load_row (job, scratch, y0 - 1);
+  color_mapper_load_row (job, scratch, y0);
+
+  for (y = y0; y < y1; y++)
+    {
+      float *out = direct_row (job->output, 4, y);
+
+      color_mapper_load_row (job, scratch, y + 1);
+
+      for (i = 0; i < 3; i++)
+        {
+          in_row.Y[i]  = scratch->Y[0][(y - 1 + i + 3) % 3];
+          aux_row.Y[i] = scratch->Y[1][(y - 1 + i + 3) % 3];
+        }
+      in_row.rgba      = scratch->rgba[0][y % 3];
+      aux_row.rgba     = scratch->rgba[1][y % 3];
+      in_row.contrast  = NULL;
+      aux_row.contrast = NULL;
+
+      job->aux_func (job->params, &aux_row, &aux_planes, width);
+
+      /* the tone curve mode takes no gradients, like the operation; the
+       * debug output of the aux gradient computes it in every mode
+       */
+      if (job->params->tone_curve && job->params->technology != COLOR_MAPPER_YGRAD_AUX)
+        memset (aux_planes.gradient, 0, width * sizeof (float));
+
+      job->features_func (job->params, &in_row, &aux_planes, &feature_planes, width);
+      job->combine_func (job->params, &feature_planes, &aux_planes,
+                         out ? out : scratch->out_row, width);
+
+      if (! out)
+        store_row (job->output, job->out_components, y, scratch->out_row, 4);
+    }
+
+  return 1;
+}
+
+void
+immanuel_color_mapper_params_init (ColorMapperParams *params)
+{
+  memset (params, 0, sizeof (*params));
+
+  params->technology        = COLOR_MAPPER_DEFAULT;
+  params->scale             = 0.5f;
+  params->globalSaturation  = 1.0f;
+  params->neutral2tinted[0] = 1.0f;
+  params->neutral2tinted[1] = 1.0f;
+  params->neutral2tinted[2] = 1.0f;
+  params->gradient_scale    = 1.0f;
+}
+
+/* the tint of the white representation, like color-mapper derives it */
+void
+immanuel_color_mapper_set_white (ColorMapperParams *params,
+                                 const double       white[3],
+                                 const double       luminance[3])
+{
+  const double *lum    = luminance_or_srgb (luminance);
+  const double  Ywhite = white[0] * lum[0] + white[1] * lum[1] + white[2] * lum[2];
+  int           c;
+
+  for (c = 0; c < 3; c++)
+    params->neutral2tinted[c] = Ywhite > 0.0 ? white[c] / Ywhite : 1.0;
+}
+
+int
+immanuel_color_mapper (const ColorMapperParams *params,
+                       const double             luminance[3],
+                       const ImmanuelImage     *input,
+                       const ImmanuelImage     *aux,
+                       const ImmanuelImage     *output,
+                       int                      n_threads)
+{
+  ColorMapperJob job;
+  int            s;
+
+  job.params         = params;
+  job.luminance      = luminance_or_srgb (luminance);
+  job.sources[0]     = input;
+  job.sources[1]     = aux;
+  job.output         = output;
+  job.out_components = immanuel_image_n_components (output);
+
+  for (s = 0; s < 2; s++)
+    {
+      job.n_components[s] = immanuel_image_n_components (job.sources[s]);
+
+      if (job.n_components[s] < 3 ||
+          job.sources[s]->width != output->width || job.sources[s]->height != output->height)
+        return 0;
+    }
+
+  if (job.out_components < 3 || output->width <= 0 || output->height <= 0 ||
+      params->contrast_source ||
+      params->technology < 0 || params->technology >= COLOR_MAPPER_N_TECHNOLOGIES)
+    return 0;
+
+  color_mapper_kernel_init ();
+  job.aux_func      = color_mapper_kernel_get_aux (params);
+  job.features_func = color_mapper_kernel_get_features (params);
+  job.combine_func  = color_mapper_kernel_get_combine (params);
+
+  return run_bands (color_mapper_band, &job, output->height, BAND_ROWS, n_threads);
+}
+
+
+/* image-gradient-rel */
+
+typedef struct
+{
+  const ImmanuelGradientParams *params;
+  const double                 *luminance;
+  const ImmanuelImage          *input;
+  int                           in_components;
+  const ImmanuelImage          *output;
+  int                           smooth;      /* gauss and halo are set */
+  ImmanuelGaussian              gauss;
+  int                           halo;
+  int                           band_rows;
+} GradientJob;
+
+/* rows above, at and below by y modulo 3 and one output row, or with
+ * smoothing the block of a band with its halo and one output row
+ */
+static int
+gradient_band (const void  *data,
+               int          y0,
+               int          y1,
+               void       **scratch_ptr)
+{
+  const GradientJob *job    = data;
+  const int          width  = job->output->width;
+  const int          n      = job->params->n_components;
+  const int          halo   = job->halo;
+  const int          bw     = width + 2 * halo;
+  float             *buf    = *scratch_ptr;
+  float             *out_row;
+  int                y;
+
+  if (! buf)
+    {
+      size_t size = job->smooth ? (size_t) bw * (job->band_rows + 2 * halo) : (size_t) 3 * (width + 2);
+
+      buf = *scratch_ptr = malloc (sizeof (float) * (size + (size_t) width * n));
+      if (! buf)
+        return 0;
+    }
+
+  if (job->smooth)
+    {
+      const int rows = y1 - y0 + 2 * halo;
+
+      out_row = buf + (size_t) bw * (job->band_rows + 2 * halo);
+
+      for (y = 0; y < rows; y++)
+        load_Y (job->input, job->in_components, job->luminance,
+                -halo, y0 - halo + y, bw, buf + (size_t) y * bw);
+
+      immanuel_gaussian_rows    (buf, bw, rows, &job->gauss);
+      immanuel_gaussian_columns (buf, bw, rows, &job->gauss);
+
+      for (y = y0; y < y1; y++)
+        {
+          /* row y and its neighbours, from one pixel left of it */
+          const float *mid = buf + (size_t) (y - y0 + halo) * bw + halo - 1;
+          float       *out = direct_row (job->output, n, y);
+
+          immanuel_gradient_row (mid - bw, mid, mid + bw, out ? out : out_row,
+                                 width, n, job->params->scale);
+          if (! out)
+            store_row (job->output, n, y, out_row, n);
+        }
+
+      return 1;
+    }
+
+  out_row = buf + (size_t) 3 * (width + 2);
+
+  load_Y (job->input, job->in_components, job->luminance, -1, y0 - 1, width + 2, buf + ((y0 + 2) % 3) * (width + 2));
+  load_Y (job->input, job->in_components, job->luminance, -1, y0,     width + 2, buf + (y0 % 3) * (width + 2));
+
+  for (y = y0; y < y1; y++)
+    {
+      float *out = direct_row (job->output, n, y);
+
+      load_Y (job->input, job->in_components, job->luminance, -1, y + 1, width + 2,
+              buf + ((y + 1) % 3) * (width + 2));
+
+      immanuel_gradient_row (buf + ((y + 2) % 3) * (width + 2),
+                             buf + (y % 3) * (width + 2),
+                             buf + ((y + 1) % 3) * (width + 2),
+                             out ? out : out_row, width, n, job->params->scale);
+      if (! out)
+        store_row (job->output, n, y, out_row, n);
+    }
+
+  return 1;
+}
+
+int
+immanuel_gradient_rel (const ImmanuelGradientParams *params,
+                       const double                  luminance[3],
+                       const ImmanuelImage          *input,
+                       const ImmanuelImage          *output,
+                       int                           n_threads)
+{
+  GradientJob job;
+  const int   n = params->n_components;
+
+  job.params        = params;
+  job.luminance     = luminance_or_srgb (luminance);
+  job.input         = input;
+  job.in_components = immanuel_image_n_components (input);
+  job.output        = output;
+
+  if ((n != 1 && n != 2 && n != 4) || immanuel_image_n_components (output) < n ||
+      job.in_components < 1 || job.in_components == 2 ||
+      input->width != output->width || input->height != output->height ||
+      output->width <= 0 || output->height <= 0)
+    return 0;
+
+  job.smooth    = params->sigma >= IMMANUEL_GAUSSIAN_SIGMA_MIN;
+  job.halo      = job.smooth ? immanuel_gradient_halo (params->sigma) : 0;
+  job.band_rows = MAX (BAND_ROWS, 4 * job.halo);
+  if (job.smooth)
+    immanuel_gaussian_init (&job.gauss, params->sigma);
+
+  return run_bands (gradient_band, &job, output->height, job.band_rows, n_threads);
+}
+
+
+/* image-density */
+
+typedef struct
+{
+  const ImmanuelDensityParams *params;
+  const double                *luminance;
+  const ImmanuelImage         *input;
+  int                          in_components;
+  const ImmanuelImage         *output;
+  float                        max_dimension;
+  int                          windowed;
+  int                          R;           /* widest radius */
+  int                          band_rows;
+} DensityJob;
+
+/* rows above, at and below by y modulo 3 and one output row, or with
+ * windows the block of a band with its halo, its summed area table and
+ * the output rows of the band
+ */
+static int
+density_band (const void  *data,
+              int          y0,
+              int          y1,
+              void       **scratch_ptr)
+{
+  const DensityJob *job    = data;
+  const int         width  = job->output->width;
+  const int         n      = job->params->n_scales;
+  const int         R      = job->R;
+  const int         bw     = width + 2 * R + 2;
+  const size_t      block  = (size_t) bw * (job->band_rows + 2 * R + 2);
+  const size_t      sat    = immanuel_density_sat_size (width, job->band_rows, R);
+  float            *buf    = *scratch_ptr;
+  float            *out_rows;
+  int               y;
+
+  if (! buf)
+    {
+      buf = *scratch_ptr = job->windowed ?
+                           malloc (sizeof (double) * sat + sizeof (float) * (block + (size_t) width * n * job->band_rows)) :
+                           malloc (sizeof (float) * ((size_t) 3 * (width + 2) + width));
+      if (! buf)
+        return 0;
+    }
+
+  if (job->windowed)
+    {
+      const int  rows = y1 - y0 + 2 * R + 2;
+      double    *sat_buf = (double *) buf;
+      float     *block_buf = (float *) (sat_buf + sat);
+      float     *out = direct_row (job->output, n, y0);
+
+      out_rows = block_buf + block;
+
+      for (y = 0; y < rows; y++)
+        load_Y (job->input, job->in_components, job->luminance,
+                -R - 1, y0 - R - 1 + y, bw, block_buf + (size_t) y * bw);
+
+      if (out)
+        {
+          immanuel_density_windows (block_buf, width, y1 - y0, job->params->radius, n,
+                                    job->max_dimension, sat_buf, out, job->output->row_stride);
+          return 1;
+        }
+
+      immanuel_density_windows (block_buf, width, y1 - y0, job->params->radius, n,
+                                job->max_dimension, sat_buf, out_rows, (ptrdiff_t) width * n);
+
+      for (y = y0; y < y1; y++)
+        store_row (job->output, n, y, out_rows + (size_t) (y - y0) * width * n, n);
+
+      return 1;
+    }
+
+  out_rows = buf + (size_t) 3 * (width + 2);
+
+  load_Y (job->input, job->in_components, job->luminance, -1, y0 - 1, width + 2, buf + ((y0 + 2) % 3) * (width + 2));
+  load_Y (job->input, job->in_components, job->luminance, -1, y0,     width + 2, buf + (y0 % 3) * (width + 2));
+
+  for (y = y0; y < y1; y++)
+    {
+      float *out = direct_row (job->output, 1, y);
+
+      load_Y (job->input, job->in_components, job->luminance, -1, y + 1, width + 2,
+              buf + ((y + 1) % 3) * (width + 2));
+
+      immanuel_density_row (buf + ((y + 2) % 3) * (width + 2),
+                            buf + (y % 3) * (width + 2),
+                            buf + ((y + 1) % 3) * (width + 2),
+                            out ? out : out_rows, width, job->max_dimension);
+      if (! out)
+        store_row (job->output, 1, y, out_rows, 1);
+    }
+
+  return 1;
+}
+
+int
+immanuel_density (const ImmanuelDensityParams *params,
+                  const double                 luminance[3],
+                  const ImmanuelImage         *input,
+                  const ImmanuelImage         *output,
+                  int                          n_threads)
+{
+  DensityJob job;
+  const int  n = params->n_scales;
+  int        i;
+
+  job.params        = params;
+  job.luminance     = luminance_or_srgb (luminance);
+  job.input         = input;
+  job.in_components = immanuel_image_n_components (input);
+  job.output        = output;
+
+  if (n < 1 || n > 4 || immanuel_image_n_components (output) < n ||
+      job.in_components < 1 || job.in_components == 2 ||
+      input->width != output->width || input->height != output->height ||
+      output->width <= 0 || output->height <= 0)
+    return 0;
+
+  /* the summed area table is as wide as the last window */
+  job.R = params->radius[n - 1];
+  for (i = 0; i < n; i++)
+    if (params->radius[i] < 0 || params->radius[i] > job.R)
+      return 0;
+
+  job.max_dimension = params->max_dimension > 0.0 ? params->max_dimension :
+                                                     MAX (input->width, input->height);
+  job.windowed      = n > 1 || job.R > 0;
+  job.band_rows     = MAX (BAND_ROWS, 4 * job.R);
+
+  return run_bands (density_band, &job, output->height, job.band_rows, n_threads);
+}
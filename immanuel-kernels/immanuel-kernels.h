@@ -0,0 +1,133 @@
+/* This file is part of the immanuel:* GEGL operations
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* color-mapper, image-gradient-rel and image-density on raw float images
+  *
+  * The same row kernels and stencils the GEGL operations run, on images in
+  * memory instead of GeglBuffers: interleaved or planar float samples with
+  * any pixel and row stride, read and written in place.  Rows are gathered
+  * into per-thread row buffers only where the kernels need another layout
+  * (planar sources, the one pixel border of the gradients, the halo of the
+  * smoothing and the windows); interleaved RGBA float is read and written
+  * without any copy.  Borders are clamped, like GEGL_ABYSS_CLAMP.
+  *
+  * Every function splits the image into bands of rows and runs them on
+  * n_threads threads (0 for one per CPU), and returns 1, or 0 when the
+  * images or parameters do not fit together.
+  */
+
+#ifndef __IMMANUEL_KERNELS_H__
+#define __IMMANUEL_KERNELS_H__
+
+#include <stddef.h>
+
+#include "color-mapper-kernel.h"
+#include "immanuel-stencils.h"
+
+#define IMMANUEL_IMAGE_MAX_COMPONENTS 4
+
+/* sample c of pixel x, y is data[c][y * row_stride + x * pixel_stride];
+ * components past the last one are NULL.  Source images are only read.
+ */
+typedef struct
+{
+  float     *data[IMMANUEL_IMAGE_MAX_COMPONENTS];
+  ptrdiff_t  pixel_stride;   /* in floats */
+  ptrdiff_t  row_stride;     /* in floats */
+  int        width;
+  int        height;
+} ImmanuelImage;
+
+/* n_components interleaved floats per pixel from data on, row_stride 0
+ * for rows of width * n_components floats
+ */
+void immanuel_image_init_interleaved (ImmanuelImage  *image,
+                                      float          *data,
+                                      int             n_components,
+                                      int             width,
+                                      int             height,
+                                      ptrdiff_t       row_stride);
+
+/* one plane per component, row_stride 0 for rows of width floats */
+void immanuel_image_init_planar      (ImmanuelImage  *image,
+                                      float * const  *planes,
+                                      int             n_components,
+                                      int             width,
+                                      int             height,
+                                      ptrdiff_t       row_stride);
+
+int  immanuel_image_n_components     (const ImmanuelImage *image);
+
+/* Sources of the gradients and densities are CIE Y: a one component image
+ * is Y, of rgb (and alpha) Y is taken with the weights luminance of the
+ * rgb primaries, NULL for linear sRGB.
+ */
+
+/* defaults of the color-mapper operation: scale 0.5, globalSaturation 1,
+ * a neutral white representation, gradients per pixel of the images
+ */
+void immanuel_color_mapper_params_init (ColorMapperParams   *params);
+
+/* white representation white (linear rgb of the working space) */
+void immanuel_color_mapper_set_white   (ColorMapperParams   *params,
+                                        const double         white[3],
+                                        const double         luminance[3]);
+
+/* maps the colors of aux to the luminance of input, into output; input
+ * and aux are rgb or rgba, output rgb or rgba.  The contrast source and
+ * the contrast grid of the operation read other images and mipmaps and
+ * are not available here, the tone curve mode is.
+ */
+int  immanuel_color_mapper             (const ColorMapperParams *params,
+                                        const double             luminance[3],
+                                        const ImmanuelImage     *input,
+                                        const ImmanuelImage     *aux,
+                                        const ImmanuelImage     *output,
+                                        int                      n_threads);
+
+typedef struct
+{
+  double sigma;         /* of a gaussian smoothing Y first, in pixels; 0 for none */
+  double scale;         /* 1 / 2^level for a mipmap level, gradients are per full resolution pixel */
+  int    n_components;  /* of output: 1 gradient; 2 Y, gradient; 4 Y, gradient, dY/dx, dY/dy */
+} ImmanuelGradientParams;
+
+/* relative gradient |grad Y| / Y, like immanuel:image-gradient-rel */
+int  immanuel_gradient_rel             (const ImmanuelGradientParams *params,
+                                        const double                  luminance[3],
+                                        const ImmanuelImage          *input,
+                                        const ImmanuelImage          *output,
+                                        int                           n_threads);
+
+typedef struct
+{
+  double max_dimension;  /* longer image side in pixels, 0 for the one of input */
+  int    n_scales;       /* components of output, 1 to 4 */
+  int    radius[4];      /* of the window of each scale in pixels, 0 for single pixels */
+} ImmanuelDensityParams;
+
+/* density, the area of the luminance relief over the area of the flat
+ * image, averaged over windows, like immanuel:image-density
+ */
+int  immanuel_density                  (const ImmanuelDensityParams  *params,
+                                        const double                  luminance[3],
+                                        const ImmanuelImage          *input,
+                                        const ImmanuelImage          *output,
+                                        int                           n_threads);
+
+#endif
@@ -0,0 +1,293 @@
+/* This file is part of the immanuel:* GEGL operations
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+#include <math.h>
+#include <stddef.h>
+
+#include "immanuel-stencils.h"
+
+#define POW2(x) ((x)*(x))
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* I.T. Young, L.J. van Vliet, M. van Ginkel: Recursive Gabor filtering,
+ * IEEE Trans. Signal Processing 50 (2002), the gaussian with the poles
+ * scaled to sigma; a causal and an anti-causal third order pass, constant
+ * cost per pixel for any sigma and the exact sigma from 0.5 on
+ */
+void
+immanuel_gaussian_init (ImmanuelGaussian *c,
+                        double            sigma)
+{
+  const double m0 = 1.16680;
+  const double m1 = 1.10783;
+  const double m2 = 1.40586;
+  double       q, scale;
+
+  q     = 1.31564 * (sqrt (1.0 + 0.490811 * sigma * sigma) - 1.0);
+  scale = (m0 + q) * (m1 * m1 + m2 * m2 + 2.0 * m1 * q + q * q);
+
+  c->a1 = q * (2.0 * m0 * m1 + m1 * m1 + m2 * m2 + (2.0 * m0 + 4.0 * m1) * q + 3.0 * q * q) / scale;
+  c->a2 = -q * q * (m0 + 2.0 * m1 + 3.0 * q) / scale;
+  c->a3 = q * q * q / scale;
+  c->B  = 1.0 - (c->a1 + c->a2 + c->a3);
+}
+
+/* the recursion starts from the edge pixel by seeding its history with it */
+void
+immanuel_gaussian_rows (float                  *block,
+                        int                     width,
+                        int                     height,
+                        const ImmanuelGaussian *c)
+{
+  int x, y;
+
+  for (y = 0; y < height; y++)
+    {
+      float  *p = block + (size_t) y * width;
+      double  w1, w2, w3;
+
+      w1 = w2 = w3 = p[0];
+      for (x = 0; x < width; x++)
+        {
+          const double w0 = c->B * p[x] + c->a1 * w1 + c->a2 * w2 + c->a3 * w3;
+
+          p[x] = w0;
+          w3 = w2;
+          w2 = w1;
+          w1 = w0;
+        }
+
+      w1 = w2 = w3 = p[width - 1];
+      for (x = width - 1; x >= 0; x--)
+        {
+          const double w0 = c->B * p[x] + c->a1 * w1 + c->a2 * w2 + c->a3 * w3;
+
+          p[x] = w0;
+          w3 = w2;
+          w2 = w1;
+          w1 = w0;
+        }
+    }
+}
+
+/* a whole row at a time so the inner loop runs along memory; rows before
+ * the first (after the last) are the first (last) one, at the edge row
+ * itself the recursion reproduces its input
+ */
+void
+immanuel_gaussian_columns (float                  *block,
+                           int                     width,
+                           int                     height,
+                           const ImmanuelGaussian *c)
+{
+  int x, y;
+
+  for (y = 0; y < height; y++)
+    {
+      float       *p  = block + (size_t) y * width;
+      const float *p1 = block + (size_t) MAX (y - 1, 0) * width;
+      const float *p2 = block + (size_t) MAX (y - 2, 0) * width;
+      const float *p3 = block + (size_t) MAX (y - 3, 0) * width;
+
+      for (x = 0; x < width; x++)
+        p[x] = c->B * p[x] + c->a1 * p1[x] + c->a2 * p2[x] + c->a3 * p3[x];
+    }
+
+  for (y = height - 1; y >= 0; y--)
+    {
+      float       *p  = block + (size_t) y * width;
+      const float *p1 = block + (size_t) MIN (y + 1, height - 1) * width;
+      const float *p2 = block + (size_t) MIN (y + 2, height - 1) * width;
+      const float *p3 = block + (size_t) MIN (y + 3, height - 1) * width;
+
+      for (x = 0; x < width; x++)
+        p[x] = c->B * p[x] + c->a1 * p1[x] + c->a2 * p2[x] + c->a3 * p3[x];
+    }
+}
+
+int
+immanuel_gradient_halo (double sigma)
+{
+  return 1 + (sigma >= IMMANUEL_GAUSSIAN_SIGMA_MIN ? (int) ceil (IMMANUEL_GAUSSIAN_EXTENT * sigma) : 0);
+}
+
+void
+immanuel_gradient_row (const float *top_ptr,
+                       const float *mid_ptr,
+                       const float *down_ptr,
+                       float       *out,
+                       int          width,
+                       int          n_components,
+                       double       scale)
+{
+  int x;
+
+  for (x = 1; x < width + 1; x++)
+    {
+      float   dx;
+      float   dy;
+      float   magnitude;
+      float  *pixel = out + (x - 1) * n_components;
+      double  YSum; // sum of CIE Y values
+      double  recip_avgY; // reciprocal of averaged luminance
+
+      dx = (mid_ptr[(x-1)] - mid_ptr[(x+1)]);
+      dy = (top_ptr[x] - down_ptr[x]);
+      YSum = (mid_ptr[(x-1)] + mid_ptr[(x+1)] + top_ptr[x] + down_ptr[x]);
+
+      if (fabs(YSum) > 0.0001)
+      {
+        recip_avgY = 4.0 / YSum;
+        /* per full resolution pixel, at level the pixels are 2^level apart */
+        magnitude = sqrt (POW2(dx) + POW2(dy)) * recip_avgY * 0.5 * scale;
+      }
+      else
+      {
+        magnitude = 0.0;
+      }
+
+      if (n_components == 1)
+        {
+          pixel[0] = magnitude;
+          continue;
+        }
+
+      pixel[0] = mid_ptr[x];
+      pixel[1] = magnitude;
+
+      if (n_components == 4)
+        {
+          pixel[2] = -dx * 0.5 * scale;
+          pixel[3] = -dy * 0.5 * scale;
+        }
+    }
+}
+
+/* density of one pixel from central differences relative to lightness */
+static inline float
+density (const float *top_ptr,
+         const float *mid_ptr,
+         const float *down_ptr,
+         int          x,
+         float        max_dimension)
+{
+  float  dx;
+  float  dy;
+  double YSum; // sum of CIE Y values
+  double recip_avgY; // reciprocal of averaged luminance
+  double delta_rel_sqr;
+
+  dx = (mid_ptr[(x-1)] - mid_ptr[(x+1)]);
+  dy = (top_ptr[x] - down_ptr[x]);
+  YSum = (mid_ptr[(x-1)] + mid_ptr[(x+1)] + top_ptr[x] + down_ptr[x]);
+
+  /* black has no relief, like image-gradient-rel */
+  if (fabs (YSum) <= 0.0001)
+    return 1.0;
+
+  recip_avgY = 4.0 / YSum;
+  delta_rel_sqr = 0.25 * (POW2(dx) + POW2(dy)) * POW2(recip_avgY);
+
+  return sqrtf (1.0 + (delta_rel_sqr * POW2(max_dimension)));
+}
+
+void
+immanuel_density_row (const float *top_ptr,
+                      const float *mid_ptr,
+                      const float *down_ptr,
+                      float       *out,
+                      int          width,
+                      float        max_dimension)
+{
+  int x;
+
+  for (x = 1; x < width + 1; x++)
+    out[(x-1)] = density (top_ptr, mid_ptr, down_ptr, x, max_dimension);
+}
+
+/* one more row and column of zeros, sat[y][x] sums the densities above
+ * and left of pixel x, y of the pixels with their window halo; in double,
+ * the sums of large windows lose the bits of a float density
+ */
+size_t
+immanuel_density_sat_size (int width,
+                           int height,
+                           int R)
+{
+  return (size_t) (width + 2 * R + 1) * (height + 2 * R + 1);
+}
+
+/* the density of every pixel and the widest window summed into a summed
+ * area table, so that the mean over any window takes four reads
+ */
+void
+immanuel_density_windows (const float *block,
+                          int          width,
+                          int          height,
+                          const int   *radius,
+                          int          n_scales,
+                          float        max_dimension,
+                          double      *sat,
+                          float       *out,
+                          ptrdiff_t    out_stride)
+{
+  const int R           = radius[n_scales - 1];
+  const int block_width = width  + 2 * R + 2;
+  const int sat_width   = width  + 2 * R + 1;
+  const int sat_height  = height + 2 * R + 1;
+  int       x, y, i;
+
+  for (x = 0; x < sat_width; x++)
+    sat[x] = 0.0;
+
+  for (y = 1; y < sat_height; y++)
+    {
+      const float *mid_ptr  = block + (size_t) y * block_width;
+      double      *sat_row  = sat + (size_t) y * sat_width;
+      double      *sat_prev = sat_row - sat_width;
+      double       row_sum  = 0.0;
+
+      sat_row[0] = 0.0;
+      for (x = 1; x < sat_width; x++)
+        {
+          row_sum   += density (mid_ptr - block_width, mid_ptr, mid_ptr + block_width,
+                                x, max_dimension);
+          sat_row[x] = sat_prev[x] + row_sum;
+        }
+    }
+
+  for (y = 0; y < height; y++)
+    {
+      float *out_row = out + y * out_stride;
+
+      for (i = 0; i < n_scales; i++)
+        {
+          const int     r     = radius[i];
+          const double  recip = 1.0 / POW2 (2 * r + 1);
+          /* window of pixel x spans sat columns x + R - r .. x + R + r + 1 */
+          const double *sat_t = sat + (size_t) (y + R - r) * sat_width + R - r;
+          const double *sat_b = sat + (size_t) (y + R + r + 1) * sat_width + R - r;
+          const int     w     = 2 * r + 1;
+
+          for (x = 0; x < width; x++)
+            out_row[x * n_scales + i] = (sat_b[x + w] - sat_b[x] - sat_t[x + w] + sat_t[x]) * recip;
+        }
+    }
+}
@@ -0,0 +1,119 @@
+/* This file is part of the immanuel:* GEGL operations
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* stencils of immanuel:image-gradient-rel and immanuel:image-density
+  *
+  * Plain C on rows and blocks of CIE Y in memory, no GEGL: the operations
+  * read their rows and blocks with gegl_buffer_get (), the strided image
+  * functions of immanuel-kernels.h gather them from raw buffers.
+  */
+
+#ifndef __IMMANUEL_STENCILS_H__
+#define __IMMANUEL_STENCILS_H__
+
+#include <stddef.h>
+
+/* the recursive gaussian is truncated at this many sigma of halo */
+#define IMMANUEL_GAUSSIAN_EXTENT    4.0
+
+/* below this sigma (in pixels at level) the recursive gaussian does not
+ * hold, and the mipmap downscale already smoothed about as much
+ */
+#define IMMANUEL_GAUSSIAN_SIGMA_MIN 0.5
+
+/* coefficients of the recursive gaussian, w[n] = B x[n] + a1 w[n - 1] +
+ * a2 w[n - 2] + a3 w[n - 3]; in double, with the poles close to 1 at large
+ * sigma float sums drift by 1e-4
+ */
+typedef struct
+{
+  double B;
+  double a1;
+  double a2;
+  double a3;
+} ImmanuelGaussian;
+
+/* coefficients for sigma, at least IMMANUEL_GAUSSIAN_SIGMA_MIN */
+void immanuel_gaussian_init    (ImmanuelGaussian       *c,
+                                double                  sigma);
+
+/* both passes along every row, then along every column of a block of
+ * width x height floats, in place; the edges continue as constant
+ */
+void immanuel_gaussian_rows    (float                  *block,
+                                int                     width,
+                                int                     height,
+                                const ImmanuelGaussian *c);
+
+void immanuel_gaussian_columns (float                  *block,
+                                int                     width,
+                                int                     height,
+                                const ImmanuelGaussian *c);
+
+/* halo of the gradient and the smoothing, in the pixels sigma is in;
+ * 0 < sigma < IMMANUEL_GAUSSIAN_SIGMA_MIN does not smooth
+ */
+int  immanuel_gradient_halo    (double                  sigma);
+
+/* relative gradient magnitude |grad Y| / Y of one row; top, mid and down
+ * are the Y rows above, at and below it with one pixel of border on each
+ * side (width + 2 floats).  With 2 or 4 components the pixel is packed as
+ * Y, magnitude (, dY/dx, dY/dy).  scale is 1 / 2^level, gradients are per
+ * full resolution pixel.
+ */
+void immanuel_gradient_row     (const float            *top,
+                                const float            *mid,
+                                const float            *down,
+                                float                  *out,
+                                int                     width,
+                                int                     n_components,
+                                double                  scale);
+
+/* density of one row, the area of the luminance relief over the area of
+ * the flat image; rows as for immanuel_gradient_row (), max_dimension is
+ * the longer image side in the pixels of the rows
+ */
+void immanuel_density_row      (const float            *top,
+                                const float            *mid,
+                                const float            *down,
+                                float                  *out,
+                                int                     width,
+                                float                   max_dimension);
+
+/* density averaged over windows of radius[0 .. n_scales - 1] pixels around
+ * each of width x height pixels, n_scales interleaved floats per pixel into
+ * rows of out, out_stride floats apart.  block holds the Y of the pixels
+ * with R + 1 pixels of halo on every side, R the widest radius and the
+ * last one, (width + 2 R + 2) floats per row; sat is scratch of
+ * immanuel_density_sat_size () doubles.
+ */
+size_t immanuel_density_sat_size (int                   width,
+                                  int                   height,
+                                  int                   R);
+
+void immanuel_density_windows  (const float            *block,
+                                int                     width,
+                                int                     height,
+                                const int              *radius,
+                                int                     n_scales,
+                                float                   max_dimension,
+                                double                 *sat,
+                                float                  *out,
+                                ptrdiff_t               out_stride);
+
+#endif
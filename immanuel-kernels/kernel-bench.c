@@ -0,0 +1,281 @@
+/* Microbenchmark of the immanuel:* kernels on raw float images
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Authors:  2024 Immanuel Schaffer
+ */
+
+ /* runs one function of immanuel-kernels.h on a synthetic input / aux pair
+  * with 1 ... N threads, on interleaved RGBA and on planar images, and
+  * prints the throughput per thread count; no GEGL, so the numbers are
+  * those of the kernels alone, without tiles, format conversion or graph.
+  * The planar result is compared with the interleaved one, they have to
+  * be the same.
+  *
+  *   kernel-bench [--function color-mapper|gradient|density] [--size WxH]
+  *                [--threads N] [--runs N] [--sigma S] [--radius R[,R]...]
+  */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "immanuel-kernels.h"
+
+enum
+{
+  FUNCTION_COLOR_MAPPER,
+  FUNCTION_GRADIENT,
+  FUNCTION_DENSITY
+};
+
+typedef struct
+{
+  int                    function;
+  ColorMapperParams      color_mapper;
+  ImmanuelGradientParams gradient;
+  ImmanuelDensityParams  density;
+} Bench;
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* smooth color ramps plus some noise, like the ramps of gegl-benchmark;
+ * seed tells input and aux apart
+ */
+static void
+fill (float *rgba,
+      int    width,
+      int    height,
+      int    seed)
+{
+  unsigned int state = 12345u * seed;
+  int          x, y, c;
+
+  for (y = 0; y < height; y++)
+    for (x = 0; x < width; x++)
+      {
+        float *pixel = rgba + ((size_t) y * width + x) * 4;
+
+        for (c = 0; c < 3; c++)
+          {
+            state    = state * 1664525u + 1013904223u;
+            pixel[c] = 0.05f + 0.9f * (c == seed % 3 ? (float) x / width : (float) y / height)
+                       + 0.02f * ((state >> 8) / 16777216.0f - 0.5f);
+          }
+        pixel[3] = 1.0f;
+      }
+}
+
+static void
+split_planes (const float *rgba,
+              float       *planes[4],
+              size_t       n_pixels)
+{
+  size_t i;
+  int    c;
+
+  for (c = 0; c < 4; c++)
+    for (i = 0; i < n_pixels; i++)
+      planes[c][i] = rgba[i * 4 + c];
+}
+
+static int
+run (const Bench         *bench,
+     const ImmanuelImage *input,
+     const ImmanuelImage *aux,
+     const ImmanuelImage *output,
+     int                  n_threads)
+{
+  switch (bench->function)
+    {
+    case FUNCTION_COLOR_MAPPER:
+      return immanuel_color_mapper (&bench->color_mapper, NULL, input, aux, output, n_threads);
+    case FUNCTION_GRADIENT:
+      return immanuel_gradient_rel (&bench->gradient, NULL, input, output, n_threads);
+    default:
+      return immanuel_density (&bench->density, NULL, input, output, n_threads);
+    }
+}
+
+static int
+output_components (const Bench *bench)
+{
+  switch (bench->function)
+    {
+    case FUNCTION_COLOR_MAPPER:
+      return 4;
+    case FUNCTION_GRADIENT:
+      return bench->gradient.n_components;
+    default:
+      return bench->density.n_scales;
+    }
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  const char    *function_names[] = { "color-mapper", "gradient", "density" };
+  Bench          bench;
+  int            width       = 4000;
+  int            height      = 3000;
+  int            max_threads = sysconf (_SC_NPROCESSORS_ONLN);
+  int            runs        = 3;
+  size_t         n_pixels, p;
+  float         *in_rgba, *aux_rgba, *out_rgba;
+  float         *in_planes[4], *aux_planes[4], *out_planes[4];
+  ImmanuelImage  images[2][3];   /* interleaved, planar; input, aux, output */
+  double         max_error = 0.0;
+  int            i, c, layout, threads, n_out;
+
+  memset (&bench, 0, sizeof (bench));
+  bench.function = FUNCTION_COLOR_MAPPER;
+  immanuel_color_mapper_params_init (&bench.color_mapper);
+  bench.gradient.scale        = 1.0;
+  bench.gradient.n_components = 2;
+  bench.density.n_scales      = 1;
+
+  for (i = 1; i < argc; i++)
+    {
+      if (! strcmp (argv[i], "--function") && i + 1 < argc)
+        {
+          i++;
+          for (bench.function = 0; bench.function < 3; bench.function++)
+            if (! strcmp (argv[i], function_names[bench.function]))
+              break;
+          if (bench.function == 3)
+            {
+              fprintf (stderr, "unknown function %s\n", argv[i]);
+              return 1;
+            }
+        }
+      else if (! strcmp (argv[i], "--size") && i + 1 < argc)
+        sscanf (argv[++i], "%dx%d", &width, &height);
+      else if (! strcmp (argv[i], "--threads") && i + 1 < argc)
+        max_threads = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "--runs") && i + 1 < argc)
+        runs = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "--sigma") && i + 1 < argc)
+        bench.gradient.sigma = atof (argv[++i]);
+      else if (! strcmp (argv[i], "--radius") && i + 1 < argc)
+        {
+          char *list = argv[++i];
+
+          for (bench.density.n_scales = 0; bench.density.n_scales < 4 && *list; bench.density.n_scales++)
+            {
+              bench.density.radius[bench.density.n_scales] = strtol (list, &list, 10);
+              if (*list == ',')
+                list++;
+            }
+        }
+      else
+        {
+          fprintf (stderr, "usage: %s [--function color-mapper|gradient|density] [--size WxH]\n"
+                           "       [--threads N] [--runs N] [--sigma S] [--radius R[,R]...]\n", argv[0]);
+          return 1;
+        }
+    }
+
+  n_pixels = (size_t) width * height;
+  n_out    = output_components (&bench);
+  in_rgba  = malloc (n_pixels * 4 * sizeof (float));
+  aux_rgba = malloc (n_pixels * 4 * sizeof (float));
+  out_rgba = malloc (n_pixels * 4 * sizeof (float));
+  for (c = 0; c < 4; c++)
+    {
+      in_planes[c]  = malloc (n_pixels * sizeof (float));
+      aux_planes[c] = malloc (n_pixels * sizeof (float));
+      out_planes[c] = malloc (n_pixels * sizeof (float));
+      if (! in_planes[c] || ! aux_planes[c] || ! out_planes[c])
+        return 1;
+    }
+  if (! in_rgba || ! aux_rgba || ! out_rgba)
+    {
+      fprintf (stderr, "out of memory for %dx%d\n", width, height);
+      return 1;
+    }
+
+  fill (in_rgba, width, height, 1);
+  fill (aux_rgba, width, height, 2);
+  split_planes (in_rgba, in_planes, n_pixels);
+  split_planes (aux_rgba, aux_planes, n_pixels);
+
+  immanuel_image_init_interleaved (&images[0][0], in_rgba,  4, width, height, 0);
+  immanuel_image_init_interleaved (&images[0][1], aux_rgba, 4, width, height, 0);
+  immanuel_image_init_interleaved (&images[0][2], out_rgba, n_out, width, height, 0);
+  immanuel_image_init_planar      (&images[1][0], in_planes,  4, width, height, 0);
+  immanuel_image_init_planar      (&images[1][1], aux_planes, 4, width, height, 0);
+  immanuel_image_init_planar      (&images[1][2], out_planes, n_out, width, height, 0);
+
+  printf ("# %s %dx%d, best of %d runs\n", function_names[bench.function], width, height, runs);
+  printf ("# layout       threads  seconds  Mpix/s  speedup\n");
+
+  for (layout = 0; layout < 2; layout++)
+    {
+      double base = 0.0;
+
+      for (threads = 1; threads <= max_threads; threads++)
+        {
+          double best = 1e300;
+          int    r;
+
+          for (r = 0; r < runs; r++)
+            {
+              double t0 = now ();
+
+              if (! run (&bench, &images[layout][0], &images[layout][1], &images[layout][2], threads))
+                {
+                  fprintf (stderr, "the parameters do not fit the images\n");
+                  return 1;
+                }
+              best = fmin (best, now () - t0);
+            }
+
+          if (threads == 1)
+            base = best;
+
+          printf ("%-12s  %7d  %7.3f  %6.1f  %7.2f\n", layout ? "planar" : "interleaved",
+                  threads, best, n_pixels / best / 1e6, base / best);
+        }
+    }
+
+  for (c = 0; c < n_out; c++)
+    for (p = 0; p < n_pixels; p++)
+      max_error = fmax (max_error, fabs (out_rgba[p * n_out + c] - out_planes[c][p]));
+
+  printf ("# max |planar - interleaved| %g\n", max_error);
+
+  for (c = 0; c < 4; c++)
+    {
+      free (in_planes[c]);
+      free (aux_planes[c]);
+      free (out_planes[c]);
+    }
+  free (in_rgba);
+  free (aux_rgba);
+  free (out_rgba);
+
+  return max_error == 0.0 ? 0 : 1;
+}